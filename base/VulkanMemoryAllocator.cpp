@@ -0,0 +1,607 @@
+/*
+* Vulkan device memory allocator
+*
+* Sub-allocates buffers and images from large device memory blocks instead of calling vkAllocateMemory per resource
+*
+* This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+*/
+
+#include "VulkanMemoryAllocator.h"
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <iomanip>
+#include <stdexcept>
+
+#include "VulkanTools.h"
+
+namespace vks
+{
+	namespace
+	{
+		constexpr uint32_t invalidIndex = ~0u;
+
+		VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment)
+		{
+			return (value + alignment - 1) & ~(alignment - 1);
+		}
+
+		VkDeviceSize alignDown(VkDeviceSize value, VkDeviceSize alignment)
+		{
+			return value & ~(alignment - 1);
+		}
+	}
+
+	/*
+		Memory block with either a TLSF or a linear sub-allocator
+
+		TLSF keeps free ranges in segregated lists indexed by a first level (power of two) and a second level
+		(linear subdivision of that power of two), both levels have a bitmap so a fitting list is found with two bit scans
+		Physically adjacent free ranges are always merged on free
+	*/
+	struct MemoryAllocator::Block
+	{
+		static constexpr uint32_t secondLevelLog2 = 5;
+		static constexpr uint32_t secondLevelCount = 1u << secondLevelLog2;
+		static constexpr uint32_t firstLevelCount = 64;
+		// Tails smaller than this stay attached to the allocation instead of becoming a free range
+		static constexpr VkDeviceSize minimumSplitSize = 64;
+
+		struct Node
+		{
+			VkDeviceSize offset = 0;
+			VkDeviceSize size = 0;
+			uint32_t prevPhysical = invalidIndex;
+			uint32_t nextPhysical = invalidIndex;
+			uint32_t prevFree = invalidIndex;
+			uint32_t nextFree = invalidIndex;
+			bool free = false;
+		};
+
+		VkDeviceMemory memory = VK_NULL_HANDLE;
+		VkDeviceSize size = 0;
+		void* mapped = nullptr;
+		AllocationStrategy strategy;
+		uint32_t allocationCount = 0;
+		VkDeviceSize usedBytes = 0;
+
+		// TLSF state
+		std::vector<Node> nodes;
+		std::vector<uint32_t> unusedNodes;
+		uint64_t firstLevelBitmap = 0;
+		uint32_t secondLevelBitmap[firstLevelCount]{};
+		uint32_t freeHeads[firstLevelCount][secondLevelCount];
+
+		// Linear state
+		VkDeviceSize linearOffset = 0;
+
+		Block(VkDeviceMemory memory, VkDeviceSize size, void* mapped, AllocationStrategy strategy) : memory(memory), size(size), mapped(mapped), strategy(strategy)
+		{
+			if (strategy == AllocationStrategy::TLSF) {
+				std::fill(&freeHeads[0][0], &freeHeads[0][0] + firstLevelCount * secondLevelCount, invalidIndex);
+				Node node{};
+				node.size = size;
+				nodes.push_back(node);
+				insertFree(0);
+			}
+		}
+
+		static void mapping(VkDeviceSize size, uint32_t& firstLevel, uint32_t& secondLevel)
+		{
+			if (size < secondLevelCount) {
+				firstLevel = 0;
+				secondLevel = static_cast<uint32_t>(size);
+			} else {
+				const uint32_t msb = 63 - std::countl_zero(static_cast<uint64_t>(size));
+				firstLevel = msb - secondLevelLog2 + 1;
+				secondLevel = static_cast<uint32_t>(size >> (msb - secondLevelLog2)) - secondLevelCount;
+			}
+		}
+
+		uint32_t newNode()
+		{
+			if (!unusedNodes.empty()) {
+				const uint32_t index = unusedNodes.back();
+				unusedNodes.pop_back();
+				nodes[index] = Node{};
+				return index;
+			}
+			nodes.push_back(Node{});
+			return static_cast<uint32_t>(nodes.size() - 1);
+		}
+
+		void insertFree(uint32_t index)
+		{
+			Node& node = nodes[index];
+			uint32_t fl, sl;
+			mapping(node.size, fl, sl);
+			node.free = true;
+			node.prevFree = invalidIndex;
+			node.nextFree = freeHeads[fl][sl];
+			if (node.nextFree != invalidIndex) {
+				nodes[node.nextFree].prevFree = index;
+			}
+			freeHeads[fl][sl] = index;
+			firstLevelBitmap |= 1ull << fl;
+			secondLevelBitmap[fl] |= 1u << sl;
+		}
+
+		void removeFree(uint32_t index)
+		{
+			Node& node = nodes[index];
+			uint32_t fl, sl;
+			mapping(node.size, fl, sl);
+			if (node.prevFree != invalidIndex) {
+				nodes[node.prevFree].nextFree = node.nextFree;
+			} else {
+				freeHeads[fl][sl] = node.nextFree;
+				if (node.nextFree == invalidIndex) {
+					secondLevelBitmap[fl] &= ~(1u << sl);
+					if (secondLevelBitmap[fl] == 0) {
+						firstLevelBitmap &= ~(1ull << fl);
+					}
+				}
+			}
+			if (node.nextFree != invalidIndex) {
+				nodes[node.nextFree].prevFree = node.prevFree;
+			}
+			node.free = false;
+			node.prevFree = node.nextFree = invalidIndex;
+		}
+
+		/** @brief Returns the head of a free list whose ranges are all at least size bytes large */
+		uint32_t findFree(VkDeviceSize size)
+		{
+			// Round up to the next list boundary so every range in the found list fits (good fit instead of best fit)
+			if (size >= secondLevelCount) {
+				const uint32_t msb = 63 - std::countl_zero(static_cast<uint64_t>(size));
+				size += (1ull << (msb - secondLevelLog2)) - 1;
+			}
+			uint32_t fl, sl;
+			mapping(size, fl, sl);
+			if (fl >= firstLevelCount) {
+				return invalidIndex;
+			}
+			uint32_t secondLevelMap = secondLevelBitmap[fl] & (~0u << sl);
+			if (secondLevelMap == 0) {
+				const uint64_t firstLevelMap = (fl + 1 < firstLevelCount) ? (firstLevelBitmap & (~0ull << (fl + 1))) : 0;
+				if (firstLevelMap == 0) {
+					return invalidIndex;
+				}
+				fl = std::countr_zero(firstLevelMap);
+				secondLevelMap = secondLevelBitmap[fl];
+			}
+			sl = std::countr_zero(secondLevelMap);
+			return freeHeads[fl][sl];
+		}
+
+		bool allocate(VkDeviceSize allocationSize, VkDeviceSize alignment, VkDeviceSize& offset, uint32_t& nodeIndex)
+		{
+			if (strategy == AllocationStrategy::Linear) {
+				const VkDeviceSize alignedOffset = alignUp(linearOffset, alignment);
+				if (alignedOffset + allocationSize > size) {
+					return false;
+				}
+				offset = alignedOffset;
+				linearOffset = alignedOffset + allocationSize;
+				nodeIndex = 0;
+				allocationCount++;
+				usedBytes += allocationSize;
+				return true;
+			}
+
+			uint32_t index = findFree(allocationSize + alignment - 1);
+			if (index == invalidIndex) {
+				return false;
+			}
+			removeFree(index);
+
+			// Return the front padding required for alignment as a separate free range
+			const VkDeviceSize alignedOffset = alignUp(nodes[index].offset, alignment);
+			const VkDeviceSize padding = alignedOffset - nodes[index].offset;
+			if (padding > 0) {
+				const uint32_t front = newNode();
+				Node& node = nodes[index];
+				nodes[front].offset = node.offset;
+				nodes[front].size = padding;
+				nodes[front].prevPhysical = node.prevPhysical;
+				nodes[front].nextPhysical = index;
+				if (node.prevPhysical != invalidIndex) {
+					nodes[node.prevPhysical].nextPhysical = front;
+				}
+				node.prevPhysical = front;
+				node.offset = alignedOffset;
+				node.size -= padding;
+				insertFree(front);
+			}
+
+			// Split off the unused tail
+			if (nodes[index].size - allocationSize >= minimumSplitSize) {
+				const uint32_t tail = newNode();
+				Node& node = nodes[index];
+				nodes[tail].offset = node.offset + allocationSize;
+				nodes[tail].size = node.size - allocationSize;
+				nodes[tail].prevPhysical = index;
+				nodes[tail].nextPhysical = node.nextPhysical;
+				if (node.nextPhysical != invalidIndex) {
+					nodes[node.nextPhysical].prevPhysical = tail;
+				}
+				node.nextPhysical = tail;
+				node.size = allocationSize;
+				insertFree(tail);
+			}
+
+			offset = nodes[index].offset;
+			nodeIndex = index;
+			allocationCount++;
+			usedBytes += nodes[index].size;
+			return true;
+		}
+
+		void free(uint32_t index, VkDeviceSize allocationSize)
+		{
+			allocationCount--;
+			if (strategy == AllocationStrategy::Linear) {
+				usedBytes -= allocationSize;
+				if (allocationCount == 0) {
+					linearOffset = 0;
+					usedBytes = 0;
+				}
+				return;
+			}
+
+			usedBytes -= nodes[index].size;
+			// Merge with the physically next range
+			const uint32_t next = nodes[index].nextPhysical;
+			if (next != invalidIndex && nodes[next].free) {
+				removeFree(next);
+				nodes[index].size += nodes[next].size;
+				nodes[index].nextPhysical = nodes[next].nextPhysical;
+				if (nodes[next].nextPhysical != invalidIndex) {
+					nodes[nodes[next].nextPhysical].prevPhysical = index;
+				}
+				unusedNodes.push_back(next);
+			}
+			// Merge with the physically previous range
+			const uint32_t prev = nodes[index].prevPhysical;
+			if (prev != invalidIndex && nodes[prev].free) {
+				removeFree(prev);
+				nodes[prev].size += nodes[index].size;
+				nodes[prev].nextPhysical = nodes[index].nextPhysical;
+				if (nodes[index].nextPhysical != invalidIndex) {
+					nodes[nodes[index].nextPhysical].prevPhysical = prev;
+				}
+				unusedNodes.push_back(index);
+				index = prev;
+			}
+			insertFree(index);
+		}
+
+		bool empty() const
+		{
+			return allocationCount == 0;
+		}
+
+		void getFreeRanges(uint32_t& count, VkDeviceSize& largest) const
+		{
+			if (strategy == AllocationStrategy::Linear) {
+				count += (linearOffset < size) ? 1 : 0;
+				largest = std::max(largest, size - linearOffset);
+				return;
+			}
+			for (size_t i = 0; i < nodes.size(); i++) {
+				if (nodes[i].free) {
+					count++;
+					largest = std::max(largest, nodes[i].size);
+				}
+			}
+		}
+	};
+
+	MemoryAllocator::MemoryAllocator(VkPhysicalDevice physicalDevice, VkDevice device) : device(device)
+	{
+		vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
+		VkPhysicalDeviceProperties properties;
+		vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+		nonCoherentAtomSize = std::max<VkDeviceSize>(properties.limits.nonCoherentAtomSize, 1);
+		// One pool per memory type, resource kind and strategy
+		for (uint32_t type = 0; type < memoryProperties.memoryTypeCount; type++) {
+			for (ResourceKind kind : { ResourceKind::Buffer, ResourceKind::DeviceAddressBuffer, ResourceKind::Image }) {
+				for (AllocationStrategy strategy : { AllocationStrategy::TLSF, AllocationStrategy::Linear }) {
+					Pool pool{};
+					pool.memoryTypeIndex = type;
+					pool.kind = kind;
+					pool.strategy = strategy;
+					pools.push_back(std::move(pool));
+				}
+			}
+		}
+		dedicatedStatistics.resize(memoryProperties.memoryHeapCount);
+	}
+
+	MemoryAllocator::~MemoryAllocator()
+	{
+		for (Pool& pool : pools) {
+			for (auto& block : pool.blocks) {
+				if (block) {
+					if (!block->empty()) {
+						std::cerr << "Memory allocator destroyed with " << block->allocationCount << " allocations left in a block of memory type " << pool.memoryTypeIndex << "\n";
+					}
+					vkFreeMemory(device, block->memory, nullptr);
+				}
+			}
+		}
+	}
+
+	uint32_t MemoryAllocator::getMemoryType(uint32_t typeBits, VkMemoryPropertyFlags properties) const
+	{
+		for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++) {
+			if ((typeBits & 1) == 1 && (memoryProperties.memoryTypes[i].propertyFlags & properties) == properties) {
+				return i;
+			}
+			typeBits >>= 1;
+		}
+		throw std::runtime_error("Could not find a matching memory type");
+	}
+
+	VkDeviceSize MemoryAllocator::getBlockSize(uint32_t memoryTypeIndex) const
+	{
+		const VkDeviceSize heapSize = memoryProperties.memoryHeaps[memoryProperties.memoryTypes[memoryTypeIndex].heapIndex].size;
+		return heapSize > 1024ull * 1024 * 1024 ? defaultBlockSize : alignUp(heapSize / 8, 4096);
+	}
+
+	VkResult MemoryAllocator::allocateDeviceMemory(uint32_t memoryTypeIndex, VkDeviceSize size, ResourceKind kind, VkDeviceMemory& memory, void*& mapped)
+	{
+		VkMemoryAllocateInfo memAlloc{};
+		memAlloc.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+		memAlloc.allocationSize = size;
+		memAlloc.memoryTypeIndex = memoryTypeIndex;
+		VkMemoryAllocateFlagsInfoKHR allocFlagsInfo{};
+		if (kind == ResourceKind::DeviceAddressBuffer) {
+			allocFlagsInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO_KHR;
+			allocFlagsInfo.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT_KHR;
+			memAlloc.pNext = &allocFlagsInfo;
+		}
+		VkResult result = vkAllocateMemory(device, &memAlloc, nullptr, &memory);
+		if (result != VK_SUCCESS) {
+			return result;
+		}
+		mapped = nullptr;
+		if (memoryProperties.memoryTypes[memoryTypeIndex].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+			result = vkMapMemory(device, memory, 0, VK_WHOLE_SIZE, 0, &mapped);
+		}
+		return result;
+	}
+
+	/**
+	* Allocate memory for a resource
+	*
+	* @param requirements Memory requirements of the resource
+	* @param memoryPropertyFlags Memory properties for this allocation (i.e. device local, host visible, coherent)
+	* @param kind Kind of resource that will be bound to the allocation
+	* @param allocation Allocation to be filled by the allocator
+	* @param strategy Sub-allocation strategy, Linear should only be used for short lived allocations
+	*
+	* @return VK_SUCCESS if the allocation could be made
+	*/
+	VkResult MemoryAllocator::allocate(const VkMemoryRequirements& requirements, VkMemoryPropertyFlags memoryPropertyFlags, ResourceKind kind, Allocation& allocation, AllocationStrategy strategy)
+	{
+		const uint32_t memoryTypeIndex = getMemoryType(requirements.memoryTypeBits, memoryPropertyFlags);
+		const VkMemoryPropertyFlags typeFlags = memoryProperties.memoryTypes[memoryTypeIndex].propertyFlags;
+		VkDeviceSize alignment = std::max<VkDeviceSize>(requirements.alignment, 1);
+		VkDeviceSize size = requirements.size;
+		// Keep non-coherent allocations on atom boundaries so they can be flushed without touching their neighbours
+		if ((typeFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) && !(typeFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)) {
+			alignment = std::max(alignment, nonCoherentAtomSize);
+			size = alignUp(size, nonCoherentAtomSize);
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+
+		allocation = Allocation{};
+		allocation.allocator = this;
+		allocation.memoryTypeIndex = memoryTypeIndex;
+		allocation.size = size;
+
+		const VkDeviceSize blockSize = getBlockSize(memoryTypeIndex);
+		// Large resources get their own device memory allocation
+		if (size > blockSize / 2) {
+			VkResult result = allocateDeviceMemory(memoryTypeIndex, size, kind, allocation.memory, allocation.mapped);
+			if (result == VK_SUCCESS) {
+				HeapStatistics& stats = dedicatedStatistics[memoryProperties.memoryTypes[memoryTypeIndex].heapIndex];
+				stats.dedicatedAllocationCount++;
+				stats.dedicatedBytes += size;
+			}
+			return result;
+		}
+
+		const uint32_t poolIndex = (memoryTypeIndex * 3 + static_cast<uint32_t>(kind)) * 2 + static_cast<uint32_t>(strategy);
+		Pool& pool = pools[poolIndex];
+		for (uint32_t i = 0; i < pool.blocks.size(); i++) {
+			Block* block = pool.blocks[i].get();
+			if (block && block->allocate(size, alignment, allocation.offset, allocation.node)) {
+				allocation.pool = poolIndex;
+				allocation.block = i;
+				allocation.memory = block->memory;
+				allocation.mapped = block->mapped ? static_cast<uint8_t*>(block->mapped) + allocation.offset : nullptr;
+				return VK_SUCCESS;
+			}
+		}
+
+		// No block has enough space left, add a new one
+		VkDeviceMemory memory;
+		void* mapped;
+		VkResult result = allocateDeviceMemory(memoryTypeIndex, blockSize, kind, memory, mapped);
+		if (result != VK_SUCCESS) {
+			return result;
+		}
+		uint32_t blockIndex = 0;
+		while (blockIndex < pool.blocks.size() && pool.blocks[blockIndex]) {
+			blockIndex++;
+		}
+		if (blockIndex == pool.blocks.size()) {
+			pool.blocks.emplace_back();
+		}
+		pool.blocks[blockIndex] = std::make_unique<Block>(memory, blockSize, mapped, strategy);
+		Block* block = pool.blocks[blockIndex].get();
+		if (!block->allocate(size, alignment, allocation.offset, allocation.node)) {
+			return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+		}
+		allocation.pool = poolIndex;
+		allocation.block = blockIndex;
+		allocation.memory = block->memory;
+		allocation.mapped = block->mapped ? static_cast<uint8_t*>(block->mapped) + allocation.offset : nullptr;
+		return VK_SUCCESS;
+	}
+
+	/**
+	* Allocate memory for a buffer, the buffer is not bound to the allocation
+	*
+	* @note Buffers with VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT are placed in device address capable blocks
+	*/
+	VkResult MemoryAllocator::allocate(VkBuffer buffer, VkBufferUsageFlags usageFlags, VkMemoryPropertyFlags memoryPropertyFlags, Allocation& allocation, AllocationStrategy strategy)
+	{
+		VkMemoryRequirements memReqs;
+		vkGetBufferMemoryRequirements(device, buffer, &memReqs);
+		const ResourceKind kind = (usageFlags & VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT) ? ResourceKind::DeviceAddressBuffer : ResourceKind::Buffer;
+		if (kind == ResourceKind::DeviceAddressBuffer) {
+			// Acceleration structures must start at a multiple of 256 bytes, which also covers the scratch and shader binding table base alignments
+			memReqs.alignment = std::max<VkDeviceSize>(memReqs.alignment, deviceAddressAlignment);
+		}
+		return allocate(memReqs, memoryPropertyFlags, kind, allocation, strategy);
+	}
+
+	/**
+	* Allocate memory for an optimal tiling image, the image is not bound to the allocation
+	*/
+	VkResult MemoryAllocator::allocate(VkImage image, VkMemoryPropertyFlags memoryPropertyFlags, Allocation& allocation)
+	{
+		VkMemoryRequirements memReqs;
+		vkGetImageMemoryRequirements(device, image, &memReqs);
+		return allocate(memReqs, memoryPropertyFlags, ResourceKind::Image, allocation, AllocationStrategy::TLSF);
+	}
+
+	/**
+	* Release an allocation, empty blocks are freed as long as their pool keeps another empty block around
+	*/
+	void MemoryAllocator::free(Allocation& allocation)
+	{
+		if (allocation.memory == VK_NULL_HANDLE) {
+			return;
+		}
+		assert(allocation.allocator == this);
+		std::lock_guard<std::mutex> lock(mutex);
+
+		if (allocation.pool == invalidIndex) {
+			vkFreeMemory(device, allocation.memory, nullptr);
+			HeapStatistics& stats = dedicatedStatistics[memoryProperties.memoryTypes[allocation.memoryTypeIndex].heapIndex];
+			stats.dedicatedAllocationCount--;
+			stats.dedicatedBytes -= allocation.size;
+			allocation = Allocation{};
+			return;
+		}
+
+		Pool& pool = pools[allocation.pool];
+		Block* block = pool.blocks[allocation.block].get();
+		block->free(allocation.node, allocation.size);
+		if (block->empty()) {
+			bool otherEmptyBlock = false;
+			for (uint32_t i = 0; i < pool.blocks.size(); i++) {
+				if (i != allocation.block && pool.blocks[i] && pool.blocks[i]->empty()) {
+					otherEmptyBlock = true;
+					break;
+				}
+			}
+			if (otherEmptyBlock) {
+				vkFreeMemory(device, block->memory, nullptr);
+				pool.blocks[allocation.block].reset();
+			}
+		}
+		allocation = Allocation{};
+	}
+
+	VkMappedMemoryRange MemoryAllocator::getMappedRange(const Allocation& allocation, VkDeviceSize offset, VkDeviceSize size) const
+	{
+		if (size == VK_WHOLE_SIZE) {
+			size = allocation.size - offset;
+		}
+		VkMappedMemoryRange mappedRange{};
+		mappedRange.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+		mappedRange.memory = allocation.memory;
+		mappedRange.offset = alignDown(allocation.offset + offset, nonCoherentAtomSize);
+		mappedRange.size = alignUp(allocation.offset + offset + size, nonCoherentAtomSize) - mappedRange.offset;
+		return mappedRange;
+	}
+
+	/**
+	* Flush a range of a host visible allocation, offset and size are relative to the allocation
+	*/
+	VkResult MemoryAllocator::flush(const Allocation& allocation, VkDeviceSize offset, VkDeviceSize size)
+	{
+		const VkMappedMemoryRange mappedRange = getMappedRange(allocation, offset, size);
+		return vkFlushMappedMemoryRanges(device, 1, &mappedRange);
+	}
+
+	/**
+	* Invalidate a range of a host visible allocation, offset and size are relative to the allocation
+	*/
+	VkResult MemoryAllocator::invalidate(const Allocation& allocation, VkDeviceSize offset, VkDeviceSize size)
+	{
+		const VkMappedMemoryRange mappedRange = getMappedRange(allocation, offset, size);
+		return vkInvalidateMappedMemoryRanges(device, 1, &mappedRange);
+	}
+
+	MemoryAllocator::Statistics MemoryAllocator::getStatistics()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		Statistics statistics{};
+		statistics.heaps = dedicatedStatistics;
+		for (const Pool& pool : pools) {
+			HeapStatistics& stats = statistics.heaps[memoryProperties.memoryTypes[pool.memoryTypeIndex].heapIndex];
+			for (const auto& block : pool.blocks) {
+				if (block) {
+					stats.blockCount++;
+					stats.blockBytes += block->size;
+					stats.allocationCount += block->allocationCount;
+					stats.usedBytes += block->usedBytes;
+					block->getFreeRanges(stats.freeRangeCount, stats.largestFreeRange);
+				}
+			}
+		}
+		for (const HeapStatistics& stats : statistics.heaps) {
+			statistics.total.blockCount += stats.blockCount;
+			statistics.total.blockBytes += stats.blockBytes;
+			statistics.total.allocationCount += stats.allocationCount;
+			statistics.total.usedBytes += stats.usedBytes;
+			statistics.total.dedicatedAllocationCount += stats.dedicatedAllocationCount;
+			statistics.total.dedicatedBytes += stats.dedicatedBytes;
+			statistics.total.freeRangeCount += stats.freeRangeCount;
+			statistics.total.largestFreeRange = std::max(statistics.total.largestFreeRange, stats.largestFreeRange);
+		}
+		return statistics;
+	}
+
+	void MemoryAllocator::printStatistics(std::ostream& stream)
+	{
+		const Statistics statistics = getStatistics();
+		auto mb = [](VkDeviceSize bytes) { return static_cast<double>(bytes) / (1024.0 * 1024.0); };
+		stream << std::fixed << std::setprecision(2);
+		for (uint32_t i = 0; i < statistics.heaps.size(); i++) {
+			const HeapStatistics& stats = statistics.heaps[i];
+			if (stats.blockCount == 0 && stats.dedicatedAllocationCount == 0) {
+				continue;
+			}
+			const bool deviceLocal = memoryProperties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT;
+			stream << "Memory heap " << i << (deviceLocal ? " (device local): " : " (host): ")
+				<< stats.blockCount << " blocks " << mb(stats.blockBytes) << " MB, "
+				<< stats.allocationCount << " sub-allocations " << mb(stats.usedBytes) << " MB used, "
+				<< stats.dedicatedAllocationCount << " dedicated " << mb(stats.dedicatedBytes) << " MB, "
+				<< stats.freeRangeCount << " free ranges, largest " << mb(stats.largestFreeRange) << " MB\n";
+		}
+		const uint32_t deviceMemoryCount = statistics.total.blockCount + statistics.total.dedicatedAllocationCount;
+		const uint32_t resourceCount = statistics.total.allocationCount + statistics.total.dedicatedAllocationCount;
+		stream << "Device memory allocations: " << deviceMemoryCount << " for " << resourceCount << " resources\n";
+		stream.unsetf(std::ios_base::floatfield);
+	}
+}
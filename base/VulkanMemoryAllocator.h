@@ -0,0 +1,116 @@
+/*
+* Vulkan device memory allocator
+*
+* Sub-allocates buffers and images from large device memory blocks instead of calling vkAllocateMemory per resource
+*
+* This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+*/
+
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <iostream>
+
+#include "vulkan/vulkan.h"
+
+namespace vks
+{
+	class MemoryAllocator;
+
+	/**
+	* @brief Range of device memory handed out by vks::MemoryAllocator
+	* @note Resources must be bound at memory + offset
+	*/
+	struct Allocation
+	{
+		MemoryAllocator* allocator = nullptr;
+		VkDeviceMemory memory = VK_NULL_HANDLE;
+		VkDeviceSize offset = 0;
+		VkDeviceSize size = 0;
+		/** @brief Host pointer to the start of the allocation, host visible memory is persistently mapped by the allocator */
+		void* mapped = nullptr;
+		uint32_t memoryTypeIndex = 0;
+		/** @brief Allocator internal bookkeeping, pool is ~0 for dedicated allocations */
+		uint32_t pool = ~0u;
+		uint32_t block = 0;
+		uint32_t node = 0;
+	};
+
+	/**
+	* @brief Sub-allocation strategy of a memory pool
+	* TLSF: two-level segregated fit with O(1) allocation and free, used for long lived resources
+	* Linear: bump allocation that is reset once every allocation in a block has been freed, used for staging and scratch memory
+	*/
+	enum class AllocationStrategy { TLSF, Linear };
+
+	/**
+	* @brief Kind of resource bound to an allocation
+	* Buffers and optimal tiling images never share a block, so bufferImageGranularity doesn't need to be considered
+	* Buffers using device addresses come from blocks allocated with VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT
+	*/
+	enum class ResourceKind { Buffer, DeviceAddressBuffer, Image };
+
+	class MemoryAllocator
+	{
+	public:
+		struct HeapStatistics
+		{
+			uint32_t blockCount = 0;
+			VkDeviceSize blockBytes = 0;
+			uint32_t allocationCount = 0;
+			VkDeviceSize usedBytes = 0;
+			uint32_t dedicatedAllocationCount = 0;
+			VkDeviceSize dedicatedBytes = 0;
+			uint32_t freeRangeCount = 0;
+			VkDeviceSize largestFreeRange = 0;
+		};
+		struct Statistics
+		{
+			std::vector<HeapStatistics> heaps;
+			HeapStatistics total;
+		};
+
+		/** @brief Size of the memory blocks for heaps larger than 1 GiB, smaller heaps use an eighth of their size */
+		static constexpr VkDeviceSize defaultBlockSize = 64ull * 1024 * 1024;
+		/** @brief Minimum alignment of buffers using device addresses */
+		static constexpr VkDeviceSize deviceAddressAlignment = 256;
+
+		MemoryAllocator(VkPhysicalDevice physicalDevice, VkDevice device);
+		~MemoryAllocator();
+
+		VkResult allocate(const VkMemoryRequirements& requirements, VkMemoryPropertyFlags memoryPropertyFlags, ResourceKind kind, Allocation& allocation, AllocationStrategy strategy = AllocationStrategy::TLSF);
+		VkResult allocate(VkBuffer buffer, VkBufferUsageFlags usageFlags, VkMemoryPropertyFlags memoryPropertyFlags, Allocation& allocation, AllocationStrategy strategy = AllocationStrategy::TLSF);
+		VkResult allocate(VkImage image, VkMemoryPropertyFlags memoryPropertyFlags, Allocation& allocation);
+		void free(Allocation& allocation);
+		VkResult flush(const Allocation& allocation, VkDeviceSize offset = 0, VkDeviceSize size = VK_WHOLE_SIZE);
+		VkResult invalidate(const Allocation& allocation, VkDeviceSize offset = 0, VkDeviceSize size = VK_WHOLE_SIZE);
+
+		Statistics getStatistics();
+		void printStatistics(std::ostream& stream = std::cout);
+
+	private:
+		struct Block;
+		struct Pool
+		{
+			uint32_t memoryTypeIndex;
+			ResourceKind kind;
+			AllocationStrategy strategy;
+			// Freed blocks leave a null entry behind so block indices stored in allocations stay valid
+			std::vector<std::unique_ptr<Block>> blocks;
+		};
+
+		VkDevice device;
+		VkPhysicalDeviceMemoryProperties memoryProperties;
+		VkDeviceSize nonCoherentAtomSize;
+		std::vector<Pool> pools;
+		std::vector<HeapStatistics> dedicatedStatistics;
+		std::mutex mutex;
+
+		uint32_t getMemoryType(uint32_t typeBits, VkMemoryPropertyFlags properties) const;
+		VkDeviceSize getBlockSize(uint32_t memoryTypeIndex) const;
+		VkResult allocateDeviceMemory(uint32_t memoryTypeIndex, VkDeviceSize size, ResourceKind kind, VkDeviceMemory& memory, void*& mapped);
+		VkMappedMemoryRange getMappedRange(const Allocation& allocation, VkDeviceSize offset, VkDeviceSize size) const;
+	};
+}
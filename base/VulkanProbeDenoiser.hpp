@@ -0,0 +1,163 @@
+/*
+* Compute pipeline running the probe denoiser of shaders/glsl/ssprobe/probedenoise.comp
+*
+* Like vks::ProbeGather every buffer is passed by device address in push constants. The a-trous iterations ping-pong
+* between two scratch buffers and the temporal pass writes the last one, base/probedenoiser.hpp is the CPU implementation
+*
+* This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+*/
+
+#pragma once
+
+#include "vulkan/vulkan.h"
+#include "VulkanInitializers.hpp"
+#include "VulkanTools.h"
+#include "probedenoiser.hpp"
+
+namespace vks
+{
+	class ProbeDenoiser
+	{
+	public:
+		/** @brief Matches the push constants of probedenoise.comp */
+		struct PushConstants
+		{
+			VkDeviceAddress probeGBuffer;
+			VkDeviceAddress probeMask;
+			VkDeviceAddress probeMaskOffsets;
+			VkDeviceAddress probes;
+			VkDeviceAddress variances;
+			VkDeviceAddress results;
+			VkDeviceAddress resultVariances;
+			VkDeviceAddress historyGBuffer;
+			VkDeviceAddress historyProbes;
+			VkDeviceAddress historyCounts;
+			VkDeviceAddress resultCounts;
+			uint32_t width;
+			uint32_t height;
+			uint32_t step;
+			uint32_t mode;
+			uint32_t frameCount;
+			float sampleCount;
+		};
+
+		/** @brief Buffers of a denoise, probe buffers hold width * height probes with the stride of the SH buffer */
+		struct Buffers
+		{
+			/** @brief Depth and packed normal of every probe, vks::sh::GBufferSample */
+			VkDeviceAddress probeGBuffer;
+			/** @brief Accumulated probes, packed by the probe mask and its prefix sum like the SH buffer of ssprobe */
+			VkDeviceAddress probeMask;
+			VkDeviceAddress probeMaskOffsets;
+			VkDeviceAddress probes;
+			/** @brief Second moment of the DC luminance of every slot, accumulated like the probes */
+			VkDeviceAddress moments;
+			/** @brief Dense probes and float variances the passes ping-pong between, the result ends up in scratch[resultIndex()] */
+			VkDeviceAddress scratch[2];
+			VkDeviceAddress scratchVariances[2];
+			/** @brief Probes denoised before the last restart, their G-buffer and float sample counts, 0 where there is none */
+			VkDeviceAddress historyGBuffer;
+			VkDeviceAddress historyProbes;
+			VkDeviceAddress historyCounts;
+			/** @brief Samples behind every result, the history counts after the next restart */
+			VkDeviceAddress resultCounts;
+		};
+
+		VkPipelineLayout pipelineLayout = VK_NULL_HANDLE;
+		VkPipeline pipeline = VK_NULL_HANDLE;
+
+		/**
+		* @brief Creates the pipeline for probes with shBands SH bands
+		* @param shaderStage probedenoise.comp.spv, loaded by the caller
+		*/
+		void create(VkDevice device, VkPipelineCache pipelineCache, VkPipelineShaderStageCreateInfo shaderStage, uint32_t shBands, const sh::DenoiseSettings& settings = {})
+		{
+			this->device = device;
+			this->settings = settings;
+			VkPushConstantRange pushConstantRange = vks::initializers::pushConstantRange(VK_SHADER_STAGE_COMPUTE_BIT, sizeof(PushConstants), 0);
+			VkPipelineLayoutCreateInfo pipelineLayoutCI = vks::initializers::pipelineLayoutCreateInfo(nullptr, 0);
+			pipelineLayoutCI.pushConstantRangeCount = 1;
+			pipelineLayoutCI.pPushConstantRanges = &pushConstantRange;
+			VK_CHECK_RESULT(vkCreatePipelineLayout(device, &pipelineLayoutCI, nullptr, &pipelineLayout));
+
+			// SH_BANDS in SH.glsl and the settings, constant 1 (H_BASIS_COUNT) keeps its default of 0
+			struct SpecializationData {
+				uint32_t shBands;
+				float depthSigma;
+				float luminanceSigma;
+				float historyClamp;
+			} specializationData { shBands, settings.depthSigma, settings.luminanceSigma, settings.historyClamp };
+			const VkSpecializationMapEntry specializationMapEntries[] = {
+				vks::initializers::specializationMapEntry(0, offsetof(SpecializationData, shBands), sizeof(uint32_t)),
+				vks::initializers::specializationMapEntry(2, offsetof(SpecializationData, depthSigma), sizeof(float)),
+				vks::initializers::specializationMapEntry(3, offsetof(SpecializationData, luminanceSigma), sizeof(float)),
+				vks::initializers::specializationMapEntry(4, offsetof(SpecializationData, historyClamp), sizeof(float)),
+			};
+			const VkSpecializationInfo specializationInfo = vks::initializers::specializationInfo(4, specializationMapEntries, sizeof(SpecializationData), &specializationData);
+			shaderStage.pSpecializationInfo = &specializationInfo;
+			VkComputePipelineCreateInfo computePipelineCI = vks::initializers::computePipelineCreateInfo(pipelineLayout);
+			computePipelineCI.stage = shaderStage;
+			VK_CHECK_RESULT(vkCreateComputePipelines(device, pipelineCache, 1, &computePipelineCI, nullptr, &pipeline));
+		}
+
+		/** @brief Scratch buffer holding the denoised probes once cmdDenoise is done */
+		uint32_t resultIndex() const
+		{
+			return settings.iterations % 2;
+		}
+
+		/**
+		* @brief Records the a-trous iterations and the temporal pass with the barriers between them
+		* The caller makes the probes visible to compute shaders before and synchronizes the results after
+		* @param frameCount Frames accumulated into the probes and moments
+		* @param sampleCount Samples accumulated into every probe
+		*/
+		void cmdDenoise(VkCommandBuffer commandBuffer, const Buffers& buffers, uint32_t width, uint32_t height, uint32_t frameCount, float sampleCount) const
+		{
+			vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+			VkMemoryBarrier memoryBarrier = vks::initializers::memoryBarrier();
+			memoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+			memoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+			PushConstants pushConstants {};
+			pushConstants.probeGBuffer = buffers.probeGBuffer;
+			pushConstants.historyGBuffer = buffers.historyGBuffer;
+			pushConstants.historyProbes = buffers.historyProbes;
+			pushConstants.historyCounts = buffers.historyCounts;
+			pushConstants.resultCounts = buffers.resultCounts;
+			pushConstants.width = width;
+			pushConstants.height = height;
+			pushConstants.frameCount = frameCount;
+			pushConstants.sampleCount = sampleCount;
+			// Iteration i reads what iteration i - 1 wrote, the first one reads the compacted accumulation
+			for (uint32_t pass = 0; pass <= settings.iterations; pass++) {
+				const bool first = pass == 0;
+				pushConstants.probeMask = first ? buffers.probeMask : 0;
+				pushConstants.probeMaskOffsets = first ? buffers.probeMaskOffsets : 0;
+				pushConstants.probes = first ? buffers.probes : buffers.scratch[(pass - 1) % 2];
+				pushConstants.variances = first ? buffers.moments : buffers.scratchVariances[(pass - 1) % 2];
+				pushConstants.results = buffers.scratch[pass % 2];
+				pushConstants.resultVariances = buffers.scratchVariances[pass % 2];
+				pushConstants.step = 1u << pass;
+				pushConstants.mode = pass == settings.iterations ? 1 : 0;
+				if (!first) {
+					vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+				}
+				vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstants), &pushConstants);
+				vkCmdDispatch(commandBuffer, (width + 7) / 8, (height + 7) / 8, 1);
+			}
+		}
+
+		void destroy()
+		{
+			if (pipeline != VK_NULL_HANDLE) {
+				vkDestroyPipeline(device, pipeline, nullptr);
+				vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
+				pipeline = VK_NULL_HANDLE;
+			}
+		}
+
+	private:
+		VkDevice device = VK_NULL_HANDLE;
+		sh::DenoiseSettings settings;
+	};
+}
@@ -0,0 +1,88 @@
+/*
+* Compute pipeline running the bilateral probe gather of shaders/glsl/ssprobe/probegather.comp
+*
+* Every buffer is passed by device address in push constants, so the gather can be recorded into any command buffer
+* without descriptor sets. base/probegather.hpp is the CPU implementation of the same gather
+*
+* This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+*/
+
+#pragma once
+
+#include "vulkan/vulkan.h"
+#include "VulkanInitializers.hpp"
+#include "VulkanTools.h"
+
+namespace vks
+{
+	class ProbeGather
+	{
+	public:
+		/** @brief Matches the push constants of probegather.comp */
+		struct PushConstants
+		{
+			/** @brief SH buffer of gridWidth * gridHeight SH probes, like the one ssprobe traces into */
+			VkDeviceAddress probes;
+			/** @brief Depth and packed normal of every probe, vks::sh::GBufferSample */
+			VkDeviceAddress probeGBuffer;
+			/** @brief Probe mask and its prefix sum if the SH buffer only holds the valid probes, 0 otherwise */
+			VkDeviceAddress probeMask;
+			VkDeviceAddress probeMaskOffsets;
+			/** @brief width * height pixel hits in, as many tightly packed RGB float irradiance values out */
+			VkDeviceAddress gbuffer;
+			VkDeviceAddress irradiance;
+			uint32_t gridWidth;
+			uint32_t gridHeight;
+			/** @brief Pixels between two probes, probe (x, y) sits at the center of its spacing x spacing tile */
+			uint32_t spacing;
+			uint32_t width;
+			uint32_t height;
+			float depthSigma;
+		};
+
+		VkPipelineLayout pipelineLayout = VK_NULL_HANDLE;
+		VkPipeline pipeline = VK_NULL_HANDLE;
+
+		/**
+		* @brief Creates the pipeline for probes with shBands SH bands
+		* @param shaderStage probegather.comp.spv, loaded by the caller
+		*/
+		void create(VkDevice device, VkPipelineCache pipelineCache, VkPipelineShaderStageCreateInfo shaderStage, uint32_t shBands)
+		{
+			this->device = device;
+			VkPushConstantRange pushConstantRange = vks::initializers::pushConstantRange(VK_SHADER_STAGE_COMPUTE_BIT, sizeof(PushConstants), 0);
+			VkPipelineLayoutCreateInfo pipelineLayoutCI = vks::initializers::pipelineLayoutCreateInfo(nullptr, 0);
+			pipelineLayoutCI.pushConstantRangeCount = 1;
+			pipelineLayoutCI.pPushConstantRanges = &pushConstantRange;
+			VK_CHECK_RESULT(vkCreatePipelineLayout(device, &pipelineLayoutCI, nullptr, &pipelineLayout));
+
+			// SH_BANDS in SH.glsl
+			const VkSpecializationMapEntry specializationMapEntry = vks::initializers::specializationMapEntry(0, 0, sizeof(uint32_t));
+			const VkSpecializationInfo specializationInfo = vks::initializers::specializationInfo(1, &specializationMapEntry, sizeof(uint32_t), &shBands);
+			shaderStage.pSpecializationInfo = &specializationInfo;
+			VkComputePipelineCreateInfo computePipelineCI = vks::initializers::computePipelineCreateInfo(pipelineLayout);
+			computePipelineCI.stage = shaderStage;
+			VK_CHECK_RESULT(vkCreateComputePipelines(device, pipelineCache, 1, &computePipelineCI, nullptr, &pipeline));
+		}
+
+		/** @brief Records the gather, the caller synchronizes the buffers around it */
+		void cmdDispatch(VkCommandBuffer commandBuffer, const PushConstants& pushConstants) const
+		{
+			vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+			vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstants), &pushConstants);
+			vkCmdDispatch(commandBuffer, (pushConstants.width + 7) / 8, (pushConstants.height + 7) / 8, 1);
+		}
+
+		void destroy()
+		{
+			if (pipeline != VK_NULL_HANDLE) {
+				vkDestroyPipeline(device, pipeline, nullptr);
+				vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
+				pipeline = VK_NULL_HANDLE;
+			}
+		}
+
+	private:
+		VkDevice device = VK_NULL_HANDLE;
+	};
+}
@@ -8,6 +8,16 @@
 
 #include "VulkanRaytracingSample.h"
 
+#include <chrono>
+#include <iomanip>
+
+VulkanRaytracingSample::~VulkanRaytracingSample()
+{
+	if (scratchArena.handle != VK_NULL_HANDLE) {
+		deleteScratchBuffer(scratchArena);
+	}
+}
+
 void VulkanRaytracingSample::updateRenderPass()
 {
 	// Update the default render pass with different color attachment load ops to keep attachment contents
@@ -116,18 +126,9 @@ VulkanRaytracingSample::ScratchBuffer VulkanRaytracingSample::createScratchBuffe
 	bufferCreateInfo.size = size;
 	bufferCreateInfo.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
 	VK_CHECK_RESULT(vkCreateBuffer(vulkanDevice->logicalDevice, &bufferCreateInfo, nullptr, &scratchBuffer.handle));
-	VkMemoryRequirements memoryRequirements{};
-	vkGetBufferMemoryRequirements(vulkanDevice->logicalDevice, scratchBuffer.handle, &memoryRequirements);
-	VkMemoryAllocateFlagsInfo memoryAllocateFlagsInfo{};
-	memoryAllocateFlagsInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO;
-	memoryAllocateFlagsInfo.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT_KHR;
-	VkMemoryAllocateInfo memoryAllocateInfo = {};
-	memoryAllocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	memoryAllocateInfo.pNext = &memoryAllocateFlagsInfo;
-	memoryAllocateInfo.allocationSize = memoryRequirements.size;
-	memoryAllocateInfo.memoryTypeIndex = vulkanDevice->getMemoryType(memoryRequirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-	VK_CHECK_RESULT(vkAllocateMemory(vulkanDevice->logicalDevice, &memoryAllocateInfo, nullptr, &scratchBuffer.memory));
-	VK_CHECK_RESULT(vkBindBufferMemory(vulkanDevice->logicalDevice, scratchBuffer.handle, scratchBuffer.memory, 0));
+	// Scratch memory only lives for the duration of a build, so it comes from a linear pool
+	VK_CHECK_RESULT(vulkanDevice->allocator->allocate(scratchBuffer.handle, bufferCreateInfo.usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, scratchBuffer.allocation, vks::AllocationStrategy::Linear));
+	VK_CHECK_RESULT(vkBindBufferMemory(vulkanDevice->logicalDevice, scratchBuffer.handle, scratchBuffer.allocation.memory, scratchBuffer.allocation.offset));
 	// Buffer device address
 	VkBufferDeviceAddressInfoKHR bufferDeviceAddresInfo{};
 	bufferDeviceAddresInfo.sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO;
@@ -138,12 +139,10 @@ VulkanRaytracingSample::ScratchBuffer VulkanRaytracingSample::createScratchBuffe
 
 void VulkanRaytracingSample::deleteScratchBuffer(ScratchBuffer& scratchBuffer)
 {
-	if (scratchBuffer.memory != VK_NULL_HANDLE) {
-		vkFreeMemory(vulkanDevice->logicalDevice, scratchBuffer.memory, nullptr);
-	}
 	if (scratchBuffer.handle != VK_NULL_HANDLE) {
 		vkDestroyBuffer(vulkanDevice->logicalDevice, scratchBuffer.handle, nullptr);
 	}
+	vulkanDevice->allocator->free(scratchBuffer.allocation);
 }
 
 void VulkanRaytracingSample::createAccelerationStructure(AccelerationStructure& accelerationStructure, VkAccelerationStructureTypeKHR type, VkAccelerationStructureBuildSizesInfoKHR buildSizeInfo)
@@ -154,24 +153,15 @@ void VulkanRaytracingSample::createAccelerationStructure(AccelerationStructure&
 	bufferCreateInfo.size = buildSizeInfo.accelerationStructureSize;
 	bufferCreateInfo.usage = VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
 	VK_CHECK_RESULT(vkCreateBuffer(vulkanDevice->logicalDevice, &bufferCreateInfo, nullptr, &accelerationStructure.buffer));
-	VkMemoryRequirements memoryRequirements{};
-	vkGetBufferMemoryRequirements(vulkanDevice->logicalDevice, accelerationStructure.buffer, &memoryRequirements);
-	VkMemoryAllocateFlagsInfo memoryAllocateFlagsInfo{};
-	memoryAllocateFlagsInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO;
-	memoryAllocateFlagsInfo.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT_KHR;
-	VkMemoryAllocateInfo memoryAllocateInfo{};
-	memoryAllocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	memoryAllocateInfo.pNext = &memoryAllocateFlagsInfo;
-	memoryAllocateInfo.allocationSize = memoryRequirements.size;
-	memoryAllocateInfo.memoryTypeIndex = vulkanDevice->getMemoryType(memoryRequirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-	VK_CHECK_RESULT(vkAllocateMemory(vulkanDevice->logicalDevice, &memoryAllocateInfo, nullptr, &accelerationStructure.memory));
-	VK_CHECK_RESULT(vkBindBufferMemory(vulkanDevice->logicalDevice, accelerationStructure.buffer, accelerationStructure.memory, 0));
+	VK_CHECK_RESULT(vulkanDevice->allocator->allocate(accelerationStructure.buffer, bufferCreateInfo.usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, accelerationStructure.allocation));
+	VK_CHECK_RESULT(vkBindBufferMemory(vulkanDevice->logicalDevice, accelerationStructure.buffer, accelerationStructure.allocation.memory, accelerationStructure.allocation.offset));
 	// Acceleration structure
 	VkAccelerationStructureCreateInfoKHR accelerationStructureCreate_info{};
 	accelerationStructureCreate_info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
 	accelerationStructureCreate_info.buffer = accelerationStructure.buffer;
 	accelerationStructureCreate_info.size = buildSizeInfo.accelerationStructureSize;
 	accelerationStructureCreate_info.type = type;
+	accelerationStructure.size = buildSizeInfo.accelerationStructureSize;
 	vkCreateAccelerationStructureKHR(vulkanDevice->logicalDevice, &accelerationStructureCreate_info, nullptr, &accelerationStructure.handle);
 	// AS device address
 	VkAccelerationStructureDeviceAddressInfoKHR accelerationDeviceAddressInfo{};
@@ -182,9 +172,349 @@ void VulkanRaytracingSample::createAccelerationStructure(AccelerationStructure&
 
 void VulkanRaytracingSample::deleteAccelerationStructure(AccelerationStructure& accelerationStructure)
 {
-	vkFreeMemory(device, accelerationStructure.memory, nullptr);
-	vkDestroyBuffer(device, accelerationStructure.buffer, nullptr);
 	vkDestroyAccelerationStructureKHR(device, accelerationStructure.handle, nullptr);
+	vkDestroyBuffer(device, accelerationStructure.buffer, nullptr);
+	vulkanDevice->allocator->free(accelerationStructure.allocation);
+}
+
+VkBuildAccelerationStructureFlagsKHR VulkanRaytracingSample::getBuildFlags(AccelerationStructureUsage usage)
+{
+	switch (usage) {
+	case AccelerationStructureUsage::Static:
+		return VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR;
+	case AccelerationStructureUsage::Updatable:
+		return VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR;
+	case AccelerationStructureUsage::Transient:
+		return VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_BUILD_BIT_KHR;
+	}
+	return VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+}
+
+uint64_t VulkanRaytracingSample::getScratchArenaAddress(VkDeviceSize size)
+{
+	// The arena's start is rounded up to the scratch offset alignment, so keep room for that
+	const VkDeviceSize alignment = std::max<VkDeviceSize>(accelerationStructureProperties.minAccelerationStructureScratchOffsetAlignment, 1);
+	if (size + alignment > scratchArenaSize) {
+		// Builds using the previous arena have been waited for by the submissions that recorded them
+		deleteScratchBuffer(scratchArena);
+		scratchArenaSize = size + alignment;
+		scratchArena = createScratchBuffer(scratchArenaSize);
+	}
+	return vks::tools::alignedSize(scratchArena.deviceAddress, alignment);
+}
+
+void VulkanRaytracingSample::buildAccelerationStructures(std::vector<AccelerationStructureBuildInput>& buildInputs)
+{
+	if (buildInputs.empty()) {
+		return;
+	}
+	const auto tStart = std::chrono::high_resolution_clock::now();
+
+	// Every build gets its own range of the scratch arena, so they can all be recorded into one command
+	const VkDeviceSize scratchAlignment = std::max<VkDeviceSize>(accelerationStructureProperties.minAccelerationStructureScratchOffsetAlignment, 1);
+	std::vector<VkAccelerationStructureBuildGeometryInfoKHR> buildGeometryInfos(buildInputs.size());
+	std::vector<const VkAccelerationStructureBuildRangeInfoKHR*> pBuildRangeInfos(buildInputs.size());
+	std::vector<VkDeviceSize> scratchOffsets(buildInputs.size());
+	VkDeviceSize scratchSize = 0;
+	for (size_t i = 0; i < buildInputs.size(); i++) {
+		AccelerationStructureBuildInput& buildInput = buildInputs[i];
+		VkAccelerationStructureBuildGeometryInfoKHR& buildGeometryInfo = buildGeometryInfos[i];
+		buildGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+		buildGeometryInfo.type = buildInput.type;
+		buildGeometryInfo.flags = getBuildFlags(buildInput.usage);
+		buildGeometryInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+		buildGeometryInfo.geometryCount = static_cast<uint32_t>(buildInput.geometries.size());
+		buildGeometryInfo.pGeometries = buildInput.geometries.data();
+
+		std::vector<uint32_t> maxPrimitiveCounts(buildInput.buildRangeInfos.size());
+		for (size_t j = 0; j < buildInput.buildRangeInfos.size(); j++) {
+			maxPrimitiveCounts[j] = buildInput.buildRangeInfos[j].primitiveCount;
+		}
+		VkAccelerationStructureBuildSizesInfoKHR buildSizesInfo{};
+		buildSizesInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
+		vkGetAccelerationStructureBuildSizesKHR(device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &buildGeometryInfo, maxPrimitiveCounts.data(), &buildSizesInfo);
+
+		createAccelerationStructure(*buildInput.accelerationStructure, buildInput.type, buildSizesInfo);
+		buildGeometryInfo.dstAccelerationStructure = buildInput.accelerationStructure->handle;
+		pBuildRangeInfos[i] = buildInput.buildRangeInfos.data();
+		scratchOffsets[i] = scratchSize;
+		scratchSize += vks::tools::alignedSize(buildSizesInfo.buildScratchSize, scratchAlignment);
+		accelerationStructureStatistics.buildSize += buildSizesInfo.accelerationStructureSize;
+	}
+	const uint64_t scratchAddress = getScratchArenaAddress(scratchSize);
+	for (size_t i = 0; i < buildInputs.size(); i++) {
+		buildGeometryInfos[i].scratchData.deviceAddress = scratchAddress + scratchOffsets[i];
+	}
+
+	// Static acceleration structures get their compacted size queried right after the build
+	std::vector<uint32_t> compactedInputs;
+	std::vector<VkAccelerationStructureKHR> compactedHandles;
+	for (uint32_t i = 0; i < buildInputs.size(); i++) {
+		if (buildInputs[i].usage == AccelerationStructureUsage::Static) {
+			compactedInputs.push_back(i);
+			compactedHandles.push_back(buildInputs[i].accelerationStructure->handle);
+		}
+	}
+	VkQueryPool queryPool = VK_NULL_HANDLE;
+	if (!compactedInputs.empty()) {
+		VkQueryPoolCreateInfo queryPoolCreateInfo{};
+		queryPoolCreateInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+		queryPoolCreateInfo.queryType = VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR;
+		queryPoolCreateInfo.queryCount = static_cast<uint32_t>(compactedInputs.size());
+		VK_CHECK_RESULT(vkCreateQueryPool(device, &queryPoolCreateInfo, nullptr, &queryPool));
+	}
+
+	// Build the acceleration structures on the device via a one-time command buffer submission
+	// Some implementations may support acceleration structure building on the host
+	// (VkPhysicalDeviceAccelerationStructureFeaturesKHR->accelerationStructureHostCommands), but we prefer device builds
+	VkCommandBuffer commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+	vkCmdBuildAccelerationStructuresKHR(commandBuffer, static_cast<uint32_t>(buildGeometryInfos.size()), buildGeometryInfos.data(), pBuildRangeInfos.data());
+	if (queryPool != VK_NULL_HANDLE) {
+		VkMemoryBarrier memoryBarrier = vks::initializers::memoryBarrier();
+		memoryBarrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+		memoryBarrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+		vkCmdResetQueryPool(commandBuffer, queryPool, 0, static_cast<uint32_t>(compactedHandles.size()));
+		vkCmdWriteAccelerationStructuresPropertiesKHR(commandBuffer, static_cast<uint32_t>(compactedHandles.size()), compactedHandles.data(), VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR, queryPool, 0);
+	}
+	vulkanDevice->flushCommandBuffer(commandBuffer, queue);
+
+	// Copy static acceleration structures into buffers of their compacted size and release the originals
+	std::vector<AccelerationStructure> uncompacted;
+	if (queryPool != VK_NULL_HANDLE) {
+		std::vector<VkDeviceSize> compactedSizes(compactedHandles.size());
+		VK_CHECK_RESULT(vkGetQueryPoolResults(device, queryPool, 0, static_cast<uint32_t>(compactedSizes.size()), compactedSizes.size() * sizeof(VkDeviceSize), compactedSizes.data(), sizeof(VkDeviceSize), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+		vkDestroyQueryPool(device, queryPool, nullptr);
+
+		commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+		for (size_t i = 0; i < compactedInputs.size(); i++) {
+			AccelerationStructure& accelerationStructure = *buildInputs[compactedInputs[i]].accelerationStructure;
+			if (compactedSizes[i] == 0 || compactedSizes[i] >= accelerationStructure.size) {
+				continue;
+			}
+			VkAccelerationStructureBuildSizesInfoKHR compactedSizeInfo{};
+			compactedSizeInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
+			compactedSizeInfo.accelerationStructureSize = compactedSizes[i];
+			AccelerationStructure compacted{};
+			createAccelerationStructure(compacted, buildInputs[compactedInputs[i]].type, compactedSizeInfo);
+
+			VkCopyAccelerationStructureInfoKHR copyInfo{};
+			copyInfo.sType = VK_STRUCTURE_TYPE_COPY_ACCELERATION_STRUCTURE_INFO_KHR;
+			copyInfo.src = accelerationStructure.handle;
+			copyInfo.dst = compacted.handle;
+			copyInfo.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_COMPACT_KHR;
+			vkCmdCopyAccelerationStructureKHR(commandBuffer, &copyInfo);
+
+			uncompacted.push_back(accelerationStructure);
+			accelerationStructure = compacted;
+			accelerationStructureStatistics.compactedCount++;
+		}
+		vulkanDevice->flushCommandBuffer(commandBuffer, queue);
+		for (AccelerationStructure& accelerationStructure : uncompacted) {
+			deleteAccelerationStructure(accelerationStructure);
+		}
+	}
+
+	for (const AccelerationStructureBuildInput& buildInput : buildInputs) {
+		accelerationStructureStatistics.finalSize += buildInput.accelerationStructure->size;
+	}
+	accelerationStructureStatistics.buildCount += static_cast<uint32_t>(buildInputs.size());
+	accelerationStructureStatistics.buildMilliseconds += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - tStart).count();
+}
+
+void VulkanRaytracingSample::cmdUpdateAccelerationStructures(VkCommandBuffer commandBuffer, const std::vector<AccelerationStructureBuildInput*>& buildInputs, const std::vector<VkBuildAccelerationStructureModeKHR>& modes)
+{
+	assert(buildInputs.size() == modes.size());
+	const VkDeviceSize scratchAlignment = std::max<VkDeviceSize>(accelerationStructureProperties.minAccelerationStructureScratchOffsetAlignment, 1);
+	std::vector<VkAccelerationStructureBuildGeometryInfoKHR> buildGeometryInfos(buildInputs.size());
+	std::vector<const VkAccelerationStructureBuildRangeInfoKHR*> pBuildRangeInfos(buildInputs.size());
+	std::vector<VkDeviceSize> scratchOffsets(buildInputs.size());
+	// Top levels depend on the bottom levels, so they are built in a second batch that reuses the scratch ranges of the first one
+	VkDeviceSize scratchSizes[2] = { 0, 0 };
+	for (size_t i = 0; i < buildInputs.size(); i++) {
+		const AccelerationStructureBuildInput& buildInput = *buildInputs[i];
+		VkAccelerationStructureBuildGeometryInfoKHR& buildGeometryInfo = buildGeometryInfos[i];
+		buildGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+		buildGeometryInfo.type = buildInput.type;
+		buildGeometryInfo.flags = getBuildFlags(buildInput.usage);
+		buildGeometryInfo.mode = modes[i];
+		buildGeometryInfo.srcAccelerationStructure = modes[i] == VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR ? buildInput.accelerationStructure->handle : VK_NULL_HANDLE;
+		buildGeometryInfo.dstAccelerationStructure = buildInput.accelerationStructure->handle;
+		buildGeometryInfo.geometryCount = static_cast<uint32_t>(buildInput.geometries.size());
+		buildGeometryInfo.pGeometries = buildInput.geometries.data();
+		pBuildRangeInfos[i] = buildInput.buildRangeInfos.data();
+
+		std::vector<uint32_t> maxPrimitiveCounts(buildInput.buildRangeInfos.size());
+		for (size_t j = 0; j < buildInput.buildRangeInfos.size(); j++) {
+			maxPrimitiveCounts[j] = buildInput.buildRangeInfos[j].primitiveCount;
+		}
+		VkAccelerationStructureBuildSizesInfoKHR buildSizesInfo{};
+		buildSizesInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
+		vkGetAccelerationStructureBuildSizesKHR(device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &buildGeometryInfo, maxPrimitiveCounts.data(), &buildSizesInfo);
+		const VkDeviceSize scratchSize = modes[i] == VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR ? buildSizesInfo.updateScratchSize : buildSizesInfo.buildScratchSize;
+		VkDeviceSize& batchScratchSize = scratchSizes[buildInput.type == VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR ? 1 : 0];
+		scratchOffsets[i] = batchScratchSize;
+		batchScratchSize += vks::tools::alignedSize(scratchSize, scratchAlignment);
+	}
+	const uint64_t scratchAddress = getScratchArenaAddress(std::max(scratchSizes[0], scratchSizes[1]));
+
+	VkMemoryBarrier memoryBarrier = vks::initializers::memoryBarrier();
+	memoryBarrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+	memoryBarrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+	for (const VkAccelerationStructureTypeKHR type : { VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR, VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR }) {
+		std::vector<VkAccelerationStructureBuildGeometryInfoKHR> batchGeometryInfos;
+		std::vector<const VkAccelerationStructureBuildRangeInfoKHR*> batchRangeInfos;
+		for (size_t i = 0; i < buildInputs.size(); i++) {
+			if (buildInputs[i]->type == type) {
+				buildGeometryInfos[i].scratchData.deviceAddress = scratchAddress + scratchOffsets[i];
+				batchGeometryInfos.push_back(buildGeometryInfos[i]);
+				batchRangeInfos.push_back(pBuildRangeInfos[i]);
+			}
+		}
+		if (batchGeometryInfos.empty()) {
+			continue;
+		}
+		vkCmdBuildAccelerationStructuresKHR(commandBuffer, static_cast<uint32_t>(batchGeometryInfos.size()), batchGeometryInfos.data(), batchRangeInfos.data());
+		// Covers the scratch reuse of the next batch as well as traversal of the results
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR | VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+	}
+}
+
+void VulkanRaytracingSample::printAccelerationStructureStatistics(std::ostream& stream)
+{
+	const AccelerationStructureStatistics& statistics = accelerationStructureStatistics;
+	const double toMiB = 1.0 / (1024.0 * 1024.0);
+	const double saved = statistics.buildSize > 0 ? 100.0 * (1.0 - static_cast<double>(statistics.finalSize) / static_cast<double>(statistics.buildSize)) : 0.0;
+	stream << std::fixed << std::setprecision(2)
+		<< "Acceleration structures: " << statistics.buildCount << " built in " << statistics.buildMilliseconds << " ms, "
+		<< statistics.compactedCount << " compacted from " << statistics.buildSize * toMiB << " MiB to " << statistics.finalSize * toMiB << " MiB (" << saved << "% saved), "
+		<< "scratch arena " << scratchArenaSize * toMiB << " MiB\n";
+	stream.unsetf(std::ios::floatfield);
+}
+
+namespace
+{
+	// Header of serialized acceleration structure files, followed by the serialized data
+	struct SerializedAccelerationStructureHeader {
+		uint32_t magic;
+		uint32_t type;
+		uint64_t hash;
+		uint64_t size;
+	};
+	constexpr uint32_t serializedAccelerationStructureMagic = 0x53414b56;
+}
+
+bool VulkanRaytracingSample::saveAccelerationStructure(const AccelerationStructure& accelerationStructure, const std::string& filename, uint64_t hash)
+{
+	// Query the size of the serialized acceleration structure
+	VkQueryPoolCreateInfo queryPoolCreateInfo{};
+	queryPoolCreateInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+	queryPoolCreateInfo.queryType = VK_QUERY_TYPE_ACCELERATION_STRUCTURE_SERIALIZATION_SIZE_KHR;
+	queryPoolCreateInfo.queryCount = 1;
+	VkQueryPool queryPool;
+	VK_CHECK_RESULT(vkCreateQueryPool(device, &queryPoolCreateInfo, nullptr, &queryPool));
+
+	VkMemoryBarrier memoryBarrier = vks::initializers::memoryBarrier();
+	memoryBarrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+	memoryBarrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+	VkCommandBuffer commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+	vkCmdResetQueryPool(commandBuffer, queryPool, 0, 1);
+	vkCmdWriteAccelerationStructuresPropertiesKHR(commandBuffer, 1, &accelerationStructure.handle, VK_QUERY_TYPE_ACCELERATION_STRUCTURE_SERIALIZATION_SIZE_KHR, queryPool, 0);
+	vulkanDevice->flushCommandBuffer(commandBuffer, queue);
+	VkDeviceSize serializedSize = 0;
+	VK_CHECK_RESULT(vkGetQueryPoolResults(device, queryPool, 0, 1, sizeof(VkDeviceSize), &serializedSize, sizeof(VkDeviceSize), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+	vkDestroyQueryPool(device, queryPool, nullptr);
+	if (serializedSize == 0) {
+		return false;
+	}
+
+	// Serialize into host visible memory
+	vks::Buffer serializedBuffer;
+	VK_CHECK_RESULT(vulkanDevice->createBuffer(
+		VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		&serializedBuffer,
+		serializedSize));
+	VkCopyAccelerationStructureToMemoryInfoKHR copyInfo{};
+	copyInfo.sType = VK_STRUCTURE_TYPE_COPY_ACCELERATION_STRUCTURE_TO_MEMORY_INFO_KHR;
+	copyInfo.src = accelerationStructure.handle;
+	copyInfo.dst.deviceAddress = getBufferDeviceAddress(serializedBuffer.buffer);
+	copyInfo.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_SERIALIZE_KHR;
+	commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+	vkCmdCopyAccelerationStructureToMemoryKHR(commandBuffer, &copyInfo);
+	memoryBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	memoryBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+	vulkanDevice->flushCommandBuffer(commandBuffer, queue);
+
+	SerializedAccelerationStructureHeader header{ serializedAccelerationStructureMagic, VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR, hash, serializedSize };
+	const std::string tempFile = filename + ".tmp";
+	bool written = false;
+	VK_CHECK_RESULT(serializedBuffer.map());
+	{
+		std::ofstream os(tempFile, std::ios::binary | std::ios::trunc);
+		os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		os.write(reinterpret_cast<const char*>(serializedBuffer.mapped), serializedSize);
+		written = os.good();
+	}
+	serializedBuffer.unmap();
+	serializedBuffer.destroy();
+	if (!written || std::rename(tempFile.c_str(), filename.c_str()) != 0) {
+		std::remove(tempFile.c_str());
+		std::cout << "Could not write acceleration structure \"" << filename << "\"\n";
+		return false;
+	}
+	return true;
+}
+
+bool VulkanRaytracingSample::loadAccelerationStructure(AccelerationStructure& accelerationStructure, const std::string& filename, uint64_t hash)
+{
+	std::vector<uint8_t> data;
+	if (!vks::tools::readFile(filename, data) || data.size() < sizeof(SerializedAccelerationStructureHeader)) {
+		return false;
+	}
+	SerializedAccelerationStructureHeader header;
+	memcpy(&header, data.data(), sizeof(header));
+	const uint8_t* serializedData = data.data() + sizeof(header);
+	// The serialized data starts with the driver and compatibility UUIDs followed by the serialized and deserialized sizes
+	const size_t versionSize = 2 * VK_UUID_SIZE + 2 * sizeof(uint64_t);
+	if (header.magic != serializedAccelerationStructureMagic || header.type != VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR || header.hash != hash || header.size != data.size() - sizeof(header) || header.size < versionSize) {
+		return false;
+	}
+
+	VkAccelerationStructureVersionInfoKHR versionInfo{};
+	versionInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_VERSION_INFO_KHR;
+	versionInfo.pVersionData = serializedData;
+	VkAccelerationStructureCompatibilityKHR compatibility = VK_ACCELERATION_STRUCTURE_COMPATIBILITY_INCOMPATIBLE_KHR;
+	vkGetDeviceAccelerationStructureCompatibilityKHR(device, &versionInfo, &compatibility);
+	if (compatibility != VK_ACCELERATION_STRUCTURE_COMPATIBILITY_COMPATIBLE_KHR) {
+		std::cout << "Serialized acceleration structure \"" << filename << "\" is not compatible with this device\n";
+		return false;
+	}
+
+	VkAccelerationStructureBuildSizesInfoKHR buildSizeInfo{};
+	buildSizeInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
+	memcpy(&buildSizeInfo.accelerationStructureSize, serializedData + 2 * VK_UUID_SIZE + sizeof(uint64_t), sizeof(uint64_t));
+	createAccelerationStructure(accelerationStructure, VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR, buildSizeInfo);
+
+	vks::Buffer serializedBuffer;
+	VK_CHECK_RESULT(vulkanDevice->createBuffer(
+		VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		&serializedBuffer,
+		header.size,
+		(void*)serializedData));
+	VkCopyMemoryToAccelerationStructureInfoKHR copyInfo{};
+	copyInfo.sType = VK_STRUCTURE_TYPE_COPY_MEMORY_TO_ACCELERATION_STRUCTURE_INFO_KHR;
+	copyInfo.src.deviceAddress = getBufferDeviceAddress(serializedBuffer.buffer);
+	copyInfo.dst = accelerationStructure.handle;
+	copyInfo.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_DESERIALIZE_KHR;
+	VkCommandBuffer commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+	vkCmdCopyMemoryToAccelerationStructureKHR(commandBuffer, &copyInfo);
+	vulkanDevice->flushCommandBuffer(commandBuffer, queue);
+	serializedBuffer.destroy();
+	return true;
 }
 
 uint64_t VulkanRaytracingSample::getBufferDeviceAddress(VkBuffer buffer)
@@ -201,7 +531,7 @@ void VulkanRaytracingSample::createStorageImage(VkFormat format, VkExtent3D exte
 	if (storageImage.image != VK_NULL_HANDLE) {
 		vkDestroyImageView(device, storageImage.view, nullptr);
 		vkDestroyImage(device, storageImage.image, nullptr);
-		vkFreeMemory(device, storageImage.memory, nullptr);
+		vulkanDevice->allocator->free(storageImage.allocation);
 		storageImage = {};
 	}
 
@@ -217,13 +547,8 @@ void VulkanRaytracingSample::createStorageImage(VkFormat format, VkExtent3D exte
 	image.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
 	VK_CHECK_RESULT(vkCreateImage(vulkanDevice->logicalDevice, &image, nullptr, &storageImage.image));
 
-	VkMemoryRequirements memReqs;
-	vkGetImageMemoryRequirements(vulkanDevice->logicalDevice, storageImage.image, &memReqs);
-	VkMemoryAllocateInfo memoryAllocateInfo = vks::initializers::memoryAllocateInfo();
-	memoryAllocateInfo.allocationSize = memReqs.size;
-	memoryAllocateInfo.memoryTypeIndex = vulkanDevice->getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-	VK_CHECK_RESULT(vkAllocateMemory(vulkanDevice->logicalDevice, &memoryAllocateInfo, nullptr, &storageImage.memory));
-	VK_CHECK_RESULT(vkBindImageMemory(vulkanDevice->logicalDevice, storageImage.image, storageImage.memory, 0));
+	VK_CHECK_RESULT(vulkanDevice->allocator->allocate(storageImage.image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, storageImage.allocation));
+	VK_CHECK_RESULT(vkBindImageMemory(vulkanDevice->logicalDevice, storageImage.image, storageImage.allocation.memory, storageImage.allocation.offset));
 
 	VkImageViewCreateInfo colorImageView = vks::initializers::imageViewCreateInfo();
 	colorImageView.viewType = VK_IMAGE_VIEW_TYPE_2D;
@@ -249,7 +574,7 @@ void VulkanRaytracingSample::deleteStorageImage()
 {
 	vkDestroyImageView(vulkanDevice->logicalDevice, storageImage.view, nullptr);
 	vkDestroyImage(vulkanDevice->logicalDevice, storageImage.image, nullptr);
-	vkFreeMemory(vulkanDevice->logicalDevice, storageImage.memory, nullptr);
+	vulkanDevice->allocator->free(storageImage.allocation);
 }
 
 void VulkanRaytracingSample::prepare()
@@ -260,6 +585,8 @@ void VulkanRaytracingSample::prepare()
 	VkPhysicalDeviceProperties2 deviceProperties2{};
 	deviceProperties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
 	deviceProperties2.pNext = &rayTracingPipelineProperties;
+	accelerationStructureProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_PROPERTIES_KHR;
+	rayTracingPipelineProperties.pNext = &accelerationStructureProperties;
 	vkGetPhysicalDeviceProperties2(physicalDevice, &deviceProperties2);
 	accelerationStructureFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_FEATURES_KHR;
 	VkPhysicalDeviceFeatures2 deviceFeatures2{};
@@ -277,6 +604,11 @@ void VulkanRaytracingSample::prepare()
 	vkCmdTraceRaysKHR = reinterpret_cast<PFN_vkCmdTraceRaysKHR>(vkGetDeviceProcAddr(device, "vkCmdTraceRaysKHR"));
 	vkGetRayTracingShaderGroupHandlesKHR = reinterpret_cast<PFN_vkGetRayTracingShaderGroupHandlesKHR>(vkGetDeviceProcAddr(device, "vkGetRayTracingShaderGroupHandlesKHR"));
 	vkCreateRayTracingPipelinesKHR = reinterpret_cast<PFN_vkCreateRayTracingPipelinesKHR>(vkGetDeviceProcAddr(device, "vkCreateRayTracingPipelinesKHR"));
+	vkCmdWriteAccelerationStructuresPropertiesKHR = reinterpret_cast<PFN_vkCmdWriteAccelerationStructuresPropertiesKHR>(vkGetDeviceProcAddr(device, "vkCmdWriteAccelerationStructuresPropertiesKHR"));
+	vkCmdCopyAccelerationStructureToMemoryKHR = reinterpret_cast<PFN_vkCmdCopyAccelerationStructureToMemoryKHR>(vkGetDeviceProcAddr(device, "vkCmdCopyAccelerationStructureToMemoryKHR"));
+	vkCmdCopyMemoryToAccelerationStructureKHR = reinterpret_cast<PFN_vkCmdCopyMemoryToAccelerationStructureKHR>(vkGetDeviceProcAddr(device, "vkCmdCopyMemoryToAccelerationStructureKHR"));
+	vkGetDeviceAccelerationStructureCompatibilityKHR = reinterpret_cast<PFN_vkGetDeviceAccelerationStructureCompatibilityKHR>(vkGetDeviceProcAddr(device, "vkGetDeviceAccelerationStructureCompatibilityKHR"));
+	vkCmdCopyAccelerationStructureKHR = reinterpret_cast<PFN_vkCmdCopyAccelerationStructureKHR>(vkGetDeviceProcAddr(device, "vkCmdCopyAccelerationStructureKHR"));
 	// Update the render pass to keep the color attachment contents, so we can draw the UI on top of the ray traced output
 	if (!rayQueryOnly) {
 		updateRenderPass();
@@ -295,12 +627,13 @@ VkStridedDeviceAddressRegionKHR VulkanRaytracingSample::getSbtEntryStridedDevice
 
 void VulkanRaytracingSample::createShaderBindingTable(ShaderBindingTable& shaderBindingTable, uint32_t handleCount)
 {
-	// Create buffer to hold all shader handles for the SBT
+	// Create buffer to hold all shader handles for the SBT, entries are placed at the aligned handle stride
+	const uint32_t handleSizeAligned = vks::tools::alignedSize(rayTracingPipelineProperties.shaderGroupHandleSize, rayTracingPipelineProperties.shaderGroupHandleAlignment);
 	VK_CHECK_RESULT(vulkanDevice->createBuffer(
 		VK_BUFFER_USAGE_SHADER_BINDING_TABLE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, 
 		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 
 		&shaderBindingTable, 
-		rayTracingPipelineProperties.shaderGroupHandleSize * handleCount));
+		handleSizeAligned * handleCount));
 	// Get the strided address to be used when dispatching the rays
 	shaderBindingTable.stridedDeviceAddressRegion = getSbtEntryStridedDeviceAddressRegion(shaderBindingTable.buffer, handleCount);
 	// Map persistent 
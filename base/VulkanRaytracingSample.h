@@ -20,6 +20,7 @@ protected:
 	virtual void updateRenderPass();
 public:
 	VulkanRaytracingSample(bool enableValidation = true): VulkanExampleBase(enableValidation) {}
+	~VulkanRaytracingSample();
 	// Function pointers for ray tracing related stuff
 	PFN_vkGetBufferDeviceAddressKHR vkGetBufferDeviceAddressKHR;
 	PFN_vkCreateAccelerationStructureKHR vkCreateAccelerationStructureKHR;
@@ -31,10 +32,16 @@ public:
 	PFN_vkCmdTraceRaysKHR vkCmdTraceRaysKHR;
 	PFN_vkGetRayTracingShaderGroupHandlesKHR vkGetRayTracingShaderGroupHandlesKHR;
 	PFN_vkCreateRayTracingPipelinesKHR vkCreateRayTracingPipelinesKHR;
+	PFN_vkCmdWriteAccelerationStructuresPropertiesKHR vkCmdWriteAccelerationStructuresPropertiesKHR;
+	PFN_vkCmdCopyAccelerationStructureToMemoryKHR vkCmdCopyAccelerationStructureToMemoryKHR;
+	PFN_vkCmdCopyMemoryToAccelerationStructureKHR vkCmdCopyMemoryToAccelerationStructureKHR;
+	PFN_vkGetDeviceAccelerationStructureCompatibilityKHR vkGetDeviceAccelerationStructureCompatibilityKHR;
+	PFN_vkCmdCopyAccelerationStructureKHR vkCmdCopyAccelerationStructureKHR;
 
 	// Available features and properties
 	VkPhysicalDeviceRayTracingPipelinePropertiesKHR  rayTracingPipelineProperties{};
 	VkPhysicalDeviceAccelerationStructureFeaturesKHR accelerationStructureFeatures{};
+	VkPhysicalDeviceAccelerationStructurePropertiesKHR accelerationStructureProperties{};
 
 	// Enabled features and properties
 	VkPhysicalDeviceBufferDeviceAddressFeatures enabledBufferDeviceAddresFeatures{};
@@ -46,20 +53,47 @@ public:
 	{
 		uint64_t deviceAddress = 0;
 		VkBuffer handle = VK_NULL_HANDLE;
-		VkDeviceMemory memory = VK_NULL_HANDLE;
+		vks::Allocation allocation;
 	};
 
 	// Holds information for a ray tracing acceleration structure
 	struct AccelerationStructure {
 		VkAccelerationStructureKHR handle;
 		uint64_t deviceAddress = 0;
-		VkDeviceMemory memory;
+		vks::Allocation allocation;
 		VkBuffer buffer;
+		VkDeviceSize size = 0;
 	};
 
+	/**
+	* @brief Intended use of an acceleration structure, selects its build flags
+	* Static: built once and traced for the rest of the run, prefers fast trace and is compacted after the build
+	* Updatable: refitted when its geometry or instances move, prefers fast trace and allows updates
+	* Transient: rebuilt from scratch often, prefers fast build
+	*/
+	enum class AccelerationStructureUsage { Static, Updatable, Transient };
+
+	// Geometry and target of an acceleration structure build, see buildAccelerationStructures
+	struct AccelerationStructureBuildInput {
+		AccelerationStructure* accelerationStructure = nullptr;
+		VkAccelerationStructureTypeKHR type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+		AccelerationStructureUsage usage = AccelerationStructureUsage::Static;
+		std::vector<VkAccelerationStructureGeometryKHR> geometries;
+		std::vector<VkAccelerationStructureBuildRangeInfoKHR> buildRangeInfos;
+	};
+
+	// Accumulated over all calls to buildAccelerationStructures
+	struct AccelerationStructureStatistics {
+		uint32_t buildCount = 0;
+		uint32_t compactedCount = 0;
+		VkDeviceSize buildSize = 0;
+		VkDeviceSize finalSize = 0;
+		double buildMilliseconds = 0.0;
+	} accelerationStructureStatistics;
+
 	// Holds information for a storage image that the ray tracing shaders output to
 	struct StorageImage {
-		VkDeviceMemory memory = VK_NULL_HANDLE;
+		vks::Allocation allocation;
 		VkImage image = VK_NULL_HANDLE;
 		VkImageView view = VK_NULL_HANDLE;
 		VkFormat format;
@@ -74,11 +108,36 @@ public:
 	// Set to true, to denote that the sample only uses ray queries (changes extension and render pass handling)
 	bool rayQueryOnly = false;
 
+	// Scratch memory shared by all acceleration structure builds, grows to the largest batch
+	ScratchBuffer scratchArena;
+	VkDeviceSize scratchArenaSize = 0;
+
 	void enableExtensions();
 	ScratchBuffer createScratchBuffer(VkDeviceSize size);
 	void deleteScratchBuffer(ScratchBuffer& scratchBuffer);
 	void createAccelerationStructure(AccelerationStructure& accelerationStructure, VkAccelerationStructureTypeKHR type, VkAccelerationStructureBuildSizesInfoKHR buildSizeInfo);
 	void deleteAccelerationStructure(AccelerationStructure& accelerationStructure);
+	/** @brief Returns the build flags used for acceleration structures with the given usage */
+	static VkBuildAccelerationStructureFlagsKHR getBuildFlags(AccelerationStructureUsage usage);
+	/** @brief Returns the device address of a range of the scratch arena with at least the given size, growing the arena if required */
+	uint64_t getScratchArenaAddress(VkDeviceSize size);
+	/**
+	* @brief Creates and builds the acceleration structures of all inputs with a single submission
+	* Static acceleration structures are compacted into right-sized buffers afterwards
+	*/
+	void buildAccelerationStructures(std::vector<AccelerationStructureBuildInput>& buildInputs);
+	/**
+	* @brief Records rebuilds or refits of acceleration structures created by buildAccelerationStructures, bottom levels first, each batch followed by a barrier
+	* Primitive counts must not grow, refits (VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR) require AccelerationStructureUsage::Updatable
+	* The scratch arena is shared, so the command buffer has to complete before the next build is recorded
+	*/
+	void cmdUpdateAccelerationStructures(VkCommandBuffer commandBuffer, const std::vector<AccelerationStructureBuildInput*>& buildInputs, const std::vector<VkBuildAccelerationStructureModeKHR>& modes);
+	/** @brief Prints the number, size, compaction savings and build time of all acceleration structures built so far */
+	void printAccelerationStructureStatistics(std::ostream& stream = std::cout);
+	/** @brief Writes a serialized copy of a built bottom level acceleration structure to a file, tagged with the hash of its build inputs */
+	bool saveAccelerationStructure(const AccelerationStructure& accelerationStructure, const std::string& filename, uint64_t hash);
+	/** @brief Recreates a bottom level acceleration structure saved by saveAccelerationStructure, fails if the hash differs or the device can't use the serialized data */
+	bool loadAccelerationStructure(AccelerationStructure& accelerationStructure, const std::string& filename, uint64_t hash);
 	uint64_t getBufferDeviceAddress(VkBuffer buffer);
 	void createStorageImage(VkFormat format, VkExtent3D extent);
 	void deleteStorageImage();
@@ -34,7 +34,7 @@ class Texture
 	vks::VulkanDevice *   device;
 	VkImage               image;
 	VkImageLayout         imageLayout;
-	VkDeviceMemory        deviceMemory;
+	vks::Allocation       allocation;
 	VkImageView           view;
 	uint32_t              width, height;
 	uint32_t              mipLevels;
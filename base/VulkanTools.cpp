@@ -7,6 +7,8 @@
  */
 
 #include "VulkanTools.h"
+#include <cfloat>
+#include <random>
 
 #if !(defined(VK_USE_PLATFORM_IOS_MVK) || defined(VK_USE_PLATFORM_MACOS_MVK))
 // iOS & macOS: VulkanExampleBase::getAssetPath() implemented externally to allow access to Objective-C components
@@ -441,5 +443,159 @@ namespace vks
 			return (value + alignment - 1) & ~(alignment - 1);
 		}
 
+		uint64_t fnv1a(const void* data, size_t size, uint64_t seed)
+		{
+			const uint8_t* bytes = static_cast<const uint8_t*>(data);
+			uint64_t hash = seed;
+			for (size_t i = 0; i < size; i++) {
+				hash ^= bytes[i];
+				hash *= 0x100000001b3ull;
+			}
+			return hash;
+		}
+
+		bool readFile(const std::string& filename, std::vector<uint8_t>& data)
+		{
+			std::ifstream is(filename, std::ios::binary | std::ios::ate);
+			if (!is.is_open()) {
+				return false;
+			}
+			const std::streamoff size = is.tellg();
+			if (size < 0) {
+				return false;
+			}
+			data.resize(static_cast<size_t>(size));
+			is.seekg(0, std::ios::beg);
+			is.read(reinterpret_cast<char*>(data.data()), size);
+			return is.good() || is.eof();
+		}
+
+		void buildAliasTable(const std::vector<float>& weights, std::vector<float>& probabilities, std::vector<uint32_t>& aliases)
+		{
+			const size_t count = weights.size();
+			probabilities.assign(count, 1.0f);
+			aliases.resize(count);
+			double total = 0.0;
+			for (float weight : weights) {
+				total += weight;
+			}
+			if (count == 0 || total <= 0.0) {
+				for (size_t i = 0; i < count; i++) {
+					aliases[i] = static_cast<uint32_t>(i);
+				}
+				return;
+			}
+
+			// Weights scaled to an average of one are split into slots that are under- and overfull
+			std::vector<double> scaled(count);
+			std::vector<uint32_t> small, large;
+			for (size_t i = 0; i < count; i++) {
+				scaled[i] = weights[i] * count / total;
+				aliases[i] = static_cast<uint32_t>(i);
+				(scaled[i] < 1.0 ? small : large).push_back(static_cast<uint32_t>(i));
+			}
+			// Every underfull slot is topped up by an overfull one, which becomes its alias
+			while (!small.empty() && !large.empty()) {
+				const uint32_t less = small.back();
+				small.pop_back();
+				const uint32_t more = large.back();
+				probabilities[less] = static_cast<float>(scaled[less]);
+				aliases[less] = more;
+				scaled[more] -= 1.0 - scaled[less];
+				if (scaled[more] < 1.0) {
+					large.pop_back();
+					small.push_back(more);
+				}
+			}
+			// Whatever remains is full up to rounding errors
+			for (uint32_t i : small) {
+				probabilities[i] = 1.0f;
+			}
+			for (uint32_t i : large) {
+				probabilities[i] = 1.0f;
+			}
+		}
+
+		std::vector<float> generateBlueNoise(uint32_t size, uint32_t seed)
+		{
+			const uint32_t count = size * size;
+			// Gaussian energy filter wrapped around the tile, sigma = 1.5 as proposed by Ulichney
+			const float sigma = 1.5f;
+			std::vector<float> filter(count);
+			for (uint32_t y = 0; y < size; y++) {
+				for (uint32_t x = 0; x < size; x++) {
+					const float dx = static_cast<float>(std::min(x, size - x));
+					const float dy = static_cast<float>(std::min(y, size - y));
+					filter[y * size + x] = std::exp(-(dx * dx + dy * dy) / (2.0f * sigma * sigma));
+				}
+			}
+
+			std::vector<uint8_t> pattern(count, 0);
+			std::vector<float> energy(count, 0.0f);
+			auto toggle = [&](uint32_t index, bool set) {
+				pattern[index] = set;
+				const float sign = set ? 1.0f : -1.0f;
+				const uint32_t px = index % size;
+				const uint32_t py = index / size;
+				for (uint32_t y = 0; y < size; y++) {
+					const uint32_t row = ((y + size - py) % size) * size;
+					for (uint32_t x = 0; x < size; x++) {
+						energy[y * size + x] += sign * filter[row + (x + size - px) % size];
+					}
+				}
+			};
+			// The tightest cluster is the set texel with the highest energy, the largest void the empty one with the lowest
+			auto find = [&](bool set) {
+				uint32_t best = 0;
+				float bestEnergy = set ? -FLT_MAX : FLT_MAX;
+				for (uint32_t i = 0; i < count; i++) {
+					if (static_cast<bool>(pattern[i]) == set && (set ? energy[i] > bestEnergy : energy[i] < bestEnergy)) {
+						best = i;
+						bestEnergy = energy[i];
+					}
+				}
+				return best;
+			};
+
+			// Initial binary pattern, random texels relaxed by moving the tightest cluster into the largest void until it stays
+			std::mt19937 generator(seed);
+			std::uniform_int_distribution<uint32_t> distribution(0, count - 1);
+			const uint32_t initialCount = std::max(count / 10, 1u);
+			for (uint32_t placed = 0; placed < initialCount;) {
+				const uint32_t index = distribution(generator);
+				if (!pattern[index]) {
+					toggle(index, true);
+					placed++;
+				}
+			}
+			while (true) {
+				const uint32_t cluster = find(true);
+				toggle(cluster, false);
+				const uint32_t hole = find(false);
+				toggle(hole, true);
+				if (hole == cluster) {
+					break;
+				}
+			}
+			const std::vector<uint8_t> initialPattern = pattern;
+			const std::vector<float> initialEnergy = energy;
+
+			// Texels of the initial pattern are ranked by removing the tightest clusters, all others by filling the largest voids
+			std::vector<float> ranks(count);
+			for (uint32_t rank = initialCount; rank > 0; rank--) {
+				const uint32_t cluster = find(true);
+				toggle(cluster, false);
+				ranks[cluster] = static_cast<float>(rank - 1) / count;
+			}
+			pattern = initialPattern;
+			energy = initialEnergy;
+			for (uint32_t rank = initialCount; rank < count; rank++) {
+				const uint32_t hole = find(false);
+				toggle(hole, true);
+				ranks[hole] = static_cast<float>(rank) / count;
+			}
+			return ranks;
+		}
+
 	}
 }
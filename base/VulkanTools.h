@@ -133,5 +133,21 @@ namespace vks
 		bool fileExists(const std::string &filename);
 
 		uint32_t alignedSize(uint32_t value, uint32_t alignment);
+		size_t alignedSize(size_t value, size_t alignment);
+
+		/** @brief 64-bit FNV-1a hash, pass a previous result as seed to hash several ranges */
+		uint64_t fnv1a(const void* data, size_t size, uint64_t seed = 0xcbf29ce484222325ull);
+		/** @brief Reads a whole binary file, returns false if it can't be opened */
+		bool readFile(const std::string& filename, std::vector<uint8_t>& data);
+		/**
+		* @brief Builds a Walker/Vose alias table for sampling indices proportional to the given weights in constant time
+		* @note Index i is picked with a uniform random slot i, kept if a second random number is below probabilities[i] and replaced by aliases[i] otherwise
+		*/
+		void buildAliasTable(const std::vector<float>& weights, std::vector<float>& probabilities, std::vector<uint32_t>& aliases);
+		/**
+		* @brief Generates a tileable size x size blue noise texture with the void and cluster method (Ulichney)
+		* @return Rank of every texel divided by the texel count, the values are uniformly distributed in [0, 1)
+		*/
+		std::vector<float> generateBlueNoise(uint32_t size, uint32_t seed = 0);
 	}
 }
@@ -12,6 +12,17 @@
 
 #include "VulkanglTFModel.h"
 
+#include <filesystem>
+#include <iomanip>
+#include <sstream>
+#include <unordered_map>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "taskscheduler.hpp"
+
 VkDescriptorSetLayout vkglTF::descriptorSetLayoutImage = VK_NULL_HANDLE;
 VkDescriptorSetLayout vkglTF::descriptorSetLayoutUbo = VK_NULL_HANDLE;
 VkMemoryPropertyFlags vkglTF::memoryPropertyFlags = 0;
@@ -32,6 +43,23 @@ bool loadImageDataFunc(tinygltf::Image* image, const int imageIndex, std::string
 	return tinygltf::LoadImageData(image, imageIndex, error, warning, req_width, req_height, bytes, size, userData);
 }
 
+bool loadImageDataFuncDeferred(tinygltf::Image* image, const int imageIndex, std::string* error, std::string* warning, int req_width, int req_height, const unsigned char* bytes, int size, void* userData)
+{
+	// KTX files will be handled by our own code
+	if (image->uri.find_last_of(".") != std::string::npos) {
+		if (image->uri.substr(image->uri.find_last_of(".") + 1) == "ktx") {
+			return true;
+		}
+	}
+
+	// Keep the encoded image, it's decoded by the image streaming worker (a width of -1 marks encoded data)
+	image->width = -1;
+	image->height = -1;
+	image->component = 0;
+	image->image.assign(bytes, bytes + size);
+	return true;
+}
+
 bool loadImageDataFuncEmpty(tinygltf::Image* image, const int imageIndex, std::string* error, std::string* warning, int req_width, int req_height, const unsigned char* bytes, int size, void* userData) 
 {
 	// This function will be used for samples that don't require images to be loaded
@@ -56,7 +84,7 @@ void vkglTF::Texture::destroy()
 	{
 		vkDestroyImageView(device->logicalDevice, view, nullptr);
 		vkDestroyImage(device->logicalDevice, image, nullptr);
-		vkFreeMemory(device->logicalDevice, deviceMemory, nullptr);
+		device->allocator->free(allocation);
 		vkDestroySampler(device->logicalDevice, sampler, nullptr);
 	}
 }
@@ -114,29 +142,16 @@ void vkglTF::Texture::fromglTfImage(tinygltf::Image &gltfimage, std::string path
 		assert(formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_BLIT_SRC_BIT);
 		assert(formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_BLIT_DST_BIT);
 
-		VkMemoryAllocateInfo memAllocInfo{};
-		memAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-		VkMemoryRequirements memReqs{};
-
 		VkBuffer stagingBuffer;
-		VkDeviceMemory stagingMemory;
-
-		VkBufferCreateInfo bufferCreateInfo{};
-		bufferCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-		bufferCreateInfo.size = bufferSize;
-		bufferCreateInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
-		bufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-		VK_CHECK_RESULT(vkCreateBuffer(device->logicalDevice, &bufferCreateInfo, nullptr, &stagingBuffer));
-		vkGetBufferMemoryRequirements(device->logicalDevice, stagingBuffer, &memReqs);
-		memAllocInfo.allocationSize = memReqs.size;
-		memAllocInfo.memoryTypeIndex = device->getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-		VK_CHECK_RESULT(vkAllocateMemory(device->logicalDevice, &memAllocInfo, nullptr, &stagingMemory));
-		VK_CHECK_RESULT(vkBindBufferMemory(device->logicalDevice, stagingBuffer, stagingMemory, 0));
-
-		uint8_t* data;
-		VK_CHECK_RESULT(vkMapMemory(device->logicalDevice, stagingMemory, 0, memReqs.size, 0, (void**)&data));
-		memcpy(data, buffer, bufferSize);
-		vkUnmapMemory(device->logicalDevice, stagingMemory);
+		vks::Allocation stagingAllocation;
+		VK_CHECK_RESULT(device->createBuffer(
+			VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+			bufferSize,
+			&stagingBuffer,
+			&stagingAllocation,
+			buffer,
+			vks::AllocationStrategy::Linear));
 
 		VkImageCreateInfo imageCreateInfo{};
 		imageCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
@@ -152,11 +167,8 @@ void vkglTF::Texture::fromglTfImage(tinygltf::Image &gltfimage, std::string path
 		imageCreateInfo.extent = { width, height, 1 };
 		imageCreateInfo.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
 		VK_CHECK_RESULT(vkCreateImage(device->logicalDevice, &imageCreateInfo, nullptr, &image));
-		vkGetImageMemoryRequirements(device->logicalDevice, image, &memReqs);
-		memAllocInfo.allocationSize = memReqs.size;
-		memAllocInfo.memoryTypeIndex = device->getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-		VK_CHECK_RESULT(vkAllocateMemory(device->logicalDevice, &memAllocInfo, nullptr, &deviceMemory));
-		VK_CHECK_RESULT(vkBindImageMemory(device->logicalDevice, image, deviceMemory, 0));
+		VK_CHECK_RESULT(device->allocator->allocate(image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, allocation));
+		VK_CHECK_RESULT(vkBindImageMemory(device->logicalDevice, image, allocation.memory, allocation.offset));
 
 		VkCommandBuffer copyCmd = device->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
 
@@ -199,7 +211,7 @@ void vkglTF::Texture::fromglTfImage(tinygltf::Image &gltfimage, std::string path
 		device->flushCommandBuffer(copyCmd, copyQueue, true);
 
 		vkDestroyBuffer(device->logicalDevice, stagingBuffer, nullptr);
-		vkFreeMemory(device->logicalDevice, stagingMemory, nullptr);
+		device->allocator->free(stagingAllocation);
 
 		// Generate the mip chain (glTF uses jpg and png, so we need to create this manually)
 		VkCommandBuffer blitCmd = device->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
@@ -313,28 +325,17 @@ void vkglTF::Texture::fromglTfImage(tinygltf::Image &gltfimage, std::string path
 		vkGetPhysicalDeviceFormatProperties(device->physicalDevice, format, &formatProperties);
 
 		VkCommandBuffer copyCmd = device->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
-		VkBuffer stagingBuffer;
-		VkDeviceMemory stagingMemory;
-
-		VkBufferCreateInfo bufferCreateInfo = vks::initializers::bufferCreateInfo();
-		bufferCreateInfo.size = ktxTextureSize;
 		// This buffer is used as a transfer source for the buffer copy
-		bufferCreateInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
-		bufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-		VK_CHECK_RESULT(vkCreateBuffer(device->logicalDevice, &bufferCreateInfo, nullptr, &stagingBuffer));
-
-		VkMemoryAllocateInfo memAllocInfo = vks::initializers::memoryAllocateInfo();
-		VkMemoryRequirements memReqs;
-		vkGetBufferMemoryRequirements(device->logicalDevice, stagingBuffer, &memReqs);
-		memAllocInfo.allocationSize = memReqs.size;
-		memAllocInfo.memoryTypeIndex = device->getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-		VK_CHECK_RESULT(vkAllocateMemory(device->logicalDevice, &memAllocInfo, nullptr, &stagingMemory));
-		VK_CHECK_RESULT(vkBindBufferMemory(device->logicalDevice, stagingBuffer, stagingMemory, 0));
-
-		uint8_t* data;
-		VK_CHECK_RESULT(vkMapMemory(device->logicalDevice, stagingMemory, 0, memReqs.size, 0, (void**)&data));
-		memcpy(data, ktxTextureData, ktxTextureSize);
-		vkUnmapMemory(device->logicalDevice, stagingMemory);
+		VkBuffer stagingBuffer;
+		vks::Allocation stagingAllocation;
+		VK_CHECK_RESULT(device->createBuffer(
+			VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+			ktxTextureSize,
+			&stagingBuffer,
+			&stagingAllocation,
+			ktxTextureData,
+			vks::AllocationStrategy::Linear));
 
 		std::vector<VkBufferImageCopy> bufferCopyRegions;
 		for (uint32_t i = 0; i < mipLevels; i++)
@@ -367,12 +368,8 @@ void vkglTF::Texture::fromglTfImage(tinygltf::Image &gltfimage, std::string path
 		imageCreateInfo.extent = { width, height, 1 };
 		imageCreateInfo.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
 		VK_CHECK_RESULT(vkCreateImage(device->logicalDevice, &imageCreateInfo, nullptr, &image));
-
-		vkGetImageMemoryRequirements(device->logicalDevice, image, &memReqs);
-		memAllocInfo.allocationSize = memReqs.size;
-		memAllocInfo.memoryTypeIndex = device->getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-		VK_CHECK_RESULT(vkAllocateMemory(device->logicalDevice, &memAllocInfo, nullptr, &deviceMemory));
-		VK_CHECK_RESULT(vkBindImageMemory(device->logicalDevice, image, deviceMemory, 0));
+		VK_CHECK_RESULT(device->allocator->allocate(image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, allocation));
+		VK_CHECK_RESULT(vkBindImageMemory(device->logicalDevice, image, allocation.memory, allocation.offset));
 
 		VkImageSubresourceRange subresourceRange = {};
 		subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
@@ -387,7 +384,7 @@ void vkglTF::Texture::fromglTfImage(tinygltf::Image &gltfimage, std::string path
 		this->imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
 
 		vkDestroyBuffer(device->logicalDevice, stagingBuffer, nullptr);
-		vkFreeMemory(device->logicalDevice, stagingMemory, nullptr);
+		device->allocator->free(stagingAllocation);
 
 		ktxTexture_Destroy(ktxTexture);
 	}
@@ -435,6 +432,11 @@ void vkglTF::Material::createDescriptorSet(VkDescriptorPool descriptorPool, VkDe
 	descriptorSetAllocInfo.pSetLayouts = &descriptorSetLayout;
 	descriptorSetAllocInfo.descriptorSetCount = 1;
 	VK_CHECK_RESULT(vkAllocateDescriptorSets(device->logicalDevice, &descriptorSetAllocInfo, &descriptorSet));
+	updateDescriptorSet(descriptorBindingFlags);
+}
+
+void vkglTF::Material::updateDescriptorSet(uint32_t descriptorBindingFlags)
+{
 	std::vector<VkDescriptorImageInfo> imageDescriptors{};
 	std::vector<VkWriteDescriptorSet> writeDescriptorSets{};
 	if (descriptorBindingFlags & DescriptorBindingFlags::ImageBaseColor) {
@@ -480,20 +482,27 @@ void vkglTF::Primitive::setDimensions(glm::vec3 min, glm::vec3 max) {
 vkglTF::Mesh::Mesh(vks::VulkanDevice *device, glm::mat4 matrix) {
 	this->device = device;
 	this->uniformBlock.matrix = matrix;
+	if (!device) {
+		// Host only models don't have uniform buffers
+		uniformBuffer.mapped = nullptr;
+		return;
+	}
 	VK_CHECK_RESULT(device->createBuffer(
 		VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
 		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
 		sizeof(uniformBlock),
 		&uniformBuffer.buffer,
-		&uniformBuffer.memory,
+		&uniformBuffer.allocation,
 		&uniformBlock));
-	VK_CHECK_RESULT(vkMapMemory(device->logicalDevice, uniformBuffer.memory, 0, sizeof(uniformBlock), 0, &uniformBuffer.mapped));
+	uniformBuffer.mapped = uniformBuffer.allocation.mapped;
 	uniformBuffer.descriptor = { uniformBuffer.buffer, 0, sizeof(uniformBlock) };
 };
 
 vkglTF::Mesh::~Mesh() {
-	vkDestroyBuffer(device->logicalDevice, uniformBuffer.buffer, nullptr);
-	vkFreeMemory(device->logicalDevice, uniformBuffer.memory, nullptr);
+	if (device) {
+		vkDestroyBuffer(device->logicalDevice, uniformBuffer.buffer, nullptr);
+		device->allocator->free(uniformBuffer.allocation);
+	}
     for(auto primitive : primitives)
     {
         delete primitive;
@@ -531,8 +540,10 @@ void vkglTF::Node::update() {
 				mesh->uniformBlock.jointMatrix[i] = jointMat;
 			}
 			mesh->uniformBlock.jointcount = (float)skin->joints.size();
-			memcpy(mesh->uniformBuffer.mapped, &mesh->uniformBlock, sizeof(mesh->uniformBlock));
-		} else {
+			if (mesh->uniformBuffer.mapped) {
+				memcpy(mesh->uniformBuffer.mapped, &mesh->uniformBlock, sizeof(mesh->uniformBlock));
+			}
+		} else if (mesh->uniformBuffer.mapped) {
 			memcpy(mesh->uniformBuffer.mapped, &m, sizeof(glm::mat4));
 		}
 	}
@@ -617,6 +628,11 @@ vkglTF::Texture* vkglTF::Model::getTexture(uint32_t index)
 
 void vkglTF::Model::createEmptyTexture(VkQueue transferQueue)
 {
+	if (hostOnly) {
+		// Doesn't reference a host image, materials without a normal map point to it
+		emptyTexture.index = ~0u;
+		return;
+	}
 	emptyTexture.device = device;
 	emptyTexture.width = 1;
 	emptyTexture.height = 1;
@@ -627,28 +643,17 @@ void vkglTF::Model::createEmptyTexture(VkQueue transferQueue)
 	unsigned char* buffer = new unsigned char[bufferSize];
 	memset(buffer, 0, bufferSize);
 
-	VkBuffer stagingBuffer;
-	VkDeviceMemory stagingMemory;
-	VkBufferCreateInfo bufferCreateInfo = vks::initializers::bufferCreateInfo();
-	bufferCreateInfo.size = bufferSize;
 	// This buffer is used as a transfer source for the buffer copy
-	bufferCreateInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
-	bufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-	VK_CHECK_RESULT(vkCreateBuffer(device->logicalDevice, &bufferCreateInfo, nullptr, &stagingBuffer));
-
-	VkMemoryAllocateInfo memAllocInfo = vks::initializers::memoryAllocateInfo();
-	VkMemoryRequirements memReqs;
-	vkGetBufferMemoryRequirements(device->logicalDevice, stagingBuffer, &memReqs);
-	memAllocInfo.allocationSize = memReqs.size;
-	memAllocInfo.memoryTypeIndex = device->getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-	VK_CHECK_RESULT(vkAllocateMemory(device->logicalDevice, &memAllocInfo, nullptr, &stagingMemory));
-	VK_CHECK_RESULT(vkBindBufferMemory(device->logicalDevice, stagingBuffer, stagingMemory, 0));
-
-	// Copy texture data into staging buffer
-	uint8_t* data;
-	VK_CHECK_RESULT(vkMapMemory(device->logicalDevice, stagingMemory, 0, memReqs.size, 0, (void**)&data));
-	memcpy(data, buffer, bufferSize);
-	vkUnmapMemory(device->logicalDevice, stagingMemory);
+	VkBuffer stagingBuffer;
+	vks::Allocation stagingAllocation;
+	VK_CHECK_RESULT(device->createBuffer(
+		VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		bufferSize,
+		&stagingBuffer,
+		&stagingAllocation,
+		buffer,
+		vks::AllocationStrategy::Linear));
 
 	VkBufferImageCopy bufferCopyRegion = {};
 	bufferCopyRegion.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
@@ -670,12 +675,8 @@ void vkglTF::Model::createEmptyTexture(VkQueue transferQueue)
 	imageCreateInfo.extent = { emptyTexture.width, emptyTexture.height, 1 };
 	imageCreateInfo.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
 	VK_CHECK_RESULT(vkCreateImage(device->logicalDevice, &imageCreateInfo, nullptr, &emptyTexture.image));
-
-	vkGetImageMemoryRequirements(device->logicalDevice, emptyTexture.image, &memReqs);
-	memAllocInfo.allocationSize = memReqs.size;
-	memAllocInfo.memoryTypeIndex = device->getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-	VK_CHECK_RESULT(vkAllocateMemory(device->logicalDevice, &memAllocInfo, nullptr, &emptyTexture.deviceMemory));
-	VK_CHECK_RESULT(vkBindImageMemory(device->logicalDevice, emptyTexture.image, emptyTexture.deviceMemory, 0));
+	VK_CHECK_RESULT(device->allocator->allocate(emptyTexture.image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, emptyTexture.allocation));
+	VK_CHECK_RESULT(vkBindImageMemory(device->logicalDevice, emptyTexture.image, emptyTexture.allocation.memory, emptyTexture.allocation.offset));
 
 	VkImageSubresourceRange subresourceRange{};
 	subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
@@ -692,7 +693,8 @@ void vkglTF::Model::createEmptyTexture(VkQueue transferQueue)
 
 	// Clean up staging resources
 	vkDestroyBuffer(device->logicalDevice, stagingBuffer, nullptr);
-	vkFreeMemory(device->logicalDevice, stagingMemory, nullptr);
+	device->allocator->free(stagingAllocation);
+	delete[] buffer;
 
 	VkSamplerCreateInfo samplerCreateInfo = vks::initializers::samplerCreateInfo();
 	samplerCreateInfo.magFilter = VK_FILTER_LINEAR;
@@ -721,13 +723,221 @@ void vkglTF::Model::createEmptyTexture(VkQueue transferQueue)
 /*
 	glTF model loading and rendering class
 */
+/*
+	Image streaming
+	The worker decodes the images on the task scheduler and first queues a low resolution version of each, then the full resolution ones
+	Uploads happen on the thread calling updateStreamedImages, so only that thread records commands
+*/
+
+struct vkglTF::Model::ImageStreamer {
+	struct StreamedImage {
+		uint32_t index;
+		tinygltf::Image image;
+		// Counts towards the low resolution and full resolution residency of the model
+		bool lowResolution;
+		bool fullResolution;
+	};
+	std::vector<StreamedImage> sources;
+	std::deque<StreamedImage> ready;
+	std::mutex mutex;
+	std::atomic<bool> stop{ false };
+	std::thread worker;
+	uint32_t lowResolutionCount = 0;
+	uint32_t fullResolutionCount = 0;
+	uint32_t lowResolutionSize = 64;
+
+	// Halves an RGBA8 image with a box filter, odd edges reuse their last texel
+	static void downsample(tinygltf::Image& image)
+	{
+		const int width = std::max(image.width / 2, 1);
+		const int height = std::max(image.height / 2, 1);
+		std::vector<unsigned char> pixels(static_cast<size_t>(width) * height * 4);
+		for (int y = 0; y < height; y++) {
+			const int y0 = std::min(y * 2, image.height - 1);
+			const int y1 = std::min(y * 2 + 1, image.height - 1);
+			for (int x = 0; x < width; x++) {
+				const int x0 = std::min(x * 2, image.width - 1);
+				const int x1 = std::min(x * 2 + 1, image.width - 1);
+				for (int c = 0; c < 4; c++) {
+					const uint32_t sum = image.image[(y0 * image.width + x0) * 4 + c] + image.image[(y0 * image.width + x1) * 4 + c] + image.image[(y1 * image.width + x0) * 4 + c] + image.image[(y1 * image.width + x1) * 4 + c];
+					pixels[(y * width + x) * 4 + c] = static_cast<unsigned char>((sum + 2) / 4);
+				}
+			}
+		}
+		image.width = width;
+		image.height = height;
+		image.image = std::move(pixels);
+	}
+
+	void push(StreamedImage&& streamedImage)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		ready.push_back(std::move(streamedImage));
+	}
+
+	// Decodes and downsamples a single source, runs on the shared task scheduler
+	void decode(StreamedImage& source)
+	{
+		if (stop) {
+			return;
+		}
+		tinygltf::Image& image = source.image;
+		// Images are either still encoded (deferred image loader) or come decoded from the model cache
+		if (image.width <= 0) {
+			int width, height, components;
+			unsigned char* pixels = stbi_load_from_memory(image.image.data(), static_cast<int>(image.image.size()), &width, &height, &components, 4);
+			image.image.clear();
+			if (pixels) {
+				image.width = width;
+				image.height = height;
+				image.image.assign(pixels, pixels + static_cast<size_t>(width) * height * 4);
+				stbi_image_free(pixels);
+			} else {
+				std::cerr << "Could not decode image \"" << image.uri << "\": " << stbi_failure_reason() << "\n";
+			}
+		} else if (image.component == 3) {
+			std::vector<unsigned char> rgba(static_cast<size_t>(image.width) * image.height * 4, 255);
+			for (size_t i = 0; i < static_cast<size_t>(image.width) * image.height; i++) {
+				memcpy(&rgba[i * 4], &image.image[i * 3], 3);
+			}
+			image.image = std::move(rgba);
+		}
+		image.component = 4;
+		image.bits = 8;
+		if (image.image.empty() || static_cast<uint32_t>(std::max(image.width, image.height)) <= lowResolutionSize) {
+			// Failed or already small enough, so there is no separate full resolution pass (an empty image keeps the placeholder)
+			push({ source.index, std::move(image), true, true });
+			return;
+		}
+		tinygltf::Image lowResolution;
+		lowResolution.width = image.width;
+		lowResolution.height = image.height;
+		lowResolution.component = 4;
+		lowResolution.bits = 8;
+		lowResolution.image = image.image;
+		while (static_cast<uint32_t>(std::max(lowResolution.width, lowResolution.height)) > lowResolutionSize) {
+			downsample(lowResolution);
+		}
+		push({ source.index, std::move(lowResolution), true, false });
+	}
+
+	void run()
+	{
+		// Images are decoded in parallel, their low resolution versions arrive in whatever order the decodes finish
+		vks::TaskScheduler::shared().parallelFor(0, static_cast<uint32_t>(sources.size()), [this](uint32_t i) { decode(sources[i]); }, 1);
+		for (StreamedImage& source : sources) {
+			if (stop) {
+				return;
+			}
+			if (!source.image.image.empty()) {
+				push({ source.index, std::move(source.image), false, true });
+			}
+		}
+	}
+};
+
+vkglTF::Model::Model() {}
+
+void vkglTF::Model::startImageStreaming(VkQueue transferQueue)
+{
+	// Placeholders keep every descriptor valid until the first decoded version arrives, normal maps get a flat normal
+	std::vector<bool> normalMaps(textures.size(), false);
+	for (const Material& material : materials) {
+		if (material.normalTexture && material.normalTexture != &emptyTexture) {
+			normalMaps[material.normalTexture->index] = true;
+		}
+	}
+	for (const ImageStreamer::StreamedImage& source : imageStreamer->sources) {
+		tinygltf::Image placeholder;
+		placeholder.width = 1;
+		placeholder.height = 1;
+		placeholder.component = 4;
+		placeholder.bits = 8;
+		placeholder.image = normalMaps[source.index] ? std::vector<unsigned char>{ 128, 128, 255, 255 } : std::vector<unsigned char>{ 255, 255, 255, 255 };
+		textures[source.index].fromglTfImage(placeholder, path, device, transferQueue);
+	}
+	imageStreamer->lowResolutionSize = streamingLowResolutionSize;
+	imageStreamer->worker = std::thread(&ImageStreamer::run, imageStreamer.get());
+}
+
+vkglTF::Model::ImageResidency vkglTF::Model::imageResidency() const
+{
+	if (!imageStreamer || imageStreamer->fullResolutionCount == imageStreamer->sources.size()) {
+		return ImageResidency::Complete;
+	}
+	return imageStreamer->lowResolutionCount == imageStreamer->sources.size() ? ImageResidency::LowResolution : ImageResidency::Placeholder;
+}
+
+std::vector<uint32_t> vkglTF::Model::updateStreamedImages(VkQueue transferQueue, uint32_t maxUploads)
+{
+	std::vector<uint32_t> updatedTextures;
+	if (!imageStreamer) {
+		return updatedTextures;
+	}
+	std::vector<ImageStreamer::StreamedImage> uploads;
+	{
+		std::lock_guard<std::mutex> lock(imageStreamer->mutex);
+		while (!imageStreamer->ready.empty() && uploads.size() < maxUploads) {
+			uploads.push_back(std::move(imageStreamer->ready.front()));
+			imageStreamer->ready.pop_front();
+		}
+	}
+	if (uploads.empty()) {
+		return updatedTextures;
+	}
+
+	// Frames already submitted may still sample the images that are replaced
+	VK_CHECK_RESULT(vkQueueWaitIdle(transferQueue));
+	for (ImageStreamer::StreamedImage& upload : uploads) {
+		imageStreamer->lowResolutionCount += upload.lowResolution ? 1 : 0;
+		imageStreamer->fullResolutionCount += upload.fullResolution ? 1 : 0;
+		if (upload.image.image.empty()) {
+			continue;
+		}
+		Texture texture;
+		texture.fromglTfImage(upload.image, path, device, transferQueue);
+		texture.index = upload.index;
+		textures[upload.index].destroy();
+		textures[upload.index] = texture;
+		updatedTextures.push_back(upload.index);
+	}
+	for (auto& material : materials) {
+		if (material.descriptorSet != VK_NULL_HANDLE) {
+			material.updateDescriptorSet(descriptorBindingFlags);
+		}
+	}
+
+	if (imageResidency() == ImageResidency::Complete) {
+		imageStreamer->worker.join();
+	}
+	return updatedTextures;
+}
+
 vkglTF::Model::~Model()
 {
+	if (imageStreamer && imageStreamer->worker.joinable()) {
+		imageStreamer->stop = true;
+		imageStreamer->worker.join();
+	}
+	// Host only models and models that were never loaded own no Vulkan objects
+	if (hostOnly || !device) {
+		for (auto node : nodes) {
+			delete node;
+		}
+		for (auto skin : skins) {
+			delete skin;
+		}
+		return;
+	}
 	vkDestroyBuffer(device->logicalDevice, vertices.buffer, nullptr);
-	vkFreeMemory(device->logicalDevice, vertices.memory, nullptr);
+	device->allocator->free(vertices.allocation);
 	vkDestroyBuffer(device->logicalDevice, indices.buffer, nullptr);
-	vkFreeMemory(device->logicalDevice, indices.memory, nullptr);
-	for (auto texture : textures) {
+	device->allocator->free(indices.allocation);
+	if (deformedStagingBuffer != VK_NULL_HANDLE) {
+		vkDestroyBuffer(device->logicalDevice, deformedStagingBuffer, nullptr);
+		device->allocator->free(deformedStagingAllocation);
+	}
+	for (auto& texture : textures) {
 		texture.destroy();
 	}
 	for (auto node : nodes) {
@@ -788,10 +998,27 @@ void vkglTF::Model::loadNode(vkglTF::Node *parent, const tinygltf::Node &node, u
 	}
 
 	// Node contains mesh data
-	if (node.mesh > -1) {
+	// Skinned meshes are deformed per node, so they always get their own copy
+	const bool sharedData = shareMeshData && node.skin < 0;
+	const auto sharedMesh = sharedData && node.mesh > -1 ? sharedMeshes.find(node.mesh) : sharedMeshes.end();
+	if (sharedMesh != sharedMeshes.end()) {
+		// Another node already loaded this glTF mesh, reference its vertices and indices instead of appending a copy
+		Mesh *newMesh = new Mesh(device, newNode->matrix);
+		newMesh->name = sharedMesh->second->name;
+		newMesh->index = node.mesh;
+		for (const Primitive *primitive : sharedMesh->second->primitives) {
+			Primitive *newPrimitive = new Primitive(primitive->firstIndex, primitive->indexCount, primitive->material);
+			newPrimitive->firstVertex = primitive->firstVertex;
+			newPrimitive->vertexCount = primitive->vertexCount;
+			newPrimitive->dimensions = primitive->dimensions;
+			newMesh->primitives.push_back(newPrimitive);
+		}
+		newNode->mesh = newMesh;
+	} else if (node.mesh > -1) {
 		const tinygltf::Mesh mesh = model.meshes[node.mesh];
 		Mesh *newMesh = new Mesh(device, newNode->matrix);
 		newMesh->name = mesh.name;
+		newMesh->index = node.mesh;
 		for (size_t j = 0; j < mesh.primitives.size(); j++) {
 			const tinygltf::Primitive &primitive = mesh.primitives[j];
 			if (primitive.indices < 0) {
@@ -940,6 +1167,9 @@ void vkglTF::Model::loadNode(vkglTF::Node *parent, const tinygltf::Node &node, u
 			newMesh->primitives.push_back(newPrimitive);
 		}
 		newNode->mesh = newMesh;
+		if (sharedData) {
+			sharedMeshes[node.mesh] = newMesh;
+		}
 	}
 	if (parent) {
 		parent->children.push_back(newNode);
@@ -985,8 +1215,22 @@ void vkglTF::Model::loadImages(tinygltf::Model &gltfModel, vks::VulkanDevice *de
 {
 	for (tinygltf::Image &image : gltfModel.images) {
 		vkglTF::Texture texture;
-		texture.fromglTfImage(image, path, device, transferQueue);
 		texture.index = static_cast<uint32_t>(textures.size());
+		const bool isKtx = image.uri.find_last_of(".") != std::string::npos && image.uri.substr(image.uri.find_last_of(".") + 1) == "ktx";
+		if (hostOnly) {
+			// Decoded to RGBA8 by tinygltf, ktx files aren't supported on the host and stay empty
+			texture.width = static_cast<uint32_t>(std::max(image.width, 0));
+			texture.height = static_cast<uint32_t>(std::max(image.height, 0));
+			if (isKtx || image.bits != 8 || image.component != 4) {
+				image.image.clear();
+			}
+			host.images.push_back(std::move(image));
+		} else if (imageStreamer && !isKtx) {
+			// Uploaded once materials are known, see startImageStreaming
+			imageStreamer->sources.push_back({ texture.index, image, false, false });
+		} else {
+			texture.fromglTfImage(image, path, device, transferQueue);
+		}
 		textures.push_back(texture);
 	}
 	// Create an empty texture to be used for empty material images
@@ -1021,6 +1265,15 @@ void vkglTF::Model::loadMaterials(tinygltf::Model &gltfModel)
 		if (mat.additionalValues.find("emissiveTexture") != mat.additionalValues.end()) {
 			material.emissiveTexture = getTexture(gltfModel.textures[mat.additionalValues["emissiveTexture"].TextureIndex()].source);
 		}
+		if (mat.emissiveFactor.size() == 3) {
+			material.emissiveFactor = glm::vec3(glm::make_vec3(mat.emissiveFactor.data()));
+		}
+		if (mat.extensions.find("KHR_materials_emissive_strength") != mat.extensions.end()) {
+			const tinygltf::Value& extension = mat.extensions["KHR_materials_emissive_strength"];
+			if (extension.Has("emissiveStrength")) {
+				material.emissiveFactor *= static_cast<float>(extension.Get("emissiveStrength").GetNumberAsDouble());
+			}
+		}
 		if (mat.additionalValues.find("occlusionTexture") != mat.additionalValues.end()) {
 			material.occlusionTexture = getTexture(gltfModel.textures[mat.additionalValues["occlusionTexture"].TextureIndex()].source);
 		}
@@ -1157,12 +1410,473 @@ void vkglTF::Model::loadAnimations(tinygltf::Model &gltfModel)
 	}
 }
 
-void vkglTF::Model::loadFromFile(std::string filename, vks::VulkanDevice *device, VkQueue transferQueue, uint32_t fileLoadingFlags, float scale)
+/*
+	Processed model cache
+	Stores everything loadGltf produces (packed vertices, indices, nodes, materials and decoded images), so warm starts skip parsing and image decoding
+*/
+
+namespace
+{
+	// Bump the version whenever the cache layout or the processing done in loadGltf changes
+	constexpr uint32_t cacheMagic = 0x4d475456;
+	constexpr uint32_t cacheVersion = 4;
+
+	struct CacheWriter {
+		std::vector<uint8_t> data;
+		void write(const void* src, size_t size) {
+			const uint8_t* bytes = static_cast<const uint8_t*>(src);
+			data.insert(data.end(), bytes, bytes + size);
+		}
+		template<typename T> void write(const T& value) {
+			static_assert(std::is_trivially_copyable_v<T>);
+			write(&value, sizeof(T));
+		}
+		void write(const std::string& str) {
+			write(static_cast<uint64_t>(str.size()));
+			write(str.data(), str.size());
+		}
+		template<typename T> void writeVector(const std::vector<T>& values) {
+			write(static_cast<uint64_t>(values.size()));
+			write(values.data(), values.size() * sizeof(T));
+		}
+	};
+
+	// Every read is bounds checked, a truncated or corrupt cache only clears valid
+	struct CacheReader {
+		const std::vector<uint8_t>& data;
+		size_t cursor = 0;
+		bool valid = true;
+		void read(void* dst, size_t size) {
+			if (!valid || size > data.size() - cursor) {
+				valid = false;
+				return;
+			}
+			if (size > 0) {
+				memcpy(dst, &data[cursor], size);
+				cursor += size;
+			}
+		}
+		template<typename T> T read() {
+			T value{};
+			read(&value, sizeof(T));
+			return value;
+		}
+		std::string readString() {
+			const uint64_t size = read<uint64_t>();
+			if (!valid || size > data.size() - cursor) {
+				valid = false;
+				return {};
+			}
+			std::string str(reinterpret_cast<const char*>(data.data() + cursor), size);
+			cursor += size;
+			return str;
+		}
+		// Element count of a following array, checked against the remaining data so corrupt counts can't trigger huge allocations
+		uint32_t readCount(size_t elementSize) {
+			const uint32_t count = read<uint32_t>();
+			if (!valid || count > (data.size() - cursor) / elementSize) {
+				valid = false;
+				return 0;
+			}
+			return count;
+		}
+		template<typename T> void readVector(std::vector<T>& values) {
+			const uint64_t count = read<uint64_t>();
+			if (!valid || count > (data.size() - cursor) / sizeof(T)) {
+				valid = false;
+				return;
+			}
+			values.resize(count);
+			read(values.data(), count * sizeof(T));
+		}
+	};
+
+	bool isExternalUri(const std::string& uri)
+	{
+		return !uri.empty() && uri.rfind("data:", 0) != 0;
+	}
+
+	// Size and modification time of a source file, compared before its contents are hashed
+	struct FileStamp {
+		uint64_t size = 0;
+		int64_t modified = 0;
+	};
+
+	bool readFileStamp(const std::string& file, FileStamp& stamp)
+	{
+		std::error_code error;
+		stamp.size = std::filesystem::file_size(file, error);
+		if (error) {
+			return false;
+		}
+		stamp.modified = std::filesystem::last_write_time(file, error).time_since_epoch().count();
+		return !error;
+	}
+
+	// Writes to a temporary file first, so an interrupted write never leaves a truncated cache behind
+	bool writeCacheFile(const std::string& cacheDirectory, const std::string& cacheFile, const std::vector<uint8_t>& data)
+	{
+		std::error_code error;
+		std::filesystem::create_directories(cacheDirectory, error);
+		const std::string tempFile = cacheFile + ".tmp";
+		{
+			std::ofstream os(tempFile, std::ios::binary | std::ios::trunc);
+			os.write(reinterpret_cast<const char*>(data.data()), data.size());
+			if (!os.good()) {
+				return false;
+			}
+		}
+		std::filesystem::rename(tempFile, cacheFile, error);
+		if (error) {
+			std::filesystem::remove(tempFile, error);
+			return false;
+		}
+		return true;
+	}
+}
+
+void vkglTF::Model::writeCache(const std::string& sourceFile, const tinygltf::Model& gltfModel, const std::vector<uint32_t>& indexBuffer, const std::vector<uint8_t>& vertexBuffer)
+{
+	if (!skins.empty() || !animations.empty()) {
+		// Skins and animations reference accessors that aren't part of the cache
+		std::cout << "Skinned or animated models are not cached: " << sourceFile << "\n";
+		cacheFile.clear();
+		return;
+	}
+
+	CacheWriter writer;
+	writer.write(cacheMagic);
+	writer.write(cacheVersion);
+
+	// Source files the cache is validated against
+	std::vector<std::string> dependencies{ sourceFile };
+	for (const tinygltf::Buffer& buffer : gltfModel.buffers) {
+		if (isExternalUri(buffer.uri)) {
+			dependencies.push_back(path + "/" + buffer.uri);
+		}
+	}
+	for (const tinygltf::Image& image : gltfModel.images) {
+		if (isExternalUri(image.uri)) {
+			dependencies.push_back(path + "/" + image.uri);
+		}
+	}
+	uint64_t hash = vks::tools::fnv1a(cacheFile.data(), cacheFile.size());
+	writer.write(static_cast<uint32_t>(dependencies.size()));
+	for (const std::string& dependency : dependencies) {
+		// Stamped before reading, so a file changing in between fails the stamp check and gets hashed on the next load
+		FileStamp stamp;
+		std::vector<uint8_t> contents;
+		if (!readFileStamp(dependency, stamp) || !vks::tools::readFile(dependency, contents)) {
+			std::cout << "Could not read \"" << dependency << "\", model is not cached\n";
+			cacheFile.clear();
+			return;
+		}
+		const uint64_t dependencyHash = vks::tools::fnv1a(contents.data(), contents.size());
+		writer.write(dependency);
+		writer.write(stamp);
+		writer.write(dependencyHash);
+		hash = vks::tools::fnv1a(&dependencyHash, sizeof(dependencyHash), hash);
+	}
+
+	writer.write(static_cast<uint8_t>(metallicRoughnessWorkflow));
+
+	// Decoded images (still encoded when streaming, see loadImageDataFuncDeferred), ktx images are loaded from their own file
+	writer.write(static_cast<uint32_t>(gltfModel.images.size()));
+	for (const tinygltf::Image& image : gltfModel.images) {
+		writer.write(image.uri);
+		writer.write(static_cast<int32_t>(image.width));
+		writer.write(static_cast<int32_t>(image.height));
+		writer.write(static_cast<int32_t>(image.component));
+		writer.writeVector(image.image);
+	}
+
+	// Materials including the default material at the end, textures are stored as image index, -1 for none and -2 for the empty texture
+	auto textureIndex = [this](const Texture* texture) -> int32_t {
+		if (texture == nullptr) {
+			return -1;
+		}
+		return texture == &emptyTexture ? -2 : static_cast<int32_t>(texture->index);
+	};
+	writer.write(static_cast<uint32_t>(materials.size()));
+	for (const Material& material : materials) {
+		writer.write(static_cast<uint32_t>(material.alphaMode));
+		writer.write(material.alphaCutoff);
+		writer.write(material.metallicFactor);
+		writer.write(material.roughnessFactor);
+		writer.write(material.baseColorFactor);
+		writer.write(material.emissiveFactor);
+		writer.write(textureIndex(material.baseColorTexture));
+		writer.write(textureIndex(material.metallicRoughnessTexture));
+		writer.write(textureIndex(material.normalTexture));
+		writer.write(textureIndex(material.occlusionTexture));
+		writer.write(textureIndex(material.emissiveTexture));
+	}
+
+	// Nodes in linearNodes order, children come before their parent
+	std::unordered_map<const Node*, int32_t> linearIndices;
+	for (size_t i = 0; i < linearNodes.size(); i++) {
+		linearIndices[linearNodes[i]] = static_cast<int32_t>(i);
+	}
+	writer.write(static_cast<uint32_t>(linearNodes.size()));
+	for (const Node* node : linearNodes) {
+		writer.write(node->name);
+		writer.write(node->index);
+		writer.write(node->parent ? linearIndices[node->parent] : -1);
+		writer.write(node->matrix);
+		writer.write(node->translation);
+		writer.write(node->scale);
+		writer.write(node->rotation);
+		writer.write(static_cast<uint8_t>(node->mesh != nullptr));
+		if (node->mesh) {
+			writer.write(node->mesh->name);
+			writer.write(node->mesh->index);
+			writer.write(static_cast<uint32_t>(node->mesh->primitives.size()));
+			for (const Primitive* primitive : node->mesh->primitives) {
+				writer.write(primitive->firstIndex);
+				writer.write(primitive->indexCount);
+				writer.write(primitive->firstVertex);
+				writer.write(primitive->vertexCount);
+				writer.write(static_cast<uint32_t>(&primitive->material - materials.data()));
+				writer.write(primitive->dimensions.min);
+				writer.write(primitive->dimensions.max);
+			}
+		}
+	}
+
+	writer.writeVector(indexBuffer);
+	writer.writeVector(vertexBuffer);
+
+	if (!writeCacheFile(cacheDirectory, cacheFile, writer.data)) {
+		std::cout << "Could not write model cache \"" << cacheFile << "\"\n";
+		cacheFile.clear();
+		return;
+	}
+	cacheHash = hash;
+}
+
+bool vkglTF::Model::loadCache(uint32_t fileLoadingFlags, std::vector<uint32_t>& indexBuffer, std::vector<uint8_t>& vertexBuffer, VkQueue transferQueue)
+{
+	std::vector<uint8_t> data;
+	if (!vks::tools::readFile(cacheFile, data)) {
+		return false;
+	}
+	CacheReader reader{ data };
+	if (reader.read<uint32_t>() != cacheMagic || reader.read<uint32_t>() != cacheVersion) {
+		return false;
+	}
+
+	// Compare against the current source files before touching any model state
+	uint64_t hash = vks::tools::fnv1a(cacheFile.data(), cacheFile.size());
+	bool stampsUpdated = false;
+	const uint32_t dependencyCount = reader.readCount(sizeof(uint64_t));
+	for (uint32_t i = 0; i < dependencyCount && reader.valid; i++) {
+		const std::string dependency = reader.readString();
+		const size_t stampOffset = reader.cursor;
+		const FileStamp cachedStamp = reader.read<FileStamp>();
+		const uint64_t dependencyHash = reader.read<uint64_t>();
+		// A file with the cached size and modification time is trusted, the contents are only hashed when just the time
+		// differs (e.g. after a fresh checkout), so warm starts don't read every source file
+		FileStamp stamp;
+		bool upToDate = reader.valid && readFileStamp(dependency, stamp) && stamp.size == cachedStamp.size;
+		if (upToDate && stamp.modified != cachedStamp.modified) {
+			std::vector<uint8_t> contents;
+			upToDate = vks::tools::readFile(dependency, contents) && vks::tools::fnv1a(contents.data(), contents.size()) == dependencyHash;
+			// Same contents, store the new stamp so the next load skips the hash again
+			if (upToDate) {
+				memcpy(&data[stampOffset], &stamp, sizeof(FileStamp));
+				stampsUpdated = true;
+			}
+		}
+		if (!upToDate) {
+			std::cout << "Model cache \"" << cacheFile << "\" is outdated\n";
+			return false;
+		}
+		hash = vks::tools::fnv1a(&dependencyHash, sizeof(dependencyHash), hash);
+	}
+
+	const bool cachedMetallicRoughnessWorkflow = reader.read<uint8_t>() != 0;
+
+	tinygltf::Model cachedModel;
+	cachedModel.images.resize(reader.readCount(sizeof(uint64_t)));
+	for (tinygltf::Image& image : cachedModel.images) {
+		if (!reader.valid) {
+			return false;
+		}
+		image.uri = reader.readString();
+		image.width = reader.read<int32_t>();
+		image.height = reader.read<int32_t>();
+		image.component = reader.read<int32_t>();
+		image.bits = 8;
+		reader.readVector(image.image);
+	}
+
+	struct MaterialRecord {
+		uint32_t alphaMode;
+		float alphaCutoff, metallicFactor, roughnessFactor;
+		glm::vec4 baseColorFactor;
+		glm::vec3 emissiveFactor;
+		int32_t textures[5];
+	};
+	std::vector<MaterialRecord> materialRecords(reader.readCount(sizeof(uint32_t)));
+	for (MaterialRecord& record : materialRecords) {
+		record.alphaMode = reader.read<uint32_t>();
+		record.alphaCutoff = reader.read<float>();
+		record.metallicFactor = reader.read<float>();
+		record.roughnessFactor = reader.read<float>();
+		record.baseColorFactor = reader.read<glm::vec4>();
+		record.emissiveFactor = reader.read<glm::vec3>();
+		for (int32_t& texture : record.textures) {
+			texture = reader.read<int32_t>();
+		}
+		if (!reader.valid || record.alphaMode > Material::ALPHAMODE_BLEND) {
+			return false;
+		}
+	}
+
+	struct PrimitiveRecord {
+		uint32_t firstIndex, indexCount, firstVertex, vertexCount, material;
+		glm::vec3 min, max;
+	};
+	struct NodeRecord {
+		std::string name;
+		uint32_t index;
+		int32_t parent;
+		glm::mat4 matrix;
+		glm::vec3 translation, scale;
+		glm::quat rotation;
+		bool hasMesh;
+		std::string meshName;
+		int32_t meshIndex;
+		std::vector<PrimitiveRecord> primitives;
+	};
+	std::vector<NodeRecord> nodeRecords(reader.readCount(sizeof(uint64_t)));
+	for (size_t i = 0; i < nodeRecords.size() && reader.valid; i++) {
+		NodeRecord& record = nodeRecords[i];
+		record.name = reader.readString();
+		record.index = reader.read<uint32_t>();
+		record.parent = reader.read<int32_t>();
+		record.matrix = reader.read<glm::mat4>();
+		record.translation = reader.read<glm::vec3>();
+		record.scale = reader.read<glm::vec3>();
+		record.rotation = reader.read<glm::quat>();
+		record.hasMesh = reader.read<uint8_t>() != 0;
+		// Parents are always stored after their children
+		if (record.parent != -1 && (record.parent <= static_cast<int32_t>(i) || record.parent >= static_cast<int32_t>(nodeRecords.size()))) {
+			return false;
+		}
+		if (record.hasMesh) {
+			record.meshName = reader.readString();
+			record.meshIndex = reader.read<int32_t>();
+			record.primitives.resize(reader.readCount(sizeof(uint32_t)));
+			for (PrimitiveRecord& primitive : record.primitives) {
+				primitive.firstIndex = reader.read<uint32_t>();
+				primitive.indexCount = reader.read<uint32_t>();
+				primitive.firstVertex = reader.read<uint32_t>();
+				primitive.vertexCount = reader.read<uint32_t>();
+				primitive.material = reader.read<uint32_t>();
+				primitive.min = reader.read<glm::vec3>();
+				primitive.max = reader.read<glm::vec3>();
+				if (!reader.valid || primitive.material >= materialRecords.size()) {
+					return false;
+				}
+			}
+		}
+	}
+
+	reader.readVector(indexBuffer);
+	reader.readVector(vertexBuffer);
+	if (!reader.valid || reader.cursor != data.size() || vertexBuffer.size() % vertices.stride != 0) {
+		indexBuffer.clear();
+		vertexBuffer.clear();
+		return false;
+	}
+
+	// The cache is consistent, create the model from it
+	metallicRoughnessWorkflow = cachedMetallicRoughnessWorkflow;
+	if (!(fileLoadingFlags & FileLoadingFlags::DontLoadImages)) {
+		loadImages(cachedModel, device, transferQueue);
+	}
+	auto texture = [this](int32_t index) -> Texture* {
+		if (index == -2) {
+			return &emptyTexture;
+		}
+		return index < 0 ? nullptr : getTexture(static_cast<uint32_t>(index));
+	};
+	for (const MaterialRecord& record : materialRecords) {
+		Material material(device);
+		material.alphaMode = static_cast<Material::AlphaMode>(record.alphaMode);
+		material.alphaCutoff = record.alphaCutoff;
+		material.metallicFactor = record.metallicFactor;
+		material.roughnessFactor = record.roughnessFactor;
+		material.baseColorFactor = record.baseColorFactor;
+		material.emissiveFactor = record.emissiveFactor;
+		material.baseColorTexture = texture(record.textures[0]);
+		material.metallicRoughnessTexture = texture(record.textures[1]);
+		material.normalTexture = texture(record.textures[2]);
+		material.occlusionTexture = texture(record.textures[3]);
+		material.emissiveTexture = texture(record.textures[4]);
+		materials.push_back(material);
+	}
+
+	for (const NodeRecord& record : nodeRecords) {
+		Node* node = new Node{};
+		node->name = record.name;
+		node->index = record.index;
+		node->matrix = record.matrix;
+		node->translation = record.translation;
+		node->scale = record.scale;
+		node->rotation = record.rotation;
+		if (record.hasMesh) {
+			Mesh* mesh = new Mesh(device, node->matrix);
+			mesh->name = record.meshName;
+			mesh->index = record.meshIndex;
+			for (const PrimitiveRecord& primitiveRecord : record.primitives) {
+				Primitive* primitive = new Primitive(primitiveRecord.firstIndex, primitiveRecord.indexCount, materials[primitiveRecord.material]);
+				primitive->firstVertex = primitiveRecord.firstVertex;
+				primitive->vertexCount = primitiveRecord.vertexCount;
+				primitive->setDimensions(primitiveRecord.min, primitiveRecord.max);
+				mesh->primitives.push_back(primitive);
+			}
+			node->mesh = mesh;
+		}
+		linearNodes.push_back(node);
+	}
+	// Children were pushed to linearNodes in the order they were attached to their parent
+	for (size_t i = 0; i < nodeRecords.size(); i++) {
+		Node* node = linearNodes[i];
+		if (nodeRecords[i].parent != -1) {
+			node->parent = linearNodes[nodeRecords[i].parent];
+			node->parent->children.push_back(node);
+		} else {
+			nodes.push_back(node);
+		}
+	}
+	// Initial pose
+	for (auto node : linearNodes) {
+		if (node->mesh) {
+			node->update();
+		}
+	}
+
+	if (stampsUpdated) {
+		writeCacheFile(cacheDirectory, cacheFile, data);
+	}
+	cacheHash = hash;
+	std::cout << "Loaded model from cache \"" << cacheFile << "\"\n";
+	return true;
+}
+
+/*
+	Parses the glTF file and flattens its nodes into the index buffer and the vertex buffer packed with the requested vertex layout
+*/
+void vkglTF::Model::loadGltf(const std::string& filename, VkQueue transferQueue, uint32_t fileLoadingFlags, float scale, std::vector<uint32_t>& indexBuffer, std::vector<uint8_t>& packedVertexBuffer)
 {
 	tinygltf::Model gltfModel;
 	tinygltf::TinyGLTF gltfContext;
 	if (fileLoadingFlags & FileLoadingFlags::DontLoadImages) {
 		gltfContext.SetImageLoader(loadImageDataFuncEmpty, nullptr);
+	} else if (fileLoadingFlags & FileLoadingFlags::StreamImages) {
+		gltfContext.SetImageLoader(loadImageDataFuncDeferred, nullptr);
 	} else {
 		gltfContext.SetImageLoader(loadImageDataFunc, nullptr);
 	}
@@ -1171,13 +1885,8 @@ void vkglTF::Model::loadFromFile(std::string filename, vks::VulkanDevice *device
 	// We let tinygltf handle this, by passing the asset manager of our app
 	tinygltf::asset_manager = androidApp->activity->assetManager;
 #endif
-	size_t pos = filename.find_last_of('/');
-	path = filename.substr(0, pos);
-
 	std::string error, warning;
 
-	this->device = device;
-
 #if defined(__ANDROID__)
 	// On Android all assets are packed with the apk in a compressed form, so we need to open them using the asset manager
 	// We let tinygltf handle this, by passing the asset manager of our app
@@ -1185,7 +1894,6 @@ void vkglTF::Model::loadFromFile(std::string filename, vks::VulkanDevice *device
 #endif
 	bool fileLoaded = gltfContext.LoadASCIIFromFile(&gltfModel, &error, &warning, filename);
 
-	std::vector<uint32_t> indexBuffer;
 	std::vector<Vertex> vertexBuffer;
 
 	if (fileLoaded) {
@@ -1194,10 +1902,13 @@ void vkglTF::Model::loadFromFile(std::string filename, vks::VulkanDevice *device
 		}
 		loadMaterials(gltfModel);
 		const tinygltf::Scene &scene = gltfModel.scenes[gltfModel.defaultScene > -1 ? gltfModel.defaultScene : 0];
+		// Pre-transformed vertices differ per node, only then every node needs its own copy of the mesh data
+		shareMeshData = !(fileLoadingFlags & FileLoadingFlags::PreTransformVertices);
 		for (size_t i = 0; i < scene.nodes.size(); i++) {
 			const tinygltf::Node node = gltfModel.nodes[scene.nodes[i]];
 			loadNode(nullptr, node, scene.nodes[i], gltfModel, indexBuffer, vertexBuffer, scale);
 		}
+		sharedMeshes.clear();
 		if (gltfModel.animations.size() > 0) {
 			loadAnimations(gltfModel);
 		}
@@ -1225,10 +1936,16 @@ void vkglTF::Model::loadFromFile(std::string filename, vks::VulkanDevice *device
 		const bool preTransform = fileLoadingFlags & FileLoadingFlags::PreTransformVertices;
 		const bool preMultiplyColor = fileLoadingFlags & FileLoadingFlags::PreMultiplyVertexColors;
 		const bool flipY = fileLoadingFlags & FileLoadingFlags::FlipY;
+		// Vertices shared by several nodes must only be processed once
+		std::vector<bool> processedVertices(vertexBuffer.size(), false);
 		for (Node* node : linearNodes) {
 			if (node->mesh) {
 				const glm::mat4 localMatrix = node->getMatrix();
 				for (Primitive* primitive : node->mesh->primitives) {
+					if (primitive->vertexCount == 0 || processedVertices[primitive->firstVertex]) {
+						continue;
+					}
+					processedVertices[primitive->firstVertex] = true;
 					for (uint32_t i = 0; i < primitive->vertexCount; i++) {
 						Vertex& vertex = vertexBuffer[primitive->firstVertex + i];
 						// Pre-transform vertex positions by node-hierarchy
@@ -1251,6 +1968,24 @@ void vkglTF::Model::loadFromFile(std::string filename, vks::VulkanDevice *device
 		}
 	}
 
+	// Keep the loaded vertices of skinned meshes, updateDeformedMeshes skins them on the host
+	if (!(fileLoadingFlags & FileLoadingFlags::PreTransformVertices)) {
+		deformedPositionsFlipped = fileLoadingFlags & FileLoadingFlags::FlipY;
+		deformedNormalsFlipped = !deformedPositionsFlipped && (fileLoadingFlags & FileLoadingFlags::PreMultiplyVertexColors);
+		for (Node* node : linearNodes) {
+			if (!node->skin || !node->mesh || node->mesh->primitives.empty()) {
+				continue;
+			}
+			// Primitives of a mesh are loaded consecutively
+			DeformedMesh deformedMesh{};
+			deformedMesh.node = node;
+			deformedMesh.firstVertex = node->mesh->primitives.front()->firstVertex;
+			deformedMesh.vertexCount = node->mesh->primitives.back()->firstVertex + node->mesh->primitives.back()->vertexCount - deformedMesh.firstVertex;
+			deformedMesh.bindPose.assign(vertexBuffer.begin() + deformedMesh.firstVertex, vertexBuffer.begin() + deformedMesh.firstVertex + deformedMesh.vertexCount);
+			deformedMeshes.push_back(std::move(deformedMesh));
+		}
+	}
+
 	for (auto extension : gltfModel.extensionsUsed) {
 		if (extension == "KHR_materials_pbrSpecularGlossiness") {
 			std::cout << "Required extension: " << extension;
@@ -1258,16 +1993,92 @@ void vkglTF::Model::loadFromFile(std::string filename, vks::VulkanDevice *device
 		}
 	}
 
-	size_t vertexBufferSize = vertexBuffer.size() * sizeof(Vertex);
+	// Pack vertices into the layout requested for the vertex buffer
+	packedVertexBuffer.resize(vertexBuffer.size() * vertices.stride);
+	for (size_t i = 0; i < vertexBuffer.size(); i++) {
+		packVertex(vertexBuffer[i], &packedVertexBuffer[i * vertices.stride]);
+	}
+
+	if (fileLoadingFlags & FileLoadingFlags::CacheProcessedModel) {
+		writeCache(filename, gltfModel, indexBuffer, packedVertexBuffer);
+	}
+}
+
+void vkglTF::Model::loadFromFile(std::string filename, vks::VulkanDevice *device, VkQueue transferQueue, uint32_t fileLoadingFlags, float scale)
+{
+	size_t pos = filename.find_last_of('/');
+	path = filename.substr(0, pos);
+
+	this->device = device;
+
+	std::vector<uint32_t> indexBuffer;
+	std::vector<uint8_t> packedVertexBuffer;
+
+	hostOnly = fileLoadingFlags & FileLoadingFlags::HostOnly;
+	if (hostOnly) {
+		// Both would upload images to the device
+		fileLoadingFlags &= ~(FileLoadingFlags::CacheProcessedModel | FileLoadingFlags::StreamImages);
+	}
+
+	if ((fileLoadingFlags & FileLoadingFlags::StreamImages) && !(fileLoadingFlags & FileLoadingFlags::DontLoadImages)) {
+		imageStreamer = std::make_unique<ImageStreamer>();
+	}
+
+	loadedFromCache = false;
+	if (fileLoadingFlags & FileLoadingFlags::CacheProcessedModel) {
+		// The cache file name only depends on the loading parameters, its contents are validated against the source files
+		uint64_t key = vks::tools::fnv1a(filename.data(), filename.size());
+		key = vks::tools::fnv1a(&fileLoadingFlags, sizeof(fileLoadingFlags), key);
+		key = vks::tools::fnv1a(&scale, sizeof(scale), key);
+		key = vks::tools::fnv1a(&vertexLayoutHash, sizeof(vertexLayoutHash), key);
+		std::stringstream cacheName;
+		cacheName << cacheDirectory << "/" << std::hex << std::setw(16) << std::setfill('0') << key << ".model";
+		cacheFile = cacheName.str();
+		loadedFromCache = loadCache(fileLoadingFlags, indexBuffer, packedVertexBuffer, transferQueue);
+	}
+	if (!loadedFromCache) {
+		loadGltf(filename, transferQueue, fileLoadingFlags, scale, indexBuffer, packedVertexBuffer);
+	}
+	if (imageStreamer) {
+		startImageStreaming(transferQueue);
+	}
+
+	size_t vertexBufferSize = packedVertexBuffer.size();
 	size_t indexBufferSize = indexBuffer.size() * sizeof(uint32_t);
 	indices.count = static_cast<uint32_t>(indexBuffer.size());
-	vertices.count = static_cast<uint32_t>(vertexBuffer.size());
+	vertices.count = static_cast<uint32_t>(packedVertexBuffer.size() / vertices.stride);
 
 	assert((vertexBufferSize > 0) && (indexBufferSize > 0));
 
+	// Keep the positions of emissive primitives so light tables can be built without reading back the vertex buffer
+	// Every vertex layout starts with the position, ray tracing acceleration structures rely on that as well
+	emissiveTriangles.clear();
+	for (Node* node : linearNodes) {
+		if (!node->mesh) {
+			continue;
+		}
+		for (Primitive* primitive : node->mesh->primitives) {
+			if (primitive->indexCount == 0 || primitive->material.emissiveFactor == glm::vec3(0.0f) || emissiveTriangles.count(primitive->firstIndex) > 0) {
+				continue;
+			}
+			std::vector<glm::vec3>& positions = emissiveTriangles[primitive->firstIndex];
+			positions.resize(primitive->indexCount);
+			for (uint32_t i = 0; i < primitive->indexCount; i++) {
+				memcpy(&positions[i], packedVertexBuffer.data() + static_cast<size_t>(indexBuffer[primitive->firstIndex + i]) * vertices.stride, sizeof(glm::vec3));
+			}
+		}
+	}
+
+	if (hostOnly) {
+		host.indices = std::move(indexBuffer);
+		host.vertices = std::move(packedVertexBuffer);
+		getSceneDimensions();
+		return;
+	}
+
 	struct StagingBuffer {
 		VkBuffer buffer;
-		VkDeviceMemory memory;
+		vks::Allocation allocation;
 	} vertexStaging, indexStaging;
 
 	// Create staging buffers
@@ -1277,16 +2088,18 @@ void vkglTF::Model::loadFromFile(std::string filename, vks::VulkanDevice *device
 		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
 		vertexBufferSize,
 		&vertexStaging.buffer,
-		&vertexStaging.memory,
-		vertexBuffer.data()));
+		&vertexStaging.allocation,
+		packedVertexBuffer.data(),
+		vks::AllocationStrategy::Linear));
 	// Index data
 	VK_CHECK_RESULT(device->createBuffer(
 		VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
 		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
 		indexBufferSize,
 		&indexStaging.buffer,
-		&indexStaging.memory,
-		indexBuffer.data()));
+		&indexStaging.allocation,
+		indexBuffer.data(),
+		vks::AllocationStrategy::Linear));
 
 	// Create device local buffers
 	// Vertex buffer
@@ -1295,14 +2108,14 @@ void vkglTF::Model::loadFromFile(std::string filename, vks::VulkanDevice *device
 		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
 		vertexBufferSize,
 		&vertices.buffer,
-		&vertices.memory));
+		&vertices.allocation));
 	// Index buffer
 	VK_CHECK_RESULT(device->createBuffer(
 	    VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | memoryPropertyFlags,
 		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
 		indexBufferSize,
 		&indices.buffer,
-		&indices.memory));
+		&indices.allocation));
 
 	// Copy from staging buffers
 	VkCommandBuffer copyCmd = device->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
@@ -1318,9 +2131,9 @@ void vkglTF::Model::loadFromFile(std::string filename, vks::VulkanDevice *device
 	device->flushCommandBuffer(copyCmd, transferQueue, true);
 
 	vkDestroyBuffer(device->logicalDevice, vertexStaging.buffer, nullptr);
-	vkFreeMemory(device->logicalDevice, vertexStaging.memory, nullptr);
+	device->allocator->free(vertexStaging.allocation);
 	vkDestroyBuffer(device->logicalDevice, indexStaging.buffer, nullptr);
-	vkFreeMemory(device->logicalDevice, indexStaging.memory, nullptr);
+	device->allocator->free(indexStaging.allocation);
 
 	getSceneDimensions();
 
@@ -1534,6 +2347,65 @@ void vkglTF::Model::updateAnimation(uint32_t index, float time)
 	}
 }
 
+void vkglTF::Model::updateDeformedMeshes(VkCommandBuffer commandBuffer)
+{
+	if (deformedMeshes.empty()) {
+		return;
+	}
+	if (deformedStagingBuffer == VK_NULL_HANDLE) {
+		VkDeviceSize stagingSize = 0;
+		for (const DeformedMesh& deformedMesh : deformedMeshes) {
+			stagingSize += static_cast<VkDeviceSize>(deformedMesh.vertexCount) * vertices.stride;
+		}
+		VK_CHECK_RESULT(device->createBuffer(
+			VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+			stagingSize,
+			&deformedStagingBuffer,
+			&deformedStagingAllocation));
+	}
+
+	// Vertices were flipped at load time, so the skin matrices are conjugated with the same flip
+	const glm::mat4 flip = glm::scale(glm::mat4(1.0f), glm::vec3(1.0f, -1.0f, 1.0f));
+	uint8_t* staging = static_cast<uint8_t*>(deformedStagingAllocation.mapped);
+	std::vector<VkBufferCopy> copyRegions;
+	VkDeviceSize stagingOffset = 0;
+	for (DeformedMesh& deformedMesh : deformedMeshes) {
+		const Mesh::UniformBlock& uniformBlock = deformedMesh.node->mesh->uniformBlock;
+		deformedMesh.min = glm::vec3(FLT_MAX);
+		deformedMesh.max = glm::vec3(-FLT_MAX);
+		for (uint32_t i = 0; i < deformedMesh.vertexCount; i++) {
+			Vertex vertex = deformedMesh.bindPose[i];
+			glm::mat4 skinMatrix(0.0f);
+			for (uint32_t j = 0; j < 4; j++) {
+				skinMatrix += vertex.weight0[j] * uniformBlock.jointMatrix[static_cast<uint32_t>(vertex.joint0[j]) % 64];
+			}
+			if (vertex.weight0.x + vertex.weight0.y + vertex.weight0.z + vertex.weight0.w <= 0.0f) {
+				skinMatrix = glm::mat4(1.0f);
+			}
+			const glm::mat4 positionMatrix = deformedPositionsFlipped ? flip * skinMatrix * flip : skinMatrix;
+			const glm::mat3 normalMatrix = deformedNormalsFlipped ? glm::mat3(flip * skinMatrix * flip) : glm::mat3(skinMatrix);
+			vertex.pos = glm::vec3(positionMatrix * glm::vec4(vertex.pos, 1.0f));
+			const glm::vec3 normal = normalMatrix * vertex.normal;
+			vertex.normal = glm::dot(normal, normal) > 0.0f ? glm::normalize(normal) : vertex.normal;
+			vertex.tangent = glm::vec4(glm::mat3(skinMatrix) * glm::vec3(vertex.tangent), vertex.tangent.w);
+			deformedMesh.min = glm::min(deformedMesh.min, vertex.pos);
+			deformedMesh.max = glm::max(deformedMesh.max, vertex.pos);
+			packVertex(vertex, staging + stagingOffset + static_cast<VkDeviceSize>(i) * vertices.stride);
+		}
+		const VkDeviceSize size = static_cast<VkDeviceSize>(deformedMesh.vertexCount) * vertices.stride;
+		copyRegions.push_back({ stagingOffset, static_cast<VkDeviceSize>(deformedMesh.firstVertex) * vertices.stride, size });
+		stagingOffset += size;
+	}
+	vkCmdCopyBuffer(commandBuffer, deformedStagingBuffer, vertices.buffer, static_cast<uint32_t>(copyRegions.size()), copyRegions.data());
+
+	// Make the new vertices visible to acceleration structure builds and shaders
+	VkMemoryBarrier memoryBarrier = vks::initializers::memoryBarrier();
+	memoryBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	memoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT;
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+}
+
 /*
 	Helper functions
 */
@@ -12,6 +12,11 @@
 #include <string>
 #include <fstream>
 #include <vector>
+#include <array>
+#include <cstring>
+#include <cmath>
+#include <memory>
+#include <unordered_map>
 
 #include "vulkan/vulkan.h"
 #include "VulkanDevice.h"
@@ -24,6 +29,7 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
+#include <glm/gtc/packing.hpp>
 
 #define TINYGLTF_NO_STB_IMAGE_WRITE
 #ifdef VK_USE_PLATFORM_ANDROID_KHR
@@ -56,7 +62,7 @@ namespace vkglTF
 		vks::VulkanDevice* device = nullptr;
 		VkImage image;
 		VkImageLayout imageLayout;
-		VkDeviceMemory deviceMemory;
+		vks::Allocation allocation;
 		VkImageView view;
 		uint32_t width, height;
 		uint32_t mipLevels;
@@ -80,6 +86,8 @@ namespace vkglTF
 		float metallicFactor = 1.0f;
 		float roughnessFactor = 1.0f;
 		glm::vec4 baseColorFactor = glm::vec4(1.0f);
+		/** @brief Emitted radiance, includes the KHR_materials_emissive_strength multiplier */
+		glm::vec3 emissiveFactor = glm::vec3(0.0f);
 		vkglTF::Texture* baseColorTexture = nullptr;
 		vkglTF::Texture* metallicRoughnessTexture = nullptr;
 		vkglTF::Texture* normalTexture = nullptr;
@@ -93,6 +101,8 @@ namespace vkglTF
 
 		Material(vks::VulkanDevice* device) : device(device) {};
 		void createDescriptorSet(VkDescriptorPool descriptorPool, VkDescriptorSetLayout descriptorSetLayout, uint32_t descriptorBindingFlags);
+		/** @brief Rewrites the image descriptors, e.g. after a streamed texture has been replaced */
+		void updateDescriptorSet(uint32_t descriptorBindingFlags);
 	};
 
 	/*
@@ -125,10 +135,12 @@ namespace vkglTF
 
 		std::vector<Primitive*> primitives;
 		std::string name;
+		/** @brief Index of the glTF mesh, nodes instancing the same glTF mesh share its vertex and index data unless vertices are pre-transformed */
+		int32_t index = -1;
 
 		struct UniformBuffer {
 			VkBuffer buffer;
-			VkDeviceMemory memory;
+			vks::Allocation allocation;
 			VkDescriptorBufferInfo descriptor;
 			VkDescriptorSet descriptorSet = VK_NULL_HANDLE;
 			void* mapped;
@@ -208,8 +220,9 @@ namespace vkglTF
 
 	/*
 		glTF default vertex layout with easy Vulkan mapping functions
+		UVHalf, NormalOct and TangentOct are compact encodings that are only available through vkglTF::VertexLayout
 	*/
-	enum class VertexComponent { Position, Normal, UV, Color, Tangent, Joint0, Weight0 };
+	enum class VertexComponent { Position, Normal, UV, Color, Tangent, Joint0, Weight0, UVHalf, NormalOct, TangentOct };
 
 	struct Vertex {
 		glm::vec3 pos;
@@ -229,12 +242,252 @@ namespace vkglTF
 		static VkPipelineVertexInputStateCreateInfo* getPipelineVertexInputState(const std::vector<VertexComponent> components);
 	};
 
+	/** @brief Octahedral encoding of a (not necessarily normalized) direction into [-1,1]^2 */
+	inline glm::vec2 octEncode(glm::vec3 n)
+	{
+		const float l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+		if (l1 == 0.0f) {
+			return glm::vec2(0.0f);
+		}
+		n /= l1;
+		glm::vec2 e(n.x, n.y);
+		if (n.z < 0.0f) {
+			e.x = (1.0f - std::abs(n.y)) * (n.x >= 0.0f ? 1.0f : -1.0f);
+			e.y = (1.0f - std::abs(n.x)) * (n.y >= 0.0f ? 1.0f : -1.0f);
+		}
+		return e;
+	}
+
+	/** @brief Inverse of octEncode, mirrors octDecode in the generated GLSL */
+	inline glm::vec3 octDecode(glm::vec2 e)
+	{
+		glm::vec3 n(e.x, e.y, 1.0f - std::abs(e.x) - std::abs(e.y));
+		const float t = std::max(-n.z, 0.0f);
+		n.x += n.x >= 0.0f ? -t : t;
+		n.y += n.y >= 0.0f ? -t : t;
+		return glm::normalize(n);
+	}
+
+	/*
+		Per-component storage description used by vkglTF::VertexLayout
+		size is in bytes and always a multiple of four, so layouts can be read as a scalar uint array from shaders
+		glslUnpack returns a GLSL expression reading the component from "vertices.v[offset+<word>]"
+	*/
+	template<VertexComponent Component> struct VertexComponentTraits;
+
+	template<> struct VertexComponentTraits<VertexComponent::Position> {
+		static constexpr uint32_t size = 12;
+		static constexpr VkFormat format = VK_FORMAT_R32G32B32_SFLOAT;
+		static constexpr const char* glslType = "vec3";
+		static constexpr const char* glslName = "pos";
+		static void pack(const Vertex& vertex, uint8_t* dst) { memcpy(dst, &vertex.pos, size); }
+		static std::string glslUnpack(uint32_t word) { return "uintBitsToFloat(uvec3(vertices.v[offset+" + std::to_string(word) + "],vertices.v[offset+" + std::to_string(word + 1) + "],vertices.v[offset+" + std::to_string(word + 2) + "]))"; }
+	};
+
+	template<> struct VertexComponentTraits<VertexComponent::Normal> {
+		static constexpr uint32_t size = 12;
+		static constexpr VkFormat format = VK_FORMAT_R32G32B32_SFLOAT;
+		static constexpr const char* glslType = "vec3";
+		static constexpr const char* glslName = "normal";
+		static void pack(const Vertex& vertex, uint8_t* dst) { memcpy(dst, &vertex.normal, size); }
+		static std::string glslUnpack(uint32_t word) { return "uintBitsToFloat(uvec3(vertices.v[offset+" + std::to_string(word) + "],vertices.v[offset+" + std::to_string(word + 1) + "],vertices.v[offset+" + std::to_string(word + 2) + "]))"; }
+	};
+
+	template<> struct VertexComponentTraits<VertexComponent::UV> {
+		static constexpr uint32_t size = 8;
+		static constexpr VkFormat format = VK_FORMAT_R32G32_SFLOAT;
+		static constexpr const char* glslType = "vec2";
+		static constexpr const char* glslName = "uv";
+		static void pack(const Vertex& vertex, uint8_t* dst) { memcpy(dst, &vertex.uv, size); }
+		static std::string glslUnpack(uint32_t word) { return "uintBitsToFloat(uvec2(vertices.v[offset+" + std::to_string(word) + "],vertices.v[offset+" + std::to_string(word + 1) + "]))"; }
+	};
+
+	template<> struct VertexComponentTraits<VertexComponent::Color> {
+		static constexpr uint32_t size = 16;
+		static constexpr VkFormat format = VK_FORMAT_R32G32B32A32_SFLOAT;
+		static constexpr const char* glslType = "vec4";
+		static constexpr const char* glslName = "color";
+		static void pack(const Vertex& vertex, uint8_t* dst) { memcpy(dst, &vertex.color, size); }
+		static std::string glslUnpack(uint32_t word) { return "uintBitsToFloat(uvec4(vertices.v[offset+" + std::to_string(word) + "],vertices.v[offset+" + std::to_string(word + 1) + "],vertices.v[offset+" + std::to_string(word + 2) + "],vertices.v[offset+" + std::to_string(word + 3) + "]))"; }
+	};
+
+	template<> struct VertexComponentTraits<VertexComponent::Tangent> {
+		static constexpr uint32_t size = 16;
+		static constexpr VkFormat format = VK_FORMAT_R32G32B32A32_SFLOAT;
+		static constexpr const char* glslType = "vec4";
+		static constexpr const char* glslName = "tangent";
+		static void pack(const Vertex& vertex, uint8_t* dst) { memcpy(dst, &vertex.tangent, size); }
+		static std::string glslUnpack(uint32_t word) { return VertexComponentTraits<VertexComponent::Color>::glslUnpack(word); }
+	};
+
+	template<> struct VertexComponentTraits<VertexComponent::Joint0> {
+		static constexpr uint32_t size = 16;
+		static constexpr VkFormat format = VK_FORMAT_R32G32B32A32_SFLOAT;
+		static constexpr const char* glslType = "vec4";
+		static constexpr const char* glslName = "joint0";
+		static void pack(const Vertex& vertex, uint8_t* dst) { memcpy(dst, &vertex.joint0, size); }
+		static std::string glslUnpack(uint32_t word) { return VertexComponentTraits<VertexComponent::Color>::glslUnpack(word); }
+	};
+
+	template<> struct VertexComponentTraits<VertexComponent::Weight0> {
+		static constexpr uint32_t size = 16;
+		static constexpr VkFormat format = VK_FORMAT_R32G32B32A32_SFLOAT;
+		static constexpr const char* glslType = "vec4";
+		static constexpr const char* glslName = "weight0";
+		static void pack(const Vertex& vertex, uint8_t* dst) { memcpy(dst, &vertex.weight0, size); }
+		static std::string glslUnpack(uint32_t word) { return VertexComponentTraits<VertexComponent::Color>::glslUnpack(word); }
+	};
+
+	// Texture coordinates as two 16 bit floats
+	template<> struct VertexComponentTraits<VertexComponent::UVHalf> {
+		static constexpr uint32_t size = 4;
+		static constexpr VkFormat format = VK_FORMAT_R16G16_SFLOAT;
+		static constexpr const char* glslType = "vec2";
+		static constexpr const char* glslName = "uv";
+		static void pack(const Vertex& vertex, uint8_t* dst) { const uint32_t packed = glm::packHalf2x16(vertex.uv); memcpy(dst, &packed, size); }
+		static std::string glslUnpack(uint32_t word) { return "unpackHalf2x16(vertices.v[offset+" + std::to_string(word) + "])"; }
+	};
+
+	// Octahedral normal as two 16 bit snorm values
+	template<> struct VertexComponentTraits<VertexComponent::NormalOct> {
+		static constexpr uint32_t size = 4;
+		static constexpr VkFormat format = VK_FORMAT_R16G16_SNORM;
+		static constexpr const char* glslType = "vec3";
+		static constexpr const char* glslName = "normal";
+		static void pack(const Vertex& vertex, uint8_t* dst) { const uint32_t packed = glm::packSnorm2x16(octEncode(vertex.normal)); memcpy(dst, &packed, size); }
+		static std::string glslUnpack(uint32_t word) { return "octDecode(unpackSnorm2x16(vertices.v[offset+" + std::to_string(word) + "]))"; }
+	};
+
+	// Octahedral tangent as two 15 bit unorm values, bit 30 stores the sign of the bitangent (tangent.w)
+	template<> struct VertexComponentTraits<VertexComponent::TangentOct> {
+		static constexpr uint32_t size = 4;
+		static constexpr VkFormat format = VK_FORMAT_R32_UINT;
+		static constexpr const char* glslType = "vec4";
+		static constexpr const char* glslName = "tangent";
+		static void pack(const Vertex& vertex, uint8_t* dst) {
+			const glm::vec2 e = glm::clamp(octEncode(glm::vec3(vertex.tangent)) * 0.5f + 0.5f, 0.0f, 1.0f);
+			uint32_t packed = static_cast<uint32_t>(std::round(e.x * 32767.0f)) | (static_cast<uint32_t>(std::round(e.y * 32767.0f)) << 15);
+			if (vertex.tangent.w < 0.0f) {
+				packed |= 1u << 30;
+			}
+			memcpy(dst, &packed, size);
+		}
+		static std::string glslUnpack(uint32_t word) { return "unpackTangentOct(vertices.v[offset+" + std::to_string(word) + "])"; }
+	};
+
+	/*
+		Compile-time vertex layout
+		Components are packed tightly in the given order, the loader decodes into vkglTF::Vertex and packs into the layout on upload
+		Vulkan attribute descriptions and the matching GLSL unpack include are generated from the same component list
+	*/
+	template<VertexComponent... Components>
+	struct VertexLayout {
+		static constexpr uint32_t componentCount = sizeof...(Components);
+		static constexpr std::array<VertexComponent, componentCount> components{ Components... };
+		static constexpr std::array<uint32_t, componentCount> sizes{ VertexComponentTraits<Components>::size... };
+		static constexpr uint32_t stride = (VertexComponentTraits<Components>::size + ...);
+
+		/** @brief Byte offset of the given component inside the layout, ~0 if the layout doesn't contain it */
+		static constexpr uint32_t offset(VertexComponent component)
+		{
+			uint32_t offset = 0;
+			for (uint32_t i = 0; i < componentCount; i++) {
+				if (components[i] == component) {
+					return offset;
+				}
+				offset += sizes[i];
+			}
+			return ~0u;
+		}
+
+		static constexpr bool contains(VertexComponent component)
+		{
+			return offset(component) != ~0u;
+		}
+
+		/** @brief Identifies the layout inside processed model caches */
+		static constexpr uint64_t hash()
+		{
+			uint64_t hash = 0xcbf29ce484222325ull;
+			for (VertexComponent component : components) {
+				hash = (hash ^ static_cast<uint64_t>(component)) * 0x100000001b3ull;
+			}
+			return hash;
+		}
+
+		static void pack(const Vertex& vertex, uint8_t* dst)
+		{
+			((VertexComponentTraits<Components>::pack(vertex, dst), dst += VertexComponentTraits<Components>::size), ...);
+		}
+
+		static VkVertexInputBindingDescription inputBindingDescription(uint32_t binding)
+		{
+			return VkVertexInputBindingDescription({ binding, stride, VK_VERTEX_INPUT_RATE_VERTEX });
+		}
+
+		static std::vector<VkVertexInputAttributeDescription> inputAttributeDescriptions(uint32_t binding)
+		{
+			std::vector<VkVertexInputAttributeDescription> result = { VkVertexInputAttributeDescription({ 0, binding, VertexComponentTraits<Components>::format, offset(Components) })... };
+			for (uint32_t location = 0; location < componentCount; location++) {
+				result[location].location = location;
+			}
+			return result;
+		}
+
+		/** @brief Returns the GLSL unpack include for this layout, expects a "Vertices" buffer reference with a scalar uint array */
+		static std::string glsl()
+		{
+			std::string source;
+			source += "// Generated by vkglTF::VertexLayout::glsl() for a " + std::to_string(stride) + " byte vertex, do not edit by hand\n\n";
+			source += "const uint VERTEX_STRIDE=" + std::to_string(stride / 4) + ";\n\n";
+			source += "struct Vertex{\n";
+			((source += std::string("    ") + VertexComponentTraits<Components>::glslType + " " + VertexComponentTraits<Components>::glslName + ";\n"), ...);
+			source += "};\n\n";
+			if (contains(VertexComponent::NormalOct) || contains(VertexComponent::TangentOct)) {
+				source += "vec3 octDecode(vec2 e){\n";
+				source += "    vec3 n=vec3(e.xy,1.-abs(e.x)-abs(e.y));\n";
+				source += "    float t=max(-n.z,0.);\n";
+				source += "    n.x+=n.x>=0.?-t:t;\n";
+				source += "    n.y+=n.y>=0.?-t:t;\n";
+				source += "    return normalize(n);\n";
+				source += "}\n\n";
+			}
+			if (contains(VertexComponent::TangentOct)) {
+				source += "vec4 unpackTangentOct(uint p){\n";
+				source += "    vec2 e=vec2(p&0x7fffu,(p>>15)&0x7fffu)*(2./32767.)-1.;\n";
+				source += "    return vec4(octDecode(e),(p&0x40000000u)!=0u?-1.:1.);\n";
+				source += "}\n\n";
+			}
+			source += "Vertex unpackVertex(Vertices vertices,uint index){\n";
+			source += "    const uint offset=index*VERTEX_STRIDE;\n";
+			source += "    Vertex vertex;\n";
+			((source += std::string("    vertex.") + VertexComponentTraits<Components>::glslName + "=" + VertexComponentTraits<Components>::glslUnpack(offset(Components) / 4) + ";\n"), ...);
+			source += "    return vertex;\n";
+			source += "}\n";
+			return source;
+		}
+	};
+
+	// Matches the memory layout of vkglTF::Vertex
+	using DefaultVertexLayout = VertexLayout<VertexComponent::Position, VertexComponent::Normal, VertexComponent::UV, VertexComponent::Color, VertexComponent::Joint0, VertexComponent::Weight0, VertexComponent::Tangent>;
+	static_assert(DefaultVertexLayout::stride == sizeof(Vertex), "DefaultVertexLayout must match vkglTF::Vertex");
+
+	// Compact layout for ray tracing: position, octahedral normal, half precision uv and octahedral tangent (24 bytes)
+	using RayTracingVertexLayout = VertexLayout<VertexComponent::Position, VertexComponent::NormalOct, VertexComponent::UVHalf, VertexComponent::TangentOct>;
+
 	enum FileLoadingFlags {
 		None = 0x00000000,
 		PreTransformVertices = 0x00000001,
 		PreMultiplyVertexColors = 0x00000002,
 		FlipY = 0x00000004,
-		DontLoadImages = 0x00000008
+		DontLoadImages = 0x00000008,
+		// Store the processed model in Model::cacheDirectory and load it from there while the source files are unchanged
+		CacheProcessedModel = 0x00000010,
+		// Decode images on a worker thread after loading, textures start as placeholders and are replaced by Model::updateStreamedImages
+		StreamImages = 0x00000020,
+		// Keep geometry and decoded images in Model::host without creating any Vulkan resources, the device may be null
+		// CacheProcessedModel and StreamImages are ignored
+		HostOnly = 0x00000040
 	};
 
 	enum RenderFlags {
@@ -252,19 +505,38 @@ namespace vkglTF
 		vkglTF::Texture* getTexture(uint32_t index);
 		vkglTF::Texture emptyTexture;
 		void createEmptyTexture(VkQueue transferQueue);
+		void (*packVertex)(const Vertex& vertex, uint8_t* dst) = &DefaultVertexLayout::pack;
+		uint64_t vertexLayoutHash = DefaultVertexLayout::hash();
+		void loadGltf(const std::string& filename, VkQueue transferQueue, uint32_t fileLoadingFlags, float scale, std::vector<uint32_t>& indexBuffer, std::vector<uint8_t>& packedVertexBuffer);
+		bool loadCache(uint32_t fileLoadingFlags, std::vector<uint32_t>& indexBuffer, std::vector<uint8_t>& vertexBuffer, VkQueue transferQueue);
+		struct ImageStreamer;
+		std::unique_ptr<ImageStreamer> imageStreamer;
+		void startImageStreaming(VkQueue transferQueue);
+		// First mesh loaded for every glTF mesh index, only filled while loading nodes with shared mesh data
+		std::unordered_map<int32_t, const Mesh*> sharedMeshes;
+		bool shareMeshData = false;
+		bool hostOnly = false;
+		// Axis flips applied to deformed meshes at load time (FlipY flips positions, the other pre-calculations flip normals)
+		bool deformedPositionsFlipped = false;
+		bool deformedNormalsFlipped = false;
+		VkBuffer deformedStagingBuffer = VK_NULL_HANDLE;
+		vks::Allocation deformedStagingAllocation;
+		void writeCache(const std::string& sourceFile, const tinygltf::Model& gltfModel, const std::vector<uint32_t>& indexBuffer, const std::vector<uint8_t>& vertexBuffer);
 	public:
-		vks::VulkanDevice* device;
+		vks::VulkanDevice* device = nullptr;
 		VkDescriptorPool descriptorPool;
 
 		struct Vertices {
 			int count;
+			// Size of a single vertex in the vertex buffer, depends on the vertex layout used for loading
+			uint32_t stride = sizeof(Vertex);
 			VkBuffer buffer;
-			VkDeviceMemory memory;
+			vks::Allocation allocation;
 		} vertices;
 		struct Indices {
 			int count;
 			VkBuffer buffer;
-			VkDeviceMemory memory;
+			vks::Allocation allocation;
 		} indices;
 
 		std::vector<Node*> nodes;
@@ -276,6 +548,34 @@ namespace vkglTF
 		std::vector<Material> materials;
 		std::vector<Animation> animations;
 
+		/*
+			Skinned mesh whose vertices are deformed on the host, so ray tracing acceleration structures can follow the animation
+		*/
+		struct DeformedMesh {
+			Node* node;
+			uint32_t firstVertex;
+			uint32_t vertexCount;
+			// Object space bounds of the current deformation
+			glm::vec3 min;
+			glm::vec3 max;
+			// Vertices as loaded, including the load time pre-calculations
+			std::vector<Vertex> bindPose;
+		};
+		std::vector<DeformedMesh> deformedMeshes;
+
+		/**
+		* @brief Geometry and images of models loaded with FileLoadingFlags::HostOnly, e.g. for baking on the CPU
+		* Vertices are packed in the layout the model was loaded with, images are RGBA8 and indexed like textures (empty if they couldn't be decoded)
+		*/
+		struct HostData {
+			std::vector<uint32_t> indices;
+			std::vector<uint8_t> vertices;
+			std::vector<tinygltf::Image> images;
+		} host;
+
+		/** @brief Object space positions of primitives with an emissive material, three per triangle, keyed by the primitive's first index */
+		std::unordered_map<uint32_t, std::vector<glm::vec3>> emissiveTriangles;
+
 		struct Dimensions {
 			glm::vec3 min = glm::vec3(FLT_MAX);
 			glm::vec3 max = glm::vec3(-FLT_MAX);
@@ -288,7 +588,20 @@ namespace vkglTF
 		bool buffersBound = false;
 		std::string path;
 
-		Model() {};
+		/** @brief Directory used for processed model caches (FileLoadingFlags::CacheProcessedModel) */
+		std::string cacheDirectory = "cache";
+		/** @brief Cache file of the loaded model, empty if caching is disabled, samples can store derived data (e.g. acceleration structures) next to it */
+		std::string cacheFile;
+		/** @brief Hash of the source files and loading parameters the cache was created from */
+		uint64_t cacheHash = 0;
+		bool loadedFromCache = false;
+
+		/** @brief Residency of the images streamed with FileLoadingFlags::StreamImages, always Complete without streaming */
+		enum class ImageResidency { Placeholder, LowResolution, Complete };
+		/** @brief Largest dimension of the low resolution images uploaded before the full resolution ones */
+		uint32_t streamingLowResolutionSize = 64;
+
+		Model();
 		~Model();
 		void loadNode(vkglTF::Node* parent, const tinygltf::Node& node, uint32_t nodeIndex, const tinygltf::Model& model, std::vector<uint32_t>& indexBuffer, std::vector<Vertex>& vertexBuffer, float globalscale);
 		void loadSkins(tinygltf::Model& gltfModel);
@@ -296,14 +609,32 @@ namespace vkglTF
 		void loadMaterials(tinygltf::Model& gltfModel);
 		void loadAnimations(tinygltf::Model& gltfModel);
 		void loadFromFile(std::string filename, vks::VulkanDevice* device, VkQueue transferQueue, uint32_t fileLoadingFlags = vkglTF::FileLoadingFlags::None, float scale = 1.0f);
+		/** @brief Loads the model and stores the vertex buffer in the given vkglTF::VertexLayout instead of vkglTF::Vertex */
+		template<typename Layout>
+		void loadFromFile(std::string filename, vks::VulkanDevice* device, VkQueue transferQueue, uint32_t fileLoadingFlags = vkglTF::FileLoadingFlags::None, float scale = 1.0f)
+		{
+			vertices.stride = Layout::stride;
+			packVertex = &Layout::pack;
+			vertexLayoutHash = Layout::hash();
+			loadFromFile(filename, device, transferQueue, fileLoadingFlags, scale);
+		}
 		void bindBuffers(VkCommandBuffer commandBuffer);
 		void drawNode(Node* node, VkCommandBuffer commandBuffer, uint32_t renderFlags = 0, VkPipelineLayout pipelineLayout = VK_NULL_HANDLE, uint32_t bindImageSet = 1);
 		void draw(VkCommandBuffer commandBuffer, uint32_t renderFlags = 0, VkPipelineLayout pipelineLayout = VK_NULL_HANDLE, uint32_t bindImageSet = 1);
 		void getNodeDimensions(Node* node, glm::vec3& min, glm::vec3& max);
 		void getSceneDimensions();
 		void updateAnimation(uint32_t index, float time);
+		/** @brief Skins all deformed meshes with their current joint matrices and records the upload of the results into the vertex buffer */
+		void updateDeformedMeshes(VkCommandBuffer commandBuffer);
 		Node* findNode(Node* parent, uint32_t index);
 		Node* nodeFromIndex(uint32_t index);
 		void prepareNodeDescriptor(vkglTF::Node* node, VkDescriptorSetLayout descriptorSetLayout);
+		ImageResidency imageResidency() const;
+		/**
+		* @brief Uploads up to maxUploads images decoded by the streaming worker and swaps them into their textures
+		* @return Indices of the textures that have been replaced, descriptors referencing them need to be rewritten
+		* @note Waits for the queue to be idle before releasing replaced images
+		*/
+		std::vector<uint32_t> updateStreamedImages(VkQueue transferQueue, uint32_t maxUploads = 4);
 	};
 }
\ No newline at end of file
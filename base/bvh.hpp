@@ -0,0 +1,310 @@
+/*
+* Bounding volume hierarchy over triangles for tracing rays on the CPU
+*
+* Built top down, splits are chosen with the surface area heuristic evaluated over binned triangle centroids
+* Intersections report the same barycentrics as Vulkan ray tracing hit attributes
+*
+* This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+*/
+
+#pragma once
+
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <numeric>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+namespace vks
+{
+	class BVH
+	{
+	public:
+		/**
+		* @brief Leaves reference count triangles starting at first, interior nodes have count = 0 and their children at first and first + 1
+		*/
+		struct Node
+		{
+			glm::vec3 boundsMin;
+			uint32_t first;
+			glm::vec3 boundsMax;
+			uint32_t count;
+		};
+
+		struct Hit
+		{
+			float t = 0.0f;
+			/** @brief Index of the triangle in the positions passed to build */
+			uint32_t triangle = 0;
+			/** @brief Weights of the second and third vertex */
+			glm::vec2 barycentrics{ 0.0f };
+		};
+
+		std::vector<Node> nodes;
+
+		/** @brief Leaves with more triangles are only created if no split is cheaper */
+		uint32_t maxLeafSize = 4;
+
+		/** @brief Builds the hierarchy over triangles given as three consecutive positions each */
+		void build(const std::vector<glm::vec3>& positions)
+		{
+			nodes.clear();
+			triangles.clear();
+			triangleIndices.clear();
+			const uint32_t count = static_cast<uint32_t>(positions.size() / 3);
+			if (count == 0) {
+				return;
+			}
+			std::vector<Bounds> bounds(count);
+			for (uint32_t i = 0; i < count; i++) {
+				bounds[i].grow(positions[i * 3]);
+				bounds[i].grow(positions[i * 3 + 1]);
+				bounds[i].grow(positions[i * 3 + 2]);
+			}
+			triangleIndices.resize(count);
+			std::iota(triangleIndices.begin(), triangleIndices.end(), 0);
+			// A binary tree over n leaves has at most 2n - 1 nodes, so node references stay valid while building
+			nodes.reserve(count * 2 - 1);
+			nodes.push_back({ glm::vec3(0.0f), 0, glm::vec3(0.0f), count });
+			subdivide(0, bounds, 0);
+
+			// Triangles are stored in leaf order, so leaves read consecutive memory
+			triangles.resize(count);
+			for (uint32_t i = 0; i < count; i++) {
+				const glm::vec3* p = &positions[triangleIndices[i] * 3];
+				triangles[i] = { p[0], p[1] - p[0], p[2] - p[0] };
+			}
+		}
+
+		/**
+		* @brief Finds the closest hit in (tmin, tmax) accepted by anyHit
+		* @param anyHit Called as anyHit(const Hit&) for every candidate, returns false to ignore the intersection like an any hit shader
+		*/
+		template<typename AnyHit>
+		bool intersect(const glm::vec3& origin, const glm::vec3& direction, float tmin, float tmax, Hit& hit, AnyHit&& anyHit) const
+		{
+			return traverse(origin, direction, tmin, tmax, hit, false, anyHit);
+		}
+
+		/** @brief Returns true as soon as any hit in (tmin, tmax) is accepted by anyHit, for shadow rays */
+		template<typename AnyHit>
+		bool occluded(const glm::vec3& origin, const glm::vec3& direction, float tmin, float tmax, AnyHit&& anyHit) const
+		{
+			Hit hit;
+			return traverse(origin, direction, tmin, tmax, hit, true, anyHit);
+		}
+
+	private:
+		struct Bounds
+		{
+			glm::vec3 min = glm::vec3(FLT_MAX);
+			glm::vec3 max = glm::vec3(-FLT_MAX);
+			void grow(const glm::vec3& p) { min = glm::min(min, p); max = glm::max(max, p); }
+			void grow(const Bounds& b) { min = glm::min(min, b.min); max = glm::max(max, b.max); }
+			float area() const
+			{
+				if (min.x > max.x) {
+					return 0.0f;
+				}
+				const glm::vec3 e = max - min;
+				return e.x * e.y + e.y * e.z + e.z * e.x;
+			}
+		};
+
+		struct Triangle
+		{
+			glm::vec3 v0;
+			glm::vec3 edge1;
+			glm::vec3 edge2;
+		};
+
+		static constexpr uint32_t binCount = 16;
+		static constexpr uint32_t stackSize = 64;
+		/** @brief Nodes this deep become leaves, so traversal never holds more than stackSize far children */
+		static constexpr uint32_t maxDepth = stackSize - 1;
+
+		std::vector<Triangle> triangles;
+		// Original triangle index of every stored triangle
+		std::vector<uint32_t> triangleIndices;
+
+		void subdivide(uint32_t nodeIndex, const std::vector<Bounds>& bounds, uint32_t depth)
+		{
+			Node& node = nodes[nodeIndex];
+			Bounds nodeBounds, centroidBounds;
+			for (uint32_t i = node.first; i < node.first + node.count; i++) {
+				const Bounds& b = bounds[triangleIndices[i]];
+				nodeBounds.grow(b);
+				centroidBounds.grow((b.min + b.max) * 0.5f);
+			}
+			node.boundsMin = nodeBounds.min;
+			node.boundsMax = nodeBounds.max;
+			// Skewed inputs, e.g. centroids getting exponentially closer, can peel off a triangle per level for hundreds of
+			// levels, past maxDepth the remaining triangles share a leaf instead
+			if (node.count == 1 || depth == maxDepth) {
+				return;
+			}
+
+			// Cost of a split relative to intersecting every triangle of the node, traversing a node costs as much as a triangle
+			float bestCost = FLT_MAX;
+			int bestAxis = -1;
+			uint32_t bestBin = 0;
+			for (int axis = 0; axis < 3; axis++) {
+				const float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+				if (extent <= 0.0f) {
+					continue;
+				}
+				std::array<Bounds, binCount> bins;
+				std::array<uint32_t, binCount> binCounts{};
+				const float scale = binCount / extent;
+				for (uint32_t i = node.first; i < node.first + node.count; i++) {
+					const Bounds& b = bounds[triangleIndices[i]];
+					const uint32_t bin = std::min(static_cast<uint32_t>(((b.min[axis] + b.max[axis]) * 0.5f - centroidBounds.min[axis]) * scale), binCount - 1);
+					bins[bin].grow(b);
+					binCounts[bin]++;
+				}
+				// Sweep from the right first, so the left sweep can evaluate every split plane
+				std::array<float, binCount> rightCosts{};
+				Bounds right;
+				uint32_t rightCount = 0;
+				for (uint32_t bin = binCount - 1; bin > 0; bin--) {
+					right.grow(bins[bin]);
+					rightCount += binCounts[bin];
+					rightCosts[bin] = right.area() * rightCount;
+				}
+				Bounds left;
+				uint32_t leftCount = 0;
+				for (uint32_t bin = 1; bin < binCount; bin++) {
+					left.grow(bins[bin - 1]);
+					leftCount += binCounts[bin - 1];
+					const float cost = left.area() * leftCount + rightCosts[bin];
+					if (leftCount > 0 && leftCount < node.count && cost < bestCost) {
+						bestCost = cost;
+						bestAxis = axis;
+						bestBin = bin;
+					}
+				}
+			}
+			const float area = nodeBounds.area();
+			const float splitCost = area > 0.0f ? 1.0f + bestCost / area : FLT_MAX;
+			if (bestAxis < 0 || (node.count <= maxLeafSize && splitCost >= static_cast<float>(node.count))) {
+				return;
+			}
+
+			const float scale = binCount / (centroidBounds.max[bestAxis] - centroidBounds.min[bestAxis]);
+			const auto middle = std::partition(triangleIndices.begin() + node.first, triangleIndices.begin() + node.first + node.count, [&](uint32_t triangle) {
+				const Bounds& b = bounds[triangle];
+				return std::min(static_cast<uint32_t>(((b.min[bestAxis] + b.max[bestAxis]) * 0.5f - centroidBounds.min[bestAxis]) * scale), binCount - 1) < bestBin;
+			});
+			const uint32_t leftCount = static_cast<uint32_t>(middle - triangleIndices.begin()) - node.first;
+			const uint32_t firstChild = static_cast<uint32_t>(nodes.size());
+			nodes.push_back({ glm::vec3(0.0f), node.first, glm::vec3(0.0f), leftCount });
+			nodes.push_back({ glm::vec3(0.0f), node.first + leftCount, glm::vec3(0.0f), node.count - leftCount });
+			node.first = firstChild;
+			node.count = 0;
+			subdivide(firstChild, bounds, depth + 1);
+			subdivide(firstChild + 1, bounds, depth + 1);
+		}
+
+		/** @brief Entry distance of the ray into the node's bounds, FLT_MAX if it misses them */
+		static float intersectBounds(const Node& node, const glm::vec3& origin, const glm::vec3& inverseDirection, float tmin, float tmax)
+		{
+			const glm::vec3 t0 = (node.boundsMin - origin) * inverseDirection;
+			const glm::vec3 t1 = (node.boundsMax - origin) * inverseDirection;
+			const glm::vec3 near = glm::min(t0, t1);
+			const glm::vec3 far = glm::max(t0, t1);
+			const float entry = std::max(std::max(near.x, near.y), std::max(near.z, tmin));
+			const float exit = std::min(std::min(far.x, far.y), std::min(far.z, tmax));
+			return entry <= exit ? entry : FLT_MAX;
+		}
+
+		/** @brief Moeller-Trumbore test, both sides of a triangle are hit like without culling flags on the GPU */
+		static bool intersectTriangle(const Triangle& triangle, const glm::vec3& origin, const glm::vec3& direction, float tmin, float tmax, float& t, glm::vec2& barycentrics)
+		{
+			const glm::vec3 p = glm::cross(direction, triangle.edge2);
+			const float determinant = glm::dot(triangle.edge1, p);
+			if (std::abs(determinant) < 1e-12f) {
+				return false;
+			}
+			const float inverseDeterminant = 1.0f / determinant;
+			const glm::vec3 s = origin - triangle.v0;
+			const float u = glm::dot(s, p) * inverseDeterminant;
+			if (u < 0.0f || u > 1.0f) {
+				return false;
+			}
+			const glm::vec3 q = glm::cross(s, triangle.edge1);
+			const float v = glm::dot(direction, q) * inverseDeterminant;
+			if (v < 0.0f || u + v > 1.0f) {
+				return false;
+			}
+			t = glm::dot(triangle.edge2, q) * inverseDeterminant;
+			barycentrics = glm::vec2(u, v);
+			return t > tmin && t < tmax;
+		}
+
+		template<typename AnyHit>
+		bool traverse(const glm::vec3& origin, const glm::vec3& direction, float tmin, float tmax, Hit& hit, bool terminateOnFirstHit, AnyHit& anyHit) const
+		{
+			if (nodes.empty() || intersectBounds(nodes[0], origin, 1.0f / direction, tmin, tmax) == FLT_MAX) {
+				return false;
+			}
+			const glm::vec3 inverseDirection = 1.0f / direction;
+			bool found = false;
+			uint32_t stack[stackSize];
+			uint32_t stackCount = 0;
+			uint32_t nodeIndex = 0;
+			while (true) {
+				const Node& node = nodes[nodeIndex];
+				if (node.count > 0) {
+					for (uint32_t i = node.first; i < node.first + node.count; i++) {
+						Hit candidate;
+						if (intersectTriangle(triangles[i], origin, direction, tmin, tmax, candidate.t, candidate.barycentrics)) {
+							candidate.triangle = triangleIndices[i];
+							if (anyHit(static_cast<const Hit&>(candidate))) {
+								hit = candidate;
+								tmax = candidate.t;
+								found = true;
+								if (terminateOnFirstHit) {
+									return true;
+								}
+							}
+						}
+					}
+				} else {
+					// The nearer child is visited first, the other one waits on the stack
+					uint32_t nearChild = node.first;
+					uint32_t farChild = node.first + 1;
+					float nearEntry = intersectBounds(nodes[nearChild], origin, inverseDirection, tmin, tmax);
+					float farEntry = intersectBounds(nodes[farChild], origin, inverseDirection, tmin, tmax);
+					if (farEntry < nearEntry) {
+						std::swap(nearChild, farChild);
+						std::swap(nearEntry, farEntry);
+					}
+					if (nearEntry != FLT_MAX) {
+						// An interior node at depth d has d far children of its ancestors on the stack at most, see maxDepth
+						if (farEntry != FLT_MAX) {
+							stack[stackCount++] = farChild;
+						}
+						nodeIndex = nearChild;
+						continue;
+					}
+				}
+				// Nodes behind the closest hit found meanwhile are skipped when popped
+				bool next = false;
+				while (stackCount > 0) {
+					nodeIndex = stack[--stackCount];
+					if (intersectBounds(nodes[nodeIndex], origin, inverseDirection, tmin, tmax) != FLT_MAX) {
+						next = true;
+						break;
+					}
+				}
+				if (!next) {
+					break;
+				}
+			}
+			return found;
+		}
+	};
+}
@@ -0,0 +1,154 @@
+/*
+* Light hierarchy for sampling many punctual lights
+*
+* Bounding volume hierarchy over light positions, emission cones and power, shading points traverse it stochastically
+* to pick a single light in O(log n) instead of evaluating every light
+*
+* This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+*/
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include <cfloat>
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+namespace vks
+{
+	/**
+	* @brief Point or spot light, matches PunctualLight in the shaders (scalar layout)
+	* Spot lights emit into a cone around direction and fade out between the inner and outer cone angle, point lights keep cosOuterAngle at -1
+	*/
+	struct PunctualLight
+	{
+		glm::vec4 position;
+		glm::vec3 color;
+		float intensity;
+		glm::vec3 direction = glm::vec3(0.0f, -1.0f, 0.0f);
+		float cosOuterAngle = -1.0f;
+		float cosInnerAngle = -1.0f;
+	};
+
+	class LightTree
+	{
+	public:
+		/**
+		* @brief Matches LightTreeNode in the shaders (scalar layout)
+		* Children of a node are stored next to each other starting at firstChild, leaves have firstChild = 0 and reference a single light
+		*/
+		struct Node
+		{
+			glm::vec3 boundsMin;
+			float power;
+			glm::vec3 boundsMax;
+			uint32_t firstChild;
+			glm::vec3 axis;
+			/** @brief Cosine of the cone around axis containing all emission directions, -1 if light is emitted in all directions */
+			float cosOrientation;
+			uint32_t light;
+		};
+		std::vector<Node> nodes;
+
+		/** @brief Power used to weight subtrees, the emitted intensity integrated over the light's cone */
+		static float power(const PunctualLight& light)
+		{
+			const float luminance = glm::dot(light.color, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+			const float solidAngle = 2.0f * glm::pi<float>() * (1.0f - std::max(light.cosOuterAngle, -1.0f));
+			return light.intensity * luminance * solidAngle;
+		}
+
+		void build(const std::vector<PunctualLight>& lights)
+		{
+			nodes.clear();
+			if (lights.empty()) {
+				return;
+			}
+			std::vector<uint32_t> indices(lights.size());
+			std::iota(indices.begin(), indices.end(), 0);
+			nodes.reserve(lights.size() * 2 - 1);
+			nodes.emplace_back();
+			buildNode(0, lights, indices, 0, static_cast<uint32_t>(indices.size()));
+		}
+
+	private:
+		/** @brief Smallest cone containing both cones, see "Importance Sampling of Many Lights with Adaptive Tree Splitting" (Conty Estevez and Kulla) */
+		static void mergeCones(glm::vec3 axisA, float cosA, glm::vec3 axisB, float cosB, glm::vec3& axis, float& cosOrientation)
+		{
+			if (cosA <= -1.0f || cosB <= -1.0f) {
+				axis = axisA;
+				cosOrientation = -1.0f;
+				return;
+			}
+			float thetaA = std::acos(std::clamp(cosA, -1.0f, 1.0f));
+			float thetaB = std::acos(std::clamp(cosB, -1.0f, 1.0f));
+			if (thetaB > thetaA) {
+				std::swap(axisA, axisB);
+				std::swap(thetaA, thetaB);
+			}
+			const float thetaD = std::acos(std::clamp(glm::dot(axisA, axisB), -1.0f, 1.0f));
+			if (std::min(thetaD + thetaB, glm::pi<float>()) <= thetaA) {
+				axis = axisA;
+				cosOrientation = std::cos(thetaA);
+				return;
+			}
+			const float thetaO = (thetaA + thetaD + thetaB) * 0.5f;
+			if (thetaO >= glm::pi<float>()) {
+				axis = axisA;
+				cosOrientation = -1.0f;
+				return;
+			}
+			// Rotate the wider cone's axis towards the other one
+			const glm::vec3 orthogonal = axisB - axisA * glm::dot(axisA, axisB);
+			const float rotation = thetaO - thetaA;
+			axis = glm::dot(orthogonal, orthogonal) > 1e-12f ? glm::normalize(axisA * std::cos(rotation) + glm::normalize(orthogonal) * std::sin(rotation)) : axisA;
+			cosOrientation = std::cos(thetaO);
+		}
+
+		void buildNode(uint32_t nodeIndex, const std::vector<PunctualLight>& lights, std::vector<uint32_t>& indices, uint32_t begin, uint32_t end)
+		{
+			if (end - begin == 1) {
+				const PunctualLight& light = lights[indices[begin]];
+				Node& node = nodes[nodeIndex];
+				node.boundsMin = node.boundsMax = glm::vec3(light.position);
+				node.power = power(light);
+				node.firstChild = 0;
+				node.axis = glm::normalize(light.direction);
+				node.cosOrientation = light.cosOuterAngle;
+				node.light = indices[begin];
+				return;
+			}
+
+			// Median split along the largest extent of the light positions
+			glm::vec3 boundsMin(FLT_MAX), boundsMax(-FLT_MAX);
+			for (uint32_t i = begin; i < end; i++) {
+				boundsMin = glm::min(boundsMin, glm::vec3(lights[indices[i]].position));
+				boundsMax = glm::max(boundsMax, glm::vec3(lights[indices[i]].position));
+			}
+			const glm::vec3 extent = boundsMax - boundsMin;
+			const int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+			const uint32_t middle = begin + (end - begin) / 2;
+			std::nth_element(indices.begin() + begin, indices.begin() + middle, indices.begin() + end, [&](uint32_t a, uint32_t b) {
+				return lights[a].position[axis] < lights[b].position[axis];
+			});
+
+			const uint32_t firstChild = static_cast<uint32_t>(nodes.size());
+			nodes.resize(nodes.size() + 2);
+			buildNode(firstChild, lights, indices, begin, middle);
+			buildNode(firstChild + 1, lights, indices, middle, end);
+
+			const Node& left = nodes[firstChild];
+			const Node& right = nodes[firstChild + 1];
+			Node& node = nodes[nodeIndex];
+			node.boundsMin = glm::min(left.boundsMin, right.boundsMin);
+			node.boundsMax = glm::max(left.boundsMax, right.boundsMax);
+			node.power = left.power + right.power;
+			node.firstChild = firstChild;
+			node.light = 0;
+			mergeCones(left.axis, left.cosOrientation, right.axis, right.cosOrientation, node.axis, node.cosOrientation);
+		}
+	};
+}
@@ -0,0 +1,157 @@
+/*
+* Denoiser for grids of screen probes, reference for shaders/glsl/ssprobe/probedenoise.comp
+*
+* The spatial part is an edge avoiding a-trous wavelet filter ("Edge-Avoiding A-Trous Wavelet Transform for fast Global
+* Illumination Filtering", Dammertz et al.) with the variance guided luminance weight of SVGF ("Spatiotemporal
+* Variance-Guided Filtering", Schied et al.): every iteration blends 5x5 probes spaced 2^iteration apart, weighted by how
+* well their depth, normal and DC luminance match. The temporal part blends the result with the denoised probes of an
+* earlier accumulation, as long as the surface is the same and the history lies within the noise of the current estimate
+*
+* Probes are dense, width * height of them with a GBufferSample each, probes with depth 0 are missing and stay black
+*
+* This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+*/
+
+#pragma once
+
+#include <vector>
+#include "probegather.hpp"
+
+namespace vks
+{
+	namespace sh
+	{
+		struct DenoiseSettings
+		{
+			/** @brief A-trous iterations, the filter covers 4 * 2^iterations - 3 probes per axis */
+			uint32_t iterations = 3;
+			/** @brief Relative depth difference halving the weight, grows with the probe spacing of the iteration */
+			float depthSigma = 0.1f;
+			/** @brief Luminance differences are measured in standard deviations of the probe's DC luminance */
+			float luminanceSigma = 4.0f;
+			/** @brief History further than this many standard deviations from the current estimate is discarded */
+			float historyClamp = 3.0f;
+		};
+
+		/** @brief Normals are compared with max(0, dot)^32 */
+		constexpr uint32_t denoiseNormalPowerSquarings = 5;
+		/** @brief B3 spline weights of the a-trous kernel */
+		constexpr float atrousKernel[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+		inline float luminance(const glm::vec3& color)
+		{
+			return glm::dot(color, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+		}
+
+		/**
+		* @brief One a-trous iteration with probes step apart
+		* @param variances Variance of the DC luminance of every probe's estimate, filtered along with the probes
+		*/
+		template<uint32_t Bands>
+		inline void atrousIteration(uint32_t width, uint32_t height, const GBufferSample* gbuffer, const Probe<Bands>* probes, const float* variances,
+			uint32_t step, const DenoiseSettings& settings, Probe<Bands>* results, float* resultVariances, TaskScheduler& scheduler = TaskScheduler::shared())
+		{
+			scheduler.parallelFor(0, height, [&](uint32_t y) {
+				for (uint32_t x = 0; x < width; x++) {
+					const uint32_t p = y * width + x;
+					results[p] = {};
+					resultVariances[p] = 0.0f;
+					if (gbuffer[p].depth <= 0.0f) {
+						continue;
+					}
+					const float depth = gbuffer[p].depth;
+					const glm::vec3 normal = unpackNormal(gbuffer[p].normal);
+					const float lum = luminance(probes[p][0]);
+					const float depthScale = 1.0f / std::max(settings.depthSigma * static_cast<float>(step) * depth, 1e-6f);
+					const float luminanceScale = 1.0f / (settings.luminanceSigma * std::sqrt(std::max(variances[p], 0.0f)) + 1e-6f);
+					Probe<Bands> sum {};
+					float varianceSum = 0.0f;
+					float weightSum = 0.0f;
+					for (int32_t dy = -2; dy <= 2; dy++) {
+						const int32_t qy = static_cast<int32_t>(y) + dy * static_cast<int32_t>(step);
+						if (qy < 0 || qy >= static_cast<int32_t>(height)) {
+							continue;
+						}
+						for (int32_t dx = -2; dx <= 2; dx++) {
+							const int32_t qx = static_cast<int32_t>(x) + dx * static_cast<int32_t>(step);
+							if (qx < 0 || qx >= static_cast<int32_t>(width)) {
+								continue;
+							}
+							const uint32_t q = static_cast<uint32_t>(qy) * width + static_cast<uint32_t>(qx);
+							if (gbuffer[q].depth <= 0.0f) {
+								continue;
+							}
+							float normalWeight = std::max(glm::dot(normal, unpackNormal(gbuffer[q].normal)), 0.0f);
+							for (uint32_t i = 0; i < denoiseNormalPowerSquarings; i++) {
+								normalWeight *= normalWeight;
+							}
+							const float relativeDepth = (gbuffer[q].depth - depth) * depthScale;
+							const float luminanceWeight = std::exp(-std::abs(luminance(probes[q][0]) - lum) * luminanceScale);
+							const float weight = atrousKernel[dx + 2] * atrousKernel[dy + 2] * normalWeight / (1.0f + relativeDepth * relativeDepth) * luminanceWeight;
+							for (uint32_t i = 0; i < coefficientCount<Bands>; i++) {
+								sum[i] += probes[q][i] * weight;
+							}
+							varianceSum += weight * weight * variances[q];
+							weightSum += weight;
+						}
+					}
+					// The probe itself always has a weight, so weightSum > 0
+					for (uint32_t i = 0; i < coefficientCount<Bands>; i++) {
+						results[p][i] = sum[i] / weightSum;
+					}
+					resultVariances[p] = varianceSum / (weightSum * weightSum);
+				}
+			});
+		}
+
+		/**
+		* @brief Blends the probes with the denoised probes of an earlier accumulation, weighted by their sample counts
+		* @param sampleCount Samples accumulated into every current probe
+		* @param historyCounts Samples behind every history probe, 0 where there is no history
+		* @param resultCounts Samples behind the blended probes, the history counts of the next accumulation
+		*/
+		template<uint32_t Bands>
+		inline void temporalAccumulate(uint32_t width, uint32_t height, const GBufferSample* gbuffer, const Probe<Bands>* probes, const float* variances, float sampleCount,
+			const GBufferSample* historyGBuffer, const Probe<Bands>* historyProbes, const float* historyCounts, const DenoiseSettings& settings,
+			Probe<Bands>* results, float* resultCounts, TaskScheduler& scheduler = TaskScheduler::shared())
+		{
+			scheduler.parallelFor(0, height, [&](uint32_t y) {
+				for (uint32_t x = 0; x < width; x++) {
+					const uint32_t p = y * width + x;
+					if (gbuffer[p].depth <= 0.0f) {
+						results[p] = {};
+						resultCounts[p] = 0.0f;
+						continue;
+					}
+					const GBufferSample& history = historyGBuffer[p];
+					const bool sameSurface = historyCounts[p] > 0.0f && history.depth > 0.0f
+						&& std::abs(history.depth - gbuffer[p].depth) <= settings.depthSigma * gbuffer[p].depth
+						&& glm::dot(unpackNormal(history.normal), unpackNormal(gbuffer[p].normal)) >= 0.9f;
+					const bool withinNoise = std::abs(luminance(historyProbes[p][0]) - luminance(probes[p][0])) <= settings.historyClamp * std::sqrt(std::max(variances[p], 0.0f));
+					if (!sameSurface || !withinNoise) {
+						results[p] = probes[p];
+						resultCounts[p] = sampleCount;
+						continue;
+					}
+					const float t = sampleCount / (sampleCount + historyCounts[p]);
+					results[p] = lerp(historyProbes[p], probes[p], t);
+					resultCounts[p] = sampleCount + historyCounts[p];
+				}
+			});
+		}
+
+		/** @brief Runs settings.iterations a-trous iterations, probes and variances hold the result afterwards */
+		template<uint32_t Bands>
+		inline void denoise(uint32_t width, uint32_t height, const GBufferSample* gbuffer, Probe<Bands>* probes, float* variances, const DenoiseSettings& settings = {},
+			TaskScheduler& scheduler = TaskScheduler::shared())
+		{
+			std::vector<Probe<Bands>> scratch(static_cast<size_t>(width) * height);
+			std::vector<float> scratchVariances(scratch.size());
+			for (uint32_t i = 0; i < settings.iterations; i++) {
+				atrousIteration(width, height, gbuffer, probes, variances, 1u << i, settings, scratch.data(), scratchVariances.data(), scheduler);
+				std::copy(scratch.begin(), scratch.end(), probes);
+				std::copy(scratchVariances.begin(), scratchVariances.end(), variances);
+			}
+		}
+	}
+}
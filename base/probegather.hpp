@@ -0,0 +1,219 @@
+/*
+* Bilateral gather of screen probes into a full resolution irradiance image
+*
+* Every pixel blends the SH of the four probes around it, weighted bilinearly and by how well the depth and normal of each
+* probe's primary hit match the pixel's, then evaluates the blend for the pixel normal. Probes that match none of the
+* pixels around them fall back to bilinear weights over the valid probes. Same math as shaders/glsl/ssprobe/probegather.comp
+*
+* This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+*/
+
+#pragma once
+
+#include <vector>
+#include "sphericalharmonics.hpp"
+#include "taskscheduler.hpp"
+
+namespace vks
+{
+	namespace sh
+	{
+		/** @brief Primary hit of a pixel or probe, ProbeGBuffer in raygen.rgen */
+		struct GBufferSample
+		{
+			/** @brief Distance from the camera along the pixel's ray, 0 where the ray misses the scene */
+			float depth;
+			/** @brief World space normal packed with packNormal */
+			uint32_t normal;
+		};
+
+		/** @brief Probes on a regular grid, probe (x, y) sits at the center of its spacing x spacing pixel tile */
+		template<uint32_t Bands>
+		struct ProbeGrid
+		{
+			uint32_t width;
+			uint32_t height;
+			uint32_t spacing;
+			/** @brief width * height probes holding incoming radiance, like the SH buffer or "v" in sh.json */
+			const Probe<Bands>* probes;
+			const GBufferSample* gbuffer;
+		};
+
+		struct GatherSettings
+		{
+			/** @brief Depth differences are measured relative to the pixel depth, a difference of depthSigma halves the weight */
+			float depthSigma = 0.1f;
+		};
+
+		/** @brief Normals are compared with max(0, dot)^8 */
+		constexpr uint32_t gatherNormalPowerSquarings = 3;
+		/** @brief Added to the bilateral weight, so pixels matching no probe still get the bilinear blend of the valid ones */
+		constexpr float gatherFallbackWeight = 1e-3f;
+
+		/** @brief Probe column or row below and above a pixel coordinate and the bilinear weight of the second one */
+		inline void gatherNeighbours(uint32_t pixel, uint32_t spacing, uint32_t count, uint32_t& first, uint32_t& second, float& t)
+		{
+			const float g = (static_cast<float>(pixel) + 0.5f) / static_cast<float>(spacing) - 0.5f;
+			const float f = std::floor(g);
+			t = g - f;
+			first = static_cast<uint32_t>(std::clamp(static_cast<int32_t>(f), 0, static_cast<int32_t>(count) - 1));
+			second = static_cast<uint32_t>(std::clamp(static_cast<int32_t>(f) + 1, 0, static_cast<int32_t>(count) - 1));
+		}
+
+		inline float gatherWeight(float pixelDepth, const glm::vec3& pixelNormal, const GBufferSample& probe, float depthSigma)
+		{
+			if (probe.depth <= 0.0f) {
+				return 0.0f;
+			}
+			float normalWeight = std::max(glm::dot(pixelNormal, unpackNormal(probe.normal)), 0.0f);
+			for (uint32_t i = 0; i < gatherNormalPowerSquarings; i++) {
+				normalWeight *= normalWeight;
+			}
+			const float relativeDepth = (probe.depth - pixelDepth) / std::max(depthSigma * pixelDepth, 1e-6f);
+			return normalWeight / (1.0f + relativeDepth * relativeDepth) + gatherFallbackWeight;
+		}
+
+		/** @brief Irradiance of a single pixel, pixels without a hit get black */
+		template<uint32_t Bands>
+		inline glm::vec3 gatherIrradiance(const ProbeGrid<Bands>& grid, const GBufferSample& pixel, uint32_t x, uint32_t y, const GatherSettings& settings = {})
+		{
+			if (pixel.depth <= 0.0f) {
+				return glm::vec3(0.0f);
+			}
+			uint32_t columns[2], rows[2];
+			float tx, ty;
+			gatherNeighbours(x, grid.spacing, grid.width, columns[0], columns[1], tx);
+			gatherNeighbours(y, grid.spacing, grid.height, rows[0], rows[1], ty);
+			const glm::vec3 normal = unpackNormal(pixel.normal);
+			Probe<Bands> blend {};
+			float weightSum = 0.0f;
+			for (uint32_t j = 0; j < 2; j++) {
+				for (uint32_t i = 0; i < 2; i++) {
+					const uint32_t probe = rows[j] * grid.width + columns[i];
+					const float weight = (i ? tx : 1.0f - tx) * (j ? ty : 1.0f - ty) * gatherWeight(pixel.depth, normal, grid.gbuffer[probe], settings.depthSigma);
+					for (uint32_t k = 0; k < coefficientCount<Bands>; k++) {
+						blend[k] += grid.probes[probe][k] * weight;
+					}
+					weightSum += weight;
+				}
+			}
+			return irradiance(blend, normal) / std::max(weightSum, 1e-8f);
+		}
+
+		/**
+		* @brief Irradiance image of width * height pixels, rows are spread over the threads of scheduler and every thread
+		* processes simd::Float::width pixels of a row at once
+		* @param gbuffer Primary hits of the pixels, row by row, with the same camera as the probes
+		*/
+		template<uint32_t Bands>
+		inline void gatherIrradiance(const ProbeGrid<Bands>& grid, const GBufferSample* gbuffer, uint32_t width, uint32_t height, glm::vec3* results,
+			const GatherSettings& settings = {}, TaskScheduler& scheduler = TaskScheduler::shared())
+		{
+			using simd::Float;
+			constexpr int stride = simd::probeStride<Bands>;
+
+			// Probe hits unpacked once, missing probes get a weight of zero
+			const uint32_t probeCount = grid.width * grid.height;
+			std::vector<float> probeDepths(probeCount), probeValid(probeCount), probeNormals(probeCount * 3);
+			for (uint32_t i = 0; i < probeCount; i++) {
+				const glm::vec3 n = unpackNormal(grid.gbuffer[i].normal);
+				probeDepths[i] = grid.gbuffer[i].depth;
+				probeValid[i] = grid.gbuffer[i].depth > 0.0f ? 1.0f : 0.0f;
+				probeNormals[i * 3] = n.x;
+				probeNormals[i * 3 + 1] = n.y;
+				probeNormals[i * 3 + 2] = n.z;
+			}
+			// Neighbouring probe columns are the same for every row
+			std::vector<int32_t> columns[2];
+			std::vector<float> columnWeights[2];
+			for (uint32_t i = 0; i < 2; i++) {
+				columns[i].resize(width);
+				columnWeights[i].resize(width);
+			}
+			for (uint32_t x = 0; x < width; x++) {
+				uint32_t first, second;
+				float t;
+				gatherNeighbours(x, grid.spacing, grid.width, first, second, t);
+				columns[0][x] = static_cast<int32_t>(first);
+				columns[1][x] = static_cast<int32_t>(second);
+				columnWeights[0][x] = 1.0f - t;
+				columnWeights[1][x] = t;
+			}
+
+			const float* coefficients = &grid.probes[0][0].x;
+			const Float zero = Float::broadcast(0.0f);
+			const Float one = Float::broadcast(1.0f);
+			scheduler.parallelFor(0, height, [&](uint32_t y) {
+				uint32_t rows[2];
+				float ty;
+				gatherNeighbours(y, grid.spacing, grid.height, rows[0], rows[1], ty);
+				const float rowWeights[2] = { 1.0f - ty, ty };
+				const GBufferSample* pixels = gbuffer + static_cast<size_t>(y) * width;
+				glm::vec3* rowResults = results + static_cast<size_t>(y) * width;
+				const uint32_t groups = width / Float::width;
+				for (uint32_t group = 0; group < groups; group++) {
+					const uint32_t first = group * Float::width;
+					float normals[3][Float::width];
+					for (uint32_t i = 0; i < Float::width; i++) {
+						const glm::vec3 n = unpackNormal(pixels[first + i].normal);
+						normals[0][i] = n.x;
+						normals[1][i] = n.y;
+						normals[2][i] = n.z;
+					}
+					const Float nx = Float::load(normals[0]), ny = Float::load(normals[1]), nz = Float::load(normals[2]);
+					const Float depth = Float::gather(&pixels[first].depth, 2);
+					const Float depthScale = one / max(depth * Float::broadcast(settings.depthSigma), Float::broadcast(1e-6f));
+
+					Float blend[stride];
+					for (Float& c : blend) {
+						c = zero;
+					}
+					Float weightSum = zero;
+					for (uint32_t j = 0; j < 2; j++) {
+						for (uint32_t i = 0; i < 2; i++) {
+							int32_t probes[Float::width], normalOffsets[Float::width], offsets[Float::width];
+							for (uint32_t k = 0; k < Float::width; k++) {
+								probes[k] = static_cast<int32_t>(rows[j] * grid.width) + columns[i][first + k];
+								normalOffsets[k] = probes[k] * 3;
+								offsets[k] = probes[k] * stride;
+							}
+							Float normalWeight = max(nx * Float::gather(probeNormals.data(), normalOffsets) + ny * Float::gather(probeNormals.data() + 1, normalOffsets) + nz * Float::gather(probeNormals.data() + 2, normalOffsets), zero);
+							for (uint32_t k = 0; k < gatherNormalPowerSquarings; k++) {
+								normalWeight = normalWeight * normalWeight;
+							}
+							const Float relativeDepth = (Float::gather(probeDepths.data(), probes) - depth) * depthScale;
+							const Float bilinear = Float::load(&columnWeights[i][first]) * Float::broadcast(rowWeights[j]);
+							const Float weight = bilinear * Float::gather(probeValid.data(), probes) * (normalWeight / (one + relativeDepth * relativeDepth) + Float::broadcast(gatherFallbackWeight));
+							for (int c = 0; c < stride; c++) {
+								blend[c] = blend[c] + Float::gather(coefficients + c, offsets) * weight;
+							}
+							weightSum = weightSum + weight;
+						}
+					}
+
+					Float b[coefficientCount<Bands>];
+					simd::basis<Bands>(nx, ny, nz, b);
+					const Float normalization = one / max(weightSum, Float::broadcast(1e-8f));
+					for (uint32_t i = 0; i < coefficientCount<Bands>; i++) {
+						b[i] = b[i] * Float::broadcast(cosineLobe[bandOf(i)]) * normalization;
+					}
+					for (uint32_t channel = 0; channel < 3; channel++) {
+						Float result = zero;
+						for (uint32_t i = 0; i < coefficientCount<Bands>; i++) {
+							result = result + blend[i * 3 + channel] * b[i];
+						}
+						result.scatter(&rowResults[first].x + channel, 3);
+					}
+					for (uint32_t i = 0; i < Float::width; i++) {
+						if (pixels[first + i].depth <= 0.0f) {
+							rowResults[first + i] = glm::vec3(0.0f);
+						}
+					}
+				}
+				for (uint32_t x = groups * Float::width; x < width; x++) {
+					rowResults[x] = gatherIrradiance(grid, pixels[x], x, y, settings);
+				}
+			});
+		}
+	}
+}
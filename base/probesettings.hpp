@@ -0,0 +1,26 @@
+/*
+* Probe layout and sh.json payload shared by the ssprobe sample and the CPU baker
+*
+* Both write the same sh.json, so the probe type and the default export live here instead of in each sample
+*
+* This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+*/
+
+#pragma once
+
+#include <type_traits>
+#include "sphericalharmonics.hpp"
+
+// SH bands per probe: 2 (4 coefficients, diffuse only, 2.25x less memory than 3), 3 (9 coefficients) or 4 (16 coefficients,
+// sharper lighting), the shaders get it as a specialization constant so it only has to be changed here
+constexpr uint32_t SH_BANDS = 3;
+// 4 or 6 stores H-basis coefficients instead (13 or 19 floats per probe instead of 27 for 3 bands), they only cover the
+// hemisphere above the probe's surface, which is all the probes integrate, and sh.json gets the packed normal as "n"
+// 0 keeps the SH_BANDS SH over the full sphere
+constexpr uint32_t H_BASIS = 0;
+using SHProbe = std::conditional_t<H_BASIS == 0, vks::sh::Probe<SH_BANDS>, vks::sh::HProbe<H_BASIS>>;
+// sh.json payload: 0 radiance SH ("v"), 1 irradiance SH convolved with the clamped cosine ("e"), 2 ambient cube ("c",
+// irradiance towards +x, -x, +y, -y, +z and -z), the last two spare consumers the convolution and the ambient cube is
+// smaller than SH_BANDS 3, override it with --export radiance|irradiance|ambientcube; H-basis probes are always radiance
+constexpr uint32_t EXPORT = 0;
+constexpr const char* EXPORT_NAMES[] = { "radiance", "irradiance", "ambientcube" };
@@ -0,0 +1,746 @@
+/*
+* Spherical harmonics math for probes with up to four bands of RGB coefficients
+*
+* Uses the basis, normalization and coefficient order of shaders/glsl/ssprobe/SH.glsl, so probes read from the SH buffer
+* or sh.json can be processed directly. Every operation exists for a single probe and as a batch kernel that processes
+* several probes (or samples) per instruction with AVX2, SSE2 or NEON, whichever the compiler targets
+*
+* This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <glm/glm.hpp>
+#include <glm/gtc/packing.hpp>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define VKS_SH_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define VKS_SH_SSE2
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define VKS_SH_NEON
+#endif
+
+namespace vks
+{
+	namespace sh
+	{
+		constexpr uint32_t maxBands = 4;
+		constexpr float pi = 3.1415926535897932384626433832795f;
+
+		/** @brief Bands * Bands coefficients, 4 for diffuse only use, 9 for the default three bands, 16 for sharper lighting */
+		template<uint32_t Bands>
+		constexpr uint32_t coefficientCount = Bands * Bands;
+
+		/** @brief Band of a coefficient index, band l holds the indices l * l to (l + 1) * (l + 1) - 1 like getIndex in SH.glsl */
+		constexpr uint32_t bandOf(uint32_t index)
+		{
+			uint32_t band = 0;
+			while ((band + 1) * (band + 1) <= index) {
+				band++;
+			}
+			return band;
+		}
+
+		/**
+		* @brief RGB coefficients in the order of getIndex in SH.glsl, tightly packed like a probe in the SH buffer
+		* @note The code of SH.glsl stores z at index 3 and -x at index 2, the table in its comment names them the other way round
+		*/
+		template<uint32_t Bands>
+		struct Probe : std::array<glm::vec3, coefficientCount<Bands>>
+		{
+			static_assert(Bands >= 1 && Bands <= maxBands, "SH probes have one to four bands");
+			static constexpr uint32_t bands = Bands;
+		};
+		static_assert(sizeof(Probe<3>) == 27 * sizeof(float), "Probes must be tightly packed");
+
+		/** @brief Convolution of every band with the clamped cosine lobe, see "An Efficient Representation for Irradiance Environment Maps" (Ramamoorthi and Hanrahan) */
+		constexpr std::array<float, maxBands> cosineLobe = { pi, 2.0f * pi / 3.0f, pi / 4.0f, 0.0f };
+
+		/** @brief Basis functions of update in SH.glsl for a normalized direction */
+		template<uint32_t Bands>
+		inline void basis(const glm::vec3& d, float y[coefficientCount<Bands>])
+		{
+			y[0] = 0.282095f;
+			if constexpr (Bands > 1) {
+				y[1] = -0.488603f * d.y;
+				y[2] = -0.488603f * d.x;
+				y[3] = 0.488603f * d.z;
+			}
+			if constexpr (Bands > 2) {
+				y[4] = 1.092548f * d.x * d.y;
+				y[5] = 1.092548f * d.y * d.z;
+				y[6] = 0.315392f * (3.0f * d.z * d.z - 1.0f);
+				y[7] = 1.092548f * d.x * d.z;
+				y[8] = 0.546274f * (d.x * d.x - d.y * d.y);
+			}
+			if constexpr (Bands > 3) {
+				const float z2 = d.z * d.z;
+				y[9] = 0.590044f * d.y * (3.0f * d.x * d.x - d.y * d.y);
+				y[10] = 2.890611f * d.x * d.y * d.z;
+				y[11] = 0.457046f * d.y * (5.0f * z2 - 1.0f);
+				y[12] = 0.373176f * d.z * (5.0f * z2 - 3.0f);
+				y[13] = 0.457046f * d.x * (5.0f * z2 - 1.0f);
+				y[14] = 1.445306f * d.z * (d.x * d.x - d.y * d.y);
+				y[15] = 0.590044f * d.x * (d.x * d.x - 3.0f * d.y * d.y);
+			}
+		}
+
+		/** @brief Adds a weighted sample like update in SH.glsl, the direction doesn't need to be normalized */
+		template<uint32_t Bands>
+		inline void project(Probe<Bands>& probe, const glm::vec3& direction, const glm::vec3& value)
+		{
+			float y[coefficientCount<Bands>];
+			basis<Bands>(glm::normalize(direction), y);
+			for (uint32_t i = 0; i < coefficientCount<Bands>; i++) {
+				probe[i] += value * y[i];
+			}
+		}
+
+		/** @brief Reconstructed function in a normalized direction */
+		template<uint32_t Bands>
+		inline glm::vec3 evaluate(const Probe<Bands>& probe, const glm::vec3& direction)
+		{
+			float y[coefficientCount<Bands>];
+			basis<Bands>(direction, y);
+			glm::vec3 result(0.0f);
+			for (uint32_t i = 0; i < coefficientCount<Bands>; i++) {
+				result += probe[i] * y[i];
+			}
+			return result;
+		}
+
+		template<uint32_t Bands>
+		inline void scaleBands(Probe<Bands>& probe, const std::array<float, maxBands>& bandScale)
+		{
+			for (uint32_t i = 0; i < coefficientCount<Bands>; i++) {
+				probe[i] *= bandScale[bandOf(i)];
+			}
+		}
+
+		/** @brief Turns incoming radiance into irradiance, evaluate then returns the irradiance for a surface normal */
+		template<uint32_t Bands>
+		inline void convolveCosine(Probe<Bands>& probe)
+		{
+			scaleBands(probe, cosineLobe);
+		}
+
+		/** @brief Irradiance for a normalized surface normal of a probe holding incoming radiance */
+		template<uint32_t Bands>
+		inline glm::vec3 irradiance(const Probe<Bands>& probe, const glm::vec3& normal)
+		{
+			float y[coefficientCount<Bands>];
+			basis<Bands>(normal, y);
+			glm::vec3 result(0.0f);
+			for (uint32_t i = 0; i < coefficientCount<Bands>; i++) {
+				result += probe[i] * (y[i] * cosineLobe[bandOf(i)]);
+			}
+			return result;
+		}
+
+		/** @brief Irradiance towards +x, -x, +y, -y, +z and -z, see "Shading in Valve's Source Engine" (Mitchell and McTaggart) */
+		using AmbientCube = std::array<glm::vec3, 6>;
+
+		constexpr glm::vec3 ambientCubeAxes[6] = {
+			glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(-1.0f, 0.0f, 0.0f),
+			glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f),
+			glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(0.0f, 0.0f, -1.0f),
+		};
+
+		/** @brief Ambient cube of a probe holding incoming radiance */
+		template<uint32_t Bands>
+		inline AmbientCube ambientCube(const Probe<Bands>& probe)
+		{
+			AmbientCube cube;
+			for (uint32_t axis = 0; axis < 6; axis++) {
+				cube[axis] = irradiance(probe, ambientCubeAxes[axis]);
+			}
+			return cube;
+		}
+
+		/**
+		* @brief Band scales of a Hann window, damping the higher bands reduces ringing around strong lights
+		* @param width Band at which the window reaches zero, has to be greater than the highest band, smaller widths blur more
+		*/
+		inline std::array<float, maxBands> hannWindow(float width)
+		{
+			std::array<float, maxBands> bandScale;
+			for (uint32_t band = 0; band < maxBands; band++) {
+				bandScale[band] = band < width ? 0.5f * (1.0f + std::cos(pi * band / width)) : 0.0f;
+			}
+			return bandScale;
+		}
+
+		template<uint32_t Bands>
+		inline void window(Probe<Bands>& probe, float width)
+		{
+			scaleBands(probe, hannWindow(width));
+		}
+
+		template<uint32_t Bands>
+		inline Probe<Bands> lerp(const Probe<Bands>& a, const Probe<Bands>& b, float t)
+		{
+			Probe<Bands> result;
+			for (uint32_t i = 0; i < coefficientCount<Bands>; i++) {
+				result[i] = a[i] + (b[i] - a[i]) * t;
+			}
+			return result;
+		}
+
+		/**
+		* @brief Rotation of probes by a rotation matrix, the rotated probe f' satisfies f'(R d) = f(d)
+		* Every band is closed under rotation, so its matrix is fitted exactly by least squares through fixed directions n:
+		* A c' = B c with A the basis at n and B the basis at R^T n, see "Stupid Spherical Harmonics (SH) Tricks" (Sloan)
+		*/
+		template<uint32_t Bands>
+		class Rotation
+		{
+		public:
+			static constexpr uint32_t maxSize = 2 * Bands - 1;
+			/** @brief Matrix of band l in the upper left (2l + 1) x (2l + 1) elements */
+			float band[Bands][maxSize][maxSize] = {};
+
+			explicit Rotation(const glm::mat3& rotation)
+			{
+				// Evenly spread points on a Fibonacci spiral, enough of them keep A^T A close to a multiple of the identity
+				constexpr uint32_t fitCount = 32;
+				float yn[fitCount][coefficientCount<Bands>];
+				float yr[fitCount][coefficientCount<Bands>];
+				for (uint32_t k = 0; k < fitCount; k++) {
+					const float z = 1.0f - (2.0f * k + 1.0f) / fitCount;
+					const float r = std::sqrt(1.0f - z * z);
+					const float phi = 2.399963f * k;
+					const glm::vec3 n(r * std::cos(phi), r * std::sin(phi), z);
+					basis<Bands>(n, yn[k]);
+					basis<Bands>(glm::transpose(rotation) * n, yr[k]);
+				}
+				band[0][0][0] = 1.0f;
+				for (uint32_t l = 1; l < Bands; l++) {
+					const uint32_t size = 2 * l + 1;
+					const uint32_t first = l * l;
+					// Normal equations A^T A c' = A^T B c
+					float a[maxSize][maxSize] = {}, b[maxSize][maxSize] = {};
+					for (uint32_t k = 0; k < fitCount; k++) {
+						for (uint32_t i = 0; i < size; i++) {
+							for (uint32_t j = 0; j < size; j++) {
+								a[i][j] += yn[k][first + i] * yn[k][first + j];
+								b[i][j] += yn[k][first + i] * yr[k][first + j];
+							}
+						}
+					}
+					// Gauss-Jordan elimination leaves (A^T A)^-1 A^T B
+					for (uint32_t column = 0; column < size; column++) {
+						uint32_t pivot = column;
+						for (uint32_t row = column + 1; row < size; row++) {
+							if (std::abs(a[row][column]) > std::abs(a[pivot][column])) {
+								pivot = row;
+							}
+						}
+						for (uint32_t j = 0; j < size; j++) {
+							std::swap(a[column][j], a[pivot][j]);
+							std::swap(b[column][j], b[pivot][j]);
+						}
+						const float inverse = 1.0f / a[column][column];
+						for (uint32_t j = 0; j < size; j++) {
+							a[column][j] *= inverse;
+							b[column][j] *= inverse;
+						}
+						for (uint32_t row = 0; row < size; row++) {
+							if (row != column && a[row][column] != 0.0f) {
+								const float factor = a[row][column];
+								for (uint32_t j = 0; j < size; j++) {
+									a[row][j] -= factor * a[column][j];
+									b[row][j] -= factor * b[column][j];
+								}
+							}
+						}
+					}
+					for (uint32_t i = 0; i < size; i++) {
+						for (uint32_t j = 0; j < size; j++) {
+							band[l][i][j] = b[i][j];
+						}
+					}
+				}
+			}
+
+			Probe<Bands> apply(const Probe<Bands>& probe) const
+			{
+				Probe<Bands> result;
+				for (uint32_t l = 0; l < Bands; l++) {
+					const uint32_t first = l * l;
+					for (uint32_t i = 0; i < 2 * l + 1; i++) {
+						result[first + i] = glm::vec3(0.0f);
+						for (uint32_t j = 0; j < 2 * l + 1; j++) {
+							result[first + i] += probe[first + j] * band[l][i][j];
+						}
+					}
+				}
+				return result;
+			}
+		};
+
+		/**
+		* @brief H-basis probe, see "Efficient Irradiance Normal Mapping" (Habel and Wimmer)
+		* Count (4 or 6) RGB coefficients over the hemisphere around the probe normal, followed by the normal packed like
+		* pack_probe_normal in SH.glsl, the layout of an H-basis probe in the SH buffer
+		*/
+		template<uint32_t Count>
+		struct HProbe : std::array<glm::vec3, Count>
+		{
+			static_assert(Count == 4 || Count == 6, "H-basis probes have 4 or 6 coefficients");
+			uint32_t normal;
+		};
+		static_assert(sizeof(HProbe<4>) == 13 * sizeof(float), "Probes must be tightly packed");
+
+		/** @brief Octahedral encoding into two 16 bit snorm values, pack_probe_normal in SH.glsl */
+		inline uint32_t packNormal(glm::vec3 n)
+		{
+			n /= std::max(std::abs(n.x) + std::abs(n.y) + std::abs(n.z), 1e-8f);
+			glm::vec2 e(n.x, n.y);
+			if (n.z < 0.0f) {
+				e.x = (1.0f - std::abs(n.y)) * (n.x >= 0.0f ? 1.0f : -1.0f);
+				e.y = (1.0f - std::abs(n.x)) * (n.y >= 0.0f ? 1.0f : -1.0f);
+			}
+			return glm::packSnorm2x16(e);
+		}
+
+		inline glm::vec3 unpackNormal(uint32_t p)
+		{
+			const glm::vec2 e = glm::unpackSnorm2x16(p);
+			glm::vec3 n(e.x, e.y, 1.0f - std::abs(e.x) - std::abs(e.y));
+			const float t = std::max(-n.z, 0.0f);
+			n.x += n.x >= 0.0f ? -t : t;
+			n.y += n.y >= 0.0f ? -t : t;
+			return glm::normalize(n);
+		}
+
+		/** @brief Rotation from the z axis to n, orthonormal_basis in raygen.rgen, see "Building an Orthonormal Basis, Revisited" (Duff et al.) */
+		inline glm::mat3 tangentFrame(const glm::vec3& n)
+		{
+			const float s = n.z >= 0.0f ? 1.0f : -1.0f;
+			const float a = -1.0f / (s + n.z);
+			const float b = n.x * n.y * a;
+			return glm::mat3(glm::vec3(1.0f + s * n.x * n.x * a, s * b, -s * n.x), glm::vec3(b, s + n.y * n.y * a, -n.y), n);
+		}
+
+		/** @brief Basis functions of update_hbasis in SH.glsl for a normalized direction in the tangent frame */
+		template<uint32_t Count>
+		inline void hbasis(const glm::vec3& d, float y[Count])
+		{
+			y[0] = 0.398942f;
+			y[1] = 0.690988f * d.x;
+			y[2] = 0.690988f * (2.0f * d.z - 1.0f);
+			y[3] = 0.690988f * d.y;
+			if constexpr (Count > 4) {
+				y[4] = 1.545097f * d.x * d.y;
+				y[5] = 0.772548f * (d.x * d.x - d.y * d.y);
+			}
+		}
+
+		/** @brief Adds a weighted sample in world space, probe.normal has to be set before */
+		template<uint32_t Count>
+		inline void project(HProbe<Count>& probe, const glm::vec3& direction, const glm::vec3& value)
+		{
+			float y[Count];
+			hbasis<Count>(glm::transpose(tangentFrame(unpackNormal(probe.normal))) * glm::normalize(direction), y);
+			for (uint32_t i = 0; i < Count; i++) {
+				probe[i] += value * y[i];
+			}
+		}
+
+		/** @brief Reconstructed function in a normalized world space direction, only meaningful above the probe's surface */
+		template<uint32_t Count>
+		inline glm::vec3 evaluate(const HProbe<Count>& probe, const glm::vec3& direction)
+		{
+			float y[Count];
+			hbasis<Count>(glm::transpose(tangentFrame(unpackNormal(probe.normal))) * direction, y);
+			glm::vec3 result(0.0f);
+			for (uint32_t i = 0; i < Count; i++) {
+				result += probe[i] * y[i];
+			}
+			return result;
+		}
+
+		/*
+			Batch kernels
+			Probes are processed in groups of Float::width, coefficients of a group are gathered into one register per
+			coefficient and channel, the remainder falls back to the single probe functions
+		*/
+		namespace simd
+		{
+			struct Float
+			{
+#if defined(VKS_SH_AVX2)
+				static constexpr uint32_t width = 8;
+				__m256 v;
+				static Float broadcast(float f) { return { _mm256_set1_ps(f) }; }
+				static Float load(const float* p) { return { _mm256_loadu_ps(p) }; }
+				static Float gather(const float* p, int stride)
+				{
+					const __m256i index = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(stride));
+					return { _mm256_i32gather_ps(p, index, 4) };
+				}
+				static Float gather(const float* p, const int32_t* indices) { return { _mm256_i32gather_ps(p, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(indices)), 4) }; }
+				void store(float* p) const { _mm256_storeu_ps(p, v); }
+				friend Float operator+(Float a, Float b) { return { _mm256_add_ps(a.v, b.v) }; }
+				friend Float operator-(Float a, Float b) { return { _mm256_sub_ps(a.v, b.v) }; }
+				friend Float operator*(Float a, Float b) { return { _mm256_mul_ps(a.v, b.v) }; }
+				friend Float operator/(Float a, Float b) { return { _mm256_div_ps(a.v, b.v) }; }
+				friend Float max(Float a, Float b) { return { _mm256_max_ps(a.v, b.v) }; }
+#elif defined(VKS_SH_SSE2)
+				static constexpr uint32_t width = 4;
+				__m128 v;
+				static Float broadcast(float f) { return { _mm_set1_ps(f) }; }
+				static Float load(const float* p) { return { _mm_loadu_ps(p) }; }
+				static Float gather(const float* p, int stride) { return { _mm_setr_ps(p[0], p[stride], p[stride * 2], p[stride * 3]) }; }
+				static Float gather(const float* p, const int32_t* indices) { return { _mm_setr_ps(p[indices[0]], p[indices[1]], p[indices[2]], p[indices[3]]) }; }
+				void store(float* p) const { _mm_storeu_ps(p, v); }
+				friend Float operator+(Float a, Float b) { return { _mm_add_ps(a.v, b.v) }; }
+				friend Float operator-(Float a, Float b) { return { _mm_sub_ps(a.v, b.v) }; }
+				friend Float operator*(Float a, Float b) { return { _mm_mul_ps(a.v, b.v) }; }
+				friend Float operator/(Float a, Float b) { return { _mm_div_ps(a.v, b.v) }; }
+				friend Float max(Float a, Float b) { return { _mm_max_ps(a.v, b.v) }; }
+#elif defined(VKS_SH_NEON)
+				static constexpr uint32_t width = 4;
+				float32x4_t v;
+				static Float broadcast(float f) { return { vdupq_n_f32(f) }; }
+				static Float load(const float* p) { return { vld1q_f32(p) }; }
+				static Float gather(const float* p, int stride)
+				{
+					const float values[4] = { p[0], p[stride], p[stride * 2], p[stride * 3] };
+					return { vld1q_f32(values) };
+				}
+				static Float gather(const float* p, const int32_t* indices)
+				{
+					const float values[4] = { p[indices[0]], p[indices[1]], p[indices[2]], p[indices[3]] };
+					return { vld1q_f32(values) };
+				}
+				void store(float* p) const { vst1q_f32(p, v); }
+				friend Float operator+(Float a, Float b) { return { vaddq_f32(a.v, b.v) }; }
+				friend Float operator-(Float a, Float b) { return { vsubq_f32(a.v, b.v) }; }
+				friend Float operator*(Float a, Float b) { return { vmulq_f32(a.v, b.v) }; }
+				friend Float operator/(Float a, Float b)
+				{
+					// 32 bit ARM has no vector division, the reciprocal estimate is refined with two Newton-Raphson steps
+					float32x4_t reciprocal = vrecpeq_f32(b.v);
+					reciprocal = vmulq_f32(vrecpsq_f32(b.v, reciprocal), reciprocal);
+					reciprocal = vmulq_f32(vrecpsq_f32(b.v, reciprocal), reciprocal);
+					return { vmulq_f32(a.v, reciprocal) };
+				}
+				friend Float max(Float a, Float b) { return { vmaxq_f32(a.v, b.v) }; }
+#else
+				// Plain loops the compiler can vectorize for other targets
+				static constexpr uint32_t width = 4;
+				float v[4];
+				static Float broadcast(float f) { return { { f, f, f, f } }; }
+				static Float load(const float* p) { return { { p[0], p[1], p[2], p[3] } }; }
+				static Float gather(const float* p, int stride) { return { { p[0], p[stride], p[stride * 2], p[stride * 3] } }; }
+				static Float gather(const float* p, const int32_t* indices) { return { { p[indices[0]], p[indices[1]], p[indices[2]], p[indices[3]] } }; }
+				void store(float* p) const { for (int i = 0; i < 4; i++) p[i] = v[i]; }
+				friend Float operator+(Float a, Float b) { Float r; for (int i = 0; i < 4; i++) r.v[i] = a.v[i] + b.v[i]; return r; }
+				friend Float operator-(Float a, Float b) { Float r; for (int i = 0; i < 4; i++) r.v[i] = a.v[i] - b.v[i]; return r; }
+				friend Float operator*(Float a, Float b) { Float r; for (int i = 0; i < 4; i++) r.v[i] = a.v[i] * b.v[i]; return r; }
+				friend Float operator/(Float a, Float b) { Float r; for (int i = 0; i < 4; i++) r.v[i] = a.v[i] / b.v[i]; return r; }
+				friend Float max(Float a, Float b) { Float r; for (int i = 0; i < 4; i++) r.v[i] = std::max(a.v[i], b.v[i]); return r; }
+#endif
+				void scatter(float* p, int stride) const
+				{
+					float values[width];
+					store(values);
+					for (uint32_t i = 0; i < width; i++) {
+						p[i * stride] = values[i];
+					}
+				}
+
+				float sum() const
+				{
+					float values[width];
+					store(values);
+					float result = 0.0f;
+					for (uint32_t i = 0; i < width; i++) {
+						result += values[i];
+					}
+					return result;
+				}
+			};
+
+			/** @brief Floats per probe */
+			template<uint32_t Bands>
+			constexpr int probeStride = coefficientCount<Bands> * 3;
+
+			/** @brief Basis functions of width directions, gathered into three registers */
+			template<uint32_t Bands>
+			inline void basis(Float x, Float y, Float z, Float b[coefficientCount<Bands>])
+			{
+				b[0] = Float::broadcast(0.282095f);
+				if constexpr (Bands > 1) {
+					b[1] = Float::broadcast(-0.488603f) * y;
+					b[2] = Float::broadcast(-0.488603f) * x;
+					b[3] = Float::broadcast(0.488603f) * z;
+				}
+				if constexpr (Bands > 2) {
+					b[4] = Float::broadcast(1.092548f) * x * y;
+					b[5] = Float::broadcast(1.092548f) * y * z;
+					b[6] = Float::broadcast(0.315392f) * (Float::broadcast(3.0f) * z * z - Float::broadcast(1.0f));
+					b[7] = Float::broadcast(1.092548f) * x * z;
+					b[8] = Float::broadcast(0.546274f) * (x * x - y * y);
+				}
+				if constexpr (Bands > 3) {
+					const Float z5 = Float::broadcast(5.0f) * z * z;
+					const Float x2 = x * x;
+					const Float y2 = y * y;
+					b[9] = Float::broadcast(0.590044f) * y * (Float::broadcast(3.0f) * x2 - y2);
+					b[10] = Float::broadcast(2.890611f) * x * y * z;
+					b[11] = Float::broadcast(0.457046f) * y * (z5 - Float::broadcast(1.0f));
+					b[12] = Float::broadcast(0.373176f) * z * (z5 - Float::broadcast(3.0f));
+					b[13] = Float::broadcast(0.457046f) * x * (z5 - Float::broadcast(1.0f));
+					b[14] = Float::broadcast(1.445306f) * z * (x2 - y2);
+					b[15] = Float::broadcast(0.590044f) * x * (x2 - Float::broadcast(3.0f) * y2);
+				}
+			}
+
+			/** @brief Loads the coefficients of width consecutive probes, channel c of coefficient i ends up in c[i * 3 + c] */
+			template<uint32_t Bands>
+			inline void loadProbes(const Probe<Bands>* probes, Float c[probeStride<Bands>])
+			{
+				const float* p = &probes[0][0].x;
+				for (int i = 0; i < probeStride<Bands>; i++) {
+					c[i] = Float::gather(p + i, probeStride<Bands>);
+				}
+			}
+
+			template<uint32_t Bands>
+			inline void storeProbes(Probe<Bands>* probes, const Float c[probeStride<Bands>])
+			{
+				float* p = &probes[0][0].x;
+				for (int i = 0; i < probeStride<Bands>; i++) {
+					c[i].scatter(p + i, probeStride<Bands>);
+				}
+			}
+
+			/** @brief Coefficients of width probes weighted by the basis functions b, summed per channel into results */
+			template<uint32_t Bands>
+			inline void dot(const Probe<Bands>* probes, const Float b[coefficientCount<Bands>], glm::vec3* results)
+			{
+				Float c[probeStride<Bands>];
+				loadProbes<Bands>(probes, c);
+				for (uint32_t channel = 0; channel < 3; channel++) {
+					Float result = Float::broadcast(0.0f);
+					for (uint32_t i = 0; i < coefficientCount<Bands>; i++) {
+						result = result + c[i * 3 + channel] * b[i];
+					}
+					result.scatter(&results[0].x + channel, 3);
+				}
+			}
+		}
+
+		/** @brief Projects count samples into probe, values are the weighted radiance of each sample like in update */
+		template<uint32_t Bands>
+		inline void projectBatch(Probe<Bands>& probe, const glm::vec3* directions, const glm::vec3* values, size_t count)
+		{
+			using simd::Float;
+			Float accumulators[simd::probeStride<Bands>];
+			for (Float& accumulator : accumulators) {
+				accumulator = Float::broadcast(0.0f);
+			}
+			const size_t groups = count / Float::width;
+			for (size_t group = 0; group < groups; group++) {
+				const float* d = &directions[group * Float::width].x;
+				const float* v = &values[group * Float::width].x;
+				Float x = Float::gather(d, 3), y = Float::gather(d + 1, 3), z = Float::gather(d + 2, 3);
+				// Normalized like in update
+				float lengths[Float::width];
+				(x * x + y * y + z * z).store(lengths);
+				for (float& length : lengths) {
+					length = 1.0f / std::sqrt(length);
+				}
+				const Float inverseLength = Float::load(lengths);
+				x = x * inverseLength;
+				y = y * inverseLength;
+				z = z * inverseLength;
+				Float b[coefficientCount<Bands>];
+				simd::basis<Bands>(x, y, z, b);
+				const Float value[3] = { Float::gather(v, 3), Float::gather(v + 1, 3), Float::gather(v + 2, 3) };
+				for (uint32_t i = 0; i < coefficientCount<Bands>; i++) {
+					for (uint32_t c = 0; c < 3; c++) {
+						accumulators[i * 3 + c] = accumulators[i * 3 + c] + b[i] * value[c];
+					}
+				}
+			}
+			for (uint32_t i = 0; i < coefficientCount<Bands>; i++) {
+				for (uint32_t c = 0; c < 3; c++) {
+					probe[i][c] += accumulators[i * 3 + c].sum();
+				}
+			}
+			for (size_t i = groups * Float::width; i < count; i++) {
+				project(probe, directions[i], values[i]);
+			}
+		}
+
+		/** @brief Evaluates every probe in its own normalized direction */
+		template<uint32_t Bands>
+		inline void evaluateBatch(const Probe<Bands>* probes, const glm::vec3* directions, glm::vec3* results, size_t count)
+		{
+			using simd::Float;
+			const size_t groups = count / Float::width;
+			for (size_t group = 0; group < groups; group++) {
+				const size_t first = group * Float::width;
+				const float* d = &directions[first].x;
+				Float b[coefficientCount<Bands>];
+				simd::basis<Bands>(Float::gather(d, 3), Float::gather(d + 1, 3), Float::gather(d + 2, 3), b);
+				simd::dot<Bands>(probes + first, b, results + first);
+			}
+			for (size_t i = groups * Float::width; i < count; i++) {
+				results[i] = evaluate(probes[i], directions[i]);
+			}
+		}
+
+		/** @brief Irradiance of every probe for its own normalized surface normal */
+		template<uint32_t Bands>
+		inline void irradianceBatch(const Probe<Bands>* probes, const glm::vec3* normals, glm::vec3* results, size_t count)
+		{
+			using simd::Float;
+			const size_t groups = count / Float::width;
+			for (size_t group = 0; group < groups; group++) {
+				const size_t first = group * Float::width;
+				const float* n = &normals[first].x;
+				Float b[coefficientCount<Bands>];
+				simd::basis<Bands>(Float::gather(n, 3), Float::gather(n + 1, 3), Float::gather(n + 2, 3), b);
+				for (uint32_t i = 0; i < coefficientCount<Bands>; i++) {
+					b[i] = b[i] * Float::broadcast(cosineLobe[bandOf(i)]);
+				}
+				simd::dot<Bands>(probes + first, b, results + first);
+			}
+			for (size_t i = groups * Float::width; i < count; i++) {
+				results[i] = irradiance(probes[i], normals[i]);
+			}
+		}
+
+		/** @brief Ambient cubes of probes holding incoming radiance */
+		template<uint32_t Bands>
+		inline void ambientCubeBatch(const Probe<Bands>* probes, AmbientCube* results, size_t count)
+		{
+			using simd::Float;
+			// Irradiance towards a fixed axis is a fixed weighting of the coefficients
+			Float weights[6][coefficientCount<Bands>];
+			for (uint32_t axis = 0; axis < 6; axis++) {
+				float y[coefficientCount<Bands>];
+				basis<Bands>(ambientCubeAxes[axis], y);
+				for (uint32_t i = 0; i < coefficientCount<Bands>; i++) {
+					weights[axis][i] = Float::broadcast(y[i] * cosineLobe[bandOf(i)]);
+				}
+			}
+			const size_t groups = count / Float::width;
+			for (size_t group = 0; group < groups; group++) {
+				const size_t first = group * Float::width;
+				Float c[simd::probeStride<Bands>];
+				simd::loadProbes<Bands>(probes + first, c);
+				for (uint32_t axis = 0; axis < 6; axis++) {
+					for (uint32_t channel = 0; channel < 3; channel++) {
+						Float result = Float::broadcast(0.0f);
+						for (uint32_t i = 0; i < coefficientCount<Bands>; i++) {
+							result = result + c[i * 3 + channel] * weights[axis][i];
+						}
+						result.scatter(&results[first][axis].x + channel, 18);
+					}
+				}
+			}
+			for (size_t i = groups * Float::width; i < count; i++) {
+				results[i] = ambientCube(probes[i]);
+			}
+		}
+
+		template<uint32_t Bands>
+		inline void scaleBandsBatch(Probe<Bands>* probes, size_t count, const std::array<float, maxBands>& bandScale)
+		{
+			using simd::Float;
+			constexpr int stride = simd::probeStride<Bands>;
+			// Scales of Float::width consecutive probes, which span exactly stride registers
+			float pattern[Float::width * stride];
+			for (uint32_t i = 0; i < Float::width * stride; i++) {
+				pattern[i] = bandScale[bandOf((i % stride) / 3)];
+			}
+			const size_t groups = count / Float::width;
+			for (size_t group = 0; group < groups; group++) {
+				float* p = &probes[group * Float::width][0].x;
+				for (int i = 0; i < stride; i++) {
+					(Float::load(p + i * Float::width) * Float::load(pattern + i * Float::width)).store(p + i * Float::width);
+				}
+			}
+			for (size_t i = groups * Float::width; i < count; i++) {
+				scaleBands(probes[i], bandScale);
+			}
+		}
+
+		template<uint32_t Bands>
+		inline void convolveCosineBatch(Probe<Bands>* probes, size_t count)
+		{
+			scaleBandsBatch(probes, count, cosineLobe);
+		}
+
+		template<uint32_t Bands>
+		inline void windowBatch(Probe<Bands>* probes, size_t count, float width)
+		{
+			scaleBandsBatch(probes, count, hannWindow(width));
+		}
+
+		/** @brief results = a + (b - a) * t for every probe, results may alias a or b */
+		template<uint32_t Bands>
+		inline void lerpBatch(const Probe<Bands>* a, const Probe<Bands>* b, float t, Probe<Bands>* results, size_t count)
+		{
+			using simd::Float;
+			const float* pa = &a[0][0].x;
+			const float* pb = &b[0][0].x;
+			float* pr = &results[0][0].x;
+			const size_t floatCount = count * simd::probeStride<Bands>;
+			const Float weight = Float::broadcast(t);
+			size_t i = 0;
+			for (; i + Float::width <= floatCount; i += Float::width) {
+				const Float va = Float::load(pa + i);
+				(va + (Float::load(pb + i) - va) * weight).store(pr + i);
+			}
+			for (; i < floatCount; i++) {
+				pr[i] = pa[i] + (pb[i] - pa[i]) * t;
+			}
+		}
+
+		/** @brief Rotates every probe, results may alias probes */
+		template<uint32_t Bands>
+		inline void rotateBatch(const Rotation<Bands>& rotation, const Probe<Bands>* probes, Probe<Bands>* results, size_t count)
+		{
+			using simd::Float;
+			const size_t groups = count / Float::width;
+			for (size_t group = 0; group < groups; group++) {
+				const size_t first = group * Float::width;
+				Float c[simd::probeStride<Bands>];
+				Float r[simd::probeStride<Bands>];
+				simd::loadProbes<Bands>(probes + first, c);
+				for (uint32_t l = 0; l < Bands; l++) {
+					const uint32_t offset = l * l;
+					for (uint32_t channel = 0; channel < 3; channel++) {
+						for (uint32_t i = 0; i < 2 * l + 1; i++) {
+							Float sum = Float::broadcast(0.0f);
+							for (uint32_t j = 0; j < 2 * l + 1; j++) {
+								sum = sum + c[(offset + j) * 3 + channel] * Float::broadcast(rotation.band[l][i][j]);
+							}
+							r[(offset + i) * 3 + channel] = sum;
+						}
+					}
+				}
+				simd::storeProbes<Bands>(results + first, r);
+			}
+			for (size_t i = groups * Float::width; i < count; i++) {
+				results[i] = rotation.apply(probes[i]);
+			}
+		}
+	}
+}
@@ -0,0 +1,468 @@
+/*
+* Work stealing task scheduler
+*
+* Every worker owns a lock-free deque (Chase-Lev), it pushes and pops tasks at the bottom while idle workers steal from
+* the top, so load balances itself without callers assigning work to threads
+* Threads waiting for a task group execute pending tasks instead of blocking
+*
+* This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+*/
+
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <algorithm>
+
+namespace vks
+{
+	/**
+	* @brief Type erased callable that stores small functions inline instead of allocating like std::function
+	* @note Move only, callables larger than inlineSize are moved to the heap
+	*/
+	class Task
+	{
+	public:
+		static constexpr size_t inlineSize = 48;
+
+		Task() = default;
+
+		template<typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, Task>>>
+		explicit Task(F&& function)
+		{
+			using Function = std::decay_t<F>;
+			if constexpr (sizeof(Function) <= inlineSize && alignof(Function) <= alignof(std::max_align_t) && std::is_nothrow_move_constructible_v<Function>) {
+				new (storage) Function(std::forward<F>(function));
+				invokeFunction = [](void* storage) { (*static_cast<Function*>(storage))(); };
+				destroyFunction = [](void* storage) { static_cast<Function*>(storage)->~Function(); };
+				moveFunction = [](void* from, void* to) {
+					new (to) Function(std::move(*static_cast<Function*>(from)));
+					static_cast<Function*>(from)->~Function();
+				};
+			} else {
+				new (storage) Function*(new Function(std::forward<F>(function)));
+				invokeFunction = [](void* storage) { (**static_cast<Function**>(storage))(); };
+				destroyFunction = [](void* storage) { delete *static_cast<Function**>(storage); };
+				moveFunction = [](void* from, void* to) { new (to) Function*(*static_cast<Function**>(from)); };
+			}
+		}
+
+		Task(Task&& other) noexcept
+		{
+			*this = std::move(other);
+		}
+
+		Task& operator=(Task&& other) noexcept
+		{
+			if (this != &other) {
+				reset();
+				if (other.invokeFunction) {
+					other.moveFunction(other.storage, storage);
+					invokeFunction = std::exchange(other.invokeFunction, nullptr);
+					destroyFunction = other.destroyFunction;
+					moveFunction = other.moveFunction;
+				}
+			}
+			return *this;
+		}
+
+		Task(const Task&) = delete;
+		Task& operator=(const Task&) = delete;
+
+		~Task()
+		{
+			reset();
+		}
+
+		void operator()()
+		{
+			invokeFunction(storage);
+		}
+
+		explicit operator bool() const
+		{
+			return invokeFunction != nullptr;
+		}
+
+	private:
+		alignas(std::max_align_t) unsigned char storage[inlineSize];
+		void (*invokeFunction)(void*) = nullptr;
+		void (*destroyFunction)(void*) = nullptr;
+		void (*moveFunction)(void*, void*) = nullptr;
+
+		void reset()
+		{
+			if (invokeFunction) {
+				destroyFunction(storage);
+				invokeFunction = nullptr;
+			}
+		}
+	};
+
+	class TaskScheduler;
+
+	/**
+	* @brief Set of tasks that can be waited on or followed by a continuation
+	* @note The destructor waits for all tasks, so they may reference data living on the stack of the creating thread
+	*/
+	class TaskGroup
+	{
+	public:
+		explicit TaskGroup(TaskScheduler& scheduler) : scheduler(scheduler) {}
+		~TaskGroup() { wait(); }
+
+		TaskGroup(const TaskGroup&) = delete;
+		TaskGroup& operator=(const TaskGroup&) = delete;
+
+		template<typename F>
+		void run(F&& function);
+
+		/**
+		* @brief Schedules function once every task of the group has finished
+		* @note Must be the last call on the group besides wait(), the continuation isn't part of the group and may run after wait() returned
+		*/
+		template<typename F>
+		void then(F&& function);
+
+		/** @brief Executes pending tasks of any group until all tasks of this group have finished */
+		void wait();
+
+	private:
+		friend class TaskScheduler;
+		TaskScheduler& scheduler;
+		/** @brief Unfinished tasks, plus continuationBit once then() published its job, both change in one atomic step */
+		std::atomic<uint32_t> pending { 0 };
+		std::atomic<void*> continuation { nullptr };
+		static constexpr uint32_t continuationBit = 1u << 31;
+
+		void finish();
+	};
+
+	class TaskScheduler
+	{
+	public:
+		/** @brief Starts threadCount - 1 workers, the thread waiting for a group is the remaining one */
+		explicit TaskScheduler(uint32_t threadCount = std::max(std::thread::hardware_concurrency(), 1u))
+		{
+			for (uint32_t i = 0; i + 1 < threadCount; i++) {
+				workers.push_back(std::make_unique<Worker>());
+			}
+			for (uint32_t i = 0; i < workers.size(); i++) {
+				workers[i]->thread = std::thread(&TaskScheduler::workerLoop, this, i);
+			}
+		}
+
+		~TaskScheduler()
+		{
+			// Remaining tasks are drained first, continuations may still be queued after every group finished
+			while (runOne()) {}
+			stopping = true;
+			queuedJobs.fetch_add(1);
+			queuedJobs.notify_all();
+			for (auto& worker : workers) {
+				worker->thread.join();
+			}
+		}
+
+		TaskScheduler(const TaskScheduler&) = delete;
+		TaskScheduler& operator=(const TaskScheduler&) = delete;
+
+		/** @brief Scheduler using every hardware thread, shared by the framework (e.g. the glTF loader) */
+		static TaskScheduler& shared()
+		{
+			static TaskScheduler scheduler;
+			return scheduler;
+		}
+
+		uint32_t getThreadCount() const
+		{
+			return static_cast<uint32_t>(workers.size()) + 1;
+		}
+
+		/**
+		* @brief Calls function(i) for every i in [begin, end) and returns once all calls finished
+		* @param grainSize Minimum number of iterations per task, 0 picks one that gives every thread about eight tasks
+		*/
+		template<typename F>
+		void parallelFor(uint32_t begin, uint32_t end, const F& function, uint32_t grainSize = 0)
+		{
+			if (begin >= end) {
+				return;
+			}
+			if (grainSize == 0) {
+				grainSize = std::max((end - begin) / (getThreadCount() * 8), 1u);
+			}
+			TaskGroup group(*this);
+			splitRange(group, begin, end, grainSize, function);
+			group.wait();
+		}
+
+	private:
+		friend class TaskGroup;
+
+		struct Job
+		{
+			Task task;
+			TaskGroup* group;
+		};
+
+		/**
+		* @brief Chase-Lev deque, see "Correct and Efficient Work-Stealing for Weak Memory Models" (Le et al.)
+		* Only the owning worker pushes and pops at the bottom, any thread may steal from the top
+		*/
+		class Deque
+		{
+		public:
+			Deque()
+			{
+				arrays.push_back(std::make_unique<Array>(256));
+				array.store(arrays.back().get(), std::memory_order_relaxed);
+			}
+
+			void push(Job* job)
+			{
+				const int64_t b = bottom.load(std::memory_order_relaxed);
+				const int64_t t = top.load(std::memory_order_acquire);
+				Array* a = array.load(std::memory_order_relaxed);
+				if (b - t > a->capacity - 1) {
+					a = grow(a, b, t);
+				}
+				a->put(b, job);
+				std::atomic_thread_fence(std::memory_order_release);
+				bottom.store(b + 1, std::memory_order_relaxed);
+			}
+
+			Job* pop()
+			{
+				const int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+				Array* a = array.load(std::memory_order_relaxed);
+				bottom.store(b, std::memory_order_relaxed);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				int64_t t = top.load(std::memory_order_relaxed);
+				Job* job = nullptr;
+				if (t <= b) {
+					job = a->get(b);
+					if (t == b) {
+						// Last job, race against thieves for it
+						if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+							job = nullptr;
+						}
+						bottom.store(b + 1, std::memory_order_relaxed);
+					}
+				} else {
+					bottom.store(b + 1, std::memory_order_relaxed);
+				}
+				return job;
+			}
+
+			Job* steal()
+			{
+				int64_t t = top.load(std::memory_order_acquire);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				const int64_t b = bottom.load(std::memory_order_acquire);
+				if (t >= b) {
+					return nullptr;
+				}
+				Job* job = array.load(std::memory_order_acquire)->get(t);
+				if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+					return nullptr;
+				}
+				return job;
+			}
+
+		private:
+			struct Array
+			{
+				int64_t capacity;
+				std::unique_ptr<std::atomic<Job*>[]> jobs;
+				explicit Array(int64_t capacity) : capacity(capacity), jobs(new std::atomic<Job*>[capacity]) {}
+				Job* get(int64_t index) const { return jobs[index & (capacity - 1)].load(std::memory_order_relaxed); }
+				void put(int64_t index, Job* job) { jobs[index & (capacity - 1)].store(job, std::memory_order_relaxed); }
+			};
+
+			alignas(64) std::atomic<int64_t> top { 0 };
+			alignas(64) std::atomic<int64_t> bottom { 0 };
+			std::atomic<Array*> array;
+			// Thieves may still read from replaced arrays, so they live as long as the deque
+			std::vector<std::unique_ptr<Array>> arrays;
+
+			Array* grow(Array* a, int64_t b, int64_t t)
+			{
+				arrays.push_back(std::make_unique<Array>(a->capacity * 2));
+				Array* grown = arrays.back().get();
+				for (int64_t i = t; i < b; i++) {
+					grown->put(i, a->get(i));
+				}
+				array.store(grown, std::memory_order_release);
+				return grown;
+			}
+		};
+
+		struct Worker
+		{
+			Deque deque;
+			std::thread thread;
+		};
+
+		std::vector<std::unique_ptr<Worker>> workers;
+		// Jobs submitted by threads that aren't workers of this scheduler
+		std::deque<Job*> injectedJobs;
+		std::mutex injectionMutex;
+		// Upper bound of the queued jobs, idle workers sleep while it is zero
+		std::atomic<uint32_t> queuedJobs { 0 };
+		std::atomic<bool> stopping { false };
+
+		static inline thread_local TaskScheduler* currentScheduler = nullptr;
+		static inline thread_local uint32_t currentWorker = 0;
+
+		void submit(Job* job)
+		{
+			// Without workers nothing but a waiting group would pick up the job, continuations would never run
+			if (workers.empty()) {
+				execute(job);
+				return;
+			}
+			queuedJobs.fetch_add(1);
+			if (currentScheduler == this) {
+				workers[currentWorker]->deque.push(job);
+			} else {
+				std::lock_guard<std::mutex> lock(injectionMutex);
+				injectedJobs.push_back(job);
+			}
+			queuedJobs.notify_one();
+		}
+
+		bool runOne()
+		{
+			Job* job = nullptr;
+			const bool isWorker = currentScheduler == this;
+			if (isWorker) {
+				job = workers[currentWorker]->deque.pop();
+			}
+			if (!job) {
+				std::lock_guard<std::mutex> lock(injectionMutex);
+				if (!injectedJobs.empty()) {
+					job = injectedJobs.front();
+					injectedJobs.pop_front();
+				}
+			}
+			// Victims are visited starting next to the thief, so thieves don't all hit the same worker
+			const uint32_t workerCount = static_cast<uint32_t>(workers.size());
+			for (uint32_t i = 0; !job && i < workerCount; i++) {
+				const uint32_t victim = ((isWorker ? currentWorker + 1 : 0) + i) % workerCount;
+				if (!isWorker || victim != currentWorker) {
+					job = workers[victim]->deque.steal();
+				}
+			}
+			if (!job) {
+				return false;
+			}
+			queuedJobs.fetch_sub(1);
+			execute(job);
+			return true;
+		}
+
+		void execute(Job* job)
+		{
+			job->task();
+			TaskGroup* group = job->group;
+			delete job;
+			if (group) {
+				group->finish();
+			}
+		}
+
+		void workerLoop(uint32_t index)
+		{
+			currentScheduler = this;
+			currentWorker = index;
+			while (!stopping) {
+				if (runOne()) {
+					continue;
+				}
+				// Yielding a few times first picks up jobs submitted right after, e.g. the next halves of a parallelFor,
+				// without a sleep and wake up. queuedJobs is raised before a job is pushed and lowered after it was taken,
+				// so for a few instructions it can count a job no thread finds: wait(0) returns at once then and this loop
+				// busy-waits, for no longer than that window unless the thread inside it is preempted
+				bool found = false;
+				for (uint32_t spin = 0; spin < 64 && !found && !stopping; spin++) {
+					std::this_thread::yield();
+					found = runOne();
+				}
+				if (!found && !stopping) {
+					queuedJobs.wait(0);
+				}
+			}
+		}
+
+		template<typename F>
+		void splitRange(TaskGroup& group, uint32_t begin, uint32_t end, uint32_t grainSize, const F& function)
+		{
+			// Upper halves are left for thieves while this thread keeps splitting the lower half
+			while (end - begin > grainSize) {
+				const uint32_t middle = begin + (end - begin) / 2;
+				group.run([this, &group, middle, end, grainSize, &function] { splitRange(group, middle, end, grainSize, function); });
+				end = middle;
+			}
+			for (uint32_t i = begin; i < end; i++) {
+				function(i);
+			}
+		}
+	};
+
+	template<typename F>
+	void TaskGroup::run(F&& function)
+	{
+		pending.fetch_add(1);
+		scheduler.submit(new TaskScheduler::Job { Task(std::forward<F>(function)), this });
+	}
+
+	template<typename F>
+	void TaskGroup::then(F&& function)
+	{
+		// The job is published before the bit announces it, and holding a task count of its own makes this call the last
+		// one to finish if all tasks are done already
+		continuation.store(new TaskScheduler::Job { Task(std::forward<F>(function)), nullptr });
+		pending.fetch_add(1 | continuationBit);
+		finish();
+	}
+
+	inline void TaskGroup::wait()
+	{
+		while (pending.load(std::memory_order_acquire) != 0) {
+			if (!scheduler.runOne()) {
+				std::this_thread::yield();
+			}
+		}
+	}
+
+	inline void TaskGroup::finish()
+	{
+		// The group may be destroyed as soon as the count reaches zero, so the continuation is read before that. A then()
+		// between the read and the exchange sets continuationBit, so the exchange fails and the loop reads the job again
+		TaskScheduler& taskScheduler = scheduler;
+		uint32_t count = pending.load();
+		while (true) {
+			if ((count & ~continuationBit) == 1) {
+				void* job = (count & continuationBit) ? continuation.load() : nullptr;
+				if (pending.compare_exchange_strong(count, 0)) {
+					if (job) {
+						taskScheduler.submit(static_cast<TaskScheduler::Job*>(job));
+					}
+					return;
+				}
+			} else if (pending.compare_exchange_weak(count, count - 1)) {
+				return;
+			}
+		}
+	}
+}
@@ -204,7 +204,7 @@ public:
 
 	struct {
 		VkImage image;
-		VkDeviceMemory mem;
+		vks::Allocation allocation;
 		VkImageView view;
 	} depthStencil;
 
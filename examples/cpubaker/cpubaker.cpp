@@ -0,0 +1,38 @@
+/*
+* CPU reference baker for the screen space probes, see cpubaker.h
+*
+* This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+*/
+
+#include "cpubaker.h"
+
+int main(int argc, char* argv[])
+{
+    CpuBaker baker;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc) {
+            baker.sampleCount = std::max(static_cast<uint32_t>(std::stoul(argv[++i])), 1u);
+        }
+        if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            baker.outputFile = argv[++i];
+        }
+        if (strcmp(argv[i], "--gather") == 0 && i + 1 < argc) {
+            baker.gatherSpacing = static_cast<uint32_t>(std::stoul(argv[++i]));
+        }
+        if (strcmp(argv[i], "--denoise") == 0 && i + 1 < argc) {
+            baker.denoiseIterations = static_cast<uint32_t>(std::stoul(argv[++i]));
+        }
+        if (strcmp(argv[i], "--export") == 0 && i + 1 < argc) {
+            const char* name = argv[++i];
+            for (uint32_t type = 0; type < std::size(EXPORT_NAMES); type++) {
+                if (strcmp(name, EXPORT_NAMES[type]) == 0) {
+                    baker.exportType = type;
+                }
+            }
+        }
+    }
+    baker.loadAssets();
+    baker.buildScene();
+    baker.bake();
+    return 0;
+}
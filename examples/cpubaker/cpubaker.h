@@ -0,0 +1,644 @@
+/*
+* CPU reference baker for the screen space probes
+*
+* Produces the probes of the ssprobe sample without a ray tracing GPU: the glTF model is loaded through vkglTF on the host,
+* a SAH BVH stands in for the acceleration structures and the integrator of raygen.rgen and closesthit.rchit runs on
+* every core. The result is written in the sh.json format of ssprobe.
+*
+* It is meant as a fallback baker and as a statistical reference for the GPU path, so it trades speed for the absence of
+* approximations: every light is evaluated at every hit instead of one picked from the light tree, textures are filtered
+* bilinearly from their full resolution and there is no radiance cache
+*/
+
+#pragma once
+
+#include "VulkanglTFModel.h"
+#include "VulkanTools.h"
+#include "camera.hpp"
+#include "lighttree.hpp"
+#include "bvh.hpp"
+#include "taskscheduler.hpp"
+#include "sphericalharmonics.hpp"
+#include "probesettings.hpp"
+#include "probegather.hpp"
+#include "probedenoiser.hpp"
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <fstream>
+#include <json.hpp>
+
+// keep the scene parameters in sync with examples/ssprobe/ssprobe.cpp, so both bake the same probes
+constexpr uint32_t WIDTH = 1280;
+constexpr uint32_t HEIGHT = 720;
+constexpr uint32_t RECURSIVE_DEPTH = 10;
+constexpr uint32_t RUSSIAN_ROULETTE_DEPTH = 3;
+// total sample count per probe, override it with --samples n
+constexpr uint32_t SAMPLE_COUNT = 256;
+constexpr glm::vec3 POSITION = glm::vec3(-0.5f, 5.0f, 3.5f);
+constexpr glm::vec3 ROTATION = glm::vec3(-15.0f, 120.0f, 0.0f);
+constexpr uint32_t LIGHT_COUNT = 1;
+const vks::PunctualLight LIGHTS[LIGHT_COUNT] {
+    vks::PunctualLight { { 2., 8., 1., 1. }, glm::vec3(1), 50. },
+};
+
+constexpr float PI = 3.1415926535897932384626433832795f;
+
+// lowbias32 integer hash by Chris Wellons, see sampler.glsl
+inline uint32_t hash(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+// PCG random numbers, every sample of every probe starts from its own hashed state
+struct Random {
+    uint32_t state;
+    Random(uint32_t pixel, uint32_t sample) : state(hash(pixel ^ hash(sample + 0x9e3779b9u))) {}
+    float next()
+    {
+        state = state * 747796405u + 2891336453u;
+        uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+        word = (word >> 22u) ^ word;
+        return static_cast<float>(word >> 8) * (1.0f / 16777216.0f);
+    }
+};
+
+class CpuBaker {
+public:
+    uint32_t width = WIDTH;
+    uint32_t height = HEIGHT;
+    uint32_t sampleCount = SAMPLE_COUNT;
+    std::string outputFile = "sh.json";
+    uint32_t exportType = EXPORT;
+    // Pixels between two probes of the full resolution image the probes are gathered to with --gather n, 0 skips it
+    uint32_t gatherSpacing = 0;
+    // A-trous iterations of the probe denoiser run before the export with --denoise n, 0 exports the probes unfiltered
+    uint32_t denoiseIterations = 0;
+    // Paths are terminated randomly based on their throughput after this many bounces, RECURSIVE_DEPTH traces full paths
+    uint32_t russianRouletteDepth = RUSSIAN_ROULETTE_DEPTH;
+
+    vkglTF::Model model;
+    Camera camera;
+    std::vector<vks::PunctualLight> lights { LIGHTS, LIGHTS + LIGHT_COUNT };
+
+    // Geometry in world space, one entry per triangle of the geometries the GPU path traces
+    struct Triangle {
+        glm::vec3 normals[3];
+        glm::vec4 tangents[3];
+        glm::vec2 uvs[3];
+        uint32_t geometry;
+    };
+    struct Geometry {
+        const vkglTF::Material* material;
+        // Alpha masked or blended materials run the any hit test, like the geometries not flagged opaque on the GPU
+        bool alphaTested;
+    };
+    std::vector<glm::vec3> positions;
+    std::vector<Triangle> triangles;
+    std::vector<Geometry> geometries;
+    vks::BVH bvh;
+
+    struct ShadingPoint {
+        glm::vec3 position;
+        // Face normal facing the ray, probes sample the hemisphere around it and store it in their G-buffer
+        glm::vec3 faceNormal;
+        // Interpolated normal facing the ray, the normal mapped one and the tangent frame
+        glm::vec3 normal;
+        glm::vec3 worldNormal;
+        glm::mat3 TBN;
+        glm::vec3 baseColor;
+        glm::vec3 emission;
+    };
+
+    // Primary hit of every probe, same as ProbeGBuffer in ssprobe: depth along the probe's camera ray, 0 where it misses
+    using ProbeGBuffer = vks::sh::GBufferSample;
+
+    void loadAssets()
+    {
+        const uint32_t gltfLoadingFlags = vkglTF::FileLoadingFlags::FlipY | vkglTF::FileLoadingFlags::HostOnly;
+        model.loadFromFile(getAssetPath() + "sponza/sponza.gltf", nullptr, VK_NULL_HANDLE, gltfLoadingFlags);
+    }
+
+    /*
+        Flattens the node hierarchy into world space triangles, selecting the same primitives and instance transforms as
+        createBottomLevelAccelerationStructure and getInstanceTransform in ssprobe
+    */
+    void buildScene()
+    {
+        std::unordered_map<const vkglTF::Material*, uint32_t> materialGeometries;
+        const vkglTF::Vertex* vertices = reinterpret_cast<const vkglTF::Vertex*>(model.host.vertices.data());
+        for (vkglTF::Node* node : model.linearNodes) {
+            if (!node->mesh) {
+                continue;
+            }
+            const glm::mat4 transform = glm::scale(glm::mat4(1.0f), glm::vec3(1.0f, -1.0f, 1.0f)) * node->getMatrix();
+            const glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(transform)));
+            for (const vkglTF::Primitive* primitive : node->mesh->primitives) {
+                if (primitive->indexCount == 0 || !primitive->material.baseColorTexture || !primitive->material.normalTexture) {
+                    continue;
+                }
+                const auto geometry = materialGeometries.try_emplace(&primitive->material, static_cast<uint32_t>(geometries.size()));
+                if (geometry.second) {
+                    geometries.push_back({ &primitive->material, primitive->material.alphaMode != vkglTF::Material::ALPHAMODE_OPAQUE });
+                }
+                for (uint32_t i = 0; i < primitive->indexCount; i += 3) {
+                    Triangle triangle {};
+                    triangle.geometry = geometry.first->second;
+                    for (uint32_t k = 0; k < 3; k++) {
+                        const vkglTF::Vertex& vertex = vertices[model.host.indices[primitive->firstIndex + i + k]];
+                        positions.push_back(glm::vec3(transform * glm::vec4(vertex.pos, 1.0f)));
+                        triangle.normals[k] = normalMatrix * vertex.normal;
+                        triangle.tangents[k] = glm::vec4(glm::mat3(transform) * glm::vec3(vertex.tangent), vertex.tangent.w);
+                        triangle.uvs[k] = vertex.uv;
+                    }
+                    triangles.push_back(triangle);
+                }
+            }
+        }
+        buildBVH();
+    }
+
+    // Builds the BVH over positions, scenes that don't come from the glTF model fill positions, triangles and geometries themselves
+    void buildBVH()
+    {
+        const auto start = std::chrono::high_resolution_clock::now();
+        bvh.build(positions);
+        const auto end = std::chrono::high_resolution_clock::now();
+        std::cout << "BVH over " << triangles.size() << " triangles built in " << std::chrono::duration<double, std::milli>(end - start).count() << " ms, " << bvh.nodes.size() << " nodes" << std::endl;
+    }
+
+    // Bilinear lookup with repeat addressing, textures the host couldn't decode read as fallback
+    glm::vec4 sampleTexture(const vkglTF::Texture* texture, glm::vec2 uv, glm::vec4 fallback) const
+    {
+        if (!texture || texture->index >= model.host.images.size() || model.host.images[texture->index].image.empty()) {
+            return fallback;
+        }
+        const tinygltf::Image& image = model.host.images[texture->index];
+        const float x = (uv.x - std::floor(uv.x)) * image.width - 0.5f;
+        const float y = (uv.y - std::floor(uv.y)) * image.height - 0.5f;
+        const int x0 = static_cast<int>(std::floor(x));
+        const int y0 = static_cast<int>(std::floor(y));
+        const float fx = x - x0;
+        const float fy = y - y0;
+        auto texel = [&](int tx, int ty) {
+            tx = ((tx % image.width) + image.width) % image.width;
+            ty = ((ty % image.height) + image.height) % image.height;
+            const unsigned char* p = &image.image[(static_cast<size_t>(ty) * image.width + tx) * 4];
+            return glm::vec4(p[0], p[1], p[2], p[3]) * (1.0f / 255.0f);
+        };
+        return glm::mix(glm::mix(texel(x0, y0), texel(x0 + 1, y0), fx), glm::mix(texel(x0, y0 + 1), texel(x0 + 1, y0 + 1), fx), fy);
+    }
+
+    glm::vec2 triangleUV(const Triangle& triangle, glm::vec2 barycentrics) const
+    {
+        return triangle.uvs[0] * (1.0f - barycentrics.x - barycentrics.y) + triangle.uvs[1] * barycentrics.x + triangle.uvs[2] * barycentrics.y;
+    }
+
+    // anyhit.rahit and shadow.rahit
+    bool acceptHit(const vks::BVH::Hit& hit) const
+    {
+        const Triangle& triangle = triangles[hit.triangle];
+        const Geometry& geometry = geometries[triangle.geometry];
+        return !geometry.alphaTested || sampleTexture(geometry.material->baseColorTexture, triangleUV(triangle, hit.barycentrics), glm::vec4(1.0f)).a >= 0.9f;
+    }
+
+    bool trace(glm::vec3 origin, glm::vec3 direction, float tmin, float tmax, vks::BVH::Hit& hit) const
+    {
+        return bvh.intersect(origin, direction, tmin, tmax, hit, [this](const vks::BVH::Hit& candidate) { return acceptHit(candidate); });
+    }
+
+    bool visible(glm::vec3 position, glm::vec3 lightvec) const
+    {
+        const float distance = glm::length(lightvec);
+        return !bvh.occluded(position, lightvec / distance, 0.0001f, distance, [this](const vks::BVH::Hit& candidate) { return acceptHit(candidate); });
+    }
+
+    // Hit attributes as computed by unpackTriangle and the start of closesthit.rchit
+    ShadingPoint shade(glm::vec3 origin, glm::vec3 direction, const vks::BVH::Hit& hit) const
+    {
+        const Triangle& triangle = triangles[hit.triangle];
+        const vkglTF::Material& material = *geometries[triangle.geometry].material;
+        const glm::vec3 b(1.0f - hit.barycentrics.x - hit.barycentrics.y, hit.barycentrics.x, hit.barycentrics.y);
+        const glm::vec2 uv = triangleUV(triangle, hit.barycentrics);
+        glm::vec3 normal = triangle.normals[0] * b.x + triangle.normals[1] * b.y + triangle.normals[2] * b.z;
+        glm::vec4 tangent = triangle.tangents[0] * b.x + triangle.tangents[1] * b.y + triangle.tangents[2] * b.z;
+        if (glm::dot(normal, direction) > 0.0f) {
+            normal = -normal;
+            tangent = -tangent;
+        }
+        ShadingPoint point;
+        point.position = origin + direction * hit.t;
+        const glm::vec3* vertices = &positions[hit.triangle * 3];
+        point.faceNormal = glm::normalize(glm::cross(vertices[1] - vertices[0], vertices[2] - vertices[0]));
+        if (glm::dot(point.faceNormal, direction) > 0.0f) {
+            point.faceNormal = -point.faceNormal;
+        }
+        point.normal = glm::normalize(normal);
+        const glm::vec3 T = glm::normalize(glm::vec3(tangent));
+        const glm::vec3 B = glm::normalize(glm::cross(point.normal, T) * tangent.w);
+        point.TBN = glm::mat3(T, B, point.normal);
+        const glm::vec3 normalSample = glm::vec3(sampleTexture(material.normalTexture, uv, glm::vec4(0.5f, 0.5f, 1.0f, 1.0f)));
+        point.worldNormal = glm::normalize(point.TBN * glm::normalize(normalSample * 2.0f - 1.0f));
+        point.baseColor = glm::vec3(sampleTexture(material.baseColorTexture, uv, glm::vec4(1.0f)));
+        point.emission = material.emissiveFactor;
+        if (material.emissiveTexture) {
+            point.emission *= glm::vec3(sampleTexture(material.emissiveTexture, uv, glm::vec4(1.0f)));
+        }
+        return point;
+    }
+
+    // Burley diffuse with roughness 1, see diffuse and compute_albedo in closesthit.rchit (its pow5 is a third power)
+    static glm::vec3 diffuse(const ShadingPoint& point, glm::vec3 v, glm::vec3 l)
+    {
+        l = glm::normalize(l);
+        const glm::vec3 h = glm::normalize(l + v);
+        const float NoL = glm::dot(point.normal, l);
+        const float NoV = glm::dot(point.normal, v);
+        const float VoH = glm::dot(v, h);
+        const float FD90 = 0.5f + 2.0f * VoH * VoH;
+        const float FdV = 1.0f + (FD90 - 1.0f) * std::pow(1.0f - NoV, 3.0f);
+        const float FdL = 1.0f + (FD90 - 1.0f) * std::pow(1.0f - NoL, 3.0f);
+        return point.baseColor * ((1.0f / PI) * FdV * FdL);
+    }
+
+    static glm::vec3 punctualLightIntensity(const vks::PunctualLight& light, glm::vec3 l)
+    {
+        float spot = 1.0f;
+        if (light.cosOuterAngle > -1.0f) {
+            const float edge = std::max(light.cosInnerAngle, light.cosOuterAngle + 1e-4f);
+            const float t = glm::clamp((glm::dot(light.direction, -l) - light.cosOuterAngle) / (edge - light.cosOuterAngle), 0.0f, 1.0f);
+            spot = t * t * (3.0f - 2.0f * t);
+        }
+        return light.color * light.intensity * spot;
+    }
+
+    glm::vec3 directLighting(const ShadingPoint& point, glm::vec3 v) const
+    {
+        glm::vec3 radiance(0.0f);
+        for (const vks::PunctualLight& light : lights) {
+            const glm::vec3 lightvec = glm::vec3(light.position) - point.position;
+            if (glm::dot(point.worldNormal, lightvec) < 0.0f || !visible(point.position, lightvec)) {
+                continue;
+            }
+            const float distance2 = glm::dot(lightvec, lightvec);
+            const glm::vec3 l = glm::normalize(lightvec);
+            const float NdotL = std::max(glm::dot(point.worldNormal, l), 0.0f);
+            radiance += punctualLightIntensity(light, l) * NdotL / distance2 * diffuse(point, v, lightvec);
+        }
+        return radiance;
+    }
+
+    // Cosine weighted direction around n, see orthonormal_basis and generate_hemisphere in the shaders
+    static glm::vec3 sampleHemisphere(const glm::mat3& basis, Random& random, float& pdf)
+    {
+        const float a = 2.0f * PI * random.next();
+        const float cosb = std::sqrt(random.next());
+        const float sinb = std::sqrt(1.0f - cosb * cosb);
+        pdf = cosb / PI;
+        return glm::normalize(basis * glm::vec3(std::cos(a) * sinb, std::sin(a) * sinb, cosb));
+    }
+
+    static glm::mat3 orthonormalBasis(glm::vec3 n)
+    {
+        const float s = n.z >= 0.0f ? 1.0f : -1.0f;
+        const float a = -1.0f / (s + n.z);
+        const float b = n.x * n.y * a;
+        return glm::mat3(glm::vec3(1.0f + s * n.x * n.x * a, s * b, -s * n.x), glm::vec3(b, s + n.y * n.y * a, -n.y), n);
+    }
+
+    template<uint32_t Bands>
+    static void projectSamples(vks::sh::Probe<Bands>& probe, const glm::vec3&, const std::vector<glm::vec3>& directions, const std::vector<glm::vec3>& values)
+    {
+        vks::sh::projectBatch(probe, directions.data(), values.data(), directions.size());
+    }
+
+    // Projected in the tangent frame of the packed normal like in raygen.rgen, so readers rebuild the same frame
+    template<uint32_t Count>
+    static void projectSamples(vks::sh::HProbe<Count>& probe, const glm::vec3& normal, const std::vector<glm::vec3>& directions, const std::vector<glm::vec3>& values)
+    {
+        probe.normal = vks::sh::packNormal(normal);
+        for (size_t i = 0; i < directions.size(); i++) {
+            vks::sh::project(probe, directions[i], values[i]);
+        }
+    }
+
+    // Ray through the center of pixel (x, y) of a width x height image, like at the start of raygen.rgen
+    static void cameraRay(uint32_t x, uint32_t y, uint32_t width, uint32_t height, const glm::mat4& viewInverse, const glm::mat4& projInverse, glm::vec3& origin, glm::vec3& direction)
+    {
+        const glm::vec2 inUV = (glm::vec2(x, y) + 0.5f) / glm::vec2(width, height);
+        const glm::vec2 d = inUV * 2.0f - 1.0f;
+        origin = glm::vec3(viewInverse * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
+        const glm::vec4 target = projInverse * glm::vec4(d.x, d.y, 1.0f, 1.0f);
+        direction = glm::vec3(viewInverse * glm::vec4(glm::normalize(glm::vec3(target)), 0.0f));
+    }
+
+    // raygen.rgen in probe tracing mode: the primary hit is traced once and every sample is a path leaving it
+    // variance is the variance of the probe's DC luminance, estimated from the spread of its samples
+    SHProbe bakeProbe(uint32_t x, uint32_t y, const glm::mat4& viewInverse, const glm::mat4& projInverse, ProbeGBuffer& gbuffer, float& variance) const
+    {
+        SHProbe sh {};
+        gbuffer = {};
+        variance = 0.0f;
+        glm::vec3 cameraOrigin, cameraDirection;
+        cameraRay(x, y, width, height, viewInverse, projInverse, cameraOrigin, cameraDirection);
+        const float tmin = 0.001f;
+        const float tmax = 10000.0f;
+
+        vks::BVH::Hit hit;
+        if (!trace(cameraOrigin, cameraDirection, tmin, tmax, hit)) {
+            return sh;
+        }
+        const ShadingPoint probe = shade(cameraOrigin, cameraDirection, hit);
+        gbuffer = { glm::distance(cameraOrigin, probe.position), vks::sh::packNormal(probe.faceNormal) };
+        const glm::mat3 probeBasis = orthonormalBasis(probe.faceNormal);
+
+        // The samples are projected together once the paths are done
+        std::vector<glm::vec3> sampleDirections(sampleCount);
+        std::vector<glm::vec3> sampleValues(sampleCount, glm::vec3(0.0f));
+        for (uint32_t i = 0; i < sampleCount; i++) {
+            Random random(y * width + x, i);
+            float samplePdf;
+            const glm::vec3 sampleDirection = sampleHemisphere(probeBasis, random, samplePdf);
+            glm::vec3 origin = probe.position;
+            glm::vec3 direction = sampleDirection;
+            glm::vec3 radiance(0.0f);
+            glm::vec3 throughput(1.0f);
+            for (uint32_t depth = 1; depth < RECURSIVE_DEPTH; depth++) {
+                if (!trace(origin, direction, tmin, tmax, hit)) {
+                    break;
+                }
+                const ShadingPoint point = shade(origin, direction, hit);
+                const glm::vec3 v = -direction;
+                // Emission is only found by BSDF sampling here, the GPU path adds light sampling and weights both with MIS
+                radiance += throughput * (directLighting(point, v) + point.emission);
+                float pdf;
+                const glm::vec3 sample = sampleHemisphere(point.TBN, random, pdf);
+                const float cosine = std::max(0.0f, glm::dot(point.worldNormal, sample));
+                throughput *= diffuse(point, v, sample) * cosine / pdf;
+                if (cosine == 0.0f) {
+                    break;
+                }
+                // Russian roulette, see raygen.rgen
+                if (depth + 1 >= russianRouletteDepth) {
+                    const float survival = glm::clamp(std::max(throughput.r, std::max(throughput.g, throughput.b)), 0.05f, 1.0f);
+                    if (random.next() >= survival) {
+                        break;
+                    }
+                    throughput /= survival;
+                }
+                origin = point.position;
+                direction = sample;
+            }
+            sampleDirections[i] = sampleDirection;
+            sampleValues[i] = radiance / samplePdf;
+        }
+        projectSamples(sh, probe.faceNormal, sampleDirections, sampleValues);
+        for (glm::vec3& coefficient : sh) {
+            coefficient *= 1.0f / static_cast<float>(sampleCount);
+        }
+        // Every sample adds Y00 * value to the DC coefficient, the variance of their mean shrinks with the sample count
+        double sum = 0.0, squareSum = 0.0;
+        for (const glm::vec3& value : sampleValues) {
+            const double dc = 0.282095 * vks::sh::luminance(value);
+            sum += dc;
+            squareSum += dc * dc;
+        }
+        const double mean = sum / sampleCount;
+        variance = static_cast<float>(std::max(squareSum / sampleCount - mean * mean, 0.0) / sampleCount);
+        return sh;
+    }
+
+    // Every probe of the width x height grid seen through the camera matrices, progress goes to stderr when verbose
+    void bakeProbes(const glm::mat4& viewInverse, const glm::mat4& projInverse, std::vector<SHProbe>& sh, std::vector<ProbeGBuffer>& gbuffer, std::vector<float>& variances, bool verbose = true) const
+    {
+        sh.assign(static_cast<size_t>(width) * height, SHProbe {});
+        gbuffer.assign(sh.size(), ProbeGBuffer {});
+        variances.assign(sh.size(), 0.0f);
+        std::atomic<uint32_t> rowsDone { 0 };
+        // Rows differ a lot in cost (sky against geometry), single row tasks let idle threads steal the expensive ones
+        vks::TaskScheduler::shared().parallelFor(0, height, [&](uint32_t y) {
+            for (uint32_t x = 0; x < width; x++) {
+                const size_t index = static_cast<size_t>(y) * width + x;
+                sh[index] = bakeProbe(x, y, viewInverse, projInverse, gbuffer[index], variances[index]);
+            }
+            const uint32_t done = ++rowsDone;
+            if (verbose && (done % 16 == 0 || done == height)) {
+                std::cerr << "\rrows: " << done << "/" << height << std::flush;
+            }
+        }, 1);
+        if (verbose) {
+            std::cerr << std::endl;
+        }
+    }
+
+    void bake()
+    {
+        camera.flipY = true;
+        camera.type = Camera::CameraType::firstperson;
+        camera.setPerspective(60.0f, (float)width / (float)height, 0.1f, 512.0f);
+        camera.setRotation(ROTATION);
+        camera.setTranslation(POSITION);
+        const glm::mat4 viewInverse = glm::inverse(camera.matrices.view);
+        const glm::mat4 projInverse = glm::inverse(camera.matrices.perspective);
+
+        std::cout << "Baking " << width << "x" << height << " probes with " << sampleCount << " samples on " << vks::TaskScheduler::shared().getThreadCount() << " threads" << std::endl;
+        std::vector<SHProbe> sh;
+        std::vector<ProbeGBuffer> gbuffer;
+        std::vector<float> variances;
+        const auto start = std::chrono::high_resolution_clock::now();
+        bakeProbes(viewInverse, projInverse, sh, gbuffer, variances);
+        const auto end = std::chrono::high_resolution_clock::now();
+        std::cout << "Baked in " << std::chrono::duration<double>(end - start).count() << " s" << std::endl;
+        if (denoiseIterations > 0) {
+            denoise(sh, gbuffer, variances);
+        }
+        if (gatherSpacing > 0) {
+            gather(sh, gbuffer, viewInverse, projInverse);
+        }
+        saveSH(std::move(sh), gbuffer);
+    }
+
+    // The spatial part of the denoiser ssprobe runs before its export, there is no earlier bake to take history from
+    template<uint32_t Bands>
+    void denoise(std::vector<vks::sh::Probe<Bands>>& sh, const std::vector<ProbeGBuffer>& gbuffer, std::vector<float>& variances) const
+    {
+        vks::sh::DenoiseSettings settings;
+        settings.iterations = denoiseIterations;
+        const auto start = std::chrono::high_resolution_clock::now();
+        vks::sh::denoise(width, height, gbuffer.data(), sh.data(), variances.data(), settings);
+        const auto end = std::chrono::high_resolution_clock::now();
+        std::cout << "Denoised in " << std::chrono::duration<double, std::milli>(end - start).count() << " ms" << std::endl;
+    }
+
+    template<uint32_t Count>
+    void denoise(std::vector<vks::sh::HProbe<Count>>&, const std::vector<ProbeGBuffer>&, std::vector<float>&) const
+    {
+        std::cerr << "--denoise needs SH probes, set H_BASIS to 0" << std::endl;
+    }
+
+    /*
+        Gathers the probes to an image gatherSpacing times their resolution with the bilateral gather of probegather.hpp,
+        the way a renderer consumes them, reports its time per megapixel and writes the irradiance to irradiance.pfm
+    */
+    template<uint32_t Bands>
+    void gather(const std::vector<vks::sh::Probe<Bands>>& sh, const std::vector<ProbeGBuffer>& gbuffer, const glm::mat4& viewInverse, const glm::mat4& projInverse) const
+    {
+        const uint32_t gatherWidth = width * gatherSpacing;
+        const uint32_t gatherHeight = height * gatherSpacing;
+        std::vector<ProbeGBuffer> pixels(static_cast<size_t>(gatherWidth) * gatherHeight);
+        vks::TaskScheduler::shared().parallelFor(0, gatherHeight, [&](uint32_t y) {
+            for (uint32_t x = 0; x < gatherWidth; x++) {
+                glm::vec3 origin, direction;
+                cameraRay(x, y, gatherWidth, gatherHeight, viewInverse, projInverse, origin, direction);
+                vks::BVH::Hit hit;
+                ProbeGBuffer& pixel = pixels[static_cast<size_t>(y) * gatherWidth + x];
+                pixel = {};
+                if (trace(origin, direction, 0.001f, 10000.0f, hit)) {
+                    const ShadingPoint point = shade(origin, direction, hit);
+                    pixel = { glm::distance(origin, point.position), vks::sh::packNormal(point.faceNormal) };
+                }
+            }
+        }, 1);
+
+        const vks::sh::ProbeGrid<Bands> grid { width, height, gatherSpacing, sh.data(), gbuffer.data() };
+        std::vector<glm::vec3> irradiance(pixels.size());
+        const auto start = std::chrono::high_resolution_clock::now();
+        vks::sh::gatherIrradiance(grid, pixels.data(), gatherWidth, gatherHeight, irradiance.data());
+        const auto end = std::chrono::high_resolution_clock::now();
+        const double milliseconds = std::chrono::duration<double, std::milli>(end - start).count();
+        std::cout << "Gathered " << gatherWidth << "x" << gatherHeight << " pixels in " << milliseconds << " ms, "
+            << milliseconds / (pixels.size() * 1e-6) << " ms per megapixel" << std::endl;
+
+        // PFM stores the rows bottom to top
+        std::ofstream file("irradiance.pfm", std::ios::binary);
+        file << "PF\n" << gatherWidth << " " << gatherHeight << "\n-1.0\n";
+        for (uint32_t y = gatherHeight; y-- > 0;) {
+            file.write(reinterpret_cast<const char*>(&irradiance[static_cast<size_t>(y) * gatherWidth]), gatherWidth * sizeof(glm::vec3));
+        }
+        std::cout << "Irradiance saved to irradiance.pfm" << std::endl;
+    }
+
+    template<uint32_t Count>
+    void gather(const std::vector<vks::sh::HProbe<Count>>&, const std::vector<ProbeGBuffer>&, const glm::mat4&, const glm::mat4&) const
+    {
+        std::cerr << "--gather needs SH probes, set H_BASIS to 0" << std::endl;
+    }
+
+    // Same format as saveSH in ssprobe, the probes are converted in place
+    void saveSH(std::vector<SHProbe> sh, const std::vector<ProbeGBuffer>& gbuffer)
+    {
+        // Valid probes are packed in scanline order like in the SH buffer of ssprobe, so rows are contiguous
+        std::vector<uint32_t> rowSlots(height + 1, 0);
+        uint32_t probeCount = 0;
+        for (uint32_t y = 0; y < height; y++)
+        {
+            rowSlots[y] = probeCount;
+            for (uint32_t x = 0; x < width; x++)
+            {
+                const size_t index = static_cast<size_t>(y) * width + x;
+                if (gbuffer[index].depth > 0.0f)
+                {
+                    sh[probeCount++] = sh[index];
+                }
+            }
+        }
+        rowSlots[height] = probeCount;
+        std::cerr << "Saving SH coefficients...";
+        using namespace nlohmann;
+        auto toString = [](const float in)
+        {
+            std::stringstream ss;
+            ss << std::setprecision(5) << in;
+            return ss.str();
+        };
+        auto writeCoefficients = [&](json& probe, const char* key, const auto& coefficients)
+        {
+            for (const glm::vec3& coefficient : coefficients)
+            {
+                probe[key].push_back({ toString(coefficient.x), toString(coefficient.y), toString(coefficient.z) });
+            }
+        };
+        // Probes whose camera ray missed the scene are left out, the others carry the depth "d" and packed normal "n" of the hit
+        auto writeProbe = [&](uint32_t x, uint32_t y)
+        {
+            const ProbeGBuffer& hit = gbuffer[y*width+x];
+            json probe;
+            probe["x"] =x;
+            probe["y"] =y;
+            probe["d"] = toString(hit.depth);
+            probe["n"] = hit.normal;
+            return probe;
+        };
+        // Rows are converted to the export payload with the batch kernels of sphericalharmonics.hpp
+        auto writeRow = [&](json& row, auto* probes, uint32_t y)
+        {
+            std::vector<uint32_t> columns;
+            for (uint32_t x = 0; x < width; x++)
+            {
+                if (gbuffer[y*width+x].depth > 0.0f)
+                {
+                    columns.push_back(x);
+                }
+            }
+            const uint32_t count = static_cast<uint32_t>(columns.size());
+            if constexpr (requires { probes->normal; })
+            {
+                // H-basis probes are evaluated around "n"
+                for (uint32_t i = 0; i < count; i++)
+                {
+                    json probe = writeProbe(columns[i], y);
+                    writeCoefficients(probe, "v", probes[i]);
+                    row.push_back(std::move(probe));
+                }
+            }
+            else
+            {
+                std::vector<vks::sh::AmbientCube> cubes;
+                if (exportType == 1)
+                {
+                    vks::sh::convolveCosineBatch(probes, count);
+                }
+                else if (exportType == 2)
+                {
+                    cubes.resize(count);
+                    vks::sh::ambientCubeBatch(probes, cubes.data(), count);
+                }
+                for (uint32_t i = 0; i < count; i++)
+                {
+                    json probe = writeProbe(columns[i], y);
+                    if (exportType == 2)
+                    {
+                        writeCoefficients(probe, "c", cubes[i]);
+                    }
+                    else
+                    {
+                        writeCoefficients(probe, exportType == 1 ? "e" : "v", probes[i]);
+                    }
+                    row.push_back(std::move(probe));
+                }
+            }
+        };
+        std::vector<json> rows(height);
+        vks::TaskScheduler::shared().parallelFor(0, height, [&](uint32_t y)
+        {
+            writeRow(rows[y], sh.data() + rowSlots[y], y);
+        });
+        json j = json::array();
+        for (json& row : rows)
+        {
+            for (json& probe : row)
+            {
+                j.push_back(std::move(probe));
+            }
+        }
+        std::ofstream o(outputFile);
+        o <<  j << std::endl;
+        std::cerr<<"\rData saved to "<<outputFile<<std::endl;
+    }
+};
@@ -1,14 +1,29 @@
 #include "VulkanRaytracingSample.h"
 #define VK_GLTF_MATERIAL_IDS
 #include "VulkanglTFModel.h"
+#include "lighttree.hpp"
 #include <random>
 #define ENABLE_VALIDATION true
 
 constexpr uint32_t WIDTH = 1280;
 constexpr uint32_t HEIGHT = 720;
-// it is recommended not less than 8 and should not be greater than 'stack_size' in glsl/pathtracing/raygen.rgen. 'stack_size' can be set freely.
+// maximum path length, it is recommended not less than 8
 // the smaller the value, the faster the ray tracing speed
 constexpr uint32_t RECURSIVE_DEPTH = 10;
+// paths are terminated randomly based on their throughput after this many bounces (Russian roulette)
+// set it to RECURSIVE_DEPTH to always trace full paths
+constexpr uint32_t RUSSIAN_ROULETTE_DEPTH = 3;
+// sample generator: 0 LCG, 1 Owen scrambled Sobol, 2 rank-1 lattice, 3 tiled blue noise (see shaders/glsl/*/sampler.glsl)
+// the low discrepancy ones converge faster than the LCG, override it with --sampler lcg|sobol|lattice|bluenoise
+constexpr uint32_t SAMPLER = 1;
+// world space hash grid caching the indirect light of path vertices, paths end early at cells holding enough samples
+// (see shaders/glsl/*/radiancecache.glsl), the cell size is in world units and the cell count must be a power of two
+constexpr bool RADIANCE_CACHE = true;
+constexpr float RADIANCE_CACHE_CELL_SIZE = 0.25f;
+constexpr uint32_t RADIANCE_CACHE_CELL_COUNT = 1 << 20;
+constexpr uint32_t RADIANCE_CACHE_MIN_SAMPLES = 64;
+// fraction of the paths written back to the cache
+constexpr float RADIANCE_CACHE_UPDATE_RATE = 0.25f;
 constexpr bool ENABLE_DIRECT_LIGHTING = true;
 // Stratified sampling
 // divide one pixel into SAMPLE_DIMENSION*SAMPLE_DEMENTION subpixels
@@ -24,37 +39,82 @@ constexpr uint32_t OUTPUT_INTERVAL = 2500;
 // more camera parameters could be set in VulkanExample(): VulkanRaytracingSample(ENABLE_VALIDATION)
 constexpr glm::vec3 POSITION = glm::vec3(-0.5f, 5.0f, 3.5f);
 constexpr glm::vec3 ROTATION = glm::vec3(-15.0f, 120.0f, 0.0f);
-// light information should not be greater than 'maxLights' in glsl/pathtracing/closesthit.rchit. 'maxLights' can be set freely.
+// point and spot lights (position, color, intensity, spot direction, cosine of the outer and inner spot angle)
+// every shading point picks one of them from a light tree, so the cost only grows logarithmically with their count
 constexpr uint32_t LIGHT_COUNT = 1;
-struct Light {
-    glm::vec4 position;
-    glm::vec3 color;
-    float intensity;
+const vks::PunctualLight LIGHTS[LIGHT_COUNT] {
+    vks::PunctualLight { { 2., 8., 1., 1. }, glm::vec3(1), 50. },
 };
 
 struct LightBlock {
-    Light lights[LIGHT_COUNT] {
-        Light { { 2., 8., 1., 1. }, glm::vec3(1), 50. },
-    };
+    // Emissive triangles sampled with next event estimation, see createEmissiveLightTable
+    uint64_t emissiveTriangles { 0 };
+    uint32_t emissiveTriangleCount { 0 };
+    float emissivePower { 0.0f };
+    // LIGHTS and the light tree built over them, see createLightBuffer
+    uint64_t lights { 0 };
+    uint64_t lightTree { 0 };
 } lightBlock;
 
 class VulkanExample : public VulkanRaytracingSample {
 public:
-    AccelerationStructure bottomLevelAS {};
+    // One bottom level acceleration structure per unique glTF mesh, see createBottomLevelAccelerationStructure
+    struct BottomLevelAS {
+        AccelerationStructure accelerationStructure;
+        // Index of the mesh's first entry in the geometry node buffer
+        uint32_t firstGeometryNode;
+        uint32_t geometryNodeCount;
+        // Skinned meshes are refitted as they animate, see updateSceneAnimation
+        int32_t deformedMesh = -1;
+        AccelerationStructureBuildInput updateInput {};
+        uint32_t refitCount = 0;
+        float builtSurfaceArea = 0.0f;
+    };
+    std::vector<BottomLevelAS> bottomLevelASes {};
+    struct BottomLevelInstance {
+        vkglTF::Node* node;
+        uint32_t bottomLevelAS;
+    };
+    std::vector<BottomLevelInstance> bottomLevelInstances {};
+    // Kept mapped for animated models, the top level is then updated from the node matrices
+    vks::Buffer instancesBuffer;
+    std::vector<glm::mat4> instanceTransforms {};
+    AccelerationStructureBuildInput topLevelBuildInput {};
+    uint32_t topLevelRefitCount = 0;
+
+    // Plays the first animation of the glTF model
+    bool animate = true;
+    float animationTime = 0.0f;
+    // Refits degrade the acceleration structure quality, so they are replaced by a full build after this many updates
+    // or once a deformed mesh's bounds grew past this surface area ratio
+    static constexpr uint32_t maxRefitCount = 32;
+    static constexpr float maxRefitSurfaceAreaRatio = 1.5f;
+    // Moving objects covering less than this angle (in radians) from the camera don't restart accumulation
+    static constexpr float accumulationResetAngle = 0.05f;
+    // Hit records per geometry node, primary rays use SBT offset 0 and shadow rays offset 1
+    static constexpr uint32_t hitRecordStride = 2;
     AccelerationStructure topLevelAS {};
 
     vks::Buffer vertexBuffer;
     vks::Buffer indexBuffer;
     uint32_t indexCount;
-    vks::Buffer transformBuffer;
 
     struct GeometryNode {
         uint64_t vertexBufferDeviceAddress;
         uint64_t indexBufferDeviceAddress;
         int32_t textureIndexBaseColor;
         int32_t textureIndexNormal;
+        int32_t textureIndexEmissive;
+        float emissiveFactor[3];
     };
     vks::Buffer geometryNodesBuffer;
+    std::vector<const vkglTF::Primitive*> geometryNodePrimitives {};
+    vks::Buffer emissiveTrianglesBuffer;
+    // Geometries whose material needs alpha testing use the hit groups with the any hit shader, all others are
+    // flagged opaque so traversal never invokes it, see createShaderBindingTables
+    std::vector<bool> geometryNodeAlphaTested {};
+    // Disabled with --alpha-test-all to compare traversal times against alpha testing every geometry in benchmark mode
+    bool classifyOpaqueGeometry = true;
 
     std::vector<VkRayTracingShaderGroupCreateInfoKHR> shaderGroups {};
     struct ShaderBindingTables {
@@ -74,9 +134,27 @@ public:
         uint32_t sampleDimension { SAMPLE_DIMENSION };
         uint32_t lightCount { LIGHT_COUNT };
         uint32_t enableDirectLighting { ENABLE_DIRECT_LIGHTING };
+        uint32_t russianRouletteDepth { RUSSIAN_ROULETTE_DEPTH };
+        uint32_t samplerType { SAMPLER };
+        uint64_t blueNoise { 0 };
+        uint64_t radianceCache { 0 };
+        uint32_t radianceCacheSize { RADIANCE_CACHE_CELL_COUNT };
+        float radianceCacheCellSize { RADIANCE_CACHE_CELL_SIZE };
+        uint32_t radianceCacheMinSamples { RADIANCE_CACHE_MIN_SAMPLES };
+        float radianceCacheUpdateRate { RADIANCE_CACHE_UPDATE_RATE };
     } uniformData;
     vks::Buffer ubo;
     vks::Buffer light;
+    vks::Buffer lightsBuffer;
+    vks::Buffer lightTreeBuffer;
+    // Only created for the blue noise sampler
+    vks::Buffer blueNoiseBuffer;
+    static constexpr uint32_t blueNoiseSize = 64;
+    static constexpr const char* samplerNames[] = { "lcg", "sobol", "lattice", "bluenoise" };
+    // Cleared whenever the scene changes, see cmdResetRadianceCache
+    vks::Buffer radianceCacheBuffer;
+    // Size of RadianceCacheCell in radiancecache.glsl
+    static constexpr VkDeviceSize radianceCacheCellSize = 5 * sizeof(uint32_t);
 
     VkPipeline pipeline;
     VkPipelineLayout pipelineLayout;
@@ -88,6 +166,8 @@ public:
     VkPhysicalDeviceDescriptorIndexingFeaturesEXT
         physicalDeviceDescriptorIndexingFeatures {};
 
+    vkglTF::Model::ImageResidency imageResidency { vkglTF::Model::ImageResidency::Placeholder };
+
     std::random_device r;
     std::default_random_engine e;
 
@@ -107,6 +187,20 @@ public:
         camera.setRotation(ROTATION);
         camera.setTranslation(POSITION);
 
+        for (size_t i = 0; i < args.size(); i++) {
+            if (strcmp(args[i], "--alpha-test-all") == 0) {
+                classifyOpaqueGeometry = false;
+            }
+            if (strcmp(args[i], "--sampler") == 0 && i + 1 < args.size()) {
+                const char* name = args[++i];
+                for (uint32_t type = 0; type < std::size(samplerNames); type++) {
+                    if (strcmp(name, samplerNames[type]) == 0) {
+                        uniformData.samplerType = type;
+                    }
+                }
+            }
+        }
+
         enableExtensions();
 
         // Buffer device address requires the 64-bit integer feature to be enabled
@@ -122,108 +216,126 @@ public:
         vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
         vkDestroyDescriptorSetLayout(device, descriptorSetLayout, nullptr);
         deleteStorageImage();
-        deleteAccelerationStructure(bottomLevelAS);
+        for (auto& bottomLevelAS : bottomLevelASes) {
+            deleteAccelerationStructure(bottomLevelAS.accelerationStructure);
+        }
+        instancesBuffer.destroy();
         deleteAccelerationStructure(topLevelAS);
         vertexBuffer.destroy();
         indexBuffer.destroy();
-        transformBuffer.destroy();
         shaderBindingTables.raygen.destroy();
         shaderBindingTables.miss.destroy();
         shaderBindingTables.hit.destroy();
         ubo.destroy();
         light.destroy();
+        lightsBuffer.destroy();
+        lightTreeBuffer.destroy();
+        blueNoiseBuffer.destroy();
+        radianceCacheBuffer.destroy();
         geometryNodesBuffer.destroy();
+        emissiveTrianglesBuffer.destroy();
         // Clean up resources
-        vkFreeMemory(device, copyImage.memory, nullptr);
         vkDestroyImage(device, copyImage.image, nullptr);
+        vulkanDevice->allocator->free(copyImage.allocation);
     }
 
     /*
-                    Create the bottom level acceleration structure that contains the
+                    Create the bottom level acceleration structures that contain the
        scene's actual geometry (vertices, triangles)
+                    There is one per unique glTF mesh in object space, nodes instancing
+       the same mesh share its acceleration structure
     */
     void createBottomLevelAccelerationStructure()
     {
-        // Use transform matrices from the glTF nodes
-        std::vector<VkTransformMatrixKHR> transformMatrices {};
-        for (auto node : model.linearNodes) {
-            if (node->mesh) {
-                for (auto primitive : node->mesh->primitives) {
-                    if (primitive->indexCount > 0) {
-                        VkTransformMatrixKHR transformMatrix {};
-                        auto m = glm::mat3x4(glm::transpose(node->getMatrix()));
-                        memcpy(&transformMatrix, (void*)&m, sizeof(glm::mat3x4));
-                        transformMatrices.push_back(transformMatrix);
-                    }
-                }
-            }
+        struct BottomLevelBuild {
+            std::vector<VkAccelerationStructureGeometryKHR> geometries;
+            std::vector<VkAccelerationStructureBuildRangeInfoKHR> buildRangeInfos;
+            std::vector<uint32_t> maxPrimitiveCounts;
+            uint32_t firstIndex;
+        };
+        std::vector<BottomLevelBuild> builds {};
+        std::vector<GeometryNode> geometryNodes {};
+        std::unordered_map<const vkglTF::Node*, int32_t> deformedMeshes {};
+        for (size_t i = 0; i < model.deformedMeshes.size(); i++) {
+            deformedMeshes[model.deformedMeshes[i].node] = static_cast<int32_t>(i);
         }
+        // Skinned meshes start in the pose of their animation rather than the bind pose
+        if (!model.deformedMeshes.empty()) {
+            VkCommandBuffer commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+            model.updateDeformedMeshes(commandBuffer);
+            vulkanDevice->flushCommandBuffer(commandBuffer, queue);
+        }
+        // Nodes sharing mesh data reference the same index range, so the first index identifies the mesh
+        std::unordered_map<uint32_t, uint32_t> meshBottomLevelAS {};
 
-        // Transform buffer
-        VK_CHECK_RESULT(vulkanDevice->createBuffer(
-            VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR,
-            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-            &transformBuffer,
-            static_cast<uint32_t>(transformMatrices.size()) * sizeof(VkTransformMatrixKHR),
-            transformMatrices.data()));
-
-        // Build
-        // One geometry per glTF node, so we can index materials using
-        // gl_GeometryIndexEXT
-        std::vector<uint32_t> maxPrimitiveCounts {};
-        std::vector<VkAccelerationStructureGeometryKHR> geometries {};
-        std::vector<VkAccelerationStructureBuildRangeInfoKHR> buildRangeInfos {};
-        std::vector<VkAccelerationStructureBuildRangeInfoKHR*> pBuildRangeInfos {};
-        std::vector<GeometryNode> geometryNodes {};
+        // One geometry per glTF primitive, so we can index materials using
+        // gl_InstanceCustomIndexEXT + gl_GeometryIndexEXT
         for (auto node : model.linearNodes) {
-            if (node->mesh) {
-                for (auto primitive : node->mesh->primitives) {
-                    if (primitive->indexCount > 0 && primitive->material.baseColorTexture && primitive->material.normalTexture) {
-                        VkDeviceOrHostAddressConstKHR vertexBufferDeviceAddress {};
-                        VkDeviceOrHostAddressConstKHR indexBufferDeviceAddress {};
-                        VkDeviceOrHostAddressConstKHR transformBufferDeviceAddress {};
-
-                        vertexBufferDeviceAddress.deviceAddress = getBufferDeviceAddress(
-                            model.vertices.buffer); // +primitive->firstVertex *
-                        // sizeof(vkglTF::Vertex);
-                        indexBufferDeviceAddress.deviceAddress = getBufferDeviceAddress(model.indices.buffer) + primitive->firstIndex * sizeof(uint32_t);
-                        transformBufferDeviceAddress.deviceAddress = getBufferDeviceAddress(transformBuffer.buffer) + static_cast<uint32_t>(geometryNodes.size()) * sizeof(VkTransformMatrixKHR);
-
-                        VkAccelerationStructureGeometryKHR geometry {};
-                        geometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
-                        geometry.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR;
-                        geometry.geometry.triangles.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR;
-                        geometry.geometry.triangles.vertexFormat = VK_FORMAT_R32G32B32_SFLOAT;
-                        geometry.geometry.triangles.vertexData = vertexBufferDeviceAddress;
-                        geometry.geometry.triangles.maxVertex = model.vertices.count;
-                        // geometry.geometry.triangles.maxVertex = primitive->vertexCount;
-                        geometry.geometry.triangles.vertexStride = sizeof(vkglTF::Vertex);
-                        geometry.geometry.triangles.indexType = VK_INDEX_TYPE_UINT32;
-                        geometry.geometry.triangles.indexData = indexBufferDeviceAddress;
-                        geometry.geometry.triangles.transformData = transformBufferDeviceAddress;
-                        geometries.push_back(geometry);
-                        maxPrimitiveCounts.push_back(primitive->indexCount / 3);
-
-                        VkAccelerationStructureBuildRangeInfoKHR buildRangeInfo {};
-                        buildRangeInfo.firstVertex = 0;
-                        buildRangeInfo.primitiveOffset = 0; // primitive->firstIndex * sizeof(uint32_t);
-                        buildRangeInfo.primitiveCount = primitive->indexCount / 3;
-                        buildRangeInfo.transformOffset = 0;
-                        buildRangeInfos.push_back(buildRangeInfo);
-
-                        GeometryNode geometryNode {};
-                        geometryNode.vertexBufferDeviceAddress = vertexBufferDeviceAddress.deviceAddress;
-                        geometryNode.indexBufferDeviceAddress = indexBufferDeviceAddress.deviceAddress;
-                        geometryNode.textureIndexBaseColor = primitive->material.baseColorTexture->index;
-                        geometryNode.textureIndexNormal = primitive->material.normalTexture->index;
-                        // @todo: map material id to global texture array
-                        geometryNodes.push_back(geometryNode);
-                    }
+            if (!node->mesh || node->mesh->primitives.empty()) {
+                continue;
+            }
+            const uint32_t meshFirstIndex = node->mesh->primitives.front()->firstIndex;
+            const auto sharedAS = meshBottomLevelAS.find(meshFirstIndex);
+            if (sharedAS != meshBottomLevelAS.end()) {
+                bottomLevelInstances.push_back({ node, sharedAS->second });
+                continue;
+            }
+
+            BottomLevelBuild build {};
+            build.firstIndex = meshFirstIndex;
+            const uint32_t firstGeometryNode = static_cast<uint32_t>(geometryNodes.size());
+            for (auto primitive : node->mesh->primitives) {
+                if (primitive->indexCount > 0 && primitive->material.baseColorTexture && primitive->material.normalTexture) {
+                    VkDeviceOrHostAddressConstKHR vertexBufferDeviceAddress {};
+                    VkDeviceOrHostAddressConstKHR indexBufferDeviceAddress {};
+
+                    vertexBufferDeviceAddress.deviceAddress = getBufferDeviceAddress(model.vertices.buffer);
+                    indexBufferDeviceAddress.deviceAddress = getBufferDeviceAddress(model.indices.buffer) + primitive->firstIndex * sizeof(uint32_t);
+
+                    VkAccelerationStructureGeometryKHR geometry {};
+                    geometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
+                    geometry.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR;
+                    geometry.geometry.triangles.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR;
+                    geometry.geometry.triangles.vertexFormat = VK_FORMAT_R32G32B32_SFLOAT;
+                    geometry.geometry.triangles.vertexData = vertexBufferDeviceAddress;
+                    geometry.geometry.triangles.maxVertex = model.vertices.count;
+                    geometry.geometry.triangles.vertexStride = model.vertices.stride;
+                    geometry.geometry.triangles.indexType = VK_INDEX_TYPE_UINT32;
+                    geometry.geometry.triangles.indexData = indexBufferDeviceAddress;
+                    // Opaque geometries skip the any hit shader, the others only need it once per primitive
+                    const bool alphaTested = !classifyOpaqueGeometry || primitive->material.alphaMode != vkglTF::Material::ALPHAMODE_OPAQUE;
+                    geometry.flags = alphaTested ? VK_GEOMETRY_NO_DUPLICATE_ANY_HIT_INVOCATION_BIT_KHR : VK_GEOMETRY_OPAQUE_BIT_KHR;
+                    build.geometries.push_back(geometry);
+                    build.maxPrimitiveCounts.push_back(primitive->indexCount / 3);
+
+                    VkAccelerationStructureBuildRangeInfoKHR buildRangeInfo {};
+                    buildRangeInfo.firstVertex = 0;
+                    buildRangeInfo.primitiveOffset = 0;
+                    buildRangeInfo.primitiveCount = primitive->indexCount / 3;
+                    buildRangeInfo.transformOffset = 0;
+                    build.buildRangeInfos.push_back(buildRangeInfo);
+
+                    GeometryNode geometryNode {};
+                    geometryNode.vertexBufferDeviceAddress = vertexBufferDeviceAddress.deviceAddress;
+                    geometryNode.indexBufferDeviceAddress = indexBufferDeviceAddress.deviceAddress;
+                    geometryNode.textureIndexBaseColor = primitive->material.baseColorTexture->index;
+                    geometryNode.textureIndexNormal = primitive->material.normalTexture->index;
+                    geometryNode.textureIndexEmissive = primitive->material.emissiveTexture ? static_cast<int32_t>(primitive->material.emissiveTexture->index) : -1;
+                    memcpy(geometryNode.emissiveFactor, &primitive->material.emissiveFactor, sizeof(geometryNode.emissiveFactor));
+                    geometryNodes.push_back(geometryNode);
+                    geometryNodeAlphaTested.push_back(alphaTested);
+                    geometryNodePrimitives.push_back(primitive);
                 }
             }
-        }
-        for (auto& rangeInfo : buildRangeInfos) {
-            pBuildRangeInfos.push_back(&rangeInfo);
+            if (build.geometries.empty()) {
+                continue;
+            }
+            const uint32_t bottomLevelIndex = static_cast<uint32_t>(bottomLevelASes.size());
+            meshBottomLevelAS[meshFirstIndex] = bottomLevelIndex;
+            const auto deformedMesh = deformedMeshes.find(node);
+            bottomLevelASes.push_back({ {}, firstGeometryNode, static_cast<uint32_t>(build.geometries.size()), deformedMesh != deformedMeshes.end() ? deformedMesh->second : -1 });
+            bottomLevelInstances.push_back({ node, bottomLevelIndex });
+            builds.push_back(std::move(build));
         }
 
         // @todo: stage to device
@@ -234,96 +346,84 @@ public:
             static_cast<uint32_t>(geometryNodes.size()) * sizeof(GeometryNode),
             geometryNodes.data()));
 
-        // Get size info
-        VkAccelerationStructureBuildGeometryInfoKHR
-            accelerationStructureBuildGeometryInfo {};
-        accelerationStructureBuildGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
-        accelerationStructureBuildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-        accelerationStructureBuildGeometryInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
-        accelerationStructureBuildGeometryInfo.geometryCount = static_cast<uint32_t>(geometries.size());
-        accelerationStructureBuildGeometryInfo.pGeometries = geometries.data();
-
-        VkAccelerationStructureBuildSizesInfoKHR
-            accelerationStructureBuildSizesInfo {};
-        accelerationStructureBuildSizesInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
-        vkGetAccelerationStructureBuildSizesKHR(
-            device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
-            &accelerationStructureBuildGeometryInfo, maxPrimitiveCounts.data(),
-            &accelerationStructureBuildSizesInfo);
-
-        createAccelerationStructure(bottomLevelAS, VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR, accelerationStructureBuildSizesInfo);
-
-        /* createAccelerationStructureBuffer(bottomLevelAS,
-                 accelerationStructureBuildSizesInfo);
-
-         VkAccelerationStructureCreateInfoKHR accelerationStructureCreateInfo {};
-         accelerationStructureCreateInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
-         accelerationStructureCreateInfo.buffer = bottomLevelAS.buffer;
-         accelerationStructureCreateInfo.size = accelerationStructureBuildSizesInfo.accelerationStructureSize;
-         accelerationStructureCreateInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-         vkCreateAccelerationStructureKHR(device, &accelerationStructureCreateInfo,
-                 nullptr, &bottomLevelAS.handle);
-
-         VkAccelerationStructureDeviceAddressInfoKHR accelerationDeviceAddressInfo {};
-         accelerationDeviceAddressInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR;
-         accelerationDeviceAddressInfo.accelerationStructure = bottomLevelAS.handle;
-         bottomLevelAS.deviceAddress = vkGetAccelerationStructureDeviceAddressKHR(
-                 device, &accelerationDeviceAddressInfo);*/
-
-        // Create a small scratch buffer used during build of the bottom level
-        // acceleration structure
-        ScratchBuffer scratchBuffer = createScratchBuffer(
-            accelerationStructureBuildSizesInfo.buildScratchSize);
-
-        accelerationStructureBuildGeometryInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
-        accelerationStructureBuildGeometryInfo.dstAccelerationStructure = bottomLevelAS.handle;
-        accelerationStructureBuildGeometryInfo.scratchData.deviceAddress = scratchBuffer.deviceAddress;
-
-        const VkAccelerationStructureBuildRangeInfoKHR* buildOffsetInfo = buildRangeInfos.data();
-
-        // Build the acceleration structure on the device via a one-time command
-        // buffer submission Some implementations may support acceleration structure
-        // building on the host
-        // (VkPhysicalDeviceAccelerationStructureFeaturesKHR->accelerationStructureHostCommands),
-        // but we prefer device builds
-        VkCommandBuffer commandBuffer = vulkanDevice->createCommandBuffer(
-            VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
-        vkCmdBuildAccelerationStructuresKHR(commandBuffer, 1,
-            &accelerationStructureBuildGeometryInfo,
-            pBuildRangeInfos.data());
-        vulkanDevice->flushCommandBuffer(commandBuffer, queue);
+        // Build all acceleration structures that couldn't be restored from the model cache with a single submission
+        // Static geometry is compacted, skinned meshes are built for refits
+        std::vector<AccelerationStructureBuildInput> buildInputs {};
+        std::vector<std::pair<uint32_t, uint64_t>> cacheEntries {};
+        for (uint32_t i = 0; i < builds.size(); i++) {
+            BottomLevelBuild& build = builds[i];
+            AccelerationStructure& bottomLevelAS = bottomLevelASes[i].accelerationStructure;
+
+            // Reuse acceleration structures stored next to the model cache while the model and the selected geometries are unchanged
+            const int32_t deformedMesh = bottomLevelASes[i].deformedMesh;
+            uint64_t cacheHash = 0;
+            if (!model.cacheFile.empty() && deformedMesh < 0) {
+                cacheHash = vks::tools::fnv1a(&build.firstIndex, sizeof(uint32_t), model.cacheHash);
+                cacheHash = vks::tools::fnv1a(build.maxPrimitiveCounts.data(), build.maxPrimitiveCounts.size() * sizeof(uint32_t), cacheHash);
+                for (const VkAccelerationStructureGeometryKHR& geometry : build.geometries) {
+                    cacheHash = vks::tools::fnv1a(&geometry.flags, sizeof(VkGeometryFlagsKHR), cacheHash);
+                }
+                if (loadAccelerationStructure(bottomLevelAS, getBottomLevelCacheFile(i), cacheHash)) {
+                    continue;
+                }
+                cacheEntries.push_back({ i, cacheHash });
+            }
+
+            AccelerationStructureBuildInput buildInput {};
+            buildInput.accelerationStructure = &bottomLevelAS;
+            buildInput.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+            buildInput.usage = deformedMesh < 0 ? AccelerationStructureUsage::Static : AccelerationStructureUsage::Updatable;
+            buildInput.geometries = std::move(build.geometries);
+            buildInput.buildRangeInfos = std::move(build.buildRangeInfos);
+            if (deformedMesh >= 0) {
+                bottomLevelASes[i].updateInput = buildInput;
+                bottomLevelASes[i].builtSurfaceArea = surfaceArea(model.deformedMeshes[deformedMesh].min, model.deformedMeshes[deformedMesh].max);
+            }
+            buildInputs.push_back(std::move(buildInput));
+        }
+        buildAccelerationStructures(buildInputs);
 
-        deleteScratchBuffer(scratchBuffer);
+        for (const auto& [index, cacheHash] : cacheEntries) {
+            saveAccelerationStructure(bottomLevelASes[index].accelerationStructure, getBottomLevelCacheFile(index), cacheHash);
+        }
+    }
+
+    std::string getBottomLevelCacheFile(uint32_t index) const
+    {
+        return model.cacheFile + "." + std::to_string(index) + ".blas";
     }
 
     /*
-                    The top level acceleration structure contains the scene's object
-       instances
+                    The top level acceleration structure contains one instance per glTF
+       node, placed with the node's transform
     */
     void createTopLevelAccelerationStructure()
     {
-        // We flip the matrix [1][1] = -1.0f to accomodate for the glTF up vector
-        VkTransformMatrixKHR transformMatrix = {
-            1.0f, 0.0f, 0.0f, 0.0f,
-            0.0f, -1.0f, 0.0f, 0.0f,
-            0.0f, 0.0f, 1.0f, 0.0f
-        };
-
-        VkAccelerationStructureInstanceKHR instance {};
-        instance.transform = transformMatrix;
-        instance.instanceCustomIndex = 0;
-        instance.mask = 0xFF;
-        instance.instanceShaderBindingTableRecordOffset = 0;
-        instance.flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR;
-        instance.accelerationStructureReference = bottomLevelAS.deviceAddress;
+        std::vector<VkAccelerationStructureInstanceKHR> instances {};
+        for (const BottomLevelInstance& bottomLevelInstance : bottomLevelInstances) {
+            const BottomLevelAS& bottomLevelAS = bottomLevelASes[bottomLevelInstance.bottomLevelAS];
+
+            instanceTransforms.push_back(getInstanceTransform(bottomLevelInstance.node));
+            const glm::mat3x4 transform = glm::mat3x4(glm::transpose(instanceTransforms.back()));
+
+            VkAccelerationStructureInstanceKHR instance {};
+            memcpy(&instance.transform, &transform, sizeof(VkTransformMatrixKHR));
+            // Shaders look up materials and vertex data with gl_InstanceCustomIndexEXT + gl_GeometryIndexEXT
+            instance.instanceCustomIndex = bottomLevelAS.firstGeometryNode;
+            instance.mask = 0xFF;
+            // Every geometry node has a primary and a shadow hit record, selected by the ray's SBT offset
+            instance.instanceShaderBindingTableRecordOffset = bottomLevelAS.firstGeometryNode * hitRecordStride;
+            instance.flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR;
+            instance.accelerationStructureReference = bottomLevelAS.accelerationStructure.deviceAddress;
+            instances.push_back(instance);
+        }
 
         // Buffer for instance data
-        vks::Buffer instancesBuffer;
         VK_CHECK_RESULT(vulkanDevice->createBuffer(
             VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR,
             VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-            &instancesBuffer, sizeof(VkAccelerationStructureInstanceKHR),
-            &instance));
+            &instancesBuffer, instances.size() * sizeof(VkAccelerationStructureInstanceKHR),
+            instances.data()));
 
         VkDeviceOrHostAddressConstKHR instanceDataDeviceAddress {};
         instanceDataDeviceAddress.deviceAddress = getBufferDeviceAddress(instancesBuffer.buffer);
@@ -336,89 +436,34 @@ public:
         accelerationStructureGeometry.geometry.instances.arrayOfPointers = VK_FALSE;
         accelerationStructureGeometry.geometry.instances.data = instanceDataDeviceAddress;
 
-        // Get size info
-        /*
-        The pSrcAccelerationStructure, dstAccelerationStructure, and mode members of
-        pBuildInfo are ignored. Any VkDeviceOrHostAddressKHR members of pBuildInfo
-        are ignored by this command, except that the hostAddress member of
-        VkAccelerationStructureGeometryTrianglesDataKHR::transformData will be
-        examined to check if it is NULL.*
-        */
-        VkAccelerationStructureBuildGeometryInfoKHR
-            accelerationStructureBuildGeometryInfo {};
-        accelerationStructureBuildGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
-        accelerationStructureBuildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
-        accelerationStructureBuildGeometryInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
-        accelerationStructureBuildGeometryInfo.geometryCount = 1;
-        accelerationStructureBuildGeometryInfo.pGeometries = &accelerationStructureGeometry;
-
-        uint32_t primitive_count = 1;
-
-        VkAccelerationStructureBuildSizesInfoKHR
-            accelerationStructureBuildSizesInfo {};
-        accelerationStructureBuildSizesInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
-        vkGetAccelerationStructureBuildSizesKHR(
-            device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
-            &accelerationStructureBuildGeometryInfo, &primitive_count,
-            &accelerationStructureBuildSizesInfo);
-
-        createAccelerationStructure(topLevelAS, VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR, accelerationStructureBuildSizesInfo);
-
-        // createAccelerationStructureBuffer(topLevelAS,
-        //     accelerationStructureBuildSizesInfo);
-
-        // VkAccelerationStructureCreateInfoKHR accelerationStructureCreateInfo {};
-        // accelerationStructureCreateInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
-        // accelerationStructureCreateInfo.buffer = topLevelAS.buffer;
-        // accelerationStructureCreateInfo.size = accelerationStructureBuildSizesInfo.accelerationStructureSize;
-        // accelerationStructureCreateInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
-        // vkCreateAccelerationStructureKHR(device, &accelerationStructureCreateInfo,
-        //     nullptr, &topLevelAS.handle);
-
-        // Create a small scratch buffer used during build of the top level
-        // acceleration structure
-        ScratchBuffer scratchBuffer = createScratchBuffer(
-            accelerationStructureBuildSizesInfo.buildScratchSize);
-
-        VkAccelerationStructureBuildGeometryInfoKHR accelerationBuildGeometryInfo {};
-        accelerationBuildGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
-        accelerationBuildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
-        accelerationBuildGeometryInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
-        accelerationBuildGeometryInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
-        accelerationBuildGeometryInfo.dstAccelerationStructure = topLevelAS.handle;
-        accelerationBuildGeometryInfo.geometryCount = 1;
-        accelerationBuildGeometryInfo.pGeometries = &accelerationStructureGeometry;
-        accelerationBuildGeometryInfo.scratchData.deviceAddress = scratchBuffer.deviceAddress;
-
         VkAccelerationStructureBuildRangeInfoKHR
             accelerationStructureBuildRangeInfo {};
-        accelerationStructureBuildRangeInfo.primitiveCount = 1;
+        accelerationStructureBuildRangeInfo.primitiveCount = static_cast<uint32_t>(instances.size());
         accelerationStructureBuildRangeInfo.primitiveOffset = 0;
         accelerationStructureBuildRangeInfo.firstVertex = 0;
         accelerationStructureBuildRangeInfo.transformOffset = 0;
-        std::vector<VkAccelerationStructureBuildRangeInfoKHR*>
-            accelerationBuildStructureRangeInfos = {
-                &accelerationStructureBuildRangeInfo
-            };
-
-        // Build the acceleration structure on the device via a one-time command
-        // buffer submission Some implementations may support acceleration structure
-        // building on the host
-        // (VkPhysicalDeviceAccelerationStructureFeaturesKHR->accelerationStructureHostCommands),
-        // but we prefer device builds
-        VkCommandBuffer commandBuffer = vulkanDevice->createCommandBuffer(
-            VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
-        vkCmdBuildAccelerationStructuresKHR(
-            commandBuffer, 1, &accelerationBuildGeometryInfo,
-            accelerationBuildStructureRangeInfos.data());
-        vulkanDevice->flushCommandBuffer(commandBuffer, queue);
 
-        // VkAccelerationStructureDeviceAddressInfoKHR accelerationDeviceAddressInfo {};
-        // accelerationDeviceAddressInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR;
-        // accelerationDeviceAddressInfo.accelerationStructure = topLevelAS.handle;
+        // Without animations instances don't move, so the top level is compacted like the bottom levels
+        const bool animated = !model.animations.empty();
+        topLevelBuildInput.accelerationStructure = &topLevelAS;
+        topLevelBuildInput.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+        topLevelBuildInput.usage = animated ? AccelerationStructureUsage::Updatable : AccelerationStructureUsage::Static;
+        topLevelBuildInput.geometries = { accelerationStructureGeometry };
+        topLevelBuildInput.buildRangeInfos = { accelerationStructureBuildRangeInfo };
+        std::vector<AccelerationStructureBuildInput> buildInputs = { topLevelBuildInput };
+        buildAccelerationStructures(buildInputs);
+
+        if (animated) {
+            VK_CHECK_RESULT(instancesBuffer.map());
+        } else {
+            instancesBuffer.destroy();
+        }
+    }
 
-        deleteScratchBuffer(scratchBuffer);
-        instancesBuffer.destroy();
+    glm::mat4 getInstanceTransform(const vkglTF::Node* node) const
+    {
+        // We flip the matrix [1][1] = -1.0f to accomodate for the glTF up vector
+        return glm::scale(glm::mat4(1.0f), glm::vec3(1.0f, -1.0f, 1.0f)) * const_cast<vkglTF::Node*>(node)->getMatrix();
     }
 
     /*
@@ -430,9 +475,10 @@ public:
                                     /-----------\
                                     | raygen    |
                                     |-----------|
-                                    | miss + shadow     |
+                                    | miss + shadow      |
                                     |-----------|
-                                    | hit + any |
+                                    | hit + shadow hit   | per geometry node, with or without any hit
+                                    |        ...         | depending on the material's alpha mode
                                     \-----------/
 
     */
@@ -451,7 +497,8 @@ public:
 
         createShaderBindingTable(shaderBindingTables.raygen, 1);
         createShaderBindingTable(shaderBindingTables.miss, 2);
-        createShaderBindingTable(shaderBindingTables.hit, 2);
+        const uint32_t hitRecordCount = static_cast<uint32_t>(geometryNodeAlphaTested.size()) * hitRecordStride;
+        createShaderBindingTable(shaderBindingTables.hit, hitRecordCount);
 
         // Copy handles
         memcpy(shaderBindingTables.raygen.mapped,
@@ -460,8 +507,15 @@ public:
         // shader binding table
         memcpy(shaderBindingTables.miss.mapped,
             shaderHandleStorage.data() + handleSizeAligned, handleSize * 2);
-        memcpy(shaderBindingTables.hit.mapped,
-            shaderHandleStorage.data() + handleSizeAligned * 3, handleSize * 2);
+        // Hit groups are ordered opaque primary, opaque shadow, alpha tested primary, alpha tested shadow
+        uint8_t* hitRecords = static_cast<uint8_t*>(shaderBindingTables.hit.mapped);
+        for (size_t i = 0; i < geometryNodeAlphaTested.size(); i++) {
+            const uint32_t firstGroup = geometryNodeAlphaTested[i] ? 5 : 3;
+            for (uint32_t j = 0; j < hitRecordStride; j++) {
+                memcpy(hitRecords + (i * hitRecordStride + j) * handleSizeAligned,
+                    shaderHandleStorage.data() + handleSizeAligned * (firstGroup + j), handleSize);
+            }
+        }
     }
 
     /*
@@ -516,12 +570,14 @@ public:
         setLayoutBindingFlags.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO_EXT;
         setLayoutBindingFlags.bindingCount = static_cast<uint32_t>(setLayoutBindings.size());
         std::vector<VkDescriptorBindingFlagsEXT> descriptorBindingFlags = {
-            0, 0, 0, 0, 0, VK_DESCRIPTOR_BINDING_VARIABLE_DESCRIPTOR_COUNT_BIT_EXT
+            0, 0, 0, 0, 0, VK_DESCRIPTOR_BINDING_VARIABLE_DESCRIPTOR_COUNT_BIT_EXT | VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT_EXT
         };
         setLayoutBindingFlags.pBindingFlags = descriptorBindingFlags.data();
 
         VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCI = vks::initializers::descriptorSetLayoutCreateInfo(setLayoutBindings);
         descriptorSetLayoutCI.pNext = &setLayoutBindingFlags;
+        // Model images are streamed in while the scene is already being traced
+        descriptorSetLayoutCI.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT_EXT;
         VK_CHECK_RESULT(vkCreateDescriptorSetLayout(device, &descriptorSetLayoutCI,
             nullptr, &descriptorSetLayout));
 
@@ -571,7 +627,9 @@ public:
             shaderGroups.push_back(shaderGroup);
         }
 
-        // Closest hit group for doing texture lookups
+        // Hit groups for opaque geometry, traversal never invokes an any hit shader for them
+        // Shadow rays terminate on the first hit and skip the closest hit shader, so their groups only need an any hit shader
+        // for alpha testing
         {
             shaderStages.push_back(
                 loadShader(getShadersPath() + "pathtracing/closesthit.rchit.spv",
@@ -581,30 +639,32 @@ public:
             shaderGroup.type = VK_RAY_TRACING_SHADER_GROUP_TYPE_TRIANGLES_HIT_GROUP_KHR;
             shaderGroup.generalShader = VK_SHADER_UNUSED_KHR;
             shaderGroup.closestHitShader = static_cast<uint32_t>(shaderStages.size()) - 1;
+            shaderGroup.anyHitShader = VK_SHADER_UNUSED_KHR;
             shaderGroup.intersectionShader = VK_SHADER_UNUSED_KHR;
-            // This group also uses an anyhit shader for doing transparency (see
-            // anyhit.rahit for details)
-            shaderStages.push_back(
-                loadShader(getShadersPath() + "pathtracing/anyhit.rahit.spv",
-                    VK_SHADER_STAGE_ANY_HIT_BIT_KHR));
-            shaderGroup.anyHitShader = static_cast<uint32_t>(shaderStages.size()) - 1;
+            shaderGroups.push_back(shaderGroup);
+            shaderGroup.closestHitShader = VK_SHADER_UNUSED_KHR;
             shaderGroups.push_back(shaderGroup);
         }
 
-        // Closet hit group for check visibility from light
+        // Hit groups for alpha masked and blended geometry, with an anyhit shader for doing transparency (see
+        // anyhit.rahit for details), shadow rays carry a different payload and use their own copy of it
         {
+            const uint32_t closestHitShader = static_cast<uint32_t>(shaderStages.size()) - 1;
             shaderStages.push_back(
-                loadShader(getShadersPath() + "pathtracing/shadow.rchit.spv",
-                    VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR));
+                loadShader(getShadersPath() + "pathtracing/anyhit.rahit.spv",
+                    VK_SHADER_STAGE_ANY_HIT_BIT_KHR));
             VkRayTracingShaderGroupCreateInfoKHR shaderGroup {};
             shaderGroup.sType = VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_KHR;
             shaderGroup.type = VK_RAY_TRACING_SHADER_GROUP_TYPE_TRIANGLES_HIT_GROUP_KHR;
             shaderGroup.generalShader = VK_SHADER_UNUSED_KHR;
-            shaderGroup.closestHitShader = static_cast<uint32_t>(shaderStages.size()) - 1;
+            shaderGroup.closestHitShader = closestHitShader;
+            shaderGroup.anyHitShader = static_cast<uint32_t>(shaderStages.size()) - 1;
             shaderGroup.intersectionShader = VK_SHADER_UNUSED_KHR;
+            shaderGroups.push_back(shaderGroup);
             shaderStages.push_back(
-                loadShader(getShadersPath() + "pathtracing/anyhit.rahit.spv",
+                loadShader(getShadersPath() + "pathtracing/shadow.rahit.spv",
                     VK_SHADER_STAGE_ANY_HIT_BIT_KHR));
+            shaderGroup.closestHitShader = VK_SHADER_UNUSED_KHR;
             shaderGroup.anyHitShader = static_cast<uint32_t>(shaderStages.size()) - 1;
             shaderGroups.push_back(shaderGroup);
         }
@@ -644,6 +704,7 @@ public:
             
         };
         VkDescriptorPoolCreateInfo descriptorPoolCreateInfo = vks::initializers::descriptorPoolCreateInfo(poolSizes, 1);
+        descriptorPoolCreateInfo.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT_EXT;
         VK_CHECK_RESULT(vkCreateDescriptorPool(device, &descriptorPoolCreateInfo,
             nullptr, &descriptorPool));
 
@@ -740,8 +801,142 @@ public:
         uniformData.frame = 0;
     }
 
+    /*
+                    Collect the emissive triangles of all instances in world space into a light table
+                    Triangles are picked proportional to their power with an alias table, the shaders combine these light
+       samples with BSDF sampling through multiple importance sampling
+    */
+    void createEmissiveLightTable()
+    {
+        // Matches EmissiveTriangle in bufferreferences.glsl (scalar layout)
+        struct EmissiveTriangle {
+            glm::vec3 positions[3];
+            uint32_t geometryNode;
+            uint32_t primitiveIndex;
+            float probability;
+            uint32_t alias;
+        };
+        std::vector<EmissiveTriangle> triangles {};
+        std::vector<float> powers {};
+        for (size_t i = 0; i < bottomLevelInstances.size(); i++) {
+            const BottomLevelAS& bottomLevelAS = bottomLevelASes[bottomLevelInstances[i].bottomLevelAS];
+            for (uint32_t j = 0; j < bottomLevelAS.geometryNodeCount; j++) {
+                const uint32_t geometryNode = bottomLevelAS.firstGeometryNode + j;
+                const vkglTF::Primitive* primitive = geometryNodePrimitives[geometryNode];
+                const auto positions = model.emissiveTriangles.find(primitive->firstIndex);
+                if (positions == model.emissiveTriangles.end()) {
+                    continue;
+                }
+                // Textures only modulate the emission, the shaders use the same luminance for the light pdf
+                const float luminance = glm::dot(primitive->material.emissiveFactor, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+                for (uint32_t k = 0; luminance > 0.0f && k + 2 < positions->second.size(); k += 3) {
+                    EmissiveTriangle triangle {};
+                    for (uint32_t l = 0; l < 3; l++) {
+                        triangle.positions[l] = glm::vec3(instanceTransforms[i] * glm::vec4(positions->second[k + l], 1.0f));
+                    }
+                    const float area = 0.5f * glm::length(glm::cross(triangle.positions[1] - triangle.positions[0], triangle.positions[2] - triangle.positions[0]));
+                    if (area <= 0.0f) {
+                        continue;
+                    }
+                    triangle.geometryNode = geometryNode;
+                    triangle.primitiveIndex = k / 3;
+                    triangles.push_back(triangle);
+                    powers.push_back(luminance * area);
+                }
+            }
+        }
+        if (triangles.empty()) {
+            return;
+        }
+
+        std::vector<float> probabilities {};
+        std::vector<uint32_t> aliases {};
+        vks::tools::buildAliasTable(powers, probabilities, aliases);
+        double emissivePower = 0.0;
+        for (size_t i = 0; i < triangles.size(); i++) {
+            triangles[i].probability = probabilities[i];
+            triangles[i].alias = aliases[i];
+            emissivePower += powers[i];
+        }
+
+        VK_CHECK_RESULT(vulkanDevice->createBuffer(
+            VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+            &emissiveTrianglesBuffer,
+            triangles.size() * sizeof(EmissiveTriangle),
+            triangles.data()));
+        lightBlock.emissiveTriangles = getBufferDeviceAddress(emissiveTrianglesBuffer.buffer);
+        lightBlock.emissiveTriangleCount = static_cast<uint32_t>(triangles.size());
+        lightBlock.emissivePower = static_cast<float>(emissivePower);
+    }
+
+    void createBlueNoiseBuffer()
+    {
+        if (uniformData.samplerType != 3) {
+            return;
+        }
+        // Tiled over the screen, every sample dimension reads it with its own offset
+        const std::vector<float> blueNoise = vks::tools::generateBlueNoise(blueNoiseSize);
+        VK_CHECK_RESULT(vulkanDevice->createBuffer(
+            VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+            &blueNoiseBuffer,
+            blueNoise.size() * sizeof(float),
+            (void*)blueNoise.data()));
+        uniformData.blueNoise = getBufferDeviceAddress(blueNoiseBuffer.buffer);
+    }
+
+    void createRadianceCacheBuffer()
+    {
+        if (!RADIANCE_CACHE) {
+            return;
+        }
+        static_assert((RADIANCE_CACHE_CELL_COUNT & (RADIANCE_CACHE_CELL_COUNT - 1)) == 0, "The radiance cache is indexed with a bit mask");
+        VK_CHECK_RESULT(vulkanDevice->createBuffer(
+            VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            &radianceCacheBuffer,
+            RADIANCE_CACHE_CELL_COUNT * radianceCacheCellSize));
+        uniformData.radianceCache = getBufferDeviceAddress(radianceCacheBuffer.buffer);
+        VkCommandBuffer commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+        cmdResetRadianceCache(commandBuffer);
+        vulkanDevice->flushCommandBuffer(commandBuffer, queue);
+    }
+
+    /** @brief Empties every cell, cached light is stale once geometry moved or textures changed */
+    void cmdResetRadianceCache(VkCommandBuffer commandBuffer)
+    {
+        if (!RADIANCE_CACHE) {
+            return;
+        }
+        vkCmdFillBuffer(commandBuffer, radianceCacheBuffer.buffer, 0, VK_WHOLE_SIZE, 0);
+        VkMemoryBarrier memoryBarrier = vks::initializers::memoryBarrier();
+        memoryBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        memoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+    }
+
     void createLightBuffer()
     {
+        // Shading points traverse the light tree to pick a single light instead of tracing a shadow ray to each of them
+        const std::vector<vks::PunctualLight> lights(std::begin(LIGHTS), std::end(LIGHTS));
+        vks::LightTree lightTree;
+        lightTree.build(lights);
+        VK_CHECK_RESULT(vulkanDevice->createBuffer(
+            VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+            &lightsBuffer,
+            lights.size() * sizeof(vks::PunctualLight),
+            (void*)lights.data()));
+        VK_CHECK_RESULT(vulkanDevice->createBuffer(
+            VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+            &lightTreeBuffer,
+            lightTree.nodes.size() * sizeof(vks::LightTree::Node),
+            lightTree.nodes.data()));
+        lightBlock.lights = getBufferDeviceAddress(lightsBuffer.buffer);
+        lightBlock.lightTree = getBufferDeviceAddress(lightTreeBuffer.buffer);
+
         VK_CHECK_RESULT(
             vulkanDevice->createBuffer(VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
@@ -887,6 +1082,9 @@ public:
         physicalDeviceDescriptorIndexingFeatures
             .descriptorBindingVariableDescriptorCount
             = VK_TRUE;
+        physicalDeviceDescriptorIndexingFeatures
+            .descriptorBindingSampledImageUpdateAfterBind
+            = VK_TRUE;
         physicalDeviceDescriptorIndexingFeatures.pNext = &enabledAccelerationStructureFeatures;
 
         deviceCreatepNextChain = &physicalDeviceDescriptorIndexingFeatures;
@@ -900,9 +1098,10 @@ public:
         // model.loadFromFile(getAssetPath() +
         //                        "models/FlightHelmet/glTF/FlightHelmet.gltf",
         //                    vulkanDevice, queue);
-        const uint32_t gltfLoadingFlags = vkglTF::FileLoadingFlags::FlipY;
-        model.loadFromFile(getAssetPath() + "sponza/sponza.gltf",
+        const uint32_t gltfLoadingFlags = vkglTF::FileLoadingFlags::FlipY | vkglTF::FileLoadingFlags::CacheProcessedModel | vkglTF::FileLoadingFlags::StreamImages;
+        model.loadFromFile<vkglTF::RayTracingVertexLayout>(getAssetPath() + "sponza/sponza.gltf",
             vulkanDevice, queue, gltfLoadingFlags);
+        imageResidency = model.imageResidency();
     }
 
     void prepare()
@@ -914,15 +1113,21 @@ public:
         // Create the acceleration structures used to render the ray traced scene
         createBottomLevelAccelerationStructure();
         createTopLevelAccelerationStructure();
+        createEmissiveLightTable();
 
         createStorageImage(swapChain.colorFormat, { width, height, 1 });
         createCopyImage();
         createLightBuffer();
+        createBlueNoiseBuffer();
+        createRadianceCacheBuffer();
         createUniformBuffer();
         createRayTracingPipeline();
         createShaderBindingTables();
         createDescriptorSets();
         buildCommandBuffers();
+        // Report how the scene resources were packed into device memory blocks
+        vulkanDevice->allocator->printStatistics();
+        printAccelerationStructureStatistics();
         prepared = true;
     }
 
@@ -935,20 +1140,167 @@ public:
         VulkanExampleBase::submitFrame();
     }
 
+    /*
+                    Upload model images decoded in the background and point the image array at them
+                    Accumulation restarts when every image is available at low resolution and again once all are complete
+    */
+    void updateStreamedImages()
+    {
+        const std::vector<uint32_t> updatedImages = model.updateStreamedImages(queue);
+        if (updatedImages.empty()) {
+            return;
+        }
+        std::vector<VkDescriptorImageInfo> textureDescriptors(updatedImages.size());
+        std::vector<VkWriteDescriptorSet> writeDescriptorSets(updatedImages.size());
+        for (size_t i = 0; i < updatedImages.size(); i++) {
+            const vkglTF::Texture& texture = model.textures[updatedImages[i]];
+            textureDescriptors[i] = { texture.sampler, texture.view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+            writeDescriptorSets[i] = vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 5, &textureDescriptors[i]);
+            writeDescriptorSets[i].dstArrayElement = updatedImages[i];
+        }
+        vkUpdateDescriptorSets(device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, nullptr);
+
+        const vkglTF::Model::ImageResidency residency = model.imageResidency();
+        if (residency != imageResidency) {
+            imageResidency = residency;
+            uniformData.frame = -1;
+            if (RADIANCE_CACHE) {
+                VkCommandBuffer commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+                cmdResetRadianceCache(commandBuffer);
+                vulkanDevice->flushCommandBuffer(commandBuffer, queue);
+            }
+        }
+    }
+
+    static float surfaceArea(const glm::vec3& min, const glm::vec3& max)
+    {
+        const glm::vec3 extent = glm::max(max - min, glm::vec3(0.0f));
+        return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+    }
+
+    /*
+        Advance the glTF animation and bring the acceleration structures up to date
+        Skinned meshes are refitted, or rebuilt once refits degrade too much, and the top level is updated from the node
+        matrices
+    */
+    void updateSceneAnimation()
+    {
+        if (!animate || model.animations.empty()) {
+            return;
+        }
+        const vkglTF::Animation& animation = model.animations[0];
+        animationTime += frameTimer;
+        if (animationTime > animation.end) {
+            animationTime = animation.start + std::fmod(animationTime - animation.start, std::max(animation.end - animation.start, 1e-3f));
+        }
+        model.updateAnimation(0, animationTime);
+
+        // Moving objects only restart accumulation if they appear large from the camera
+        const glm::vec3 cameraPosition = glm::vec3(glm::inverse(camera.matrices.view)[3]);
+        bool restartAccumulation = false;
+        auto isSignificant = [&](const glm::mat4& transform, const glm::vec3& min, const glm::vec3& max) {
+            const glm::vec3 center = glm::vec3(transform * glm::vec4((min + max) * 0.5f, 1.0f));
+            const float scale = std::max({ glm::length(glm::vec3(transform[0])), glm::length(glm::vec3(transform[1])), glm::length(glm::vec3(transform[2])) });
+            const float radius = glm::length(max - min) * 0.5f * scale;
+            const float distance = std::max(glm::length(center - cameraPosition) - radius, 1e-3f);
+            return radius / distance > accumulationResetAngle;
+        };
+
+        // Deformed meshes are refitted every frame
+        std::vector<AccelerationStructureBuildInput*> buildInputs {};
+        std::vector<VkBuildAccelerationStructureModeKHR> modes {};
+        for (BottomLevelAS& bottomLevelAS : bottomLevelASes) {
+            if (bottomLevelAS.deformedMesh < 0) {
+                continue;
+            }
+            const vkglTF::Model::DeformedMesh& deformedMesh = model.deformedMeshes[bottomLevelAS.deformedMesh];
+            const float area = surfaceArea(deformedMesh.min, deformedMesh.max);
+            if (bottomLevelAS.refitCount >= maxRefitCount || area > bottomLevelAS.builtSurfaceArea * maxRefitSurfaceAreaRatio) {
+                modes.push_back(VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR);
+                bottomLevelAS.refitCount = 0;
+                bottomLevelAS.builtSurfaceArea = area;
+            } else {
+                modes.push_back(VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR);
+                bottomLevelAS.refitCount++;
+            }
+            buildInputs.push_back(&bottomLevelAS.updateInput);
+        }
+
+        // Instances follow their node matrices
+        bool instancesMoved = false;
+        VkAccelerationStructureInstanceKHR* instances = static_cast<VkAccelerationStructureInstanceKHR*>(instancesBuffer.mapped);
+        for (size_t i = 0; i < bottomLevelInstances.size(); i++) {
+            const BottomLevelInstance& bottomLevelInstance = bottomLevelInstances[i];
+            const BottomLevelAS& bottomLevelAS = bottomLevelASes[bottomLevelInstance.bottomLevelAS];
+            const glm::mat4 transform = getInstanceTransform(bottomLevelInstance.node);
+            const bool moved = transform != instanceTransforms[i];
+            glm::vec3 min, max;
+            if (bottomLevelAS.deformedMesh >= 0) {
+                min = model.deformedMeshes[bottomLevelAS.deformedMesh].min;
+                max = model.deformedMeshes[bottomLevelAS.deformedMesh].max;
+            } else if (moved) {
+                min = glm::vec3(FLT_MAX);
+                max = glm::vec3(-FLT_MAX);
+                for (auto primitive : bottomLevelInstance.node->mesh->primitives) {
+                    min = glm::min(min, primitive->dimensions.min);
+                    max = glm::max(max, primitive->dimensions.max);
+                }
+            } else {
+                continue;
+            }
+            restartAccumulation |= isSignificant(transform, min, max);
+            if (moved) {
+                const glm::mat3x4 instanceTransform = glm::mat3x4(glm::transpose(transform));
+                memcpy(&instances[i].transform, &instanceTransform, sizeof(VkTransformMatrixKHR));
+                instanceTransforms[i] = transform;
+                instancesMoved = true;
+            }
+        }
+        if (instancesMoved || !buildInputs.empty()) {
+            // Instances may end up far from where the top level was built, so it's rebuilt regularly as well
+            if (topLevelRefitCount >= maxRefitCount) {
+                modes.push_back(VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR);
+                topLevelRefitCount = 0;
+            } else {
+                modes.push_back(VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR);
+                topLevelRefitCount++;
+            }
+            buildInputs.push_back(&topLevelBuildInput);
+        }
+        if (buildInputs.empty()) {
+            return;
+        }
+
+        VkCommandBuffer commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+        model.updateDeformedMeshes(commandBuffer);
+        cmdUpdateAccelerationStructures(commandBuffer, buildInputs, modes);
+        // Small movements keep the cached light, like they keep the accumulated image
+        if (restartAccumulation) {
+            cmdResetRadianceCache(commandBuffer);
+        }
+        vulkanDevice->flushCommandBuffer(commandBuffer, queue);
+
+        if (restartAccumulation) {
+            uniformData.frame = -1;
+        }
+    }
+
     virtual void render()
     {
         if (!prepared)
             return;
+        updateStreamedImages();
+        updateSceneAnimation();
         updateUniformBuffers();
         draw();
         std::cerr << "sample count:" << (uniformData.frame) * SAMPLE_COUNT << std::endl;
-        if (uniformData.frame && uniformData.frame% OUTPUT_INTERVAL == 0)
+        if (uniformData.frame && uniformData.frame % OUTPUT_INTERVAL == 0 && imageResidency == vkglTF::Model::ImageResidency::Complete)
 			saveScreenshot();
     }
 
     struct CopyImage {
         VkImage image;
-        VkDeviceMemory memory;
+        vks::Allocation allocation;
     } copyImage;
 
     void createCopyImage()
@@ -970,15 +1322,12 @@ public:
         // Create the image
 
         VK_CHECK_RESULT(vkCreateImage(device, &imageCreateCI, nullptr, &copyImage.image));
-        // Create memory to back up the image
+        // Create memory to back up the image, it must be host visible to copy from
+        // A linear tiled image is a linear resource like a buffer, so it is placed in a buffer block
         VkMemoryRequirements memRequirements;
-        VkMemoryAllocateInfo memAllocInfo(vks::initializers::memoryAllocateInfo());
         vkGetImageMemoryRequirements(device, copyImage.image, &memRequirements);
-        memAllocInfo.allocationSize = memRequirements.size;
-        // Memory must be host visible to copy from
-        memAllocInfo.memoryTypeIndex = vulkanDevice->getMemoryType(memRequirements.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-        VK_CHECK_RESULT(vkAllocateMemory(device, &memAllocInfo, nullptr, &copyImage.memory));
-        VK_CHECK_RESULT(vkBindImageMemory(device, copyImage.image, copyImage.memory, 0));
+        VK_CHECK_RESULT(vulkanDevice->allocator->allocate(memRequirements, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, vks::ResourceKind::Buffer, copyImage.allocation));
+        VK_CHECK_RESULT(vkBindImageMemory(device, copyImage.image, copyImage.allocation.memory, copyImage.allocation.offset));
     }
 
     void saveScreenshot()
@@ -989,9 +1338,8 @@ public:
         VkSubresourceLayout subResourceLayout;
         vkGetImageSubresourceLayout(device, copyImage.image, &subResource, &subResourceLayout);
 
-        // Map image memory so we can start copying from it
-        const char* data;
-        vkMapMemory(device, copyImage.memory, 0, VK_WHOLE_SIZE, 0, (void**)&data);
+        // Host visible allocations are persistently mapped
+        const char* data = static_cast<const char*>(copyImage.allocation.mapped);
         data += subResourceLayout.offset;
 
         std::string filename = std::to_string((uniformData.frame) * SAMPLE_COUNT) + std::string(".ppm");
@@ -1030,7 +1378,6 @@ public:
         file.close();
 
         std::cerr << "Screenshot saved to disk" << std::endl;
-        vkUnmapMemory(device, copyImage.memory);
     }
 
     virtual void viewChanged() { uniformData.frame = -1; }
@@ -1,55 +1,130 @@
 #include "VulkanRaytracingSample.h"
 #define VK_GLTF_MATERIAL_IDS
 #include "VulkanglTFModel.h"
+#include "lighttree.hpp"
+#include "taskscheduler.hpp"
+#include "sphericalharmonics.hpp"
+#include "probesettings.hpp"
+#include "VulkanProbeDenoiser.hpp"
 #include <random>
+#include <bit>
 #include <json.hpp>
 #define ENABLE_VALIDATION true
 
 constexpr uint32_t WIDTH = 1280;
 constexpr uint32_t HEIGHT = 720;
-// it is recommended not less than 8 and should not be greater than 'stack_size' in glsl/ssprobe/raygen.rgen. 'stack_size' can be set freely.
+// maximum path length, it is recommended not less than 8
 // the smaller the value, the faster the ray tracing speed
 constexpr uint32_t RECURSIVE_DEPTH = 10;
+// paths are terminated randomly based on their throughput after this many bounces (Russian roulette)
+// set it to RECURSIVE_DEPTH to always trace full paths
+constexpr uint32_t RUSSIAN_ROULETTE_DEPTH = 3;
+// sample generator: 0 LCG, 1 Owen scrambled Sobol, 2 rank-1 lattice, 3 tiled blue noise (see shaders/glsl/*/sampler.glsl)
+// the low discrepancy ones converge faster than the LCG, override it with --sampler lcg|sobol|lattice|bluenoise
+constexpr uint32_t SAMPLER = 1;
+// sample the hemisphere from the primary hit the classification pass stored, one camera ray per probe and accumulation
+// instead of a full camera path per sample
+constexpr bool PROBE_TRACING = true;
+// world space hash grid caching the indirect light of path vertices, paths end early at cells holding enough samples
+// (see shaders/glsl/*/radiancecache.glsl), the cell size is in world units and the cell count must be a power of two
+constexpr bool RADIANCE_CACHE = true;
+constexpr float RADIANCE_CACHE_CELL_SIZE = 0.25f;
+constexpr uint32_t RADIANCE_CACHE_CELL_COUNT = 1 << 20;
+constexpr uint32_t RADIANCE_CACHE_MIN_SAMPLES = 64;
+// fraction of the paths written back to the cache
+constexpr float RADIANCE_CACHE_UPDATE_RATE = 0.25f;
 // total sample counts per pixel per frames is
 constexpr uint32_t SAMPLE_COUNT = 2;
+// SH_BANDS, H_BASIS and the sh.json payload EXPORT are shared with the CPU baker, see base/probesettings.hpp
 // the sample results(SH coefficients) will be accumulated
 // output a json every n frames
 // output dir: ./out/**/bin/sh.json
 constexpr uint32_t OUTPUT_INTERVAL = 5000;
+// the exported probes are denoised first: DENOISE_ITERATIONS a-trous iterations guided by the probe depth and normal and
+// by the variance of the accumulation, then a blend with the probes exported before the last restart wherever the surface
+// and lighting still match (see base/probedenoiser.hpp), SH probes only, turn it off for H-basis probes
+constexpr bool DENOISE = true;
+constexpr uint32_t DENOISE_ITERATIONS = 3;
+static_assert(!DENOISE || H_BASIS == 0, "The probe denoiser filters SH probes only, set DENOISE to false for H-basis probes");
 // more camera parameters could be set in VulkanExample(): VulkanRaytracingSample(ENABLE_VALIDATION)
 constexpr glm::vec3 POSITION = glm::vec3(-0.5f, 5.0f, 3.5f);
 constexpr glm::vec3 ROTATION = glm::vec3(-15.0f, 120.0f, 0.0f);
-// light information should not be greater than 'maxLights' in glsl/ssprobe/closesthit.rchit. 'maxLights' can be set freely.
+// point and spot lights (position, color, intensity, spot direction, cosine of the outer and inner spot angle)
+// every shading point picks one of them from a light tree, so the cost only grows logarithmically with their count
 constexpr uint32_t LIGHT_COUNT = 1;
-struct Light {
-    glm::vec4 position;
-    glm::vec3 color;
-    float intensity;
+const vks::PunctualLight LIGHTS[LIGHT_COUNT] {
+    vks::PunctualLight { { 2., 8., 1., 1. }, glm::vec3(1), 50. },
 };
 
 struct LightBlock {
-    Light lights[LIGHT_COUNT] {
-        Light { { 2., 8., 1., 1. }, glm::vec3(1), 50. },
-    };
+    // Emissive triangles sampled with next event estimation, see createEmissiveLightTable
+    uint64_t emissiveTriangles { 0 };
+    uint32_t emissiveTriangleCount { 0 };
+    float emissivePower { 0.0f };
+    // LIGHTS and the light tree built over them, see createLightBuffer
+    uint64_t lights { 0 };
+    uint64_t lightTree { 0 };
 } lightBlock;
 
 class VulkanExample : public VulkanRaytracingSample {
 public:
-    AccelerationStructure bottomLevelAS {};
+    // One bottom level acceleration structure per unique glTF mesh, see createBottomLevelAccelerationStructure
+    struct BottomLevelAS {
+        AccelerationStructure accelerationStructure;
+        // Index of the mesh's first entry in the geometry node buffer
+        uint32_t firstGeometryNode;
+        uint32_t geometryNodeCount;
+        // Skinned meshes are refitted as they animate, see updateSceneAnimation
+        int32_t deformedMesh = -1;
+        AccelerationStructureBuildInput updateInput {};
+        uint32_t refitCount = 0;
+        float builtSurfaceArea = 0.0f;
+    };
+    std::vector<BottomLevelAS> bottomLevelASes {};
+    struct BottomLevelInstance {
+        vkglTF::Node* node;
+        uint32_t bottomLevelAS;
+    };
+    std::vector<BottomLevelInstance> bottomLevelInstances {};
+    // Kept mapped for animated models, the top level is then updated from the node matrices
+    vks::Buffer instancesBuffer;
+    std::vector<glm::mat4> instanceTransforms {};
+    AccelerationStructureBuildInput topLevelBuildInput {};
+    uint32_t topLevelRefitCount = 0;
+
+    // Plays the first animation of the glTF model
+    bool animate = true;
+    float animationTime = 0.0f;
+    // Refits degrade the acceleration structure quality, so they are replaced by a full build after this many updates
+    // or once a deformed mesh's bounds grew past this surface area ratio
+    static constexpr uint32_t maxRefitCount = 32;
+    static constexpr float maxRefitSurfaceAreaRatio = 1.5f;
+    // Moving objects covering less than this angle (in radians) from the camera don't restart accumulation
+    static constexpr float accumulationResetAngle = 0.05f;
+    // Hit records per geometry node, primary rays use SBT offset 0 and shadow rays offset 1
+    static constexpr uint32_t hitRecordStride = 2;
     AccelerationStructure topLevelAS {};
 
     vks::Buffer vertexBuffer;
     vks::Buffer indexBuffer;
     uint32_t indexCount;
-    vks::Buffer transformBuffer;
 
     struct GeometryNode {
         uint64_t vertexBufferDeviceAddress;
         uint64_t indexBufferDeviceAddress;
         int32_t textureIndexBaseColor;
         int32_t textureIndexNormal;
+        int32_t textureIndexEmissive;
+        float emissiveFactor[3];
     };
     vks::Buffer geometryNodesBuffer;
+    std::vector<const vkglTF::Primitive*> geometryNodePrimitives {};
+    vks::Buffer emissiveTrianglesBuffer;
+    // Geometries whose material needs alpha testing use the hit groups with the any hit shader, all others are
+    // flagged opaque so traversal never invokes it, see createShaderBindingTables
+    std::vector<bool> geometryNodeAlphaTested {};
+    // Disabled with --alpha-test-all to compare traversal times against alpha testing every geometry in benchmark mode
+    bool classifyOpaqueGeometry = true;
 
     std::vector<VkRayTracingShaderGroupCreateInfoKHR> shaderGroups {};
     struct ShaderBindingTables {
@@ -68,9 +143,34 @@ public:
         uint32_t recursiveDepth { RECURSIVE_DEPTH };
         uint32_t sampleCount { SAMPLE_COUNT };
         uint32_t lightCount { LIGHT_COUNT };
+        uint32_t russianRouletteDepth { RUSSIAN_ROULETTE_DEPTH };
+        uint32_t samplerType { SAMPLER };
+        uint64_t blueNoise { 0 };
+        uint32_t probeTracing { PROBE_TRACING };
+        uint64_t radianceCache { 0 };
+        uint32_t radianceCacheSize { RADIANCE_CACHE_CELL_COUNT };
+        float radianceCacheCellSize { RADIANCE_CACHE_CELL_SIZE };
+        uint32_t radianceCacheMinSamples { RADIANCE_CACHE_MIN_SAMPLES };
+        float radianceCacheUpdateRate { RADIANCE_CACHE_UPDATE_RATE };
+        uint64_t probeGBuffer { 0 };
+        uint64_t probeMask { 0 };
+        uint64_t probeMaskOffsets { 0 };
+        uint64_t probeMoments { 0 };
+        uint32_t probeClassification { 0 };
     } uniformData;
     vks::Buffer ubo;
     vks::Buffer light;
+    vks::Buffer lightsBuffer;
+    vks::Buffer lightTreeBuffer;
+    // Only created for the blue noise sampler
+    vks::Buffer blueNoiseBuffer;
+    static constexpr uint32_t blueNoiseSize = 64;
+    static constexpr const char* samplerNames[] = { "lcg", "sobol", "lattice", "bluenoise" };
+    uint32_t exportType { EXPORT };
+    // Cleared whenever the scene changes, see cmdResetRadianceCache
+    vks::Buffer radianceCacheBuffer;
+    // Size of RadianceCacheCell in radiancecache.glsl
+    static constexpr VkDeviceSize radianceCacheCellSize = 5 * sizeof(uint32_t);
 
     VkPipeline pipeline;
     VkPipelineLayout pipelineLayout;
@@ -82,7 +182,42 @@ public:
     VkPhysicalDeviceDescriptorIndexingFeaturesEXT
         physicalDeviceDescriptorIndexingFeatures {};
 
+    vkglTF::Model::ImageResidency imageResidency { vkglTF::Model::ImageResidency::Placeholder };
+
     vks::Buffer storageBuffer;
+    // Primary hit of every probe, exported next to the coefficients so consumers can place and reproject the probes
+    // Matches ProbeGBuffer in raygen.rgen, depth is the distance along the probe's camera ray and 0 where it misses
+    struct ProbeGBuffer {
+        float depth;
+        uint32_t normal;
+    };
+    vks::Buffer probeGBuffer;
+    // One bit per probe, set by the classification pass where the probe's camera ray hits the scene, and the
+    // exclusive prefix sum of the bits per word built by probemask.comp, followed by the valid probe count
+    // Only valid probes are traced, stored and exported, packed in scanline order, see classifyProbes
+    vks::Buffer probeMask;
+    vks::Buffer probeMaskOffsets;
+    VkPipeline probeMaskPipeline;
+    VkPipelineLayout probeMaskPipelineLayout;
+    // Matches the push constants in probemask.comp
+    struct ProbeMaskPushConstants {
+        uint64_t probeMask;
+        uint64_t probeMaskOffsets;
+        uint32_t wordCount;
+    };
+    // Second moment of the DC luminance of every slot, accumulated next to the probes for the denoiser's variance
+    vks::Buffer probeMoments;
+    // The denoiser ping-pongs between the scratch buffers, which hold a probe for every pixel, and keeps the result of the
+    // last export of an accumulation as history for the next one, see denoiseProbes and classifyProbes
+    vks::ProbeDenoiser probeDenoiser;
+    vks::Buffer denoiseScratch[2];
+    vks::Buffer denoiseScratchVariances[2];
+    vks::Buffer denoisedCounts;
+    vks::Buffer historyGBuffer;
+    vks::Buffer historyProbes;
+    vks::Buffer historyCounts;
+    // Set once the current accumulation has been denoised, its result becomes the history at the next restart
+    bool denoised { false };
 
     std::random_device r;
     std::default_random_engine e;
@@ -103,6 +238,28 @@ public:
         camera.setRotation(ROTATION);
         camera.setTranslation(POSITION);
 
+        for (size_t i = 0; i < args.size(); i++) {
+            if (strcmp(args[i], "--alpha-test-all") == 0) {
+                classifyOpaqueGeometry = false;
+            }
+            if (strcmp(args[i], "--sampler") == 0 && i + 1 < args.size()) {
+                const char* name = args[++i];
+                for (uint32_t type = 0; type < std::size(samplerNames); type++) {
+                    if (strcmp(name, samplerNames[type]) == 0) {
+                        uniformData.samplerType = type;
+                    }
+                }
+            }
+            if (strcmp(args[i], "--export") == 0 && i + 1 < args.size()) {
+                const char* name = args[++i];
+                for (uint32_t type = 0; type < std::size(EXPORT_NAMES); type++) {
+                    if (strcmp(name, EXPORT_NAMES[type]) == 0) {
+                        exportType = type;
+                    }
+                }
+            }
+        }
+
         enableExtensions();
 
         // Buffer device address requires the 64-bit integer feature to be enabled
@@ -116,110 +273,147 @@ public:
     {
         vkDestroyPipeline(device, pipeline, nullptr);
         vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
+        vkDestroyPipeline(device, probeMaskPipeline, nullptr);
+        vkDestroyPipelineLayout(device, probeMaskPipelineLayout, nullptr);
+        probeDenoiser.destroy();
         vkDestroyDescriptorSetLayout(device, descriptorSetLayout, nullptr);
         deleteStorageImage();
-        deleteAccelerationStructure(bottomLevelAS);
+        for (auto& bottomLevelAS : bottomLevelASes) {
+            deleteAccelerationStructure(bottomLevelAS.accelerationStructure);
+        }
+        instancesBuffer.destroy();
         deleteAccelerationStructure(topLevelAS);
         vertexBuffer.destroy();
         indexBuffer.destroy();
-        transformBuffer.destroy();
         shaderBindingTables.raygen.destroy();
         shaderBindingTables.miss.destroy();
         shaderBindingTables.hit.destroy();
         ubo.destroy();
         light.destroy();
+        lightsBuffer.destroy();
+        lightTreeBuffer.destroy();
+        blueNoiseBuffer.destroy();
+        radianceCacheBuffer.destroy();
         storageBuffer.unmap();
         storageBuffer.destroy();
+        probeGBuffer.unmap();
+        probeGBuffer.destroy();
+        probeMask.unmap();
+        probeMask.destroy();
+        probeMaskOffsets.unmap();
+        probeMaskOffsets.destroy();
+        probeMoments.destroy();
+        for (uint32_t i = 0; i < 2; i++) {
+            denoiseScratch[i].unmap();
+            denoiseScratch[i].destroy();
+            denoiseScratchVariances[i].destroy();
+        }
+        denoisedCounts.destroy();
+        historyGBuffer.destroy();
+        historyProbes.destroy();
+        historyCounts.destroy();
         geometryNodesBuffer.destroy();
+        emissiveTrianglesBuffer.destroy();
         // Clean up resources
     }
 
     /*
-                    Create the bottom level acceleration structure that contains the
+                    Create the bottom level acceleration structures that contain the
        scene's actual geometry (vertices, triangles)
+                    There is one per unique glTF mesh in object space, nodes instancing
+       the same mesh share its acceleration structure
     */
     void createBottomLevelAccelerationStructure()
     {
-        // Use transform matrices from the glTF nodes
-        std::vector<VkTransformMatrixKHR> transformMatrices {};
-        for (auto node : model.linearNodes) {
-            if (node->mesh) {
-                for (auto primitive : node->mesh->primitives) {
-                    if (primitive->indexCount > 0) {
-                        VkTransformMatrixKHR transformMatrix {};
-                        auto m = glm::mat3x4(glm::transpose(node->getMatrix()));
-                        memcpy(&transformMatrix, (void*)&m, sizeof(glm::mat3x4));
-                        transformMatrices.push_back(transformMatrix);
-                    }
-                }
-            }
+        struct BottomLevelBuild {
+            std::vector<VkAccelerationStructureGeometryKHR> geometries;
+            std::vector<VkAccelerationStructureBuildRangeInfoKHR> buildRangeInfos;
+            std::vector<uint32_t> maxPrimitiveCounts;
+            uint32_t firstIndex;
+        };
+        std::vector<BottomLevelBuild> builds {};
+        std::vector<GeometryNode> geometryNodes {};
+        std::unordered_map<const vkglTF::Node*, int32_t> deformedMeshes {};
+        for (size_t i = 0; i < model.deformedMeshes.size(); i++) {
+            deformedMeshes[model.deformedMeshes[i].node] = static_cast<int32_t>(i);
         }
+        // Skinned meshes start in the pose of their animation rather than the bind pose
+        if (!model.deformedMeshes.empty()) {
+            VkCommandBuffer commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+            model.updateDeformedMeshes(commandBuffer);
+            vulkanDevice->flushCommandBuffer(commandBuffer, queue);
+        }
+        // Nodes sharing mesh data reference the same index range, so the first index identifies the mesh
+        std::unordered_map<uint32_t, uint32_t> meshBottomLevelAS {};
 
-        // Transform buffer
-        VK_CHECK_RESULT(vulkanDevice->createBuffer(
-            VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR,
-            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-            &transformBuffer,
-            static_cast<uint32_t>(transformMatrices.size()) * sizeof(VkTransformMatrixKHR),
-            transformMatrices.data()));
-
-        // Build
-        // One geometry per glTF node, so we can index materials using
-        // gl_GeometryIndexEXT
-        std::vector<uint32_t> maxPrimitiveCounts {};
-        std::vector<VkAccelerationStructureGeometryKHR> geometries {};
-        std::vector<VkAccelerationStructureBuildRangeInfoKHR> buildRangeInfos {};
-        std::vector<VkAccelerationStructureBuildRangeInfoKHR*> pBuildRangeInfos {};
-        std::vector<GeometryNode> geometryNodes {};
+        // One geometry per glTF primitive, so we can index materials using
+        // gl_InstanceCustomIndexEXT + gl_GeometryIndexEXT
         for (auto node : model.linearNodes) {
-            if (node->mesh) {
-                for (auto primitive : node->mesh->primitives) {
-                    if (primitive->indexCount > 0 && primitive->material.baseColorTexture && primitive->material.normalTexture) {
-                        VkDeviceOrHostAddressConstKHR vertexBufferDeviceAddress {};
-                        VkDeviceOrHostAddressConstKHR indexBufferDeviceAddress {};
-                        VkDeviceOrHostAddressConstKHR transformBufferDeviceAddress {};
-
-                        vertexBufferDeviceAddress.deviceAddress = getBufferDeviceAddress(
-                            model.vertices.buffer); // +primitive->firstVertex *
-                        // sizeof(vkglTF::Vertex);
-                        indexBufferDeviceAddress.deviceAddress = getBufferDeviceAddress(model.indices.buffer) + primitive->firstIndex * sizeof(uint32_t);
-                        transformBufferDeviceAddress.deviceAddress = getBufferDeviceAddress(transformBuffer.buffer) + static_cast<uint32_t>(geometryNodes.size()) * sizeof(VkTransformMatrixKHR);
-
-                        VkAccelerationStructureGeometryKHR geometry {};
-                        geometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
-                        geometry.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR;
-                        geometry.geometry.triangles.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR;
-                        geometry.geometry.triangles.vertexFormat = VK_FORMAT_R32G32B32_SFLOAT;
-                        geometry.geometry.triangles.vertexData = vertexBufferDeviceAddress;
-                        geometry.geometry.triangles.maxVertex = model.vertices.count;
-                        // geometry.geometry.triangles.maxVertex = primitive->vertexCount;
-                        geometry.geometry.triangles.vertexStride = sizeof(vkglTF::Vertex);
-                        geometry.geometry.triangles.indexType = VK_INDEX_TYPE_UINT32;
-                        geometry.geometry.triangles.indexData = indexBufferDeviceAddress;
-                        geometry.geometry.triangles.transformData = transformBufferDeviceAddress;
-                        geometries.push_back(geometry);
-                        maxPrimitiveCounts.push_back(primitive->indexCount / 3);
-
-                        VkAccelerationStructureBuildRangeInfoKHR buildRangeInfo {};
-                        buildRangeInfo.firstVertex = 0;
-                        buildRangeInfo.primitiveOffset = 0; // primitive->firstIndex * sizeof(uint32_t);
-                        buildRangeInfo.primitiveCount = primitive->indexCount / 3;
-                        buildRangeInfo.transformOffset = 0;
-                        buildRangeInfos.push_back(buildRangeInfo);
-
-                        GeometryNode geometryNode {};
-                        geometryNode.vertexBufferDeviceAddress = vertexBufferDeviceAddress.deviceAddress;
-                        geometryNode.indexBufferDeviceAddress = indexBufferDeviceAddress.deviceAddress;
-                        geometryNode.textureIndexBaseColor = primitive->material.baseColorTexture->index;
-                        geometryNode.textureIndexNormal = primitive->material.normalTexture->index;
-                        // @todo: map material id to global texture array
-                        geometryNodes.push_back(geometryNode);
-                    }
+            if (!node->mesh || node->mesh->primitives.empty()) {
+                continue;
+            }
+            const uint32_t meshFirstIndex = node->mesh->primitives.front()->firstIndex;
+            const auto sharedAS = meshBottomLevelAS.find(meshFirstIndex);
+            if (sharedAS != meshBottomLevelAS.end()) {
+                bottomLevelInstances.push_back({ node, sharedAS->second });
+                continue;
+            }
+
+            BottomLevelBuild build {};
+            build.firstIndex = meshFirstIndex;
+            const uint32_t firstGeometryNode = static_cast<uint32_t>(geometryNodes.size());
+            for (auto primitive : node->mesh->primitives) {
+                if (primitive->indexCount > 0 && primitive->material.baseColorTexture && primitive->material.normalTexture) {
+                    VkDeviceOrHostAddressConstKHR vertexBufferDeviceAddress {};
+                    VkDeviceOrHostAddressConstKHR indexBufferDeviceAddress {};
+
+                    vertexBufferDeviceAddress.deviceAddress = getBufferDeviceAddress(model.vertices.buffer);
+                    indexBufferDeviceAddress.deviceAddress = getBufferDeviceAddress(model.indices.buffer) + primitive->firstIndex * sizeof(uint32_t);
+
+                    VkAccelerationStructureGeometryKHR geometry {};
+                    geometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
+                    geometry.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR;
+                    geometry.geometry.triangles.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR;
+                    geometry.geometry.triangles.vertexFormat = VK_FORMAT_R32G32B32_SFLOAT;
+                    geometry.geometry.triangles.vertexData = vertexBufferDeviceAddress;
+                    geometry.geometry.triangles.maxVertex = model.vertices.count;
+                    geometry.geometry.triangles.vertexStride = model.vertices.stride;
+                    geometry.geometry.triangles.indexType = VK_INDEX_TYPE_UINT32;
+                    geometry.geometry.triangles.indexData = indexBufferDeviceAddress;
+                    // Opaque geometries skip the any hit shader, the others only need it once per primitive
+                    const bool alphaTested = !classifyOpaqueGeometry || primitive->material.alphaMode != vkglTF::Material::ALPHAMODE_OPAQUE;
+                    geometry.flags = alphaTested ? VK_GEOMETRY_NO_DUPLICATE_ANY_HIT_INVOCATION_BIT_KHR : VK_GEOMETRY_OPAQUE_BIT_KHR;
+                    build.geometries.push_back(geometry);
+                    build.maxPrimitiveCounts.push_back(primitive->indexCount / 3);
+
+                    VkAccelerationStructureBuildRangeInfoKHR buildRangeInfo {};
+                    buildRangeInfo.firstVertex = 0;
+                    buildRangeInfo.primitiveOffset = 0;
+                    buildRangeInfo.primitiveCount = primitive->indexCount / 3;
+                    buildRangeInfo.transformOffset = 0;
+                    build.buildRangeInfos.push_back(buildRangeInfo);
+
+                    GeometryNode geometryNode {};
+                    geometryNode.vertexBufferDeviceAddress = vertexBufferDeviceAddress.deviceAddress;
+                    geometryNode.indexBufferDeviceAddress = indexBufferDeviceAddress.deviceAddress;
+                    geometryNode.textureIndexBaseColor = primitive->material.baseColorTexture->index;
+                    geometryNode.textureIndexNormal = primitive->material.normalTexture->index;
+                    geometryNode.textureIndexEmissive = primitive->material.emissiveTexture ? static_cast<int32_t>(primitive->material.emissiveTexture->index) : -1;
+                    memcpy(geometryNode.emissiveFactor, &primitive->material.emissiveFactor, sizeof(geometryNode.emissiveFactor));
+                    geometryNodes.push_back(geometryNode);
+                    geometryNodeAlphaTested.push_back(alphaTested);
+                    geometryNodePrimitives.push_back(primitive);
                 }
             }
-        }
-        for (auto& rangeInfo : buildRangeInfos) {
-            pBuildRangeInfos.push_back(&rangeInfo);
+            if (build.geometries.empty()) {
+                continue;
+            }
+            const uint32_t bottomLevelIndex = static_cast<uint32_t>(bottomLevelASes.size());
+            meshBottomLevelAS[meshFirstIndex] = bottomLevelIndex;
+            const auto deformedMesh = deformedMeshes.find(node);
+            bottomLevelASes.push_back({ {}, firstGeometryNode, static_cast<uint32_t>(build.geometries.size()), deformedMesh != deformedMeshes.end() ? deformedMesh->second : -1 });
+            bottomLevelInstances.push_back({ node, bottomLevelIndex });
+            builds.push_back(std::move(build));
         }
 
         // @todo: stage to device
@@ -230,79 +424,84 @@ public:
             static_cast<uint32_t>(geometryNodes.size()) * sizeof(GeometryNode),
             geometryNodes.data()));
 
-        // Get size info
-        VkAccelerationStructureBuildGeometryInfoKHR
-            accelerationStructureBuildGeometryInfo {};
-        accelerationStructureBuildGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
-        accelerationStructureBuildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
-        accelerationStructureBuildGeometryInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
-        accelerationStructureBuildGeometryInfo.geometryCount = static_cast<uint32_t>(geometries.size());
-        accelerationStructureBuildGeometryInfo.pGeometries = geometries.data();
-
-        VkAccelerationStructureBuildSizesInfoKHR
-            accelerationStructureBuildSizesInfo {};
-        accelerationStructureBuildSizesInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
-        vkGetAccelerationStructureBuildSizesKHR(
-            device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
-            &accelerationStructureBuildGeometryInfo, maxPrimitiveCounts.data(),
-            &accelerationStructureBuildSizesInfo);
-
-        createAccelerationStructure(bottomLevelAS, VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR, accelerationStructureBuildSizesInfo);
-
-        // Create a small scratch buffer used during build of the bottom level
-        // acceleration structure
-        ScratchBuffer scratchBuffer = createScratchBuffer(
-            accelerationStructureBuildSizesInfo.buildScratchSize);
-
-        accelerationStructureBuildGeometryInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
-        accelerationStructureBuildGeometryInfo.dstAccelerationStructure = bottomLevelAS.handle;
-        accelerationStructureBuildGeometryInfo.scratchData.deviceAddress = scratchBuffer.deviceAddress;
-
-        const VkAccelerationStructureBuildRangeInfoKHR* buildOffsetInfo = buildRangeInfos.data();
-
-        // Build the acceleration structure on the device via a one-time command
-        // buffer submission Some implementations may support acceleration structure
-        // building on the host
-        // (VkPhysicalDeviceAccelerationStructureFeaturesKHR->accelerationStructureHostCommands),
-        // but we prefer device builds
-        VkCommandBuffer commandBuffer = vulkanDevice->createCommandBuffer(
-            VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
-        vkCmdBuildAccelerationStructuresKHR(commandBuffer, 1,
-            &accelerationStructureBuildGeometryInfo,
-            pBuildRangeInfos.data());
-        vulkanDevice->flushCommandBuffer(commandBuffer, queue);
+        // Build all acceleration structures that couldn't be restored from the model cache with a single submission
+        // Static geometry is compacted, skinned meshes are built for refits
+        std::vector<AccelerationStructureBuildInput> buildInputs {};
+        std::vector<std::pair<uint32_t, uint64_t>> cacheEntries {};
+        for (uint32_t i = 0; i < builds.size(); i++) {
+            BottomLevelBuild& build = builds[i];
+            AccelerationStructure& bottomLevelAS = bottomLevelASes[i].accelerationStructure;
+
+            // Reuse acceleration structures stored next to the model cache while the model and the selected geometries are unchanged
+            const int32_t deformedMesh = bottomLevelASes[i].deformedMesh;
+            uint64_t cacheHash = 0;
+            if (!model.cacheFile.empty() && deformedMesh < 0) {
+                cacheHash = vks::tools::fnv1a(&build.firstIndex, sizeof(uint32_t), model.cacheHash);
+                cacheHash = vks::tools::fnv1a(build.maxPrimitiveCounts.data(), build.maxPrimitiveCounts.size() * sizeof(uint32_t), cacheHash);
+                for (const VkAccelerationStructureGeometryKHR& geometry : build.geometries) {
+                    cacheHash = vks::tools::fnv1a(&geometry.flags, sizeof(VkGeometryFlagsKHR), cacheHash);
+                }
+                if (loadAccelerationStructure(bottomLevelAS, getBottomLevelCacheFile(i), cacheHash)) {
+                    continue;
+                }
+                cacheEntries.push_back({ i, cacheHash });
+            }
+
+            AccelerationStructureBuildInput buildInput {};
+            buildInput.accelerationStructure = &bottomLevelAS;
+            buildInput.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+            buildInput.usage = deformedMesh < 0 ? AccelerationStructureUsage::Static : AccelerationStructureUsage::Updatable;
+            buildInput.geometries = std::move(build.geometries);
+            buildInput.buildRangeInfos = std::move(build.buildRangeInfos);
+            if (deformedMesh >= 0) {
+                bottomLevelASes[i].updateInput = buildInput;
+                bottomLevelASes[i].builtSurfaceArea = surfaceArea(model.deformedMeshes[deformedMesh].min, model.deformedMeshes[deformedMesh].max);
+            }
+            buildInputs.push_back(std::move(buildInput));
+        }
+        buildAccelerationStructures(buildInputs);
+
+        for (const auto& [index, cacheHash] : cacheEntries) {
+            saveAccelerationStructure(bottomLevelASes[index].accelerationStructure, getBottomLevelCacheFile(index), cacheHash);
+        }
+    }
 
-        deleteScratchBuffer(scratchBuffer);
+    std::string getBottomLevelCacheFile(uint32_t index) const
+    {
+        return model.cacheFile + "." + std::to_string(index) + ".blas";
     }
 
     /*
-                    The top level acceleration structure contains the scene's object
-       instances
+                    The top level acceleration structure contains one instance per glTF
+       node, placed with the node's transform
     */
     void createTopLevelAccelerationStructure()
     {
-        // We flip the matrix [1][1] = -1.0f to accomodate for the glTF up vector
-        VkTransformMatrixKHR transformMatrix = {
-            1.0f, 0.0f, 0.0f, 0.0f,
-            0.0f, -1.0f, 0.0f, 0.0f,
-            0.0f, 0.0f, 1.0f, 0.0f
-        };
-
-        VkAccelerationStructureInstanceKHR instance {};
-        instance.transform = transformMatrix;
-        instance.instanceCustomIndex = 0;
-        instance.mask = 0xFF;
-        instance.instanceShaderBindingTableRecordOffset = 0;
-        instance.flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR;
-        instance.accelerationStructureReference = bottomLevelAS.deviceAddress;
+        std::vector<VkAccelerationStructureInstanceKHR> instances {};
+        for (const BottomLevelInstance& bottomLevelInstance : bottomLevelInstances) {
+            const BottomLevelAS& bottomLevelAS = bottomLevelASes[bottomLevelInstance.bottomLevelAS];
+
+            instanceTransforms.push_back(getInstanceTransform(bottomLevelInstance.node));
+            const glm::mat3x4 transform = glm::mat3x4(glm::transpose(instanceTransforms.back()));
+
+            VkAccelerationStructureInstanceKHR instance {};
+            memcpy(&instance.transform, &transform, sizeof(VkTransformMatrixKHR));
+            // Shaders look up materials and vertex data with gl_InstanceCustomIndexEXT + gl_GeometryIndexEXT
+            instance.instanceCustomIndex = bottomLevelAS.firstGeometryNode;
+            instance.mask = 0xFF;
+            // Every geometry node has a primary and a shadow hit record, selected by the ray's SBT offset
+            instance.instanceShaderBindingTableRecordOffset = bottomLevelAS.firstGeometryNode * hitRecordStride;
+            instance.flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR;
+            instance.accelerationStructureReference = bottomLevelAS.accelerationStructure.deviceAddress;
+            instances.push_back(instance);
+        }
 
         // Buffer for instance data
-        vks::Buffer instancesBuffer;
         VK_CHECK_RESULT(vulkanDevice->createBuffer(
             VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR,
             VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-            &instancesBuffer, sizeof(VkAccelerationStructureInstanceKHR),
-            &instance));
+            &instancesBuffer, instances.size() * sizeof(VkAccelerationStructureInstanceKHR),
+            instances.data()));
 
         VkDeviceOrHostAddressConstKHR instanceDataDeviceAddress {};
         instanceDataDeviceAddress.deviceAddress = getBufferDeviceAddress(instancesBuffer.buffer);
@@ -315,78 +514,34 @@ public:
         accelerationStructureGeometry.geometry.instances.arrayOfPointers = VK_FALSE;
         accelerationStructureGeometry.geometry.instances.data = instanceDataDeviceAddress;
 
-        // Get size info
-        /*
-        The pSrcAccelerationStructure, dstAccelerationStructure, and mode members of
-        pBuildInfo are ignored. Any VkDeviceOrHostAddressKHR members of pBuildInfo
-        are ignored by this command, except that the hostAddress member of
-        VkAccelerationStructureGeometryTrianglesDataKHR::transformData will be
-        examined to check if it is NULL.*
-        */
-        VkAccelerationStructureBuildGeometryInfoKHR
-            accelerationStructureBuildGeometryInfo {};
-        accelerationStructureBuildGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
-        accelerationStructureBuildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
-        accelerationStructureBuildGeometryInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
-        accelerationStructureBuildGeometryInfo.geometryCount = 1;
-        accelerationStructureBuildGeometryInfo.pGeometries = &accelerationStructureGeometry;
-
-        uint32_t primitive_count = 1;
-
-        VkAccelerationStructureBuildSizesInfoKHR
-            accelerationStructureBuildSizesInfo {};
-        accelerationStructureBuildSizesInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
-        vkGetAccelerationStructureBuildSizesKHR(
-            device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
-            &accelerationStructureBuildGeometryInfo, &primitive_count,
-            &accelerationStructureBuildSizesInfo);
-
-        createAccelerationStructure(topLevelAS, VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR, accelerationStructureBuildSizesInfo);
-
-        // Create a small scratch buffer used during build of the top level
-        // acceleration structure
-        ScratchBuffer scratchBuffer = createScratchBuffer(
-            accelerationStructureBuildSizesInfo.buildScratchSize);
-
-        VkAccelerationStructureBuildGeometryInfoKHR accelerationBuildGeometryInfo {};
-        accelerationBuildGeometryInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
-        accelerationBuildGeometryInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
-        accelerationBuildGeometryInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
-        accelerationBuildGeometryInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
-        accelerationBuildGeometryInfo.dstAccelerationStructure = topLevelAS.handle;
-        accelerationBuildGeometryInfo.geometryCount = 1;
-        accelerationBuildGeometryInfo.pGeometries = &accelerationStructureGeometry;
-        accelerationBuildGeometryInfo.scratchData.deviceAddress = scratchBuffer.deviceAddress;
-
         VkAccelerationStructureBuildRangeInfoKHR
             accelerationStructureBuildRangeInfo {};
-        accelerationStructureBuildRangeInfo.primitiveCount = 1;
+        accelerationStructureBuildRangeInfo.primitiveCount = static_cast<uint32_t>(instances.size());
         accelerationStructureBuildRangeInfo.primitiveOffset = 0;
         accelerationStructureBuildRangeInfo.firstVertex = 0;
         accelerationStructureBuildRangeInfo.transformOffset = 0;
-        std::vector<VkAccelerationStructureBuildRangeInfoKHR*>
-            accelerationBuildStructureRangeInfos = {
-                &accelerationStructureBuildRangeInfo
-            };
-
-        // Build the acceleration structure on the device via a one-time command
-        // buffer submission Some implementations may support acceleration structure
-        // building on the host
-        // (VkPhysicalDeviceAccelerationStructureFeaturesKHR->accelerationStructureHostCommands),
-        // but we prefer device builds
-        VkCommandBuffer commandBuffer = vulkanDevice->createCommandBuffer(
-            VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
-        vkCmdBuildAccelerationStructuresKHR(
-            commandBuffer, 1, &accelerationBuildGeometryInfo,
-            accelerationBuildStructureRangeInfos.data());
-        vulkanDevice->flushCommandBuffer(commandBuffer, queue);
 
-        // VkAccelerationStructureDeviceAddressInfoKHR accelerationDeviceAddressInfo {};
-        // accelerationDeviceAddressInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR;
-        // accelerationDeviceAddressInfo.accelerationStructure = topLevelAS.handle;
+        // Without animations instances don't move, so the top level is compacted like the bottom levels
+        const bool animated = !model.animations.empty();
+        topLevelBuildInput.accelerationStructure = &topLevelAS;
+        topLevelBuildInput.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+        topLevelBuildInput.usage = animated ? AccelerationStructureUsage::Updatable : AccelerationStructureUsage::Static;
+        topLevelBuildInput.geometries = { accelerationStructureGeometry };
+        topLevelBuildInput.buildRangeInfos = { accelerationStructureBuildRangeInfo };
+        std::vector<AccelerationStructureBuildInput> buildInputs = { topLevelBuildInput };
+        buildAccelerationStructures(buildInputs);
+
+        if (animated) {
+            VK_CHECK_RESULT(instancesBuffer.map());
+        } else {
+            instancesBuffer.destroy();
+        }
+    }
 
-        deleteScratchBuffer(scratchBuffer);
-        instancesBuffer.destroy();
+    glm::mat4 getInstanceTransform(const vkglTF::Node* node) const
+    {
+        // We flip the matrix [1][1] = -1.0f to accomodate for the glTF up vector
+        return glm::scale(glm::mat4(1.0f), glm::vec3(1.0f, -1.0f, 1.0f)) * const_cast<vkglTF::Node*>(node)->getMatrix();
     }
 
     /*
@@ -398,9 +553,10 @@ public:
                                     /-----------\
                                     | raygen    |
                                     |-----------|
-                                    | miss + shadow *2    |
+                                    | miss + shadow      |
                                     |-----------|
-                                    | hit + any *2 |
+                                    | hit + shadow hit   | per geometry node, with or without any hit
+                                    |        ...         | depending on the material's alpha mode
                                     \-----------/
 
     */
@@ -419,7 +575,8 @@ public:
 
         createShaderBindingTable(shaderBindingTables.raygen, 1);
         createShaderBindingTable(shaderBindingTables.miss, 2);
-        createShaderBindingTable(shaderBindingTables.hit, 2);
+        const uint32_t hitRecordCount = static_cast<uint32_t>(geometryNodeAlphaTested.size()) * hitRecordStride;
+        createShaderBindingTable(shaderBindingTables.hit, hitRecordCount);
 
         // Copy handles
         memcpy(shaderBindingTables.raygen.mapped,
@@ -428,8 +585,15 @@ public:
         // shader binding table
         memcpy(shaderBindingTables.miss.mapped,
             shaderHandleStorage.data() + handleSizeAligned, handleSize * 2);
-        memcpy(shaderBindingTables.hit.mapped,
-            shaderHandleStorage.data() + handleSizeAligned * 3, handleSize * 2);
+        // Hit groups are ordered opaque primary, opaque shadow, alpha tested primary, alpha tested shadow
+        uint8_t* hitRecords = static_cast<uint8_t*>(shaderBindingTables.hit.mapped);
+        for (size_t i = 0; i < geometryNodeAlphaTested.size(); i++) {
+            const uint32_t firstGroup = geometryNodeAlphaTested[i] ? 5 : 3;
+            for (uint32_t j = 0; j < hitRecordStride; j++) {
+                memcpy(hitRecords + (i * hitRecordStride + j) * handleSizeAligned,
+                    shaderHandleStorage.data() + handleSizeAligned * (firstGroup + j), handleSize);
+            }
+        }
     }
 
     /*
@@ -483,12 +647,14 @@ public:
         setLayoutBindingFlags.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO_EXT;
         setLayoutBindingFlags.bindingCount = static_cast<uint32_t>(setLayoutBindings.size());
         std::vector<VkDescriptorBindingFlagsEXT> descriptorBindingFlags = {
-            0, 0, 0, 0, 0, 0, VK_DESCRIPTOR_BINDING_VARIABLE_DESCRIPTOR_COUNT_BIT_EXT
+            0, 0, 0, 0, 0, 0, VK_DESCRIPTOR_BINDING_VARIABLE_DESCRIPTOR_COUNT_BIT_EXT | VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT_EXT
         };
         setLayoutBindingFlags.pBindingFlags = descriptorBindingFlags.data();
 
         VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCI = vks::initializers::descriptorSetLayoutCreateInfo(setLayoutBindings);
         descriptorSetLayoutCI.pNext = &setLayoutBindingFlags;
+        // Model images are streamed in while the scene is already being traced
+        descriptorSetLayoutCI.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT_EXT;
         VK_CHECK_RESULT(vkCreateDescriptorSetLayout(device, &descriptorSetLayoutCI,
             nullptr, &descriptorSetLayout));
 
@@ -503,10 +669,18 @@ public:
         std::vector<VkPipelineShaderStageCreateInfo> shaderStages;
 
         // Ray generation group
+        // SH_BANDS and H_BASIS size the probes in SH.glsl through specialization constants 0 and 1
+        const uint32_t probeLayout[2] = { SH_BANDS, H_BASIS };
+        const std::vector<VkSpecializationMapEntry> probeLayoutEntries = {
+            vks::initializers::specializationMapEntry(0, 0, sizeof(uint32_t)),
+            vks::initializers::specializationMapEntry(1, sizeof(uint32_t), sizeof(uint32_t)),
+        };
+        const VkSpecializationInfo raygenSpecializationInfo = vks::initializers::specializationInfo(probeLayoutEntries, sizeof(probeLayout), probeLayout);
         {
             shaderStages.push_back(
                 loadShader(getShadersPath() + "ssprobe/raygen.rgen.spv",
                     VK_SHADER_STAGE_RAYGEN_BIT_KHR));
+            shaderStages.back().pSpecializationInfo = &raygenSpecializationInfo;
             VkRayTracingShaderGroupCreateInfoKHR shaderGroup {};
             shaderGroup.sType = VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_KHR;
             shaderGroup.type = VK_RAY_TRACING_SHADER_GROUP_TYPE_GENERAL_KHR;
@@ -538,7 +712,9 @@ public:
             shaderGroups.push_back(shaderGroup);
         }
 
-        // Closest hit group for doing texture lookups
+        // Hit groups for opaque geometry, traversal never invokes an any hit shader for them
+        // Shadow rays terminate on the first hit and skip the closest hit shader, so their groups only need an any hit shader
+        // for alpha testing
         {
             shaderStages.push_back(
                 loadShader(getShadersPath() + "ssprobe/closesthit.rchit.spv",
@@ -548,30 +724,32 @@ public:
             shaderGroup.type = VK_RAY_TRACING_SHADER_GROUP_TYPE_TRIANGLES_HIT_GROUP_KHR;
             shaderGroup.generalShader = VK_SHADER_UNUSED_KHR;
             shaderGroup.closestHitShader = static_cast<uint32_t>(shaderStages.size()) - 1;
+            shaderGroup.anyHitShader = VK_SHADER_UNUSED_KHR;
             shaderGroup.intersectionShader = VK_SHADER_UNUSED_KHR;
-            // This group also uses an anyhit shader for doing transparency (see
-            // anyhit.rahit for details)
-            shaderStages.push_back(
-                loadShader(getShadersPath() + "ssprobe/anyhit.rahit.spv",
-                    VK_SHADER_STAGE_ANY_HIT_BIT_KHR));
-            shaderGroup.anyHitShader = static_cast<uint32_t>(shaderStages.size()) - 1;
+            shaderGroups.push_back(shaderGroup);
+            shaderGroup.closestHitShader = VK_SHADER_UNUSED_KHR;
             shaderGroups.push_back(shaderGroup);
         }
 
-        // Closet hit group for check visibility from light
+        // Hit groups for alpha masked and blended geometry, with an anyhit shader for doing transparency (see
+        // anyhit.rahit for details), shadow rays carry a different payload and use their own copy of it
         {
+            const uint32_t closestHitShader = static_cast<uint32_t>(shaderStages.size()) - 1;
             shaderStages.push_back(
-                loadShader(getShadersPath() + "ssprobe/shadow.rchit.spv",
-                    VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR));
+                loadShader(getShadersPath() + "ssprobe/anyhit.rahit.spv",
+                    VK_SHADER_STAGE_ANY_HIT_BIT_KHR));
             VkRayTracingShaderGroupCreateInfoKHR shaderGroup {};
             shaderGroup.sType = VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_KHR;
             shaderGroup.type = VK_RAY_TRACING_SHADER_GROUP_TYPE_TRIANGLES_HIT_GROUP_KHR;
             shaderGroup.generalShader = VK_SHADER_UNUSED_KHR;
-            shaderGroup.closestHitShader = static_cast<uint32_t>(shaderStages.size()) - 1;
+            shaderGroup.closestHitShader = closestHitShader;
+            shaderGroup.anyHitShader = static_cast<uint32_t>(shaderStages.size()) - 1;
             shaderGroup.intersectionShader = VK_SHADER_UNUSED_KHR;
+            shaderGroups.push_back(shaderGroup);
             shaderStages.push_back(
-                loadShader(getShadersPath() + "ssprobe/anyhit.rahit.spv",
+                loadShader(getShadersPath() + "ssprobe/shadow.rahit.spv",
                     VK_SHADER_STAGE_ANY_HIT_BIT_KHR));
+            shaderGroup.closestHitShader = VK_SHADER_UNUSED_KHR;
             shaderGroup.anyHitShader = static_cast<uint32_t>(shaderStages.size()) - 1;
             shaderGroups.push_back(shaderGroup);
         }
@@ -611,6 +789,7 @@ public:
             { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, imageCount },            
         };
         VkDescriptorPoolCreateInfo descriptorPoolCreateInfo = vks::initializers::descriptorPoolCreateInfo(poolSizes, 1);
+        descriptorPoolCreateInfo.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT_EXT;
         VK_CHECK_RESULT(vkCreateDescriptorPool(device, &descriptorPoolCreateInfo,
             nullptr, &descriptorPool));
 
@@ -709,8 +888,142 @@ public:
         uniformData.frame = 0;
     }
 
+    /*
+                    Collect the emissive triangles of all instances in world space into a light table
+                    Triangles are picked proportional to their power with an alias table, the shaders combine these light
+       samples with BSDF sampling through multiple importance sampling
+    */
+    void createEmissiveLightTable()
+    {
+        // Matches EmissiveTriangle in bufferreferences.glsl (scalar layout)
+        struct EmissiveTriangle {
+            glm::vec3 positions[3];
+            uint32_t geometryNode;
+            uint32_t primitiveIndex;
+            float probability;
+            uint32_t alias;
+        };
+        std::vector<EmissiveTriangle> triangles {};
+        std::vector<float> powers {};
+        for (size_t i = 0; i < bottomLevelInstances.size(); i++) {
+            const BottomLevelAS& bottomLevelAS = bottomLevelASes[bottomLevelInstances[i].bottomLevelAS];
+            for (uint32_t j = 0; j < bottomLevelAS.geometryNodeCount; j++) {
+                const uint32_t geometryNode = bottomLevelAS.firstGeometryNode + j;
+                const vkglTF::Primitive* primitive = geometryNodePrimitives[geometryNode];
+                const auto positions = model.emissiveTriangles.find(primitive->firstIndex);
+                if (positions == model.emissiveTriangles.end()) {
+                    continue;
+                }
+                // Textures only modulate the emission, the shaders use the same luminance for the light pdf
+                const float luminance = glm::dot(primitive->material.emissiveFactor, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+                for (uint32_t k = 0; luminance > 0.0f && k + 2 < positions->second.size(); k += 3) {
+                    EmissiveTriangle triangle {};
+                    for (uint32_t l = 0; l < 3; l++) {
+                        triangle.positions[l] = glm::vec3(instanceTransforms[i] * glm::vec4(positions->second[k + l], 1.0f));
+                    }
+                    const float area = 0.5f * glm::length(glm::cross(triangle.positions[1] - triangle.positions[0], triangle.positions[2] - triangle.positions[0]));
+                    if (area <= 0.0f) {
+                        continue;
+                    }
+                    triangle.geometryNode = geometryNode;
+                    triangle.primitiveIndex = k / 3;
+                    triangles.push_back(triangle);
+                    powers.push_back(luminance * area);
+                }
+            }
+        }
+        if (triangles.empty()) {
+            return;
+        }
+
+        std::vector<float> probabilities {};
+        std::vector<uint32_t> aliases {};
+        vks::tools::buildAliasTable(powers, probabilities, aliases);
+        double emissivePower = 0.0;
+        for (size_t i = 0; i < triangles.size(); i++) {
+            triangles[i].probability = probabilities[i];
+            triangles[i].alias = aliases[i];
+            emissivePower += powers[i];
+        }
+
+        VK_CHECK_RESULT(vulkanDevice->createBuffer(
+            VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+            &emissiveTrianglesBuffer,
+            triangles.size() * sizeof(EmissiveTriangle),
+            triangles.data()));
+        lightBlock.emissiveTriangles = getBufferDeviceAddress(emissiveTrianglesBuffer.buffer);
+        lightBlock.emissiveTriangleCount = static_cast<uint32_t>(triangles.size());
+        lightBlock.emissivePower = static_cast<float>(emissivePower);
+    }
+
+    void createBlueNoiseBuffer()
+    {
+        if (uniformData.samplerType != 3) {
+            return;
+        }
+        // Tiled over the screen, every sample dimension reads it with its own offset
+        const std::vector<float> blueNoise = vks::tools::generateBlueNoise(blueNoiseSize);
+        VK_CHECK_RESULT(vulkanDevice->createBuffer(
+            VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+            &blueNoiseBuffer,
+            blueNoise.size() * sizeof(float),
+            (void*)blueNoise.data()));
+        uniformData.blueNoise = getBufferDeviceAddress(blueNoiseBuffer.buffer);
+    }
+
+    void createRadianceCacheBuffer()
+    {
+        if (!RADIANCE_CACHE) {
+            return;
+        }
+        static_assert((RADIANCE_CACHE_CELL_COUNT & (RADIANCE_CACHE_CELL_COUNT - 1)) == 0, "The radiance cache is indexed with a bit mask");
+        VK_CHECK_RESULT(vulkanDevice->createBuffer(
+            VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            &radianceCacheBuffer,
+            RADIANCE_CACHE_CELL_COUNT * radianceCacheCellSize));
+        uniformData.radianceCache = getBufferDeviceAddress(radianceCacheBuffer.buffer);
+        VkCommandBuffer commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+        cmdResetRadianceCache(commandBuffer);
+        vulkanDevice->flushCommandBuffer(commandBuffer, queue);
+    }
+
+    /** @brief Empties every cell, cached light is stale once geometry moved or textures changed */
+    void cmdResetRadianceCache(VkCommandBuffer commandBuffer)
+    {
+        if (!RADIANCE_CACHE) {
+            return;
+        }
+        vkCmdFillBuffer(commandBuffer, radianceCacheBuffer.buffer, 0, VK_WHOLE_SIZE, 0);
+        VkMemoryBarrier memoryBarrier = vks::initializers::memoryBarrier();
+        memoryBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        memoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+    }
+
     void createLightBuffer()
     {
+        // Shading points traverse the light tree to pick a single light instead of tracing a shadow ray to each of them
+        const std::vector<vks::PunctualLight> lights(std::begin(LIGHTS), std::end(LIGHTS));
+        vks::LightTree lightTree;
+        lightTree.build(lights);
+        VK_CHECK_RESULT(vulkanDevice->createBuffer(
+            VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+            &lightsBuffer,
+            lights.size() * sizeof(vks::PunctualLight),
+            (void*)lights.data()));
+        VK_CHECK_RESULT(vulkanDevice->createBuffer(
+            VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+            &lightTreeBuffer,
+            lightTree.nodes.size() * sizeof(vks::LightTree::Node),
+            lightTree.nodes.data()));
+        lightBlock.lights = getBufferDeviceAddress(lightsBuffer.buffer);
+        lightBlock.lightTree = getBufferDeviceAddress(lightTreeBuffer.buffer);
+
         VK_CHECK_RESULT(
             vulkanDevice->createBuffer(VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
@@ -843,6 +1156,9 @@ public:
         physicalDeviceDescriptorIndexingFeatures
             .descriptorBindingVariableDescriptorCount
             = VK_TRUE;
+        physicalDeviceDescriptorIndexingFeatures
+            .descriptorBindingSampledImageUpdateAfterBind
+            = VK_TRUE;
         physicalDeviceDescriptorIndexingFeatures.pNext = &enabledAccelerationStructureFeatures;
 
         deviceCreatepNextChain = &physicalDeviceDescriptorIndexingFeatures;
@@ -853,9 +1169,10 @@ public:
     void loadAssets()
     {
         vkglTF::memoryPropertyFlags = VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
-        const uint32_t gltfLoadingFlags = vkglTF::FileLoadingFlags::FlipY;
-        model.loadFromFile(getAssetPath() + "sponza/sponza.gltf",
+        const uint32_t gltfLoadingFlags = vkglTF::FileLoadingFlags::FlipY | vkglTF::FileLoadingFlags::CacheProcessedModel | vkglTF::FileLoadingFlags::StreamImages;
+        model.loadFromFile<vkglTF::RayTracingVertexLayout>(getAssetPath() + "sponza/sponza.gltf",
             vulkanDevice, queue, gltfLoadingFlags);
+        imageResidency = model.imageResidency();
     }
 
     void prepare()
@@ -867,15 +1184,27 @@ public:
         // Create the acceleration structures used to render the ray traced scene
         createBottomLevelAccelerationStructure();
         createTopLevelAccelerationStructure();
+        createEmissiveLightTable();
 
         createStorageImage(swapChain.colorFormat, { width, height, 1 });
         createStorageBuffer();
         createLightBuffer();
+        createBlueNoiseBuffer();
+        createRadianceCacheBuffer();
         createUniformBuffer();
         createRayTracingPipeline();
+        createProbeMaskPipeline();
+        if (DENOISE) {
+            createDenoiseBuffers();
+            probeDenoiser.create(device, pipelineCache, loadShader(getShadersPath() + "ssprobe/probedenoise.comp.spv", VK_SHADER_STAGE_COMPUTE_BIT), SH_BANDS, { DENOISE_ITERATIONS });
+        }
         createShaderBindingTables();
         createDescriptorSets();
         buildCommandBuffers();
+        classifyProbes();
+        // Report how the scene resources were packed into device memory blocks
+        vulkanDevice->allocator->printStatistics();
+        printAccelerationStructureStatistics();
         prepared = true;
     }
 
@@ -888,63 +1217,469 @@ public:
         VulkanExampleBase::submitFrame();
     }
 
+    /*
+                    Upload model images decoded in the background and point the image array at them
+                    Accumulation restarts when every image is available at low resolution and again once all are complete
+    */
+    void updateStreamedImages()
+    {
+        const std::vector<uint32_t> updatedImages = model.updateStreamedImages(queue);
+        if (updatedImages.empty()) {
+            return;
+        }
+        std::vector<VkDescriptorImageInfo> textureDescriptors(updatedImages.size());
+        std::vector<VkWriteDescriptorSet> writeDescriptorSets(updatedImages.size());
+        for (size_t i = 0; i < updatedImages.size(); i++) {
+            const vkglTF::Texture& texture = model.textures[updatedImages[i]];
+            textureDescriptors[i] = { texture.sampler, texture.view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+            writeDescriptorSets[i] = vks::initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 6, &textureDescriptors[i]);
+            writeDescriptorSets[i].dstArrayElement = updatedImages[i];
+        }
+        vkUpdateDescriptorSets(device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, nullptr);
+
+        const vkglTF::Model::ImageResidency residency = model.imageResidency();
+        if (residency != imageResidency) {
+            imageResidency = residency;
+            uniformData.frame = -1;
+            if (RADIANCE_CACHE) {
+                VkCommandBuffer commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+                cmdResetRadianceCache(commandBuffer);
+                vulkanDevice->flushCommandBuffer(commandBuffer, queue);
+            }
+        }
+    }
+
+    static float surfaceArea(const glm::vec3& min, const glm::vec3& max)
+    {
+        const glm::vec3 extent = glm::max(max - min, glm::vec3(0.0f));
+        return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+    }
+
+    /*
+        Advance the glTF animation and bring the acceleration structures up to date
+        Skinned meshes are refitted, or rebuilt once refits degrade too much, and the top level is updated from the node
+        matrices
+    */
+    void updateSceneAnimation()
+    {
+        if (!animate || model.animations.empty()) {
+            return;
+        }
+        const vkglTF::Animation& animation = model.animations[0];
+        animationTime += frameTimer;
+        if (animationTime > animation.end) {
+            animationTime = animation.start + std::fmod(animationTime - animation.start, std::max(animation.end - animation.start, 1e-3f));
+        }
+        model.updateAnimation(0, animationTime);
+
+        // Moving objects only restart accumulation if they appear large from the camera
+        const glm::vec3 cameraPosition = glm::vec3(glm::inverse(camera.matrices.view)[3]);
+        bool restartAccumulation = false;
+        auto isSignificant = [&](const glm::mat4& transform, const glm::vec3& min, const glm::vec3& max) {
+            const glm::vec3 center = glm::vec3(transform * glm::vec4((min + max) * 0.5f, 1.0f));
+            const float scale = std::max({ glm::length(glm::vec3(transform[0])), glm::length(glm::vec3(transform[1])), glm::length(glm::vec3(transform[2])) });
+            const float radius = glm::length(max - min) * 0.5f * scale;
+            const float distance = std::max(glm::length(center - cameraPosition) - radius, 1e-3f);
+            return radius / distance > accumulationResetAngle;
+        };
+
+        // Deformed meshes are refitted every frame
+        std::vector<AccelerationStructureBuildInput*> buildInputs {};
+        std::vector<VkBuildAccelerationStructureModeKHR> modes {};
+        for (BottomLevelAS& bottomLevelAS : bottomLevelASes) {
+            if (bottomLevelAS.deformedMesh < 0) {
+                continue;
+            }
+            const vkglTF::Model::DeformedMesh& deformedMesh = model.deformedMeshes[bottomLevelAS.deformedMesh];
+            const float area = surfaceArea(deformedMesh.min, deformedMesh.max);
+            if (bottomLevelAS.refitCount >= maxRefitCount || area > bottomLevelAS.builtSurfaceArea * maxRefitSurfaceAreaRatio) {
+                modes.push_back(VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR);
+                bottomLevelAS.refitCount = 0;
+                bottomLevelAS.builtSurfaceArea = area;
+            } else {
+                modes.push_back(VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR);
+                bottomLevelAS.refitCount++;
+            }
+            buildInputs.push_back(&bottomLevelAS.updateInput);
+        }
+
+        // Instances follow their node matrices
+        bool instancesMoved = false;
+        VkAccelerationStructureInstanceKHR* instances = static_cast<VkAccelerationStructureInstanceKHR*>(instancesBuffer.mapped);
+        for (size_t i = 0; i < bottomLevelInstances.size(); i++) {
+            const BottomLevelInstance& bottomLevelInstance = bottomLevelInstances[i];
+            const BottomLevelAS& bottomLevelAS = bottomLevelASes[bottomLevelInstance.bottomLevelAS];
+            const glm::mat4 transform = getInstanceTransform(bottomLevelInstance.node);
+            const bool moved = transform != instanceTransforms[i];
+            glm::vec3 min, max;
+            if (bottomLevelAS.deformedMesh >= 0) {
+                min = model.deformedMeshes[bottomLevelAS.deformedMesh].min;
+                max = model.deformedMeshes[bottomLevelAS.deformedMesh].max;
+            } else if (moved) {
+                min = glm::vec3(FLT_MAX);
+                max = glm::vec3(-FLT_MAX);
+                for (auto primitive : bottomLevelInstance.node->mesh->primitives) {
+                    min = glm::min(min, primitive->dimensions.min);
+                    max = glm::max(max, primitive->dimensions.max);
+                }
+            } else {
+                continue;
+            }
+            restartAccumulation |= isSignificant(transform, min, max);
+            if (moved) {
+                const glm::mat3x4 instanceTransform = glm::mat3x4(glm::transpose(transform));
+                memcpy(&instances[i].transform, &instanceTransform, sizeof(VkTransformMatrixKHR));
+                instanceTransforms[i] = transform;
+                instancesMoved = true;
+            }
+        }
+        if (instancesMoved || !buildInputs.empty()) {
+            // Instances may end up far from where the top level was built, so it's rebuilt regularly as well
+            if (topLevelRefitCount >= maxRefitCount) {
+                modes.push_back(VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR);
+                topLevelRefitCount = 0;
+            } else {
+                modes.push_back(VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR);
+                topLevelRefitCount++;
+            }
+            buildInputs.push_back(&topLevelBuildInput);
+        }
+        if (buildInputs.empty()) {
+            return;
+        }
+
+        VkCommandBuffer commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+        model.updateDeformedMeshes(commandBuffer);
+        cmdUpdateAccelerationStructures(commandBuffer, buildInputs, modes);
+        // Small movements keep the cached light, like they keep the accumulated image
+        if (restartAccumulation) {
+            cmdResetRadianceCache(commandBuffer);
+        }
+        vulkanDevice->flushCommandBuffer(commandBuffer, queue);
+
+        if (restartAccumulation) {
+            uniformData.frame = -1;
+        }
+    }
+
     virtual void render()
     {
         if (!prepared)
             return;
+        updateStreamedImages();
+        updateSceneAnimation();
         updateUniformBuffers();
+        if (uniformData.frame == 0) {
+            classifyProbes();
+        }
         draw();
         std::ios::sync_with_stdio(false);
         std::cerr << "sample count:" << (uniformData.frame) * SAMPLE_COUNT << std::endl;
-        if (uniformData.frame && uniformData.frame % OUTPUT_INTERVAL == 0)
+        if (uniformData.frame && uniformData.frame % OUTPUT_INTERVAL == 0 && imageResidency == vkglTF::Model::ImageResidency::Complete) {
+            if (DENOISE) {
+                denoiseProbes();
+            }
             saveSH();
+        }
     }
 
     void createStorageBuffer() {
-        // Three Band SH Coefficients RGB
-            VkDeviceSize storageBufferSize = width * height * 9 * sizeof(glm::vec3);
+        // RGB SH coefficients of SH_BANDS bands, or H_BASIS coefficients and a normal per probe
+        // Sized for a probe on every pixel, only the slots of the valid probes are used, see classifyProbes
+        VkDeviceSize storageBufferSize = width * height * sizeof(SHProbe);
 
         VK_CHECK_RESULT(vulkanDevice->createBuffer(
-			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
             VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
             &storageBuffer, storageBufferSize)); 
         VK_CHECK_RESULT(storageBuffer.map());
+
+        VK_CHECK_RESULT(vulkanDevice->createBuffer(
+            VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
+            &probeGBuffer, width * height * sizeof(ProbeGBuffer)));
+        VK_CHECK_RESULT(probeGBuffer.map());
+        uniformData.probeGBuffer = getBufferDeviceAddress(probeGBuffer.buffer);
+
+        VK_CHECK_RESULT(vulkanDevice->createBuffer(
+            VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
+            &probeMask, probeMaskWordCount() * sizeof(uint32_t)));
+        VK_CHECK_RESULT(probeMask.map());
+        uniformData.probeMask = getBufferDeviceAddress(probeMask.buffer);
+        VK_CHECK_RESULT(vulkanDevice->createBuffer(
+            VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
+            &probeMaskOffsets, (probeMaskWordCount() + 1) * sizeof(uint32_t)));
+        VK_CHECK_RESULT(probeMaskOffsets.map());
+        uniformData.probeMaskOffsets = getBufferDeviceAddress(probeMaskOffsets.buffer);
+
+        VK_CHECK_RESULT(vulkanDevice->createBuffer(
+            VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            &probeMoments, width * height * sizeof(float)));
+        uniformData.probeMoments = getBufferDeviceAddress(probeMoments.buffer);
+    }
+
+    void createDenoiseBuffers()
+    {
+        const VkDeviceSize probeCount = width * height;
+        const VkBufferUsageFlags usage = VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+        // The result is read back by saveSH, the history starts out without any samples
+        for (uint32_t i = 0; i < 2; i++) {
+            VK_CHECK_RESULT(vulkanDevice->createBuffer(usage,
+                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
+                &denoiseScratch[i], probeCount * sizeof(SHProbe)));
+            VK_CHECK_RESULT(denoiseScratch[i].map());
+            VK_CHECK_RESULT(vulkanDevice->createBuffer(usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &denoiseScratchVariances[i], probeCount * sizeof(float)));
+        }
+        VK_CHECK_RESULT(vulkanDevice->createBuffer(usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &denoisedCounts, probeCount * sizeof(float)));
+        const VkBufferUsageFlags historyUsage = VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+        VK_CHECK_RESULT(vulkanDevice->createBuffer(historyUsage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &historyGBuffer, probeCount * sizeof(ProbeGBuffer)));
+        VK_CHECK_RESULT(vulkanDevice->createBuffer(historyUsage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &historyProbes, probeCount * sizeof(SHProbe)));
+        VK_CHECK_RESULT(vulkanDevice->createBuffer(historyUsage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &historyCounts, probeCount * sizeof(float)));
+        VkCommandBuffer commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+        vkCmdFillBuffer(commandBuffer, historyCounts.buffer, 0, VK_WHOLE_SIZE, 0);
+        vulkanDevice->flushCommandBuffer(commandBuffer, queue);
+    }
+
+    uint32_t probeMaskWordCount() const
+    {
+        return (width * height + 31) / 32;
+    }
+
+    void createProbeMaskPipeline()
+    {
+        VkPushConstantRange pushConstantRange = vks::initializers::pushConstantRange(VK_SHADER_STAGE_COMPUTE_BIT, sizeof(ProbeMaskPushConstants), 0);
+        VkPipelineLayoutCreateInfo pipelineLayoutCI = vks::initializers::pipelineLayoutCreateInfo(nullptr, 0);
+        pipelineLayoutCI.pushConstantRangeCount = 1;
+        pipelineLayoutCI.pPushConstantRanges = &pushConstantRange;
+        VK_CHECK_RESULT(vkCreatePipelineLayout(device, &pipelineLayoutCI, nullptr, &probeMaskPipelineLayout));
+        VkComputePipelineCreateInfo computePipelineCI = vks::initializers::computePipelineCreateInfo(probeMaskPipelineLayout);
+        computePipelineCI.stage = loadShader(getShadersPath() + "ssprobe/probemask.comp.spv", VK_SHADER_STAGE_COMPUTE_BIT);
+        VK_CHECK_RESULT(vkCreateComputePipelines(device, pipelineCache, 1, &computePipelineCI, nullptr, &probeMaskPipeline));
+    }
+
+    /*
+                    Find the probes whose camera ray hits the scene and give them consecutive slots in the SH buffer
+                    Runs whenever accumulation restarts, sky pixels then cost neither rays nor SH buffer traffic
+       until the next restart
+    */
+    void classifyProbes()
+    {
+        // The classification flag is read from the same uniform buffer as the frames in flight
+        VK_CHECK_RESULT(vkQueueWaitIdle(queue));
+        uniformData.probeClassification = 1;
+        memcpy(ubo.mapped, &uniformData, sizeof(uniformData));
+
+        VkCommandBuffer commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+        // The last denoised export of the accumulation that just ended is the history of the next one, together with the
+        // G-buffer it was denoised with, which the classification pass is about to overwrite
+        if (DENOISE && denoised) {
+            const VkDeviceSize probeCount = width * height;
+            VkBufferCopy copyRegion { 0, 0, probeCount * sizeof(SHProbe) };
+            vkCmdCopyBuffer(commandBuffer, denoiseScratch[probeDenoiser.resultIndex()].buffer, historyProbes.buffer, 1, &copyRegion);
+            copyRegion.size = probeCount * sizeof(float);
+            vkCmdCopyBuffer(commandBuffer, denoisedCounts.buffer, historyCounts.buffer, 1, &copyRegion);
+            copyRegion.size = probeCount * sizeof(ProbeGBuffer);
+            vkCmdCopyBuffer(commandBuffer, probeGBuffer.buffer, historyGBuffer.buffer, 1, &copyRegion);
+            denoised = false;
+        }
+        vkCmdFillBuffer(commandBuffer, probeMask.buffer, 0, VK_WHOLE_SIZE, 0);
+        VkMemoryBarrier memoryBarrier = vks::initializers::memoryBarrier();
+        memoryBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        memoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, pipeline);
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, pipelineLayout, 0, 1, &descriptorSet, 0, 0);
+        VkStridedDeviceAddressRegionKHR emptySbtEntry = {};
+        vkCmdTraceRaysKHR(
+            commandBuffer,
+            &shaderBindingTables.raygen.stridedDeviceAddressRegion,
+            &shaderBindingTables.miss.stridedDeviceAddressRegion,
+            &shaderBindingTables.hit.stridedDeviceAddressRegion,
+            &emptySbtEntry,
+            width,
+            height,
+            1);
+        memoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        memoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+
+        const ProbeMaskPushConstants pushConstants { uniformData.probeMask, uniformData.probeMaskOffsets, probeMaskWordCount() };
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, probeMaskPipeline);
+        vkCmdPushConstants(commandBuffer, probeMaskPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(ProbeMaskPushConstants), &pushConstants);
+        vkCmdDispatch(commandBuffer, 1, 1, 1);
+        memoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        memoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_HOST_READ_BIT;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR | VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+        vulkanDevice->flushCommandBuffer(commandBuffer, queue);
+
+        uniformData.probeClassification = 0;
+        memcpy(ubo.mapped, &uniformData, sizeof(uniformData));
+    }
+
+    /*
+                    Denoise the accumulated probes before they are exported, with the variance of the accumulation and the
+       history of the last restart, see vks::ProbeDenoiser
+    */
+    void denoiseProbes()
+    {
+        VkCommandBuffer commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+        // The accumulation of the frame just submitted is read
+        VkMemoryBarrier memoryBarrier = vks::initializers::memoryBarrier();
+        memoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        memoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+        vks::ProbeDenoiser::Buffers buffers {};
+        buffers.probeGBuffer = uniformData.probeGBuffer;
+        buffers.probeMask = uniformData.probeMask;
+        buffers.probeMaskOffsets = uniformData.probeMaskOffsets;
+        buffers.probes = getBufferDeviceAddress(storageBuffer.buffer);
+        buffers.moments = uniformData.probeMoments;
+        for (uint32_t i = 0; i < 2; i++) {
+            buffers.scratch[i] = getBufferDeviceAddress(denoiseScratch[i].buffer);
+            buffers.scratchVariances[i] = getBufferDeviceAddress(denoiseScratchVariances[i].buffer);
+        }
+        buffers.historyGBuffer = getBufferDeviceAddress(historyGBuffer.buffer);
+        buffers.historyProbes = getBufferDeviceAddress(historyProbes.buffer);
+        buffers.historyCounts = getBufferDeviceAddress(historyCounts.buffer);
+        buffers.resultCounts = getBufferDeviceAddress(denoisedCounts.buffer);
+        // Frames 0 to uniformData.frame are accumulated
+        const uint32_t frameCount = uniformData.frame + 1;
+        probeDenoiser.cmdDenoise(commandBuffer, buffers, width, height, frameCount, static_cast<float>(frameCount * SAMPLE_COUNT));
+        memoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        memoryBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT | VK_ACCESS_TRANSFER_READ_BIT;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_HOST_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+        vulkanDevice->flushCommandBuffer(commandBuffer, queue);
+        denoised = true;
     }
 
     void saveSH() {
-        const auto data = static_cast<glm::vec3*>(storageBuffer.mapped);
-        std::vector<glm::vec3> sh;
-        sh.resize(width*height*9);
-        memcpy(sh.data(), data, width*height*9*sizeof(glm::vec3));
+        // Only valid probes are stored, packed in scanline order, see probe_slot in raygen.rgen
+        const auto mask = static_cast<const uint32_t*>(probeMask.mapped);
+        const auto offsets = static_cast<const uint32_t*>(probeMaskOffsets.mapped);
+        const uint32_t probeCount = offsets[probeMaskWordCount()];
+        auto probeValid = [&](uint32_t index) { return (mask[index / 32] >> (index % 32) & 1u) != 0; };
+        auto rowSlot = [&](uint32_t y)
+        {
+            const uint32_t index = y * width;
+            return y == height ? probeCount : offsets[index / 32] + static_cast<uint32_t>(std::popcount(mask[index / 32] & ((1u << (index % 32)) - 1u)));
+        };
+        std::vector<SHProbe> sh;
+        if (DENOISE)
+        {
+            // The denoiser writes a probe for every pixel, the valid ones are packed like in the SH buffer
+            const auto data = static_cast<const SHProbe*>(denoiseScratch[probeDenoiser.resultIndex()].mapped);
+            sh.reserve(probeCount);
+            for (uint32_t i = 0; i < width * height; i++)
+            {
+                if (probeValid(i))
+                {
+                    sh.push_back(data[i]);
+                }
+            }
+        }
+        else
+        {
+            const auto data = static_cast<SHProbe*>(storageBuffer.mapped);
+            sh.assign(data, data + probeCount);
+        }
+        const auto gbuffer = static_cast<const ProbeGBuffer*>(probeGBuffer.mapped);
         std::cerr << "Saving SH coefficients...";
         using namespace nlohmann;
-        json j;
-        for (uint32_t y = 0; y <height;y++)
+        auto toString = [](const float in)
+        {
+            std::stringstream ss;
+            ss << std::setprecision(5) << in;
+            return ss.str();
+        };
+        auto writeCoefficients = [&](json& probe, const char* key, const auto& coefficients)
+        {
+            for (const glm::vec3& coefficient : coefficients)
+            {
+                probe[key].push_back({ toString(coefficient.x), toString(coefficient.y), toString(coefficient.z) });
+            }
+        };
+        // Probes whose camera ray missed the scene are left out, the others carry the depth "d" and packed normal "n" of the hit
+        auto writeProbe = [&](uint32_t x, uint32_t y)
+        {
+            const ProbeGBuffer& hit = gbuffer[y*width+x];
+            json probe;
+            probe["x"] =x;
+            probe["y"] =y;
+            probe["d"] = toString(hit.depth);
+            probe["n"] = hit.normal;
+            return probe;
+        };
+        // Rows are converted to the export payload with the batch kernels of sphericalharmonics.hpp
+        auto writeRow = [&](json& row, auto* probes, uint32_t y)
         {
+            std::vector<uint32_t> columns;
             for (uint32_t x = 0; x < width; x++)
             {
-                uint32_t index = (y*width+x)*9;
-            	json probe;
-                probe["x"] =x;
-                probe["y"] =y;
-                for (uint32_t k = 0; k < 9; k++)
-				{
-                auto toString = [](const float in)
+                if (probeValid(y*width+x))
+                {
+                    columns.push_back(x);
+                }
+            }
+            const uint32_t count = static_cast<uint32_t>(columns.size());
+            if constexpr (requires { probes->normal; })
+            {
+                // H-basis probes are evaluated around "n"
+                for (uint32_t i = 0; i < count; i++)
                 {
-					std::stringstream ss;
-					ss << std::setprecision(5) << in;
-					return ss.str();
-				};
-                
-					probe["v"].push_back({ toString(sh[index+k].x), toString(sh[index+k].y), toString(sh[index+k].z) });
-				}
-				j.push_back(probe);
-			}
-		}
+                    json probe = writeProbe(columns[i], y);
+                    writeCoefficients(probe, "v", probes[i]);
+                    row.push_back(std::move(probe));
+                }
+            }
+            else
+            {
+                std::vector<vks::sh::AmbientCube> cubes;
+                if (exportType == 1)
+                {
+                    vks::sh::convolveCosineBatch(probes, count);
+                }
+                else if (exportType == 2)
+                {
+                    cubes.resize(count);
+                    vks::sh::ambientCubeBatch(probes, cubes.data(), count);
+                }
+                for (uint32_t i = 0; i < count; i++)
+                {
+                    json probe = writeProbe(columns[i], y);
+                    if (exportType == 2)
+                    {
+                        writeCoefficients(probe, "c", cubes[i]);
+                    }
+                    else
+                    {
+                        writeCoefficients(probe, exportType == 1 ? "e" : "v", probes[i]);
+                    }
+                    row.push_back(std::move(probe));
+                }
+            }
+        };
+        // Formatting dominates the export, so rows of probes are built in parallel and joined in order
+        std::vector<json> rows(height);
+        vks::TaskScheduler::shared().parallelFor(0, height, [&](uint32_t y)
+        {
+            writeRow(rows[y], sh.data() + rowSlot(y), y);
+        });
+        json j = json::array();
+        for (json& row : rows)
+        {
+            for (json& probe : row)
+            {
+                j.push_back(std::move(probe));
+            }
+        }
         std::string file("sh.json");
     	std::ofstream o(file);
         o <<  j << std::endl;
-        std::cerr<<"\rData saved to "<<file<<std::endl;
+        std::cerr<<"\rData saved to "<<file<<" ("<<probeCount<<"/"<<width * height<<" valid probes)"<<std::endl;
     }
 
     virtual void viewChanged() { uniformData.frame = -1; }
@@ -0,0 +1,33 @@
+// Generated by vkglTF::VertexLayout::glsl() for a 24 byte vertex, do not edit by hand
+
+const uint VERTEX_STRIDE=6;
+
+struct Vertex{
+    vec3 pos;
+    vec3 normal;
+    vec2 uv;
+    vec4 tangent;
+};
+
+vec3 octDecode(vec2 e){
+    vec3 n=vec3(e.xy,1.-abs(e.x)-abs(e.y));
+    float t=max(-n.z,0.);
+    n.x+=n.x>=0.?-t:t;
+    n.y+=n.y>=0.?-t:t;
+    return normalize(n);
+}
+
+vec4 unpackTangentOct(uint p){
+    vec2 e=vec2(p&0x7fffu,(p>>15)&0x7fffu)*(2./32767.)-1.;
+    return vec4(octDecode(e),(p&0x40000000u)!=0u?-1.:1.);
+}
+
+Vertex unpackVertex(Vertices vertices,uint index){
+    const uint offset=index*VERTEX_STRIDE;
+    Vertex vertex;
+    vertex.pos=uintBitsToFloat(uvec3(vertices.v[offset+0],vertices.v[offset+1],vertices.v[offset+2]));
+    vertex.normal=octDecode(unpackSnorm2x16(vertices.v[offset+3]));
+    vertex.uv=unpackHalf2x16(vertices.v[offset+4]);
+    vertex.tangent=unpackTangentOct(vertices.v[offset+5]);
+    return vertex;
+}
@@ -0,0 +1,129 @@
+// Sample generators indexed by (pixel, sample, dimension), selected with ubo.samplerType
+// Requires the UBO, GL_EXT_buffer_reference2, GL_EXT_scalar_block_layout and random.glsl for the LCG
+
+#define SAMPLER_LCG 0
+#define SAMPLER_SOBOL 1
+#define SAMPLER_LATTICE 2
+#define SAMPLER_BLUE_NOISE 3
+
+// Dimensions used by the camera ray and reserved for every bounce, see sampler_set_bounce
+#define SAMPLER_CAMERA_DIMENSIONS 2
+#define SAMPLER_BOUNCE_DIMENSIONS 8
+
+#define BLUE_NOISE_SIZE 64
+
+layout(buffer_reference,scalar)buffer BlueNoise{float v[];};
+
+// lowbias32 integer hash by Chris Wellons
+uint hash(uint x){
+	x^=x>>16;
+	x*=0x7feb352du;
+	x^=x>>15;
+	x*=0x846ca68bu;
+	x^=x>>16;
+	return x;
+}
+
+uint hash_combine(uint seed,uint v){
+	return seed^(v+0x9e3779b9u+(seed<<6)+(seed>>2));
+}
+
+// Fixed point fraction to float in [0, 1), only the upper 24 bits fit the mantissa
+float to_unorm(uint x){
+	return float(x>>8)*(1./16777216.);
+}
+
+// Owen scrambling of a fixed point fraction, see "Practical Hash-based Owen Scrambling" (Burley)
+uint nested_uniform_scramble(uint x,uint seed){
+	x=bitfieldReverse(x);
+	x+=seed;
+	x^=x*0x6c50b47cu;
+	x^=x*0xb82f1e52u;
+	x^=x*0xc7afe638u;
+	x^=x*0x8d22f6e6u;
+	return bitfieldReverse(x);
+}
+
+// The first Sobol dimension is the bit reversed index, the second one is generated by the Pascal matrix
+uint sobol_second_dimension(uint index){
+	uint result=0u;
+	uint v=1u<<31;
+	for(;index!=0u;index>>=1){
+		if((index&1u)!=0u){
+			result^=v;
+		}
+		v^=v>>1;
+	}
+	return result;
+}
+
+// Every pixel gets its own scramble seed, the LCG instead restarts from a new seed each frame
+SamplerState sampler_init(uvec2 pixel){
+	SamplerState rng;
+	uint pixelIndex=pixel.y*gl_LaunchSizeEXT.x+pixel.x;
+	rng.seed=ubo.samplerType==SAMPLER_LCG?tea(pixelIndex,ubo.randomSeed):hash(pixelIndex);
+	rng.index=0;
+	rng.dimension=0;
+	rng.pixel=(pixel.y<<16)|pixel.x;
+	return rng;
+}
+
+void sampler_start(inout SamplerState rng,uint sampleIndex){
+	rng.index=sampleIndex;
+	rng.dimension=0;
+}
+
+// Bounces start at fixed dimensions, so a branch drawing fewer samples doesn't shift the dimensions of later bounces
+void sampler_set_bounce(inout SamplerState rng,uint depth){
+	rng.dimension=SAMPLER_CAMERA_DIMENSIONS+depth*SAMPLER_BOUNCE_DIMENSIONS;
+}
+
+// Tiled blue noise, shifted by a per dimension offset and advanced over the samples by a rank-1 lattice generator
+uint blue_noise(SamplerState rng,uint dimension,uint generator){
+	uint offset=hash(dimension);
+	uvec2 texel=(uvec2(rng.pixel&0xffffu,rng.pixel>>16)+uvec2(offset,offset>>16))%BLUE_NOISE_SIZE;
+	float value=BlueNoise(ubo.blueNoise).v[texel.y*BLUE_NOISE_SIZE+texel.x];
+	return uint(value*4294967296.)+rng.index*generator;
+}
+
+float sample1D(inout SamplerState rng){
+	if(ubo.samplerType==SAMPLER_LCG){
+		return rnd(rng.seed);
+	}
+	uint dimension=rng.dimension++;
+	uint seed=hash_combine(rng.seed,hash(dimension));
+	if(ubo.samplerType==SAMPLER_SOBOL){
+		// Shuffling the index decorrelates the dimensions, which all use the first Sobol dimension
+		uint index=nested_uniform_scramble(rng.index,seed);
+		return to_unorm(nested_uniform_scramble(bitfieldReverse(index),hash_combine(seed,1u)));
+	}
+	if(ubo.samplerType==SAMPLER_LATTICE){
+		// Rank-1 lattice with the golden ratio generator, randomized with a Cranley-Patterson rotation
+		return to_unorm(rng.index*0x9e3779b9u+hash(seed));
+	}
+	return to_unorm(blue_noise(rng,dimension,0x9e3779b9u));
+}
+
+vec2 sample2D(inout SamplerState rng){
+	if(ubo.samplerType==SAMPLER_SOBOL){
+		uint seed=hash_combine(rng.seed,hash(rng.dimension));
+		rng.dimension+=2;
+		uint index=nested_uniform_scramble(rng.index,seed);
+		return vec2(to_unorm(nested_uniform_scramble(bitfieldReverse(index),hash_combine(seed,1u))),
+		to_unorm(nested_uniform_scramble(sobol_second_dimension(index),hash_combine(seed,2u))));
+	}
+	if(ubo.samplerType==SAMPLER_LATTICE){
+		// R2 sequence generators, 1/phi2 and 1/phi2^2 of the plastic number
+		uint seed=hash_combine(rng.seed,hash(rng.dimension));
+		rng.dimension+=2;
+		return vec2(to_unorm(rng.index*0xc13fa9a9u+hash(seed)),to_unorm(rng.index*0x91e10da5u+hash(hash(seed))));
+	}
+	if(ubo.samplerType==SAMPLER_BLUE_NOISE){
+		// The R2 generators of the lattice, with the golden ratio in both dimensions the samples of a pixel lie on a line
+		uint dimension=rng.dimension;
+		rng.dimension+=2;
+		return vec2(to_unorm(blue_noise(rng,dimension,0xc13fa9a9u)),to_unorm(blue_noise(rng,dimension+1,0x91e10da5u)));
+	}
+	float x=sample1D(rng);
+	return vec2(x,sample1D(rng));
+}
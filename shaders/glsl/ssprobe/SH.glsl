@@ -10,32 +10,100 @@
 // L = 1                                                  0.5*sqrt(1/pi)
 // L = 2                         -sqrt(3/(4pi))*y         sqrt(3/(4pi))*z       -sqrt(3/(4pi))*x
 // L = 3  0.5*sqrt(15/pi)*x*y  -0.5*sqrt(15/pi)*y*z  0.25*sqrt(5/pi)*(3z^2-1)  -0.5*sqrt(15/pi)*x*z  0.25*sqrt(15/pi)*(x^2-y^2)
+// L = 4 goes beyond UE5 and uses the real SH without Condon-Shortley phase, M=-3..3:
+//   0.590044*y*(3x^2-y^2)  2.890611*x*y*z  0.457046*y*(5z^2-1)  0.373176*z*(5z^2-3)  0.457046*x*(5z^2-1)  1.445306*z*(x^2-y^2)  0.590044*x*(x^2-3y^2)
+
+// Band count, set by the host through specialization constant 0 (SH_BANDS in base/probesettings.hpp): 2 bands hold 4 coefficients
+// for diffuse only use, 3 bands 9 and 4 bands 16
+layout(constant_id=0)const uint SH_BANDS=3;
+const uint SH_COEFFICIENT_COUNT=SH_BANDS*SH_BANDS;
+// Local arrays are sized for the largest band count, the coefficients past SH_COEFFICIENT_COUNT are never touched and
+// get removed once the pipeline is specialized
+#define SH_MAX_COEFFICIENT_COUNT 16
 uint getIndex(int l,int m){
     return l*(l-1)+m;
 }
 
-void update(inout vec3 SH[9],vec3 direction,vec3 value){
+void update(inout vec3 SH[SH_MAX_COEFFICIENT_COUNT],vec3 direction,vec3 value){
     direction=normalize(direction);
     float x=direction.x,y=direction.y,z=direction.z;
     SH[getIndex(1,0)]+=value*.282095;
-    SH[getIndex(2,-1)]+=-value*.488603*y;
-    SH[getIndex(2,1)]+=value*.488603*z;
-    SH[getIndex(2,0)]+=-value*.488603*x;
-    SH[getIndex(3,-2)]+=value*1.092548*x*y;
-    SH[getIndex(3,-1)]+=-value*-1.092548*y*z;
-    SH[getIndex(3,0)]+=value*.315392*(3.*z*z-1.);
-    SH[getIndex(3,1)]+=-value*-1.092548*x*z;
-    SH[getIndex(3,2)]+=value*.546274*(x*x-y*y);
-}
-
-vec3 loadSH(uint bias){
-    bias*=3;
+    if(SH_BANDS>1){
+        SH[getIndex(2,-1)]+=-value*.488603*y;
+        SH[getIndex(2,1)]+=value*.488603*z;
+        SH[getIndex(2,0)]+=-value*.488603*x;
+    }
+    if(SH_BANDS>2){
+        SH[getIndex(3,-2)]+=value*1.092548*x*y;
+        SH[getIndex(3,-1)]+=-value*-1.092548*y*z;
+        SH[getIndex(3,0)]+=value*.315392*(3.*z*z-1.);
+        SH[getIndex(3,1)]+=-value*-1.092548*x*z;
+        SH[getIndex(3,2)]+=value*.546274*(x*x-y*y);
+    }
+    if(SH_BANDS>3){
+        SH[getIndex(4,-3)]+=value*.590044*y*(3.*x*x-y*y);
+        SH[getIndex(4,-2)]+=value*2.890611*x*y*z;
+        SH[getIndex(4,-1)]+=value*.457046*y*(5.*z*z-1.);
+        SH[getIndex(4,0)]+=value*.373176*z*(5.*z*z-3.);
+        SH[getIndex(4,1)]+=value*.457046*x*(5.*z*z-1.);
+        SH[getIndex(4,2)]+=value*1.445306*z*(x*x-y*y);
+        SH[getIndex(4,3)]+=value*.590044*x*(x*x-3.*y*y);
+    }
+}
+
+// H-basis, see "Efficient Irradiance Normal Mapping" (Habel and Wimmer): 4 or 6 functions orthonormal over the hemisphere
+// around +z, so probes only store the hemisphere above their surface, in the tangent frame of the probe normal
+// Set by the host through specialization constant 1 (H_BASIS in base/probesettings.hpp), 0 keeps the SH over the full sphere
+layout(constant_id=1)const uint H_BASIS_COUNT=0;
+
+void update_hbasis(inout vec3 H[SH_MAX_COEFFICIENT_COUNT],vec3 direction,vec3 value){
+    direction=normalize(direction);
+    float x=direction.x,y=direction.y,z=direction.z;
+    H[0]+=value*.398942;
+    H[1]+=value*.690988*x;
+    H[2]+=value*.690988*(2.*z-1.);
+    H[3]+=value*.690988*y;
+    if(H_BASIS_COUNT>4){
+        H[4]+=value*1.545097*x*y;
+        H[5]+=value*.772548*(x*x-y*y);
+    }
+}
+
+// Octahedral normal as two 16 bit snorm values, H-basis probes are evaluated in the tangent frame of the decoded normal
+uint pack_probe_normal(vec3 n){
+    n/=max(abs(n.x)+abs(n.y)+abs(n.z),1e-8);
+    vec2 e=n.z>=0.?n.xy:(1.-abs(n.yx))*vec2(n.x>=0.?1.:-1.,n.y>=0.?1.:-1.);
+    return packSnorm2x16(e);
+}
+
+vec3 unpack_probe_normal(uint p){
+    vec2 e=unpackSnorm2x16(p);
+    vec3 n=vec3(e.xy,1.-abs(e.x)-abs(e.y));
+    float t=max(-n.z,0.);
+    n.x+=n.x>=0.?-t:t;
+    n.y+=n.y>=0.?-t:t;
+    return normalize(n);
+}
+
+// Floats per probe in the SH buffer, H-basis probes end with their packed normal
+const uint PROBE_COEFFICIENT_COUNT=H_BASIS_COUNT>0?H_BASIS_COUNT:SH_COEFFICIENT_COUNT;
+const uint PROBE_STRIDE=PROBE_COEFFICIENT_COUNT*3+(H_BASIS_COUNT>0?1:0);
+
+// Shaders without the SH buffer binding (probegather.comp) define SH_NO_PROBE_STORAGE and address the probes themselves
+#ifndef SH_NO_PROBE_STORAGE
+vec3 loadSH(uint probe,uint i){
+    uint bias=probe*PROBE_STRIDE+i*3;
     return vec3(shCoefficients.SH[bias],shCoefficients.SH[bias+1],shCoefficients.SH[bias+2]);
 }
 
-void storeSH(vec3 value,uint bias){
-    bias*=3;
+void storeSH(vec3 value,uint probe,uint i){
+    uint bias=probe*PROBE_STRIDE+i*3;
     shCoefficients.SH[bias]=value.x;
     shCoefficients.SH[bias+1]=value.y;
     shCoefficients.SH[bias+2]=value.z;
 }
+
+void storeProbeNormal(uint probe,uint packedNormal){
+    shCoefficients.SH[probe*PROBE_STRIDE+PROBE_COEFFICIENT_COUNT*3]=uintBitsToFloat(packedNormal);
+}
+#endif
@@ -10,6 +10,39 @@ layout(push_constant)uniform BufferReferences{
 	uint64_t bufferAddress;
 }bufferReferences;
 
-layout(buffer_reference,scalar)buffer Vertices{vec4 v[];};
+layout(buffer_reference,scalar)buffer Vertices{uint v[];};
 layout(buffer_reference,scalar)buffer Indices{uint i[];};
-layout(buffer_reference,scalar)buffer Data{vec4 f[];};
\ No newline at end of file
+layout(buffer_reference,scalar)buffer Data{vec4 f[];};
+
+// Emissive light table entry, triangles are picked with the alias table formed by probability and alias
+struct EmissiveTriangle{
+	vec3 positions[3];
+	uint geometryNode;
+	uint primitiveIndex;
+	float probability;
+	uint alias;
+};
+layout(buffer_reference,scalar)buffer EmissiveTriangles{EmissiveTriangle t[];};
+
+// Point or spot light, matches vks::PunctualLight
+struct PunctualLight{
+	vec4 position;
+	vec3 color;
+	float intensity;
+	vec3 direction;
+	float cosOuterAngle;
+	float cosInnerAngle;
+};
+layout(buffer_reference,scalar)buffer PunctualLights{PunctualLight l[];};
+
+// Light hierarchy node, matches vks::LightTree::Node
+struct LightTreeNode{
+	vec3 boundsMin;
+	float power;
+	vec3 boundsMax;
+	uint firstChild;
+	vec3 axis;
+	float cosOrientation;
+	uint light;
+};
+layout(buffer_reference,scalar)buffer LightTreeNodes{LightTreeNode n[];};
\ No newline at end of file
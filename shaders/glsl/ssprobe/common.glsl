@@ -1,13 +1,40 @@
+// Position of a path in the sample sequence, see sampler.glsl
+struct SamplerState{
+    // Per pixel scramble seed, the LCG state for SAMPLER_LCG
+    uint seed;
+    uint index;
+    uint dimension;
+    // Pixel coordinates packed into 16 bits each
+    uint pixel;
+};
+
 struct RayPayload{
     vec3 radiance;
     vec3 worldpos;
+    // Geometric normal facing the ray, probe tracing samples the hemisphere around it
+    vec3 normal;
     vec3 samplevec;
     vec3 brdf;
     float cosine;
     float pdf;
-    uint seed;
+    SamplerState rng;
+    // Ray cone for texture LOD, the width at the ray origin and the spread angle, see textureLOD in geometrytypes.glsl
+    float coneWidth;
+    float coneSpread;
     bool lightingflag;
     bool recursiveflag;
+    // Set by a hit that sampled emissive lights, emission found by its BSDF sample is then weighted with MIS
+    bool misflag;
 };
 
+// Payload of shadow rays, dist is set to -1 by the miss shader, the cone lets alpha tested any hits pick a mip level
+struct ShadowPayload{
+    float dist;
+    float coneWidth;
+    float coneSpread;
+};
+
+// A diffuse bounce scatters the cone, so textures seen by the next ray are read from coarser mips
+const float diffuseConeSpread=.25;
+
 const float PI=3.1415926535897932384626433832795;
\ No newline at end of file
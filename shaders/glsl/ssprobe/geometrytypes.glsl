@@ -4,53 +4,79 @@
 *
 */
 
-struct Vertex{
-    vec3 pos;
-    vec3 normal;
-    vec2 uv;
-    vec4 tangent;
-};
+// Vertex struct and unpackVertex() are generated from vkglTF::RayTracingVertexLayout
+#include "../common/vertexlayout.glsl"
 
 struct Triangle{
     Vertex vertices[3];
     vec3 normal;
     vec2 uv;
     vec4 tangent;
+    // Geometric normal in world space, on the side the winding of the vertices gives it
+    vec3 faceNormal;
+    // Half the log2 of the texture space area per world space area, see textureLOD
+    float lodConstant;
 };
 
+// Every mesh stores its geometry nodes consecutively, the instance custom index of a TLAS instance is the first node of its mesh
+GeometryNode hitGeometryNode()
+{
+    return geometryNodes.nodes[gl_InstanceCustomIndexEXT+gl_GeometryIndexEXT];
+}
+
 // This function will unpack our vertex buffer data into a single triangle and calculates uv coordinates
+// Vertices are stored in object space, normal and tangent are returned in world space
 
 Triangle unpackTriangle(uint index)
 {
     Triangle tri;
     const uint triIndex=index*3;
     
-    GeometryNode geometryNode=geometryNodes.nodes[gl_GeometryIndexEXT];
+    GeometryNode geometryNode=hitGeometryNode();
     
     Indices indices=Indices(geometryNode.indexBufferDeviceAddress);
     Vertices vertices=Vertices(geometryNode.vertexBufferDeviceAddress);
     
     // Unpack vertices
-    // Data is packed as vec4 so we can map to the glTF vertex structure from the host side
-    // We match vkglTF::Vertex: pos.xyz+normal.x, normalyz+uv.xy
-    // glm::vec3 pos;
-    // glm::vec3 normal;
-    // glm::vec2 uv;
-    // ...
+    // The vertex buffer uses the compact vkglTF::RayTracingVertexLayout, see vertexlayout.glsl
     for(uint i=0;i<3;i++){
-        const uint offset=indices.i[triIndex+i]*6;
-        // 6 = sizeof(vkglTF::Vertex)/sizeof(vec4)
-        vec4 d0=vertices.v[offset+0];// pos.xyz, n.x
-        vec4 d1=vertices.v[offset+1];// n.yz, uv.xy
-        tri.vertices[i].pos=d0.xyz;
-        tri.vertices[i].normal=vec3(d0.w,d1.xy);
-        tri.vertices[i].uv=d1.zw;
-        tri.vertices[i].tangent=vertices.v[offset+2];// t.xyz, t.w
+        tri.vertices[i]=unpackVertex(vertices,indices.i[triIndex+i]);
     }
     // Calculate values at barycentric coordinates
     vec3 barycentricCoords=vec3(1.f-attribs.x-attribs.y,attribs.x,attribs.y);
     tri.uv=tri.vertices[0].uv*barycentricCoords.x+tri.vertices[1].uv*barycentricCoords.y+tri.vertices[2].uv*barycentricCoords.z;
     tri.normal=tri.vertices[0].normal*barycentricCoords.x+tri.vertices[1].normal*barycentricCoords.y+tri.vertices[2].normal*barycentricCoords.z;
     tri.tangent=tri.vertices[0].tangent*barycentricCoords.x+tri.vertices[1].tangent*barycentricCoords.y+tri.vertices[2].tangent*barycentricCoords.z;
+    // Normals use the inverse transpose of the instance transform
+    tri.normal=tri.normal*mat3(gl_WorldToObjectEXT);
+    tri.tangent.xyz=mat3(gl_ObjectToWorldEXT)*tri.tangent.xyz;
+    vec3 edge1=gl_ObjectToWorldEXT*vec4(tri.vertices[1].pos-tri.vertices[0].pos,0.);
+    vec3 edge2=gl_ObjectToWorldEXT*vec4(tri.vertices[2].pos-tri.vertices[0].pos,0.);
+    tri.faceNormal=normalize(cross(edge1,edge2));
+    vec2 uvEdge1=tri.vertices[1].uv-tri.vertices[0].uv;
+    vec2 uvEdge2=tri.vertices[2].uv-tri.vertices[0].uv;
+    float uvArea=abs(uvEdge1.x*uvEdge2.y-uvEdge2.x*uvEdge1.y);
+    tri.lodConstant=.5*log2(max(uvArea,1e-12)/max(length(cross(edge1,edge2)),1e-12));
     return tri;
+}
+
+// Mip level covered by a ray cone of the given width at the hit, see "Improved Shader and Texture Level of Detail Using
+// Ray Cones" (Akenine-Moller et al.), ray tracing stages have no derivatives so texture() would always read mip 0
+float textureLOD(Triangle tri,int textureIndex,float coneWidth)
+{
+    vec2 size=vec2(textureSize(textures[nonuniformEXT(textureIndex)],0));
+    float cosine=abs(dot(normalize(tri.normal),normalize(gl_WorldRayDirectionEXT)));
+    return tri.lodConstant+.5*log2(size.x*size.y)+log2(max(coneWidth,1e-8))-log2(max(cosine,1e-4));
+}
+
+// Texture coordinates at the given barycentrics of any triangle, e.g. a point sampled on an emissive triangle
+vec2 triangleUV(GeometryNode geometryNode,uint index,vec3 barycentricCoords)
+{
+    Indices indices=Indices(geometryNode.indexBufferDeviceAddress);
+    Vertices vertices=Vertices(geometryNode.vertexBufferDeviceAddress);
+    vec2 uv=vec2(0.);
+    for(uint i=0;i<3;i++){
+        uv+=unpackVertex(vertices,indices.i[index*3+i]).uv*barycentricCoords[i];
+    }
+    return uv;
 }
\ No newline at end of file
@@ -0,0 +1,127 @@
+// World space hash grid caching the indirect light leaving path vertices, keyed on the quantized position and normal
+// Completed paths write every vertex back, later paths stop at cells holding enough samples and use their average
+// Requires the UBO and sampler.glsl for the hashes
+
+// Cells probed after the hashed one before giving up
+#define RADIANCE_CACHE_PROBES 8
+#define RADIANCE_CACHE_INVALID 0xffffffffu
+// Vertices of a path recorded for the update, deeper ones are only used to terminate paths
+#define RADIANCE_CACHE_MAX_VERTICES 8
+// Vertices before this depth are always traced, so the cell grid doesn't show up in the first bounce
+#define RADIANCE_CACHE_QUERY_DEPTH 2
+// Radiance is accumulated in fixed point, clamped and capped per cell so the sums can't overflow
+#define RADIANCE_CACHE_SCALE 1024.
+#define RADIANCE_CACHE_MAX_RADIANCE 1000.
+#define RADIANCE_CACHE_MAX_SAMPLES 1024u
+
+// Matches radianceCacheCellSize in the samples, an empty cell has checksum 0
+struct RadianceCacheCell{
+	uint checksum;
+	uint sampleCount;
+	uint radiance[3];
+};
+layout(buffer_reference,scalar)buffer RadianceCacheCells{RadianceCacheCell c[];};
+
+struct RadianceCachePath{
+	bool update;
+	uint vertexCount;
+	uint cells[RADIANCE_CACHE_MAX_VERTICES];
+	// Path radiance including the vertex and the throughput reaching it
+	vec3 radiance[RADIANCE_CACHE_MAX_VERTICES];
+	vec3 throughput[RADIANCE_CACHE_MAX_VERTICES];
+};
+
+// Normals are bucketed by their major axis, so both sides of thin walls get their own cells
+void radiance_cache_key(vec3 position,vec3 normal,out uint slot,out uint checksum){
+	uvec3 p=uvec3(ivec3(floor(position/ubo.radianceCacheCellSize)));
+	vec3 a=abs(normal);
+	uint axis=a.x>a.y?(a.x>a.z?0:2):(a.y>a.z?1:2);
+	uint n=axis*2+(normal[axis]<0.?1:0);
+	slot=hash(p.x^hash(p.y^hash(p.z^hash(n))));
+	checksum=max(hash(p.x+hash(p.y+hash(p.z+hash(n+0x9e3779b9u)))),1u);
+}
+
+uint radiance_cache_find(vec3 position,vec3 normal){
+	uint slot,checksum;
+	radiance_cache_key(position,normal,slot,checksum);
+	RadianceCacheCells cells=RadianceCacheCells(ubo.radianceCache);
+	for(uint i=0;i<RADIANCE_CACHE_PROBES;i++){
+		uint index=(slot+i)&(ubo.radianceCacheSize-1);
+		uint stored=cells.c[index].checksum;
+		if(stored==checksum){
+			return index;
+		}
+		if(stored==0u){
+			break;
+		}
+	}
+	return RADIANCE_CACHE_INVALID;
+}
+
+uint radiance_cache_insert(vec3 position,vec3 normal){
+	uint slot,checksum;
+	radiance_cache_key(position,normal,slot,checksum);
+	RadianceCacheCells cells=RadianceCacheCells(ubo.radianceCache);
+	for(uint i=0;i<RADIANCE_CACHE_PROBES;i++){
+		uint index=(slot+i)&(ubo.radianceCacheSize-1);
+		uint stored=atomicCompSwap(cells.c[index].checksum,0u,checksum);
+		if(stored==0u||stored==checksum){
+			return index;
+		}
+	}
+	return RADIANCE_CACHE_INVALID;
+}
+
+// Only a fraction of the paths is written back, the decision is independent of the sampler's dimensions
+RadianceCachePath radiance_cache_start(SamplerState rng){
+	RadianceCachePath path;
+	path.update=ubo.radianceCache!=0&&to_unorm(hash(hash_combine(rng.seed,rng.index)))<ubo.radianceCacheUpdateRate;
+	path.vertexCount=0;
+	return path;
+}
+
+bool radiance_cache_query(vec3 position,vec3 normal,out vec3 radiance){
+	radiance=vec3(0.);
+	if(ubo.radianceCache==0){
+		return false;
+	}
+	uint index=radiance_cache_find(position,normal);
+	if(index==RADIANCE_CACHE_INVALID){
+		return false;
+	}
+	RadianceCacheCells cells=RadianceCacheCells(ubo.radianceCache);
+	uint sampleCount=cells.c[index].sampleCount;
+	if(sampleCount<ubo.radianceCacheMinSamples){
+		return false;
+	}
+	radiance=vec3(cells.c[index].radiance[0],cells.c[index].radiance[1],cells.c[index].radiance[2])/(RADIANCE_CACHE_SCALE*float(sampleCount));
+	return true;
+}
+
+void radiance_cache_record(inout RadianceCachePath path,vec3 position,vec3 normal,vec3 radiance,vec3 throughput){
+	if(!path.update||path.vertexCount==RADIANCE_CACHE_MAX_VERTICES){
+		return;
+	}
+	path.cells[path.vertexCount]=radiance_cache_insert(position,normal);
+	path.radiance[path.vertexCount]=radiance;
+	path.throughput[path.vertexCount]=throughput;
+	path.vertexCount++;
+}
+
+// The light a vertex reflects is whatever the path gathered after it, divided by the throughput reaching it
+void radiance_cache_update(RadianceCachePath path,vec3 radiance){
+	RadianceCacheCells cells=RadianceCacheCells(ubo.radianceCache);
+	for(uint i=0;i<path.vertexCount;i++){
+		uint index=path.cells[i];
+		if(index==RADIANCE_CACHE_INVALID||cells.c[index].sampleCount>=RADIANCE_CACHE_MAX_SAMPLES){
+			continue;
+		}
+		vec3 throughput=path.throughput[i];
+		vec3 indirect=mix(vec3(0.),(radiance-path.radiance[i])/max(throughput,vec3(1e-8)),greaterThan(throughput,vec3(0.)));
+		uvec3 value=uvec3(clamp(indirect,0.,RADIANCE_CACHE_MAX_RADIANCE)*RADIANCE_CACHE_SCALE+.5);
+		atomicAdd(cells.c[index].radiance[0],value.r);
+		atomicAdd(cells.c[index].radiance[1],value.g);
+		atomicAdd(cells.c[index].radiance[2],value.b);
+		atomicAdd(cells.c[index].sampleCount,1u);
+	}
+}
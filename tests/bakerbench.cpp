@@ -0,0 +1,91 @@
+/*
+* Throughput of the CPU baker and the parts it is built from
+*
+* Reports SH projection in probes per second (sampleCount samples each, like a probe of the baker), BVH traversal in
+* rays per second and the whole baker in probes per second, on the box room of scenes.hpp and on a random triangle soup.
+* Not run by ctest, run it from the build directory: bakerbench [--samples n] [--threads n]
+*
+* This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+*/
+
+#include "testing.hpp"
+#include "scenes.hpp"
+#include <random>
+
+int main(int argc, char* argv[])
+{
+    uint32_t sampleCount = 64;
+    uint32_t threadCount = vks::TaskScheduler::shared().getThreadCount();
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc) {
+            sampleCount = std::max(static_cast<uint32_t>(std::stoul(argv[++i])), 1u);
+        }
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threadCount = std::max(static_cast<uint32_t>(std::stoul(argv[++i])), 1u);
+        }
+    }
+    std::mt19937 generator(1);
+    std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+    auto randomPoint = [&]() { return glm::vec3(uniform(generator), uniform(generator), uniform(generator)); };
+
+    // SH projection of one probe's samples, single threaded
+    {
+        std::vector<glm::vec3> directions(sampleCount), values(sampleCount);
+        for (uint32_t i = 0; i < sampleCount; i++) {
+            directions[i] = glm::normalize(randomPoint());
+            values[i] = randomPoint();
+        }
+        SHProbe probe {};
+        const double seconds = testing::measure([&]() {
+            for (uint32_t i = 0; i < 1024; i++) {
+                CpuBaker::projectSamples(probe, directions[i % sampleCount], directions, values);
+            }
+        });
+        std::cout << "SH projection: " << 1024.0 / seconds << " probes/s (" << sampleCount << " samples, " << SH_BANDS << " bands)" << std::endl;
+    }
+
+    // Closest hit rays through 100k random triangles, single threaded
+    {
+        std::vector<glm::vec3> positions;
+        for (uint32_t i = 0; i < 100000; i++) {
+            const glm::vec3 center = randomPoint() * 10.0f;
+            for (uint32_t k = 0; k < 3; k++) {
+                positions.push_back(center + randomPoint() * 0.2f);
+            }
+        }
+        vks::BVH bvh;
+        const double buildSeconds = testing::measure([&]() { bvh.build(positions); }, 0.0);
+        std::vector<glm::vec3> origins(4096), directions(4096);
+        for (uint32_t i = 0; i < origins.size(); i++) {
+            origins[i] = randomPoint() * 10.0f;
+            directions[i] = glm::normalize(randomPoint());
+        }
+        uint32_t hits = 0;
+        const double seconds = testing::measure([&]() {
+            vks::BVH::Hit hit;
+            for (uint32_t i = 0; i < origins.size(); i++) {
+                hits += bvh.intersect(origins[i], directions[i], 0.001f, 100.0f, hit, [](const vks::BVH::Hit&) { return true; }) ? 1 : 0;
+            }
+        });
+        std::cout << "BVH: built 100000 triangles in " << buildSeconds * 1000.0 << " ms, " << origins.size() / seconds << " rays/s" << std::endl;
+    }
+
+    // The whole baker on the box room, on every thread of the scheduler
+    {
+        vks::TaskScheduler scheduler(threadCount);
+        TestScene scene;
+        buildBoxRoom(scene, 64, 36, sampleCount);
+        const uint32_t probeCount = scene.baker.width * scene.baker.height;
+        const double seconds = testing::measure([&]() {
+            scheduler.parallelFor(0, scene.baker.height, [&](uint32_t y) {
+                for (uint32_t x = 0; x < scene.baker.width; x++) {
+                    CpuBaker::ProbeGBuffer probeGBuffer;
+                    float variance;
+                    scene.baker.bakeProbe(x, y, scene.viewInverse, scene.projInverse, probeGBuffer, variance);
+                }
+            }, 1);
+        }, 2.0);
+        std::cout << "Baker: " << probeCount / seconds << " probes/s (" << sampleCount << " samples, " << threadCount << " threads)" << std::endl;
+    }
+    return 0;
+}
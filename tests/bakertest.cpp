@@ -0,0 +1,117 @@
+/*
+* Unit tests of the CPU baker in examples/cpubaker
+*
+* Bakes the box room of scenes.hpp at a low resolution and checks what is known without a reference: the probe
+* G-buffer against the analytic floor plane, zero probes where the camera ray misses or nothing emits, lit probes
+* under the light and results that don't depend on how the rows are scheduled
+*
+* This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+*/
+
+#include "testing.hpp"
+#include "scenes.hpp"
+
+static bool probeIsZero(const SHProbe& probe)
+{
+    for (const glm::vec3& coefficient : probe) {
+        if (coefficient != glm::vec3(0.0f)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Depth and normal of the probes that see the floor match the intersection with the plane y = 0
+static void testFloorGBuffer()
+{
+    TestScene scene;
+    buildBoxRoom(scene, 32, 24, 16);
+    CpuBaker& baker = scene.baker;
+    std::vector<SHProbe> sh;
+    std::vector<CpuBaker::ProbeGBuffer> gbuffer;
+    std::vector<float> variances;
+    baker.bakeProbes(scene.viewInverse, scene.projInverse, sh, gbuffer, variances, false);
+
+    uint32_t floorProbes = 0;
+    for (uint32_t y = 0; y < baker.height; y++) {
+        for (uint32_t x = 0; x < baker.width; x++) {
+            glm::vec3 origin, direction;
+            CpuBaker::cameraRay(x, y, baker.width, baker.height, scene.viewInverse, scene.projInverse, origin, direction);
+            if (direction.y >= 0.0f) {
+                continue;
+            }
+            const float t = -origin.y / direction.y;
+            const glm::vec3 point = origin + direction * t;
+            // Away from the edges, where the walls may be hit first
+            if (std::abs(point.x) > 0.9f || point.z < -0.9f || point.z > 0.9f) {
+                continue;
+            }
+            const CpuBaker::ProbeGBuffer& probe = gbuffer[y * baker.width + x];
+            CHECK_NEAR(probe.depth, t, 1e-4f);
+            CHECK_NEAR(vks::sh::unpackNormal(probe.normal), glm::vec3(0.0f, 1.0f, 0.0f), 1e-4f);
+            // The floor under the light receives light over the walls and the ceiling
+            CHECK(sh[y * baker.width + x][0].x > 0.0f);
+            floorProbes++;
+        }
+    }
+    CHECK(floorProbes > 50);
+}
+
+// Probes whose camera ray leaves the room stay zero, and so does every probe of a room without lights
+static void testZeroProbes()
+{
+    TestScene scene;
+    buildBoxRoom(scene, 16, 12, 4);
+    scene.lookAt(glm::vec3(0.0f, 1.0f, 3.0f), glm::vec3(0.0f, 1.0f, 6.0f));
+    std::vector<SHProbe> sh;
+    std::vector<CpuBaker::ProbeGBuffer> gbuffer;
+    std::vector<float> variances;
+    scene.baker.bakeProbes(scene.viewInverse, scene.projInverse, sh, gbuffer, variances, false);
+    for (size_t i = 0; i < sh.size(); i++) {
+        CHECK(gbuffer[i].depth == 0.0f);
+        CHECK(probeIsZero(sh[i]));
+        CHECK(variances[i] == 0.0f);
+    }
+
+    TestScene dark;
+    buildBoxRoom(dark, 16, 12, 4);
+    dark.baker.lights.clear();
+    dark.baker.bakeProbes(dark.viewInverse, dark.projInverse, sh, gbuffer, variances, false);
+    uint32_t hits = 0;
+    for (size_t i = 0; i < sh.size(); i++) {
+        hits += gbuffer[i].depth > 0.0f ? 1 : 0;
+        CHECK(probeIsZero(sh[i]));
+    }
+    CHECK(hits > 0);
+}
+
+// Every probe seeds its own random numbers, so the parallel bake equals probes baked one by one
+static void testDeterminism()
+{
+    TestScene scene;
+    buildBoxRoom(scene, 16, 12, 8);
+    CpuBaker& baker = scene.baker;
+    std::vector<SHProbe> sh;
+    std::vector<CpuBaker::ProbeGBuffer> gbuffer;
+    std::vector<float> variances;
+    baker.bakeProbes(scene.viewInverse, scene.projInverse, sh, gbuffer, variances, false);
+    bool identical = true;
+    for (uint32_t y = 0; y < baker.height; y++) {
+        for (uint32_t x = 0; x < baker.width; x++) {
+            CpuBaker::ProbeGBuffer probeGBuffer;
+            float variance;
+            const SHProbe probe = baker.bakeProbe(x, y, scene.viewInverse, scene.projInverse, probeGBuffer, variance);
+            const size_t index = y * baker.width + x;
+            identical = identical && probe == sh[index] && probeGBuffer.depth == gbuffer[index].depth && variance == variances[index];
+        }
+    }
+    CHECK(identical);
+}
+
+int main()
+{
+    testFloorGBuffer();
+    testZeroProbes();
+    testDeterminism();
+    return testing::report("bakertest");
+}
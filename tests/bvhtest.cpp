@@ -0,0 +1,164 @@
+/*
+* Unit tests of bvh.hpp
+*
+* Closest hits, any hit filtering and occlusion of random rays through a random triangle soup are compared against a
+* brute force loop over every triangle, and again through a degenerate scene that would build a tree deeper than the
+* traversal stack
+*
+* This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+*/
+
+#include "testing.hpp"
+#include "bvh.hpp"
+#include <random>
+#include <vector>
+
+// Moeller-Trumbore without culling, written independently of the one in bvh.hpp
+static bool intersect(const glm::vec3* triangle, glm::vec3 origin, glm::vec3 direction, float tmin, float tmax, float& t)
+{
+    const glm::vec3 e1 = triangle[1] - triangle[0];
+    const glm::vec3 e2 = triangle[2] - triangle[0];
+    const glm::vec3 p = glm::cross(direction, e2);
+    const float determinant = glm::dot(e1, p);
+    if (std::abs(determinant) < 1e-12f) {
+        return false;
+    }
+    const glm::vec3 s = origin - triangle[0];
+    const float u = glm::dot(s, p) / determinant;
+    const glm::vec3 q = glm::cross(s, e1);
+    const float v = glm::dot(direction, q) / determinant;
+    t = glm::dot(e2, q) / determinant;
+    return u >= 0.0f && v >= 0.0f && u + v <= 1.0f && t > tmin && t < tmax;
+}
+
+template<typename AnyHit>
+static bool bruteForce(const std::vector<glm::vec3>& positions, glm::vec3 origin, glm::vec3 direction, float tmin, float tmax, float& closest, AnyHit anyHit)
+{
+    bool found = false;
+    for (uint32_t i = 0; i < positions.size() / 3; i++) {
+        float t;
+        if (intersect(&positions[i * 3], origin, direction, tmin, tmax, t) && anyHit(i)) {
+            tmax = t;
+            closest = t;
+            found = true;
+        }
+    }
+    return found;
+}
+
+static uint32_t treeDepth(const vks::BVH& bvh, uint32_t nodeIndex = 0)
+{
+    const vks::BVH::Node& node = bvh.nodes[nodeIndex];
+    return node.count > 0 ? 0 : 1 + std::max(treeDepth(bvh, node.first), treeDepth(bvh, node.first + 1));
+}
+
+// Six ladders of unit triangles whose centers approach the origin exponentially along +-x, +-y and +-z, the binned SAH
+// peels off about one triangle per level, so without a depth limit the tree gets far deeper than the traversal stack
+static void testDeepTree()
+{
+    // Rungs per ladder, the last one is 2^-119 from the origin
+    constexpr uint32_t ladderLength = 120;
+    std::vector<glm::vec3> positions;
+    for (int axis = 0; axis < 3; axis++) {
+        for (float sign : { 1.0f, -1.0f }) {
+            for (int i = 0; i < static_cast<int>(ladderLength); i++) {
+                glm::vec3 center(0.0f), u(0.0f), v(0.0f);
+                center[axis] = sign * std::ldexp(1.0f, -i);
+                u[(axis + 1) % 3] = 0.5f;
+                v[(axis + 2) % 3] = 0.5f;
+                positions.push_back(center - u - v);
+                positions.push_back(center + u - v);
+                positions.push_back(center + v);
+            }
+        }
+    }
+    vks::BVH bvh;
+    bvh.build(positions);
+    CHECK(treeDepth(bvh) < 64);
+
+    std::mt19937 generator(2);
+    std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+    uint32_t mismatches = 0;
+    for (uint32_t i = 0; i < 1024; i++) {
+        const glm::vec3 origin = glm::vec3(uniform(generator), uniform(generator), uniform(generator)) * 2.0f;
+        const glm::vec3 direction = glm::normalize(glm::vec3(uniform(generator), uniform(generator), uniform(generator)));
+        // The triangles near the origin overlap within less than the tolerance, so hits are also compared with only the
+        // deepest rung of every ladder accepted, those sit in the subtrees an overflowing stack would drop
+        for (uint32_t deepest : { 0u, ladderLength - 8 }) {
+            auto accept = [&](uint32_t triangle) { return triangle % ladderLength >= deepest; };
+            float expected = 0.0f;
+            const bool expectedHit = bruteForce(positions, origin, direction, 0.001f, 100.0f, expected, accept);
+            vks::BVH::Hit hit;
+            const bool found = bvh.intersect(origin, direction, 0.001f, 100.0f, hit, [&](const vks::BVH::Hit& candidate) { return accept(candidate.triangle); });
+            const bool occluded = bvh.occluded(origin, direction, 0.001f, 100.0f, [&](const vks::BVH::Hit& candidate) { return accept(candidate.triangle); });
+            if (found != expectedHit || occluded != expectedHit || (found && std::abs(hit.t - expected) > 1e-5f)) {
+                mismatches++;
+            }
+        }
+    }
+    CHECK(mismatches == 0);
+}
+
+int main()
+{
+    std::mt19937 generator(1);
+    std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+    auto randomPoint = [&]() { return glm::vec3(uniform(generator), uniform(generator), uniform(generator)); };
+
+    // Small triangles scattered through the unit cube, so most rays hit several of them
+    std::vector<glm::vec3> positions;
+    for (uint32_t i = 0; i < 2000; i++) {
+        const glm::vec3 center = randomPoint();
+        for (uint32_t k = 0; k < 3; k++) {
+            positions.push_back(center + randomPoint() * 0.15f);
+        }
+    }
+    vks::BVH bvh;
+    bvh.build(positions);
+    CHECK(!bvh.nodes.empty());
+
+    auto acceptAll = [](uint32_t) { return true; };
+    // Stands in for alpha testing, every third triangle is transparent
+    auto acceptSome = [](uint32_t triangle) { return triangle % 3 != 0; };
+    uint32_t hits = 0;
+    for (uint32_t i = 0; i < 4096; i++) {
+        const glm::vec3 origin = randomPoint() * 1.5f;
+        const glm::vec3 direction = glm::normalize(randomPoint());
+        const float tmax = i % 2 == 0 ? 10.0f : 0.5f;
+
+        float expected = 0.0f;
+        vks::BVH::Hit hit;
+        const bool expectedHit = bruteForce(positions, origin, direction, 0.001f, tmax, expected, acceptAll);
+        const bool found = bvh.intersect(origin, direction, 0.001f, tmax, hit, [](const vks::BVH::Hit&) { return true; });
+        CHECK(found == expectedHit);
+        if (found && expectedHit) {
+            hits++;
+            CHECK_NEAR(hit.t, expected, 1e-5f);
+            // The reported triangle and barycentrics lead back to the hit point
+            const glm::vec3* triangle = &positions[hit.triangle * 3];
+            const glm::vec3 point = triangle[0] * (1.0f - hit.barycentrics.x - hit.barycentrics.y) + triangle[1] * hit.barycentrics.x + triangle[2] * hit.barycentrics.y;
+            CHECK_NEAR(point, origin + direction * hit.t, 1e-4f);
+        }
+        CHECK(bvh.occluded(origin, direction, 0.001f, tmax, [](const vks::BVH::Hit&) { return true; }) == expectedHit);
+
+        const bool expectedFiltered = bruteForce(positions, origin, direction, 0.001f, tmax, expected, acceptSome);
+        const bool foundFiltered = bvh.intersect(origin, direction, 0.001f, tmax, hit, [&](const vks::BVH::Hit& candidate) { return acceptSome(candidate.triangle); });
+        CHECK(foundFiltered == expectedFiltered);
+        if (foundFiltered && expectedFiltered) {
+            CHECK(acceptSome(hit.triangle));
+            CHECK_NEAR(hit.t, expected, 1e-5f);
+        }
+        CHECK(bvh.occluded(origin, direction, 0.001f, tmax, [&](const vks::BVH::Hit& candidate) { return acceptSome(candidate.triangle); }) == expectedFiltered);
+    }
+    // The scene is dense enough that a broken traversal can't pass by missing everything
+    CHECK(hits > 1000);
+
+    vks::BVH empty;
+    empty.build({});
+    vks::BVH::Hit hit;
+    CHECK(!empty.intersect(glm::vec3(0.0f), glm::vec3(0.0f, 0.0f, 1.0f), 0.0f, 1.0f, hit, [](const vks::BVH::Hit&) { return true; }));
+
+    testDeepTree();
+
+    return testing::report("bvhtest");
+}
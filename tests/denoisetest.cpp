@@ -0,0 +1,214 @@
+/*
+* Compares the probe denoiser of probedenoise.comp with probedenoiser.hpp
+*
+* Both denoise the same fixed grid of noisy probes: two walls with a depth edge between them, a floor and a window where
+* the rays miss, accumulated over FRAME_COUNT frames and compacted by the probe mask like the SH buffer of ssprobe. The
+* history covers every case of the temporal pass (none, same surface within and outside the noise, another surface) far
+* enough from its thresholds that rounding can't flip them. Probes, variances and sample counts have to match within a
+* relative tolerance. Skipped without a Vulkan device
+*
+* This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+*/
+
+#include "testing.hpp"
+#include "testdevice.hpp"
+#include "probedenoiser.hpp"
+#include "VulkanProbeDenoiser.hpp"
+#include <bit>
+#include <random>
+
+constexpr uint32_t BANDS = 3;
+constexpr uint32_t WIDTH = 320;
+constexpr uint32_t HEIGHT = 180;
+constexpr uint32_t FRAME_COUNT = 64;
+constexpr float SAMPLE_COUNT = FRAME_COUNT * 16.0f;
+
+using Probe = vks::sh::Probe<BANDS>;
+
+// Primary hit of probe (x, y) and the noiseless DC of its surface
+static vks::sh::GBufferSample probeHit(uint32_t x, uint32_t y, glm::vec3& radiance)
+{
+    const float u = (static_cast<float>(x) + 0.5f) / WIDTH;
+    const float v = (static_cast<float>(y) + 0.5f) / HEIGHT;
+    if (u > 0.7f && u < 0.85f && v < 0.3f) {
+        radiance = glm::vec3(0.0f);
+        return { 0.0f, 0 };
+    }
+    if (v > 0.75f) {
+        radiance = glm::vec3(0.4f, 0.35f, 0.3f) * (1.0f + u);
+        return { 2.0f + 8.0f * (1.0f - v), vks::sh::packNormal(glm::vec3(0.0f, 1.0f, 0.0f)) };
+    }
+    if (u < 0.47f) {
+        radiance = glm::vec3(1.2f, 0.4f, 0.3f);
+        return { 3.0f + u, vks::sh::packNormal(glm::normalize(glm::vec3(0.6f, 0.0f, 0.8f))) };
+    }
+    radiance = glm::vec3(0.2f, 0.5f, 1.0f) * (2.0f - v);
+    return { 8.0f - 2.0f * u, vks::sh::packNormal(glm::normalize(glm::vec3(-0.3f, 0.2f, 0.93f))) };
+}
+
+int main()
+{
+    constexpr uint32_t probeCount = WIDTH * HEIGHT;
+    std::mt19937 generator(1);
+    std::normal_distribution<float> noise(0.0f, 1.0f);
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+
+    // Accumulated means and the second moment of their DC luminance, dense with zeros for the missing probes
+    std::vector<vks::sh::GBufferSample> gbuffer(probeCount);
+    std::vector<Probe> probes(probeCount);
+    std::vector<float> moments(probeCount), variances(probeCount);
+    for (uint32_t y = 0; y < HEIGHT; y++) {
+        for (uint32_t x = 0; x < WIDTH; x++) {
+            const uint32_t p = y * WIDTH + x;
+            glm::vec3 radiance;
+            gbuffer[p] = probeHit(x, y, radiance);
+            if (gbuffer[p].depth <= 0.0f) {
+                continue;
+            }
+            // Noise of the mean, brighter probes are noisier
+            const float sigma = 0.05f * (0.5f + uniform(generator)) * (1.0f + vks::sh::luminance(radiance));
+            probes[p][0] = radiance + glm::vec3(noise(generator)) * sigma;
+            for (uint32_t i = 1; i < vks::sh::coefficientCount<BANDS>; i++) {
+                probes[p][i] = glm::vec3(noise(generator), noise(generator), noise(generator)) * 0.1f;
+            }
+            const float mean = vks::sh::luminance(probes[p][0]);
+            moments[p] = mean * mean + sigma * sigma * FRAME_COUNT;
+            variances[p] = std::max(moments[p] - mean * mean, 0.0f) / FRAME_COUNT;
+        }
+    }
+    // The compacted accumulation, probe mask and prefix sum of ssprobe, see classifyProbes there
+    const uint32_t wordCount = (probeCount + 31) / 32;
+    std::vector<uint32_t> probeMask(wordCount), probeMaskOffsets(wordCount);
+    std::vector<Probe> compactedProbes;
+    std::vector<float> compactedMoments;
+    for (uint32_t p = 0; p < probeCount; p++) {
+        if (gbuffer[p].depth > 0.0f) {
+            probeMask[p / 32] |= 1u << (p % 32);
+            compactedProbes.push_back(probes[p]);
+            compactedMoments.push_back(moments[p]);
+        }
+    }
+    for (uint32_t word = 1; word < wordCount; word++) {
+        probeMaskOffsets[word] = probeMaskOffsets[word - 1] + static_cast<uint32_t>(std::popcount(probeMask[word - 1]));
+    }
+
+    // CPU reference, the spatial part first since the history is placed relative to its result
+    const vks::sh::DenoiseSettings settings {};
+    std::vector<Probe> filtered = probes;
+    std::vector<float> filteredVariances = variances;
+    vks::sh::denoise(WIDTH, HEIGHT, gbuffer.data(), filtered.data(), filteredVariances.data(), settings);
+    std::vector<vks::sh::GBufferSample> historyGBuffer = gbuffer;
+    std::vector<Probe> historyProbes(probeCount);
+    std::vector<float> historyCounts(probeCount);
+    for (uint32_t p = 0; p < probeCount; p++) {
+        if (gbuffer[p].depth <= 0.0f) {
+            continue;
+        }
+        const float sigma = std::sqrt(filteredVariances[p]);
+        historyProbes[p] = filtered[p];
+        historyCounts[p] = 4.0f * SAMPLE_COUNT;
+        switch (p % 4) {
+        case 0:
+            historyCounts[p] = 0.0f;
+            break;
+        case 1:
+            // Same DC luminance, so well within the noise, different higher bands so the blend shows
+            for (uint32_t i = 1; i < vks::sh::coefficientCount<BANDS>; i++) {
+                historyProbes[p][i] = glm::vec3(noise(generator), noise(generator), noise(generator)) * 0.1f;
+            }
+            break;
+        case 2:
+            historyProbes[p][0] += glm::vec3(10.0f * settings.historyClamp * sigma + 0.1f);
+            break;
+        case 3:
+            historyGBuffer[p].depth *= 1.0f + 5.0f * settings.depthSigma;
+            break;
+        }
+    }
+    std::vector<Probe> expected(probeCount);
+    std::vector<float> expectedCounts(probeCount);
+    vks::sh::temporalAccumulate(WIDTH, HEIGHT, gbuffer.data(), filtered.data(), filteredVariances.data(), SAMPLE_COUNT, historyGBuffer.data(), historyProbes.data(),
+        historyCounts.data(), settings, expected.data(), expectedCounts.data());
+
+    TestDevice testDevice;
+    if (!testDevice.create()) {
+        return testing::skipped;
+    }
+    vks::ProbeDenoiser denoiser;
+    VkPipelineShaderStageCreateInfo shaderStage = testDevice.loadShader("ssprobe/probedenoise.comp.spv");
+    denoiser.create(testDevice.device, VK_NULL_HANDLE, shaderStage, BANDS, settings);
+    vkDestroyShaderModule(testDevice.device, shaderStage.module, nullptr);
+
+    vks::Buffer probeGBufferBuffer, probeMaskBuffer, probeMaskOffsetsBuffer, probeBuffer, momentBuffer, scratch[2], scratchVariances[2];
+    vks::Buffer historyGBufferBuffer, historyProbeBuffer, historyCountBuffer, resultCountBuffer;
+    testDevice.createBuffer(probeGBufferBuffer, probeCount * sizeof(vks::sh::GBufferSample), gbuffer.data());
+    testDevice.createBuffer(probeMaskBuffer, wordCount * sizeof(uint32_t), probeMask.data());
+    testDevice.createBuffer(probeMaskOffsetsBuffer, wordCount * sizeof(uint32_t), probeMaskOffsets.data());
+    testDevice.createBuffer(probeBuffer, compactedProbes.size() * sizeof(Probe), compactedProbes.data());
+    testDevice.createBuffer(momentBuffer, compactedMoments.size() * sizeof(float), compactedMoments.data());
+    for (uint32_t i = 0; i < 2; i++) {
+        testDevice.createBuffer(scratch[i], probeCount * sizeof(Probe));
+        testDevice.createBuffer(scratchVariances[i], probeCount * sizeof(float));
+    }
+    testDevice.createBuffer(historyGBufferBuffer, probeCount * sizeof(vks::sh::GBufferSample), historyGBuffer.data());
+    testDevice.createBuffer(historyProbeBuffer, probeCount * sizeof(Probe), historyProbes.data());
+    testDevice.createBuffer(historyCountBuffer, probeCount * sizeof(float), historyCounts.data());
+    testDevice.createBuffer(resultCountBuffer, probeCount * sizeof(float));
+
+    vks::ProbeDenoiser::Buffers buffers {};
+    buffers.probeGBuffer = testDevice.address(probeGBufferBuffer);
+    buffers.probeMask = testDevice.address(probeMaskBuffer);
+    buffers.probeMaskOffsets = testDevice.address(probeMaskOffsetsBuffer);
+    buffers.probes = testDevice.address(probeBuffer);
+    buffers.moments = testDevice.address(momentBuffer);
+    for (uint32_t i = 0; i < 2; i++) {
+        buffers.scratch[i] = testDevice.address(scratch[i]);
+        buffers.scratchVariances[i] = testDevice.address(scratchVariances[i]);
+    }
+    buffers.historyGBuffer = testDevice.address(historyGBufferBuffer);
+    buffers.historyProbes = testDevice.address(historyProbeBuffer);
+    buffers.historyCounts = testDevice.address(historyCountBuffer);
+    buffers.resultCounts = testDevice.address(resultCountBuffer);
+    const double milliseconds = testDevice.run([&](VkCommandBuffer commandBuffer) {
+        denoiser.cmdDenoise(commandBuffer, buffers, WIDTH, HEIGHT, FRAME_COUNT, SAMPLE_COUNT);
+        VkMemoryBarrier memoryBarrier = vks::initializers::memoryBarrier();
+        memoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        memoryBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+    });
+    if (milliseconds > 0.0) {
+        std::cout << "GPU denoise: " << milliseconds << " ms for " << WIDTH << "x" << HEIGHT << " probes" << std::endl;
+    }
+
+    // The temporal pass writes scratch[resultIndex()], the variances stay in the buffer of the last a-trous iteration
+    std::vector<Probe> results(probeCount);
+    std::vector<float> resultVariances(probeCount), resultCounts(probeCount);
+    testDevice.download(scratch[denoiser.resultIndex()], probeCount * sizeof(Probe), results.data());
+    testDevice.download(scratchVariances[(settings.iterations - 1) % 2], probeCount * sizeof(float), resultVariances.data());
+    testDevice.download(resultCountBuffer, probeCount * sizeof(float), resultCounts.data());
+
+    auto relativeError = [](float value, float expected) { return std::abs(value - expected) / std::max(std::abs(expected), 1.0f); };
+    float maxProbeError = 0.0f, maxVarianceError = 0.0f;
+    uint32_t countMismatches = 0;
+    for (uint32_t p = 0; p < probeCount; p++) {
+        for (uint32_t i = 0; i < vks::sh::coefficientCount<BANDS>; i++) {
+            for (uint32_t channel = 0; channel < 3; channel++) {
+                maxProbeError = std::max(maxProbeError, relativeError(results[p][i][channel], expected[p][i][channel]));
+            }
+        }
+        // Variances are orders of magnitude below one, compare them relative to themselves
+        maxVarianceError = std::max(maxVarianceError, std::abs(resultVariances[p] - filteredVariances[p]) / std::max(filteredVariances[p], 1e-12f));
+        countMismatches += resultCounts[p] == expectedCounts[p] ? 0 : 1;
+    }
+    std::cout << "Largest relative difference: probes " << maxProbeError << ", variances " << maxVarianceError << std::endl;
+    CHECK(maxProbeError < 1e-3f);
+    CHECK(maxVarianceError < 1e-3f);
+    CHECK(countMismatches == 0);
+
+    for (vks::Buffer* buffer : { &probeGBufferBuffer, &probeMaskBuffer, &probeMaskOffsetsBuffer, &probeBuffer, &momentBuffer, &scratch[0], &scratch[1], &scratchVariances[0],
+             &scratchVariances[1], &historyGBufferBuffer, &historyProbeBuffer, &historyCountBuffer, &resultCountBuffer }) {
+        buffer->destroy();
+    }
+    denoiser.destroy();
+    return testing::report("denoisetest");
+}
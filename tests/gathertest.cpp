@@ -0,0 +1,178 @@
+/*
+* Compares the bilateral probe gather of probegather.comp with probegather.hpp and measures both
+*
+* Both gather the same synthetic probe grid into a 1920x1080 irradiance image: two walls with a depth edge between them,
+* a floor and a window where the rays miss, seen by probes every 8 pixels with random SH. The compute shader also runs on
+* the compacted SH buffer of ssprobe, which has to give the same image. Reports ms per megapixel of the CPU gather on
+* every thread of the scheduler and of the compute shader, from timestamps. Skipped without a Vulkan device
+*
+* This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+*/
+
+#include "testing.hpp"
+#include "testdevice.hpp"
+#include "probegather.hpp"
+#include "VulkanProbeGather.hpp"
+#include <bit>
+#include <random>
+
+constexpr uint32_t BANDS = 3;
+constexpr uint32_t SPACING = 8;
+constexpr uint32_t WIDTH = 1920;
+constexpr uint32_t HEIGHT = 1080;
+constexpr uint32_t GRID_WIDTH = WIDTH / SPACING;
+constexpr uint32_t GRID_HEIGHT = HEIGHT / SPACING;
+// Dispatches averaged for the timing
+constexpr uint32_t REPEATS = 16;
+
+using Probe = vks::sh::Probe<BANDS>;
+
+static vks::sh::GBufferSample pixelHit(uint32_t x, uint32_t y)
+{
+    const float u = (static_cast<float>(x) + 0.5f) / WIDTH;
+    const float v = (static_cast<float>(y) + 0.5f) / HEIGHT;
+    if (u > 0.7f && u < 0.85f && v < 0.3f) {
+        return { 0.0f, 0 };
+    }
+    if (v > 0.75f) {
+        return { 2.0f + 8.0f * (1.0f - v), vks::sh::packNormal(glm::vec3(0.0f, 1.0f, 0.0f)) };
+    }
+    if (u < 0.47f) {
+        return { 3.0f + u, vks::sh::packNormal(glm::normalize(glm::vec3(0.6f, 0.0f, 0.8f))) };
+    }
+    return { 8.0f - 2.0f * u, vks::sh::packNormal(glm::normalize(glm::vec3(-0.3f, 0.2f, 0.93f))) };
+}
+
+int main()
+{
+    std::vector<vks::sh::GBufferSample> gbuffer(WIDTH * HEIGHT);
+    for (uint32_t y = 0; y < HEIGHT; y++) {
+        for (uint32_t x = 0; x < WIDTH; x++) {
+            gbuffer[y * WIDTH + x] = pixelHit(x, y);
+        }
+    }
+    std::mt19937 generator(1);
+    std::uniform_real_distribution<float> dc(0.0f, 2.0f), higher(-0.5f, 0.5f);
+    std::vector<vks::sh::GBufferSample> probeGBuffer(GRID_WIDTH * GRID_HEIGHT);
+    std::vector<Probe> probes(GRID_WIDTH * GRID_HEIGHT);
+    for (uint32_t y = 0; y < GRID_HEIGHT; y++) {
+        for (uint32_t x = 0; x < GRID_WIDTH; x++) {
+            const uint32_t probe = y * GRID_WIDTH + x;
+            probeGBuffer[probe] = pixelHit(x * SPACING + SPACING / 2, y * SPACING + SPACING / 2);
+            probes[probe][0] = glm::vec3(dc(generator), dc(generator), dc(generator));
+            for (uint32_t i = 1; i < vks::sh::coefficientCount<BANDS>; i++) {
+                probes[probe][i] = glm::vec3(higher(generator), higher(generator), higher(generator));
+            }
+        }
+    }
+    // The compacted SH buffer, probe mask and prefix sum of ssprobe, see classifyProbes there
+    const uint32_t wordCount = (GRID_WIDTH * GRID_HEIGHT + 31) / 32;
+    std::vector<uint32_t> probeMask(wordCount), probeMaskOffsets(wordCount);
+    std::vector<Probe> compactedProbes;
+    for (uint32_t probe = 0; probe < GRID_WIDTH * GRID_HEIGHT; probe++) {
+        if (probeGBuffer[probe].depth > 0.0f) {
+            probeMask[probe / 32] |= 1u << (probe % 32);
+            compactedProbes.push_back(probes[probe]);
+        }
+    }
+    for (uint32_t word = 1; word < wordCount; word++) {
+        probeMaskOffsets[word] = probeMaskOffsets[word - 1] + static_cast<uint32_t>(std::popcount(probeMask[word - 1]));
+    }
+
+    const double megapixels = WIDTH * HEIGHT * 1e-6;
+    const vks::sh::ProbeGrid<BANDS> grid { GRID_WIDTH, GRID_HEIGHT, SPACING, probes.data(), probeGBuffer.data() };
+    std::vector<glm::vec3> expected(WIDTH * HEIGHT);
+    const double cpuSeconds = testing::measure([&]() { vks::sh::gatherIrradiance(grid, gbuffer.data(), WIDTH, HEIGHT, expected.data()); });
+    std::cout << "CPU gather: " << cpuSeconds * 1000.0 / megapixels << " ms/MPix (" << vks::TaskScheduler::shared().getThreadCount() << " threads)" << std::endl;
+
+    TestDevice testDevice;
+    if (!testDevice.create()) {
+        return testing::skipped;
+    }
+    vks::ProbeGather gather;
+    VkPipelineShaderStageCreateInfo shaderStage = testDevice.loadShader("ssprobe/probegather.comp.spv");
+    gather.create(testDevice.device, VK_NULL_HANDLE, shaderStage, BANDS);
+    vkDestroyShaderModule(testDevice.device, shaderStage.module, nullptr);
+
+    vks::Buffer probeBuffer, compactedProbeBuffer, probeGBufferBuffer, probeMaskBuffer, probeMaskOffsetsBuffer, gbufferBuffer, irradianceBuffer;
+    testDevice.createBuffer(probeBuffer, probes.size() * sizeof(Probe), probes.data());
+    testDevice.createBuffer(compactedProbeBuffer, compactedProbes.size() * sizeof(Probe), compactedProbes.data());
+    testDevice.createBuffer(probeGBufferBuffer, probeGBuffer.size() * sizeof(vks::sh::GBufferSample), probeGBuffer.data());
+    testDevice.createBuffer(probeMaskBuffer, wordCount * sizeof(uint32_t), probeMask.data());
+    testDevice.createBuffer(probeMaskOffsetsBuffer, wordCount * sizeof(uint32_t), probeMaskOffsets.data());
+    testDevice.createBuffer(gbufferBuffer, gbuffer.size() * sizeof(vks::sh::GBufferSample), gbuffer.data());
+    testDevice.createBuffer(irradianceBuffer, expected.size() * sizeof(glm::vec3));
+
+    vks::ProbeGather::PushConstants pushConstants {};
+    pushConstants.probes = testDevice.address(probeBuffer);
+    pushConstants.probeGBuffer = testDevice.address(probeGBufferBuffer);
+    pushConstants.gbuffer = testDevice.address(gbufferBuffer);
+    pushConstants.irradiance = testDevice.address(irradianceBuffer);
+    pushConstants.gridWidth = GRID_WIDTH;
+    pushConstants.gridHeight = GRID_HEIGHT;
+    pushConstants.spacing = SPACING;
+    pushConstants.width = WIDTH;
+    pushConstants.height = HEIGHT;
+    pushConstants.depthSigma = vks::sh::GatherSettings {}.depthSigma;
+
+    // Largest difference to the CPU gather, relative to the irradiance where it is above one
+    auto compare = [&](const char* name) {
+        std::vector<glm::vec3> irradiance(expected.size());
+        testDevice.download(irradianceBuffer, irradiance.size() * sizeof(glm::vec3), irradiance.data());
+        float maxError = 0.0f;
+        for (size_t i = 0; i < expected.size(); i++) {
+            for (uint32_t channel = 0; channel < 3; channel++) {
+                maxError = std::max(maxError, std::abs(irradiance[i][channel] - expected[i][channel]) / std::max(std::abs(expected[i][channel]), 1.0f));
+            }
+        }
+        std::cout << name << ": largest relative difference " << maxError << std::endl;
+        CHECK(maxError < 1e-3f);
+    };
+    VkMemoryBarrier memoryBarrier = vks::initializers::memoryBarrier();
+    memoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    memoryBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    testDevice.run([&](VkCommandBuffer commandBuffer) {
+        gather.cmdDispatch(commandBuffer, pushConstants);
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+    });
+    compare("Dense probes");
+
+    vks::ProbeGather::PushConstants compactedPushConstants = pushConstants;
+    compactedPushConstants.probes = testDevice.address(compactedProbeBuffer);
+    compactedPushConstants.probeMask = testDevice.address(probeMaskBuffer);
+    compactedPushConstants.probeMaskOffsets = testDevice.address(probeMaskOffsetsBuffer);
+    testDevice.run([&](VkCommandBuffer commandBuffer) {
+        vkCmdFillBuffer(commandBuffer, irradianceBuffer.buffer, 0, VK_WHOLE_SIZE, 0);
+        VkMemoryBarrier fillBarrier = vks::initializers::memoryBarrier();
+        fillBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        fillBarrier.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &fillBarrier, 0, nullptr, 0, nullptr);
+        gather.cmdDispatch(commandBuffer, compactedPushConstants);
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+    });
+    compare("Compacted probes");
+
+    // Back to back dispatches of the compacted gather, like ssprobe would run it every frame
+    const double milliseconds = testDevice.run([&](VkCommandBuffer commandBuffer) {
+        VkMemoryBarrier dispatchBarrier = vks::initializers::memoryBarrier();
+        dispatchBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        dispatchBarrier.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        for (uint32_t i = 0; i < REPEATS; i++) {
+            if (i > 0) {
+                vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &dispatchBarrier, 0, nullptr, 0, nullptr);
+            }
+            gather.cmdDispatch(commandBuffer, compactedPushConstants);
+        }
+    });
+    if (milliseconds > 0.0) {
+        std::cout << "GPU gather: " << milliseconds / REPEATS / megapixels << " ms/MPix" << std::endl;
+    } else {
+        std::cout << "GPU gather: no timestamps on this queue" << std::endl;
+    }
+
+    for (vks::Buffer* buffer : { &probeBuffer, &compactedProbeBuffer, &probeGBufferBuffer, &probeMaskBuffer, &probeMaskOffsetsBuffer, &gbufferBuffer, &irradianceBuffer }) {
+        buffer->destroy();
+    }
+    gather.destroy();
+    return testing::report("gathertest");
+}
@@ -0,0 +1,206 @@
+/*
+* Golden image regression test of the path integrator
+*
+* The reference in tests/data is the DC coefficient of every probe of the box room, baked with many samples by a port of
+* the estimator raygen.rgen had before the forward integrator: every bounce is pushed on a stack of direct radiance, BRDF,
+* cosine and pdf, which is unwound once the path ends. The test bakes the same probes with the forward integrator of
+* examples/cpubaker, Russian roulette and fewer samples and compares both estimates with a z-score per probe, so it fails
+* if the forward integrator or its roulette stop converging to the radiance of the old estimator, without being sensitive
+* to the noise of either bake. Regenerate the reference after an intended change of the shading or the scene with
+*   goldentest --generate <tests/data/boxroom>
+*
+* Both integrators are CPU mirrors of the shaders, the GPU path has the same structure but needs a ray tracing device to
+* run
+*
+* This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+*/
+
+#include "testing.hpp"
+#include "scenes.hpp"
+#include <glm/gtc/type_ptr.hpp>
+
+constexpr uint32_t WIDTH_PROBES = 16;
+constexpr uint32_t HEIGHT_PROBES = 12;
+constexpr uint32_t REFERENCE_SAMPLES = 8192;
+constexpr uint32_t TEST_SAMPLES = 512;
+
+// Little endian PFM with the rows stored bottom to top, channels is 3 for color ("PF") and 1 for grey ("Pf")
+static bool writePFM(const std::string& path, uint32_t width, uint32_t height, uint32_t channels, const std::vector<float>& pixels)
+{
+    std::ofstream file(path, std::ios::binary);
+    file << (channels == 3 ? "PF" : "Pf") << "\n" << width << " " << height << "\n-1.0\n";
+    for (uint32_t y = height; y-- > 0;) {
+        file.write(reinterpret_cast<const char*>(&pixels[static_cast<size_t>(y) * width * channels]), width * channels * sizeof(float));
+    }
+    return static_cast<bool>(file);
+}
+
+static bool readPFM(const std::string& path, uint32_t width, uint32_t height, uint32_t channels, std::vector<float>& pixels)
+{
+    std::ifstream file(path, std::ios::binary);
+    std::string type;
+    uint32_t fileWidth = 0, fileHeight = 0;
+    float scale = 0.0f;
+    file >> type >> fileWidth >> fileHeight >> scale;
+    file.get();
+    if (!file || type != (channels == 3 ? "PF" : "Pf") || fileWidth != width || fileHeight != height || scale >= 0.0f) {
+        return false;
+    }
+    pixels.resize(static_cast<size_t>(width) * height * channels);
+    for (uint32_t y = height; y-- > 0;) {
+        file.read(reinterpret_cast<char*>(&pixels[static_cast<size_t>(y) * width * channels]), width * channels * sizeof(float));
+    }
+    return static_cast<bool>(file);
+}
+
+/**
+* CpuBaker::bakeProbe with the stack estimator of the old raygen.rgen: direct radiance, BRDF, cosine and pdf of every
+* bounce are stored until the path misses, turns below the surface or reaches RECURSIVE_DEPTH, then the stack is unwound
+* from the last bounce to the first. Samples and random numbers are the ones of bakeProbe without Russian roulette
+*/
+static SHProbe bakeProbeUnwound(const CpuBaker& baker, uint32_t x, uint32_t y, const glm::mat4& viewInverse, const glm::mat4& projInverse, float& variance)
+{
+    SHProbe sh {};
+    variance = 0.0f;
+    glm::vec3 cameraOrigin, cameraDirection;
+    CpuBaker::cameraRay(x, y, baker.width, baker.height, viewInverse, projInverse, cameraOrigin, cameraDirection);
+    const float tmin = 0.001f;
+    const float tmax = 10000.0f;
+
+    vks::BVH::Hit hit;
+    if (!baker.trace(cameraOrigin, cameraDirection, tmin, tmax, hit)) {
+        return sh;
+    }
+    const CpuBaker::ShadingPoint probe = baker.shade(cameraOrigin, cameraDirection, hit);
+    const glm::mat3 probeBasis = CpuBaker::orthonormalBasis(probe.faceNormal);
+
+    std::vector<glm::vec3> sampleDirections(baker.sampleCount);
+    std::vector<glm::vec3> sampleValues(baker.sampleCount);
+    for (uint32_t i = 0; i < baker.sampleCount; i++) {
+        Random random(y * baker.width + x, i);
+        float samplePdf;
+        const glm::vec3 sampleDirection = CpuBaker::sampleHemisphere(probeBasis, random, samplePdf);
+        glm::vec3 directRadiance[RECURSIVE_DEPTH], brdf[RECURSIVE_DEPTH];
+        float cosine[RECURSIVE_DEPTH], pdf[RECURSIVE_DEPTH];
+        glm::vec3 origin = probe.position;
+        glm::vec3 direction = sampleDirection;
+        uint32_t depth;
+        for (depth = 1;; depth++) {
+            if (!baker.trace(origin, direction, tmin, tmax, hit)) {
+                depth--;
+                break;
+            }
+            const CpuBaker::ShadingPoint point = baker.shade(origin, direction, hit);
+            const glm::vec3 v = -direction;
+            directRadiance[depth] = baker.directLighting(point, v) + point.emission;
+            const glm::vec3 sample = CpuBaker::sampleHemisphere(point.TBN, random, pdf[depth]);
+            cosine[depth] = std::max(0.0f, glm::dot(point.worldNormal, sample));
+            brdf[depth] = CpuBaker::diffuse(point, v, sample);
+            if (cosine[depth] == 0.0f || depth >= RECURSIVE_DEPTH - 1) {
+                break;
+            }
+            origin = point.position;
+            direction = sample;
+        }
+        glm::vec3 radiance(0.0f);
+        for (; depth > 0; depth--) {
+            radiance = directRadiance[depth] + radiance * brdf[depth] * cosine[depth] / pdf[depth];
+        }
+        sampleDirections[i] = sampleDirection;
+        sampleValues[i] = radiance / samplePdf;
+    }
+    CpuBaker::projectSamples(sh, probe.faceNormal, sampleDirections, sampleValues);
+    for (glm::vec3& coefficient : sh) {
+        coefficient *= 1.0f / static_cast<float>(baker.sampleCount);
+    }
+    double sum = 0.0, squareSum = 0.0;
+    for (const glm::vec3& value : sampleValues) {
+        const double dc = 0.282095 * vks::sh::luminance(value);
+        sum += dc;
+        squareSum += dc * dc;
+    }
+    const double mean = sum / baker.sampleCount;
+    variance = static_cast<float>(std::max(squareSum / baker.sampleCount - mean * mean, 0.0) / baker.sampleCount);
+    return sh;
+}
+
+// DC coefficient of every probe and the variance of its luminance, from the old stack estimator if unwound is set
+static void bake(uint32_t sampleCount, bool unwound, std::vector<float>& dc, std::vector<float>& variances)
+{
+    TestScene scene;
+    buildBoxRoom(scene, WIDTH_PROBES, HEIGHT_PROBES, sampleCount);
+    // A grey room, so paths lose enough throughput for the roulette to terminate them
+    scene.setAlbedo(glm::vec3(0.5f));
+    std::vector<SHProbe> sh;
+    if (unwound) {
+        sh.resize(WIDTH_PROBES * HEIGHT_PROBES);
+        variances.resize(sh.size());
+        vks::TaskScheduler::shared().parallelFor(0, HEIGHT_PROBES, [&](uint32_t y) {
+            for (uint32_t x = 0; x < WIDTH_PROBES; x++) {
+                sh[y * WIDTH_PROBES + x] = bakeProbeUnwound(scene.baker, x, y, scene.viewInverse, scene.projInverse, variances[y * WIDTH_PROBES + x]);
+            }
+        }, 1);
+    } else {
+        std::vector<CpuBaker::ProbeGBuffer> gbuffer;
+        scene.baker.bakeProbes(scene.viewInverse, scene.projInverse, sh, gbuffer, variances, false);
+    }
+    dc.resize(sh.size() * 3);
+    for (size_t i = 0; i < sh.size(); i++) {
+        dc[i * 3 + 0] = sh[i][0].x;
+        dc[i * 3 + 1] = sh[i][0].y;
+        dc[i * 3 + 2] = sh[i][0].z;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc != 2 && !(argc == 3 && strcmp(argv[1], "--generate") == 0)) {
+        std::cerr << "usage: goldentest [--generate] <reference path without extension>" << std::endl;
+        return 2;
+    }
+    const std::string reference = argv[argc - 1];
+    if (argc == 3) {
+        std::vector<float> dc, variances;
+        bake(REFERENCE_SAMPLES, true, dc, variances);
+        if (!writePFM(reference + ".pfm", WIDTH_PROBES, HEIGHT_PROBES, 3, dc) || !writePFM(reference + "_variance.pfm", WIDTH_PROBES, HEIGHT_PROBES, 1, variances)) {
+            std::cerr << "Could not write " << reference << std::endl;
+            return 1;
+        }
+        std::cout << "Reference written to " << reference << ".pfm" << std::endl;
+        return 0;
+    }
+
+    std::vector<float> referenceDC, referenceVariances;
+    if (!readPFM(reference + ".pfm", WIDTH_PROBES, HEIGHT_PROBES, 3, referenceDC) || !readPFM(reference + "_variance.pfm", WIDTH_PROBES, HEIGHT_PROBES, 1, referenceVariances)) {
+        std::cerr << "Could not read the reference " << reference << ".pfm, create it with --generate" << std::endl;
+        return 1;
+    }
+    std::vector<float> dc, variances;
+    bake(TEST_SAMPLES, false, dc, variances);
+
+    // With unbiased estimators the z-scores are roughly standard normal, so their mean square stays near one
+    double squareSum = 0.0;
+    uint32_t probeCount = 0;
+    float maxZ = 0.0f;
+    for (uint32_t i = 0; i < WIDTH_PROBES * HEIGHT_PROBES; i++) {
+        const float value = vks::sh::luminance(glm::make_vec3(&dc[i * 3]));
+        const float expected = vks::sh::luminance(glm::make_vec3(&referenceDC[i * 3]));
+        const float variance = variances[i] + referenceVariances[i];
+        if (variance == 0.0f) {
+            // Probes that miss the room or see no light are exactly zero in both
+            CHECK_NEAR(value, expected, 1e-6f);
+            continue;
+        }
+        const float z = (value - expected) / std::sqrt(variance);
+        squareSum += z * z;
+        maxZ = std::max(maxZ, std::abs(z));
+        probeCount++;
+    }
+    const float meanSquareZ = static_cast<float>(squareSum / std::max(probeCount, 1u));
+    std::cout << probeCount << " lit probes, mean square z-score " << meanSquareZ << ", largest " << maxZ << std::endl;
+    CHECK(probeCount > WIDTH_PROBES * HEIGHT_PROBES / 3);
+    // Generous bounds, the variances themselves are estimated from the samples and the DC of a probe is a ratio estimate
+    CHECK(meanSquareZ < 2.0f);
+    CHECK(maxZ < 6.0f);
+    return testing::report("goldentest");
+}
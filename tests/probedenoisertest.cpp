@@ -0,0 +1,171 @@
+/*
+* Unit tests of probedenoiser.hpp
+*
+* The filter has to lower the variance of a flat noisy patch without moving its mean, keep probes on either side of a
+* depth or normal edge apart, and leave missing probes black without darkening the probes around them. denoisetest
+* compares the compute shader with the same code on a device
+*
+* This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+*/
+
+#include "testing.hpp"
+#include "probedenoiser.hpp"
+#include <random>
+#include <vector>
+
+using namespace vks;
+
+constexpr uint32_t BANDS = 3;
+constexpr uint32_t WIDTH = 64;
+constexpr uint32_t HEIGHT = 48;
+
+using Probe = sh::Probe<BANDS>;
+
+// Probes of a grid with the same DC radiance in every channel and the same variance
+struct Grid {
+    std::vector<sh::GBufferSample> gbuffer = std::vector<sh::GBufferSample>(WIDTH * HEIGHT);
+    std::vector<Probe> probes = std::vector<Probe>(WIDTH * HEIGHT);
+    std::vector<float> variances = std::vector<float>(WIDTH * HEIGHT);
+
+    void set(uint32_t x, uint32_t y, float depth, glm::vec3 normal, float radiance, float variance)
+    {
+        const uint32_t p = y * WIDTH + x;
+        gbuffer[p] = { depth, sh::packNormal(normal) };
+        probes[p] = {};
+        probes[p][0] = glm::vec3(radiance);
+        variances[p] = variance;
+    }
+
+    float dc(uint32_t x, uint32_t y) const
+    {
+        return sh::luminance(probes[y * WIDTH + x][0]);
+    }
+
+    void denoise()
+    {
+        sh::denoise(WIDTH, HEIGHT, gbuffer.data(), probes.data(), variances.data());
+    }
+};
+
+// Mean and variance of the DC of all probes
+static void statistics(const Grid& grid, double& mean, double& variance)
+{
+    double sum = 0.0, squareSum = 0.0;
+    for (uint32_t y = 0; y < HEIGHT; y++) {
+        for (uint32_t x = 0; x < WIDTH; x++) {
+            sum += grid.dc(x, y);
+            squareSum += grid.dc(x, y) * grid.dc(x, y);
+        }
+    }
+    mean = sum / (WIDTH * HEIGHT);
+    variance = squareSum / (WIDTH * HEIGHT) - mean * mean;
+}
+
+static void testFlatPatch()
+{
+    constexpr float sigma = 0.1f;
+    std::mt19937 generator(1);
+    std::normal_distribution<float> noise(0.0f, sigma);
+    Grid grid;
+    for (uint32_t y = 0; y < HEIGHT; y++) {
+        for (uint32_t x = 0; x < WIDTH; x++) {
+            grid.set(x, y, 4.0f, glm::vec3(0.0f, 0.0f, 1.0f), 1.0f + noise(generator), sigma * sigma);
+        }
+    }
+    double meanBefore, varianceBefore, meanAfter, varianceAfter;
+    statistics(grid, meanBefore, varianceBefore);
+    grid.denoise();
+    statistics(grid, meanAfter, varianceAfter);
+    std::cout << "Flat patch: variance " << varianceBefore << " before, " << varianceAfter << " after denoising" << std::endl;
+    CHECK(varianceAfter < 0.1 * varianceBefore);
+    CHECK_NEAR(static_cast<float>(meanAfter), static_cast<float>(meanBefore), 0.01f);
+    // The variances that come out are the ones of the filtered estimates, so they shrink too
+    float largestVariance = 0.0f;
+    for (float variance : grid.variances) {
+        largestVariance = std::max(largestVariance, variance);
+    }
+    CHECK(largestVariance < 0.5f * sigma * sigma);
+}
+
+/**
+* Largest relative change of a probe when the left half of the grid has DC 1 at depth 2 facing the camera and the right
+* half DC 0.2 at rightDepth facing rightNormal. The variance is the one of a noisy estimate of the left half, the
+* luminance weight alone lets the halves blend across the border
+*/
+static float edgeBlur(float rightDepth, glm::vec3 rightNormal)
+{
+    constexpr float variance = 0.01f;
+    Grid grid;
+    for (uint32_t y = 0; y < HEIGHT; y++) {
+        for (uint32_t x = 0; x < WIDTH; x++) {
+            if (x < WIDTH / 2) {
+                grid.set(x, y, 2.0f, glm::vec3(0.0f, 0.0f, 1.0f), 1.0f, variance);
+            } else {
+                grid.set(x, y, rightDepth, rightNormal, 0.2f, variance);
+            }
+        }
+    }
+    grid.denoise();
+    float largestChange = 0.0f;
+    for (uint32_t y = 0; y < HEIGHT; y++) {
+        for (uint32_t x = 0; x < WIDTH; x++) {
+            const float expected = x < WIDTH / 2 ? 1.0f : 0.2f;
+            largestChange = std::max(largestChange, std::abs(grid.dc(x, y) - expected) / expected);
+        }
+    }
+    return largestChange;
+}
+
+static void testEdges()
+{
+    const float sameSurface = edgeBlur(2.0f, glm::vec3(0.0f, 0.0f, 1.0f));
+    const float depthEdge = edgeBlur(6.0f, glm::vec3(0.0f, 0.0f, 1.0f));
+    const float normalEdge = edgeBlur(2.0f, glm::vec3(1.0f, 0.0f, 0.0f));
+    std::cout << "Largest relative change at a luminance edge " << sameSurface << ", depth edge " << depthEdge << ", normal edge " << normalEdge << std::endl;
+    // Without a geometric edge the halves do blend, so the checks below test the depth and normal weights
+    CHECK(sameSurface > 0.05f);
+    CHECK(depthEdge < 0.01f);
+    CHECK(normalEdge < 0.01f);
+}
+
+static void testMissingProbes()
+{
+    Grid grid;
+    for (uint32_t y = 0; y < HEIGHT; y++) {
+        for (uint32_t x = 0; x < WIDTH; x++) {
+            const bool hole = x >= 24 && x < 40 && y >= 16 && y < 32;
+            if (hole) {
+                grid.set(x, y, 0.0f, glm::vec3(0.0f, 0.0f, 1.0f), 0.0f, 0.0f);
+            } else {
+                grid.set(x, y, 4.0f, glm::vec3(0.0f, 0.0f, 1.0f), 1.0f, 0.01f);
+            }
+        }
+    }
+    grid.denoise();
+    bool holeBlack = true;
+    float largestError = 0.0f;
+    for (uint32_t y = 0; y < HEIGHT; y++) {
+        for (uint32_t x = 0; x < WIDTH; x++) {
+            const uint32_t p = y * WIDTH + x;
+            if (grid.gbuffer[p].depth > 0.0f) {
+                largestError = std::max(largestError, std::abs(grid.dc(x, y) - 1.0f));
+                continue;
+            }
+            for (uint32_t i = 0; i < sh::coefficientCount<BANDS>; i++) {
+                holeBlack = holeBlack && grid.probes[p][i] == glm::vec3(0.0f);
+            }
+            holeBlack = holeBlack && grid.variances[p] == 0.0f;
+        }
+    }
+    CHECK(holeBlack);
+    // The probes around the hole only average their own value
+    CHECK(largestError < 1e-5f);
+}
+
+int main()
+{
+    testFlatPatch();
+    testEdges();
+    testMissingProbes();
+    return testing::report("probedenoisertest");
+}
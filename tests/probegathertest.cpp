@@ -0,0 +1,161 @@
+/*
+* Unit tests of probegather.hpp
+*
+* A field of identical probes has to gather back to the irradiance of that probe wherever the pixels and probes are, and
+* probes across a depth edge from a pixel must not leak into it while they do blend on a continuous surface. Every check
+* runs the single pixel gather and the batched one, gathertest compares the compute shader with them on a device
+*
+* This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+*/
+
+#include "testing.hpp"
+#include "probegather.hpp"
+#include <random>
+#include <vector>
+
+using namespace vks;
+
+constexpr uint32_t BANDS = 3;
+constexpr uint32_t SPACING = 8;
+constexpr uint32_t GRID_WIDTH = 16;
+constexpr uint32_t GRID_HEIGHT = 12;
+constexpr uint32_t WIDTH = GRID_WIDTH * SPACING;
+constexpr uint32_t HEIGHT = GRID_HEIGHT * SPACING;
+
+using Probe = sh::Probe<BANDS>;
+
+struct Scene {
+    std::vector<Probe> probes = std::vector<Probe>(GRID_WIDTH * GRID_HEIGHT);
+    std::vector<sh::GBufferSample> probeGBuffer = std::vector<sh::GBufferSample>(GRID_WIDTH * GRID_HEIGHT);
+    std::vector<sh::GBufferSample> gbuffer = std::vector<sh::GBufferSample>(WIDTH * HEIGHT);
+
+    sh::ProbeGrid<BANDS> grid() const
+    {
+        return { GRID_WIDTH, GRID_HEIGHT, SPACING, probes.data(), probeGBuffer.data() };
+    }
+
+    // Irradiance of every pixel from the single pixel gather and from the batched one
+    void gather(std::vector<glm::vec3>& single, std::vector<glm::vec3>& batched) const
+    {
+        single.resize(WIDTH * HEIGHT);
+        batched.resize(WIDTH * HEIGHT);
+        for (uint32_t y = 0; y < HEIGHT; y++) {
+            for (uint32_t x = 0; x < WIDTH; x++) {
+                single[y * WIDTH + x] = sh::gatherIrradiance(grid(), gbuffer[y * WIDTH + x], x, y);
+            }
+        }
+        sh::gatherIrradiance(grid(), gbuffer.data(), WIDTH, HEIGHT, batched.data());
+    }
+};
+
+// Largest difference of a gathered image to expected(x, y), relative to the expected irradiance where it is above one
+template<typename F>
+static float largestError(const std::vector<glm::vec3>& irradiance, F&& expected)
+{
+    float error = 0.0f;
+    for (uint32_t y = 0; y < HEIGHT; y++) {
+        for (uint32_t x = 0; x < WIDTH; x++) {
+            const glm::vec3 e = expected(x, y);
+            for (uint32_t channel = 0; channel < 3; channel++) {
+                error = std::max(error, std::abs(irradiance[y * WIDTH + x][channel] - e[channel]) / std::max(std::abs(e[channel]), 1.0f));
+            }
+        }
+    }
+    return error;
+}
+
+static glm::vec3 randomNormal(std::mt19937& generator)
+{
+    std::normal_distribution<float> normal(0.0f, 1.0f);
+    glm::vec3 n(normal(generator), normal(generator), normal(generator));
+    // Facing the camera at -z, like every surface it sees
+    n.z = std::abs(n.z) + 0.1f;
+    return glm::normalize(n);
+}
+
+// Every probe holds the same radiance, so every blend of them is that probe again, whatever depths and normals weight it
+static void testConstantField(std::mt19937& generator)
+{
+    std::uniform_real_distribution<float> depth(1.0f, 10.0f), coefficient(-0.3f, 0.3f);
+    Probe probe {};
+    probe[0] = glm::vec3(1.0f, 0.8f, 0.6f);
+    for (uint32_t i = 1; i < sh::coefficientCount<BANDS>; i++) {
+        probe[i] = glm::vec3(coefficient(generator), coefficient(generator), coefficient(generator));
+    }
+    Scene scene;
+    for (uint32_t i = 0; i < GRID_WIDTH * GRID_HEIGHT; i++) {
+        scene.probes[i] = probe;
+        scene.probeGBuffer[i] = { depth(generator), sh::packNormal(randomNormal(generator)) };
+    }
+    for (sh::GBufferSample& pixel : scene.gbuffer) {
+        pixel = { depth(generator), sh::packNormal(randomNormal(generator)) };
+    }
+    std::vector<glm::vec3> single, batched;
+    scene.gather(single, batched);
+    auto expected = [&](uint32_t x, uint32_t y) { return sh::irradiance(probe, sh::unpackNormal(scene.gbuffer[y * WIDTH + x].normal)); };
+    CHECK(largestError(single, expected) < 1e-4f);
+    CHECK(largestError(batched, expected) < 1e-4f);
+}
+
+/**
+* Left of pixel column WIDTH / 2 a wall at depth 2 with irradiance 1, right of it one at rightDepth with irradiance 0.2,
+* both facing the camera. Returns the largest share of the other wall's irradiance in a gathered pixel
+*/
+static void edgeLeaks(float rightDepth, float& singleLeak, float& batchedLeak)
+{
+    const glm::vec3 normal(0.0f, 0.0f, 1.0f);
+    Probe unit {};
+    unit[0] = glm::vec3(1.0f);
+    Probe left {}, right {};
+    left[0] = glm::vec3(1.0f / sh::irradiance(unit, normal).x);
+    right[0] = left[0] * 0.2f;
+    Scene scene;
+    for (uint32_t y = 0; y < GRID_HEIGHT; y++) {
+        for (uint32_t x = 0; x < GRID_WIDTH; x++) {
+            const bool isLeft = x < GRID_WIDTH / 2;
+            scene.probes[y * GRID_WIDTH + x] = isLeft ? left : right;
+            scene.probeGBuffer[y * GRID_WIDTH + x] = { isLeft ? 2.0f : rightDepth, sh::packNormal(normal) };
+        }
+    }
+    for (uint32_t y = 0; y < HEIGHT; y++) {
+        for (uint32_t x = 0; x < WIDTH; x++) {
+            scene.gbuffer[y * WIDTH + x] = { x < WIDTH / 2 ? 2.0f : rightDepth, sh::packNormal(normal) };
+        }
+    }
+    std::vector<glm::vec3> single, batched;
+    scene.gather(single, batched);
+    auto largestLeak = [](const std::vector<glm::vec3>& irradiance) {
+        float leak = 0.0f;
+        for (uint32_t y = 0; y < HEIGHT; y++) {
+            for (uint32_t x = 0; x < WIDTH; x++) {
+                const float own = x < WIDTH / 2 ? 1.0f : 0.2f;
+                leak = std::max(leak, std::abs(irradiance[y * WIDTH + x].x - own) / 0.8f);
+            }
+        }
+        return leak;
+    };
+    singleLeak = largestLeak(single);
+    batchedLeak = largestLeak(batched);
+}
+
+static void testDepthEdge()
+{
+    float singleLeak, batchedLeak;
+    edgeLeaks(2.0f, singleLeak, batchedLeak);
+    std::cout << "Largest leak across a luminance edge " << singleLeak << " (batched " << batchedLeak << ")";
+    // On one surface the probes on both sides blend, so the checks below test the depth weight
+    CHECK(singleLeak > 0.4f);
+    CHECK(batchedLeak > 0.4f);
+    edgeLeaks(20.0f, singleLeak, batchedLeak);
+    std::cout << ", depth edge " << singleLeak << " (batched " << batchedLeak << ")" << std::endl;
+    CHECK(singleLeak < 0.02f);
+    CHECK(batchedLeak < 0.02f);
+}
+
+int main()
+{
+    std::mt19937 generator(1);
+    testConstantField(generator);
+    testDepthEdge();
+    return testing::report("probegathertest");
+}
@@ -0,0 +1,314 @@
+/*
+* RMSE against sample count of the samplers in shaders/glsl/ssprobe/sampler.glsl
+*
+* Every generator is transcribed literally from sampler.glsl and random.glsl and draws the probe directions the way
+* raygen.rgen does in probe tracing mode: sampler_init per probe, sampler_start per sample, bounce 0 and a cosine
+* weighted direction from sample2D. The probes project an analytic sky (a smooth gradient, a sun lobe and the hard edge of
+* an occluder) into three band SH, and the RMSE of their coefficients against a dense quadrature is printed for every
+* power of two sample count as a table that can be plotted directly, followed by the convergence rate of each sampler.
+* Not run by ctest, run it from the build directory: samplerbench [--probes n] [--max-samples n]
+*
+* This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+*/
+
+#include "testing.hpp"
+#include "sphericalharmonics.hpp"
+#include "VulkanTools.h"
+#include <cstring>
+#include <iomanip>
+#include <string>
+#include <vector>
+
+constexpr uint32_t SAMPLER_LCG = 0;
+constexpr uint32_t SAMPLER_SOBOL = 1;
+constexpr uint32_t SAMPLER_LATTICE = 2;
+constexpr uint32_t SAMPLER_BLUE_NOISE = 3;
+constexpr const char* SAMPLER_NAMES[] = { "lcg", "sobol", "lattice", "bluenoise" };
+constexpr uint32_t SAMPLER_CAMERA_DIMENSIONS = 2;
+constexpr uint32_t SAMPLER_BOUNCE_DIMENSIONS = 8;
+constexpr uint32_t BLUE_NOISE_SIZE = 64;
+constexpr float PI = 3.1415926535897932384626433832795f;
+
+// random.glsl
+static uint32_t tea(uint32_t val0, uint32_t val1)
+{
+    uint32_t sum = 0;
+    uint32_t v0 = val0;
+    uint32_t v1 = val1;
+    for (uint32_t n = 0; n < 16; n++) {
+        sum += 0x9E3779B9;
+        v0 += ((v1 << 4) + 0xA341316C) ^ (v1 + sum) ^ ((v1 >> 5) + 0xC8013EA4);
+        v1 += ((v0 << 4) + 0xAD90777D) ^ (v0 + sum) ^ ((v0 >> 5) + 0x7E95761E);
+    }
+    return v0;
+}
+
+static uint32_t lcg(uint32_t& previous)
+{
+    const uint32_t multiplier = 1664525u;
+    const uint32_t increment = 1013904223u;
+    previous = (multiplier * previous + increment);
+    return previous & 0x00FFFFFF;
+}
+
+static float rnd(uint32_t& previous)
+{
+    return (float(lcg(previous)) / float(0x01000000));
+}
+
+// sampler.glsl
+static uint32_t hash(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+static uint32_t hash_combine(uint32_t seed, uint32_t v)
+{
+    return seed ^ (v + 0x9e3779b9u + (seed << 6) + (seed >> 2));
+}
+
+static float to_unorm(uint32_t x)
+{
+    return float(x >> 8) * (1.f / 16777216.f);
+}
+
+static uint32_t bitfieldReverse(uint32_t x)
+{
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+static uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed)
+{
+    x = bitfieldReverse(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return bitfieldReverse(x);
+}
+
+static uint32_t sobol_second_dimension(uint32_t index)
+{
+    uint32_t result = 0u;
+    uint32_t v = 1u << 31;
+    for (; index != 0u; index >>= 1) {
+        if ((index & 1u) != 0u) {
+            result ^= v;
+        }
+        v ^= v >> 1;
+    }
+    return result;
+}
+
+struct SamplerState {
+    uint32_t seed;
+    uint32_t index;
+    uint32_t dimension;
+    uint32_t pixel;
+};
+
+// The uniforms and bindings sampler.glsl reads
+struct Sampler {
+    uint32_t samplerType;
+    uint32_t randomSeed;
+    uint32_t launchWidth;
+    std::vector<float> blueNoise;
+
+    SamplerState sampler_init(glm::uvec2 pixel) const
+    {
+        SamplerState rng;
+        uint32_t pixelIndex = pixel.y * launchWidth + pixel.x;
+        rng.seed = samplerType == SAMPLER_LCG ? tea(pixelIndex, randomSeed) : hash(pixelIndex);
+        rng.index = 0;
+        rng.dimension = 0;
+        rng.pixel = (pixel.y << 16) | pixel.x;
+        return rng;
+    }
+
+    static void sampler_start(SamplerState& rng, uint32_t sampleIndex)
+    {
+        rng.index = sampleIndex;
+        rng.dimension = 0;
+    }
+
+    static void sampler_set_bounce(SamplerState& rng, uint32_t depth)
+    {
+        rng.dimension = SAMPLER_CAMERA_DIMENSIONS + depth * SAMPLER_BOUNCE_DIMENSIONS;
+    }
+
+    uint32_t blue_noise(const SamplerState& rng, uint32_t dimension, uint32_t generator) const
+    {
+        uint32_t offset = hash(dimension);
+        glm::uvec2 texel = (glm::uvec2(rng.pixel & 0xffffu, rng.pixel >> 16) + glm::uvec2(offset, offset >> 16)) % BLUE_NOISE_SIZE;
+        float value = blueNoise[texel.y * BLUE_NOISE_SIZE + texel.x];
+        return static_cast<uint32_t>(value * 4294967296.) + rng.index * generator;
+    }
+
+    float sample1D(SamplerState& rng) const
+    {
+        if (samplerType == SAMPLER_LCG) {
+            return rnd(rng.seed);
+        }
+        uint32_t dimension = rng.dimension++;
+        uint32_t seed = hash_combine(rng.seed, hash(dimension));
+        if (samplerType == SAMPLER_SOBOL) {
+            uint32_t index = nested_uniform_scramble(rng.index, seed);
+            return to_unorm(nested_uniform_scramble(bitfieldReverse(index), hash_combine(seed, 1u)));
+        }
+        if (samplerType == SAMPLER_LATTICE) {
+            return to_unorm(rng.index * 0x9e3779b9u + hash(seed));
+        }
+        return to_unorm(blue_noise(rng, dimension, 0x9e3779b9u));
+    }
+
+    glm::vec2 sample2D(SamplerState& rng) const
+    {
+        if (samplerType == SAMPLER_SOBOL) {
+            uint32_t seed = hash_combine(rng.seed, hash(rng.dimension));
+            rng.dimension += 2;
+            uint32_t index = nested_uniform_scramble(rng.index, seed);
+            return glm::vec2(to_unorm(nested_uniform_scramble(bitfieldReverse(index), hash_combine(seed, 1u))),
+                to_unorm(nested_uniform_scramble(sobol_second_dimension(index), hash_combine(seed, 2u))));
+        }
+        if (samplerType == SAMPLER_LATTICE) {
+            uint32_t seed = hash_combine(rng.seed, hash(rng.dimension));
+            rng.dimension += 2;
+            return glm::vec2(to_unorm(rng.index * 0xc13fa9a9u + hash(seed)), to_unorm(rng.index * 0x91e10da5u + hash(hash(seed))));
+        }
+        if (samplerType == SAMPLER_BLUE_NOISE) {
+            uint32_t dimension = rng.dimension;
+            rng.dimension += 2;
+            return glm::vec2(to_unorm(blue_noise(rng, dimension, 0xc13fa9a9u)), to_unorm(blue_noise(rng, dimension + 1, 0x91e10da5u)));
+        }
+        float x = sample1D(rng);
+        return glm::vec2(x, sample1D(rng));
+    }
+};
+
+// Incoming radiance in the tangent frame of the probe: sky gradient, sun lobe and an occluder with a hard edge
+static float sky(const glm::vec3& d)
+{
+    const glm::vec3 sun = glm::normalize(glm::vec3(0.4f, 0.2f, 0.9f));
+    const float lobe = std::pow(std::max(glm::dot(d, sun), 0.0f), 8.0f);
+    return 0.2f + 0.3f * d.z + 4.0f * lobe + (d.x > 0.3f ? 0.0f : 0.5f);
+}
+
+// Fibonacci spiral over the upper hemisphere, each point stands for 2 pi / count
+static vks::sh::Probe<3> referenceProbe(uint32_t count)
+{
+    vks::sh::Probe<3> probe {};
+    for (uint32_t k = 0; k < count; k++) {
+        const float z = 1.0f - (k + 0.5f) / count;
+        const float r = std::sqrt(1.0f - z * z);
+        const float phi = 2.399963f * k;
+        const glm::vec3 d(r * std::cos(phi), r * std::sin(phi), z);
+        vks::sh::project(probe, d, glm::vec3(sky(d) * 2.0f * PI / count));
+    }
+    return probe;
+}
+
+// Probe direction of raygen.rgen in probe tracing mode, the probe normal is +z so orthonormal_basis is the identity
+// Dividing by the cosine pdf like raygen.rgen makes the samples heavy tailed near the horizon, which caps every rate
+static vks::sh::Probe<3> estimateProbe(const Sampler& sampler, glm::uvec2 pixel, uint32_t sampleCount)
+{
+    vks::sh::Probe<3> probe {};
+    SamplerState rng = sampler.sampler_init(pixel);
+    for (uint32_t i = 0; i < sampleCount; i++) {
+        Sampler::sampler_start(rng, i);
+        Sampler::sampler_set_bounce(rng, 0);
+        const glm::vec2 u = sampler.sample2D(rng);
+        const float a = 2.f * PI * u.x;
+        const float cosb = std::sqrt(u.y);
+        const float sinb = std::sqrt(1.f - cosb * cosb);
+        const glm::vec3 direction = glm::normalize(glm::vec3(std::cos(a) * sinb, std::sin(a) * sinb, cosb));
+        const float pdf = cosb * (1.f / PI);
+        if (pdf > 0.0f) {
+            vks::sh::project(probe, direction, glm::vec3(sky(direction) / pdf));
+        }
+    }
+    for (glm::vec3& coefficient : probe) {
+        coefficient *= 1.0f / sampleCount;
+    }
+    return probe;
+}
+
+int main(int argc, char* argv[])
+{
+    uint32_t probeSize = 16;
+    uint32_t maxSamples = 4096;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--probes") == 0 && i + 1 < argc) {
+            probeSize = std::max(static_cast<uint32_t>(std::stoul(argv[++i])), 1u);
+        }
+        if (strcmp(argv[i], "--max-samples") == 0 && i + 1 < argc) {
+            maxSamples = std::max(static_cast<uint32_t>(std::stoul(argv[++i])), 1u);
+        }
+    }
+    const vks::sh::Probe<3> reference = referenceProbe(1u << 22);
+
+    Sampler samplers[4];
+    for (uint32_t type = 0; type < 4; type++) {
+        samplers[type] = { type, 0u, probeSize, {} };
+    }
+    samplers[SAMPLER_BLUE_NOISE].blueNoise = vks::tools::generateBlueNoise(BLUE_NOISE_SIZE);
+
+    // Every probe of the probeSize x probeSize grid is an independent randomization of the same estimate
+    std::cout << "# RMSE of the SH coefficients over " << probeSize * probeSize << " probes" << std::endl;
+    std::cout << std::left << std::setw(10) << "samples";
+    for (const char* name : SAMPLER_NAMES) {
+        std::cout << std::setw(14) << name;
+    }
+    std::cout << std::endl;
+    std::vector<std::vector<double>> rmse(4);
+    std::vector<uint32_t> sampleCounts;
+    for (uint32_t sampleCount = 1; sampleCount <= maxSamples; sampleCount *= 2) {
+        sampleCounts.push_back(sampleCount);
+        std::cout << std::setw(10) << sampleCount;
+        for (uint32_t type = 0; type < 4; type++) {
+            double squareSum = 0.0;
+            for (uint32_t y = 0; y < probeSize; y++) {
+                for (uint32_t x = 0; x < probeSize; x++) {
+                    const vks::sh::Probe<3> probe = estimateProbe(samplers[type], glm::uvec2(x, y), sampleCount);
+                    for (uint32_t i = 0; i < 9; i++) {
+                        squareSum += std::pow(probe[i].x - reference[i].x, 2.0);
+                    }
+                }
+            }
+            rmse[type].push_back(std::sqrt(squareSum / (probeSize * probeSize * 9)));
+            std::cout << std::setw(14) << rmse[type].back();
+        }
+        std::cout << std::endl;
+    }
+
+    // Least squares slope of log RMSE over log samples from 16 samples on, plain Monte Carlo converges with -0.5
+    std::cout << "# convergence rate (RMSE ~ samples^rate)" << std::endl;
+    for (uint32_t type = 0; type < 4; type++) {
+        double sx = 0.0, sy = 0.0, sxx = 0.0, sxy = 0.0;
+        uint32_t n = 0;
+        for (size_t i = 0; i < sampleCounts.size(); i++) {
+            if (sampleCounts[i] < 16) {
+                continue;
+            }
+            const double lx = std::log(static_cast<double>(sampleCounts[i]));
+            const double ly = std::log(rmse[type][i]);
+            sx += lx;
+            sy += ly;
+            sxx += lx * lx;
+            sxy += lx * ly;
+            n++;
+        }
+        const double slope = n > 1 ? (n * sxy - sx * sy) / (n * sxx - sx * sx) : 0.0;
+        std::cout << "# " << SAMPLER_NAMES[type] << ": " << slope << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,85 @@
+/*
+* Synthetic scenes for the CPU baker tests and benchmarks
+*
+* Built directly into CpuBaker's triangles, so they need neither a glTF file nor a device. The box room is a 2 x 2 x 2
+* room with the floor at y = 0 and an open front at z = 1, lit by one point light under the ceiling and seen by a camera
+* outside the opening
+*
+* This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+*/
+
+#pragma once
+
+#include "cpubaker.h"
+#include <glm/gtc/matrix_transform.hpp>
+
+struct TestScene {
+    // Material of every geometry, white unless setAlbedo gives it a base color texture
+    vkglTF::Material material { nullptr };
+    vkglTF::Texture albedoTexture {};
+    CpuBaker baker;
+    glm::mat4 viewInverse;
+    glm::mat4 projInverse;
+
+    TestScene() = default;
+    TestScene(const TestScene&) = delete;
+
+    // Quad a b c d in counter clockwise order seen from the side normal points to
+    void addQuad(glm::vec3 a, glm::vec3 b, glm::vec3 c, glm::vec3 d, glm::vec3 normal)
+    {
+        if (baker.geometries.empty()) {
+            baker.geometries.push_back({ &material, false });
+        }
+        const glm::vec4 tangent(glm::normalize(b - a), 1.0f);
+        const glm::vec3 corners[2][3] = { { a, b, c }, { a, c, d } };
+        const glm::vec2 uvs[2][3] = { { { 0, 0 }, { 1, 0 }, { 1, 1 } }, { { 0, 0 }, { 1, 1 }, { 0, 1 } } };
+        for (uint32_t i = 0; i < 2; i++) {
+            CpuBaker::Triangle triangle {};
+            for (uint32_t k = 0; k < 3; k++) {
+                baker.positions.push_back(corners[i][k]);
+                triangle.normals[k] = normal;
+                triangle.tangents[k] = tangent;
+                triangle.uvs[k] = uvs[i][k];
+            }
+            triangle.geometry = 0;
+            baker.triangles.push_back(triangle);
+        }
+    }
+
+    // Every surface gets this albedo from a 1x1 base color texture, stored like the images vkglTF decodes on the host
+    void setAlbedo(glm::vec3 albedo)
+    {
+        tinygltf::Image image;
+        image.width = 1;
+        image.height = 1;
+        image.component = 4;
+        image.image = { static_cast<unsigned char>(albedo.r * 255.0f + 0.5f), static_cast<unsigned char>(albedo.g * 255.0f + 0.5f), static_cast<unsigned char>(albedo.b * 255.0f + 0.5f), 255 };
+        albedoTexture.index = static_cast<uint32_t>(baker.model.host.images.size());
+        baker.model.host.images.push_back(image);
+        material.baseColorTexture = &albedoTexture;
+    }
+
+    void lookAt(glm::vec3 eye, glm::vec3 center)
+    {
+        viewInverse = glm::inverse(glm::lookAt(eye, center, glm::vec3(0.0f, 1.0f, 0.0f)));
+        projInverse = glm::inverse(glm::perspective(glm::radians(60.0f), static_cast<float>(baker.width) / baker.height, 0.1f, 100.0f));
+    }
+};
+
+// Box room baked to a width x height probe grid with sampleCount samples per probe
+inline void buildBoxRoom(TestScene& scene, uint32_t width, uint32_t height, uint32_t sampleCount)
+{
+    const glm::vec3 p000(-1, 0, -1), p100(1, 0, -1), p010(-1, 2, -1), p110(1, 2, -1);
+    const glm::vec3 p001(-1, 0, 1), p101(1, 0, 1), p011(-1, 2, 1), p111(1, 2, 1);
+    scene.addQuad(p001, p101, p100, p000, glm::vec3(0, 1, 0));
+    scene.addQuad(p010, p110, p111, p011, glm::vec3(0, -1, 0));
+    scene.addQuad(p000, p100, p110, p010, glm::vec3(0, 0, 1));
+    scene.addQuad(p001, p000, p010, p011, glm::vec3(1, 0, 0));
+    scene.addQuad(p100, p101, p111, p110, glm::vec3(-1, 0, 0));
+    scene.baker.lights = { vks::PunctualLight { { 0.0f, 1.8f, 0.0f, 1.0f }, glm::vec3(1.0f), 4.0f } };
+    scene.baker.width = width;
+    scene.baker.height = height;
+    scene.baker.sampleCount = sampleCount;
+    scene.baker.buildBVH();
+    scene.lookAt(glm::vec3(0.0f, 1.0f, 3.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+}
@@ -0,0 +1,85 @@
+/*
+* Throughput of the task scheduler against its thread count
+*
+* For every thread count from one up to twice the hardware threads (doubling), reports parallelFor over fine and coarse
+* iterations in iterations per second and TaskGroup::run / wait of independent small tasks in tasks per second, each with
+* its speedup over a single thread. Not run by ctest, run it from the build directory: schedulerbench [--max-threads n]
+*
+* This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+*/
+
+#include "testing.hpp"
+#include "taskscheduler.hpp"
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Integer hash chain standing in for the work of one iteration, rounds sets its cost
+static uint32_t work(uint32_t seed, uint32_t rounds)
+{
+    for (uint32_t i = 0; i < rounds; i++) {
+        seed ^= seed >> 16;
+        seed *= 0x7feb352du;
+        seed ^= seed >> 15;
+        seed *= 0x846ca68bu;
+        seed ^= seed >> 16;
+    }
+    return seed;
+}
+
+int main(int argc, char* argv[])
+{
+    uint32_t maxThreads = std::max(std::thread::hardware_concurrency(), 1u) * 2;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--max-threads") == 0 && i + 1 < argc) {
+            maxThreads = std::max(static_cast<uint32_t>(std::stoul(argv[++i])), 1u);
+        }
+    }
+    std::vector<uint32_t> threadCounts;
+    for (uint32_t threadCount = 1; threadCount < maxThreads; threadCount *= 2) {
+        threadCounts.push_back(threadCount);
+    }
+    threadCounts.push_back(maxThreads);
+
+    constexpr uint32_t fineIterations = 1 << 20;
+    constexpr uint32_t coarseIterations = 1 << 12;
+    constexpr uint32_t groupTasks = 1 << 14;
+    std::vector<uint32_t> results(fineIterations);
+
+    std::cout << "# " << std::thread::hardware_concurrency() << " hardware threads" << std::endl;
+    std::cout << std::left << std::setw(9) << "threads" << std::setw(28) << "parallelFor fine (it/s)" << std::setw(28) << "parallelFor coarse (it/s)" << std::setw(28) << "TaskGroup (tasks/s)" << std::endl;
+    double baseline[3] = {};
+    for (uint32_t threadCount : threadCounts) {
+        vks::TaskScheduler scheduler(threadCount);
+        // A few nanoseconds per iteration, the default grain size has to amortize the task overhead
+        const double fine = fineIterations / testing::measure([&]() {
+            scheduler.parallelFor(0, fineIterations, [&](uint32_t i) { results[i] = work(i, 4); });
+        });
+        // Microseconds per iteration, one task each like the rows of the CPU baker
+        const double coarse = coarseIterations / testing::measure([&]() {
+            scheduler.parallelFor(0, coarseIterations, [&](uint32_t i) { results[i] = work(i, 4096); }, 1);
+        });
+        // Tasks submitted one by one from the calling thread, they go through the injection queue
+        const double group = groupTasks / testing::measure([&]() {
+            vks::TaskGroup taskGroup(scheduler);
+            for (uint32_t i = 0; i < groupTasks; i++) {
+                taskGroup.run([&results, i] { results[i] = work(i, 64); });
+            }
+            taskGroup.wait();
+        });
+        const double throughput[3] = { fine, coarse, group };
+        std::cout << std::setw(9) << threadCount;
+        for (uint32_t i = 0; i < 3; i++) {
+            if (threadCount == threadCounts.front()) {
+                baseline[i] = throughput[i];
+            }
+            std::ostringstream cell;
+            cell << std::setprecision(3) << throughput[i] << " (" << std::fixed << std::setprecision(2) << throughput[i] / baseline[i] << "x)";
+            std::cout << std::setw(28) << cell.str();
+        }
+        std::cout << std::endl;
+    }
+    return 0;
+}
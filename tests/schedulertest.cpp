@@ -0,0 +1,135 @@
+/*
+* Unit tests of taskscheduler.hpp
+*
+* Continuations racing with the last tasks of their group, parallelFor nested inside parallelFor, and a stress test of
+* the work stealing deques: workers push far more jobs than a deque holds initially while the other threads steal them,
+* every job has to run exactly once
+*
+* This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+*/
+
+#include "testing.hpp"
+#include "taskscheduler.hpp"
+#include <memory>
+#include <vector>
+
+constexpr uint32_t THREAD_COUNT = 4;
+
+// Waits until value reaches expected, false if that takes longer than a few seconds
+static bool waitFor(const std::atomic<uint32_t>& value, uint32_t expected)
+{
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (value.load() < expected) {
+        if (std::chrono::steady_clock::now() > deadline) {
+            return false;
+        }
+        std::this_thread::yield();
+    }
+    return true;
+}
+
+// then() right after run(), so the last task often finishes while then() publishes the continuation
+static void testContinuationRace(vks::TaskScheduler& scheduler)
+{
+    constexpr uint32_t iterations = 100000;
+    constexpr uint32_t tasks = 2;
+    std::atomic<uint32_t> taskRuns { 0 }, continuationRuns { 0 }, earlyContinuations { 0 };
+    uint32_t lost = 0;
+    for (uint32_t i = 0; i < iterations; i++) {
+        {
+            vks::TaskGroup group(scheduler);
+            for (uint32_t k = 0; k < tasks; k++) {
+                group.run([&taskRuns] { taskRuns.fetch_add(1); });
+            }
+            const uint32_t expectedTaskRuns = (i + 1) * tasks;
+            group.then([&taskRuns, &continuationRuns, &earlyContinuations, expectedTaskRuns] {
+                if (taskRuns.load() != expectedTaskRuns) {
+                    earlyContinuations.fetch_add(1);
+                }
+                continuationRuns.fetch_add(1);
+            });
+        }
+        if (!waitFor(continuationRuns, i + 1)) {
+            lost = iterations - i;
+            break;
+        }
+    }
+    CHECK(lost == 0);
+    CHECK(earlyContinuations.load() == 0);
+    CHECK(continuationRuns.load() == iterations);
+}
+
+// Continuation of a group whose tasks all finished already
+static void testLateContinuation(vks::TaskScheduler& scheduler)
+{
+    std::atomic<uint32_t> continuationRuns { 0 };
+    vks::TaskGroup group(scheduler);
+    group.run([] {});
+    group.wait();
+    group.then([&continuationRuns] { continuationRuns.fetch_add(1); });
+    CHECK(waitFor(continuationRuns, 1));
+}
+
+static void testNestedParallelFor(vks::TaskScheduler& scheduler)
+{
+    constexpr uint32_t outer = 64;
+    constexpr uint32_t inner = 512;
+    std::vector<uint32_t> calls(outer * inner);
+    scheduler.parallelFor(0, outer, [&](uint32_t i) {
+        scheduler.parallelFor(0, inner, [&](uint32_t j) { calls[i * inner + j]++; });
+    }, 1);
+    uint32_t wrong = 0;
+    for (uint32_t count : calls) {
+        wrong += count == 1 ? 0 : 1;
+    }
+    CHECK(wrong == 0);
+}
+
+// Spawner tasks mostly run on workers and push into their own deque, growing it past its initial 256 jobs
+static void testStealStress(vks::TaskScheduler& scheduler)
+{
+    constexpr uint32_t rounds = 16;
+    constexpr uint32_t spawners = 8;
+    constexpr uint32_t jobsPerSpawner = 1 << 13;
+    constexpr uint32_t jobCount = spawners * jobsPerSpawner;
+    std::unique_ptr<std::atomic<uint32_t>[]> runs(new std::atomic<uint32_t>[jobCount]);
+    bool exactlyOnce = true;
+    bool sumMatches = true;
+    for (uint32_t round = 0; round < rounds; round++) {
+        for (uint32_t i = 0; i < jobCount; i++) {
+            runs[i].store(0);
+        }
+        std::atomic<uint64_t> sum { 0 };
+        {
+            vks::TaskGroup group(scheduler);
+            for (uint32_t spawner = 0; spawner < spawners; spawner++) {
+                group.run([&group, &runs, &sum, spawner] {
+                    for (uint32_t k = 0; k < jobsPerSpawner; k++) {
+                        const uint32_t job = spawner * jobsPerSpawner + k;
+                        group.run([&runs, &sum, job] {
+                            runs[job].fetch_add(1);
+                            sum.fetch_add(job);
+                        });
+                    }
+                });
+            }
+            group.wait();
+        }
+        for (uint32_t i = 0; i < jobCount; i++) {
+            exactlyOnce = exactlyOnce && runs[i].load() == 1;
+        }
+        sumMatches = sumMatches && sum.load() == static_cast<uint64_t>(jobCount) * (jobCount - 1) / 2;
+    }
+    CHECK(exactlyOnce);
+    CHECK(sumMatches);
+}
+
+int main()
+{
+    vks::TaskScheduler scheduler(THREAD_COUNT);
+    testContinuationRace(scheduler);
+    testLateContinuation(scheduler);
+    testNestedParallelFor(scheduler);
+    testStealStress(scheduler);
+    return testing::report("schedulertest");
+}
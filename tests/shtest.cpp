@@ -0,0 +1,305 @@
+/*
+* Unit tests of sphericalharmonics.hpp
+*
+* The basis functions are compared against a literal transcription of update and update_hbasis in
+* shaders/glsl/ssprobe/SH.glsl, so the CPU code and the shaders can't drift apart unnoticed. The remaining checks cover
+* the math (orthonormality, cosine convolution, rotation) and that every batch kernel matches its single probe version
+*
+* This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+*/
+
+#include "testing.hpp"
+#include "sphericalharmonics.hpp"
+#include <glm/gtc/matrix_transform.hpp>
+#include <random>
+#include <vector>
+
+using namespace vks;
+
+// update in SH.glsl with SH_BANDS = 4 and a unit value, getIndex(l, m) = l * (l - 1) + m
+static void shaderBasis(glm::vec3 direction, float SH[16])
+{
+    auto getIndex = [](int l, int m) { return l * (l - 1) + m; };
+    direction = glm::normalize(direction);
+    const float x = direction.x, y = direction.y, z = direction.z;
+    const float value = 1.0f;
+    SH[getIndex(1, 0)] = value * .282095f;
+    SH[getIndex(2, -1)] = -value * .488603f * y;
+    SH[getIndex(2, 1)] = value * .488603f * z;
+    SH[getIndex(2, 0)] = -value * .488603f * x;
+    SH[getIndex(3, -2)] = value * 1.092548f * x * y;
+    SH[getIndex(3, -1)] = -value * -1.092548f * y * z;
+    SH[getIndex(3, 0)] = value * .315392f * (3.f * z * z - 1.f);
+    SH[getIndex(3, 1)] = -value * -1.092548f * x * z;
+    SH[getIndex(3, 2)] = value * .546274f * (x * x - y * y);
+    SH[getIndex(4, -3)] = value * .590044f * y * (3.f * x * x - y * y);
+    SH[getIndex(4, -2)] = value * 2.890611f * x * y * z;
+    SH[getIndex(4, -1)] = value * .457046f * y * (5.f * z * z - 1.f);
+    SH[getIndex(4, 0)] = value * .373176f * z * (5.f * z * z - 3.f);
+    SH[getIndex(4, 1)] = value * .457046f * x * (5.f * z * z - 1.f);
+    SH[getIndex(4, 2)] = value * 1.445306f * z * (x * x - y * y);
+    SH[getIndex(4, 3)] = value * .590044f * x * (x * x - 3.f * y * y);
+}
+
+// update_hbasis in SH.glsl with H_BASIS_COUNT = 6 and a unit value
+static void shaderHBasis(glm::vec3 direction, float H[6])
+{
+    direction = glm::normalize(direction);
+    const float x = direction.x, y = direction.y, z = direction.z;
+    const float value = 1.0f;
+    H[0] = value * .398942f;
+    H[1] = value * .690988f * x;
+    H[2] = value * .690988f * (2.f * z - 1.f);
+    H[3] = value * .690988f * y;
+    H[4] = value * 1.545097f * x * y;
+    H[5] = value * .772548f * (x * x - y * y);
+}
+
+// Evenly spread directions on a Fibonacci spiral, each one stands for 4 pi / count of the sphere
+static std::vector<glm::vec3> sphereQuadrature(uint32_t count)
+{
+    std::vector<glm::vec3> directions(count);
+    for (uint32_t k = 0; k < count; k++) {
+        const float z = 1.0f - (2.0f * k + 1.0f) / count;
+        const float r = std::sqrt(1.0f - z * z);
+        const float phi = 2.399963f * k;
+        directions[k] = glm::vec3(r * std::cos(phi), r * std::sin(phi), z);
+    }
+    return directions;
+}
+
+static glm::vec3 randomDirection(std::mt19937& generator)
+{
+    std::normal_distribution<float> normal;
+    return glm::normalize(glm::vec3(normal(generator), normal(generator), normal(generator)));
+}
+
+template<uint32_t Bands>
+static sh::Probe<Bands> randomProbe(std::mt19937& generator)
+{
+    std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+    sh::Probe<Bands> probe;
+    for (glm::vec3& coefficient : probe) {
+        coefficient = glm::vec3(uniform(generator), uniform(generator), uniform(generator));
+    }
+    return probe;
+}
+
+template<uint32_t Bands>
+static bool probesNear(const sh::Probe<Bands>& a, const sh::Probe<Bands>& b, float tolerance)
+{
+    for (uint32_t i = 0; i < sh::coefficientCount<Bands>; i++) {
+        if (glm::any(glm::greaterThan(glm::abs(a[i] - b[i]), glm::vec3(tolerance)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void testShaderBasis(std::mt19937& generator)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        const glm::vec3 d = randomDirection(generator);
+        float expected[16], y[16];
+        shaderBasis(d, expected);
+        sh::basis<4>(d, y);
+        bool match = true;
+        for (uint32_t k = 0; k < 16; k++) {
+            match = match && std::abs(y[k] - expected[k]) <= 1e-6f;
+        }
+        CHECK(match);
+        float expectedH[6], h[6];
+        shaderHBasis(d, expectedH);
+        sh::hbasis<6>(d, h);
+        bool matchH = true;
+        for (uint32_t k = 0; k < 6; k++) {
+            matchH = matchH && std::abs(h[k] - expectedH[k]) <= 1e-6f;
+        }
+        CHECK(matchH);
+    }
+}
+
+// Integrals of Yi Yj over the sphere and of Hi Hj over the upper hemisphere are 1 for i = j and 0 otherwise
+static void testOrthonormality()
+{
+    const std::vector<glm::vec3> directions = sphereQuadrature(65536);
+    float gram[16][16] = {};
+    float hgram[6][6] = {};
+    for (const glm::vec3& d : directions) {
+        float y[16];
+        sh::basis<4>(d, y);
+        for (uint32_t i = 0; i < 16; i++) {
+            for (uint32_t j = 0; j < 16; j++) {
+                gram[i][j] += y[i] * y[j] * (4.0f * sh::pi / directions.size());
+            }
+        }
+        if (d.z >= 0.0f) {
+            float h[6];
+            sh::hbasis<6>(d, h);
+            for (uint32_t i = 0; i < 6; i++) {
+                for (uint32_t j = 0; j < 6; j++) {
+                    hgram[i][j] += h[i] * h[j] * (4.0f * sh::pi / directions.size());
+                }
+            }
+        }
+    }
+    for (uint32_t i = 0; i < 16; i++) {
+        for (uint32_t j = 0; j < 16; j++) {
+            CHECK_NEAR(gram[i][j], i == j ? 1.0f : 0.0f, 2e-3f);
+        }
+    }
+    for (uint32_t i = 0; i < 6; i++) {
+        for (uint32_t j = 0; j < 6; j++) {
+            CHECK_NEAR(hgram[i][j], i == j ? 1.0f : 0.0f, 2e-3f);
+        }
+    }
+}
+
+// A probe projected from constant radiance L reconstructs L and has irradiance pi L in every direction
+static void testConstantRadiance(std::mt19937& generator)
+{
+    const glm::vec3 radiance(0.25f, 0.5f, 1.0f);
+    const std::vector<glm::vec3> directions = sphereQuadrature(4096);
+    sh::Probe<3> probe {};
+    for (const glm::vec3& d : directions) {
+        sh::project(probe, d, radiance * (4.0f * sh::pi / directions.size()));
+    }
+    for (uint32_t i = 0; i < 16; i++) {
+        const glm::vec3 d = randomDirection(generator);
+        CHECK_NEAR(sh::evaluate(probe, d), radiance, 2e-3f);
+        CHECK_NEAR(sh::irradiance(probe, d), radiance * sh::pi, 5e-3f);
+    }
+    const sh::AmbientCube cube = sh::ambientCube(probe);
+    for (const glm::vec3& face : cube) {
+        CHECK_NEAR(face, radiance * sh::pi, 5e-3f);
+    }
+}
+
+// Irradiance of a single direction of light is its clamped cosine, smoothed by the band limit
+static void testDirectionalIrradiance()
+{
+    const glm::vec3 light = glm::normalize(glm::vec3(0.3f, 0.8f, -0.5f));
+    sh::Probe<3> probe {};
+    sh::project(probe, light, glm::vec3(1.0f));
+    // Three bands reproduce the clamped cosine to within about 0.1 of its peak (Ramamoorthi and Hanrahan)
+    CHECK_NEAR(sh::irradiance(probe, light).x, 1.0f, 0.1f);
+    CHECK_NEAR(sh::irradiance(probe, -light).x, 0.0f, 0.1f);
+    sh::Probe<3> convolved = probe;
+    sh::convolveCosine(convolved);
+    CHECK_NEAR(sh::evaluate(convolved, light), sh::irradiance(probe, light), 1e-5f);
+}
+
+// The rotated probe seen from R d is the original probe seen from d
+static void testRotation(std::mt19937& generator)
+{
+    const glm::mat3 rotation = glm::mat3(glm::rotate(glm::mat4(1.0f), 1.1f, glm::normalize(glm::vec3(1.0f, -2.0f, 0.5f))));
+    const sh::Rotation<4> rotate(rotation);
+    const sh::Probe<4> probe = randomProbe<4>(generator);
+    const sh::Probe<4> rotated = rotate.apply(probe);
+    for (uint32_t i = 0; i < 32; i++) {
+        const glm::vec3 d = randomDirection(generator);
+        CHECK_NEAR(sh::evaluate(rotated, rotation * d), sh::evaluate(probe, d), 1e-3f);
+    }
+    const sh::Rotation<4> identity(glm::mat3(1.0f));
+    CHECK(probesNear(identity.apply(probe), probe, 1e-4f));
+}
+
+// Sizes that aren't a multiple of the SIMD width, so the tail of every kernel runs too
+static void testBatchKernels(std::mt19937& generator)
+{
+    constexpr uint32_t count = 13;
+    std::vector<sh::Probe<3>> probes(count), others(count), results(count);
+    std::vector<glm::vec3> directions(count), values(count), batch(count);
+    for (uint32_t i = 0; i < count; i++) {
+        probes[i] = randomProbe<3>(generator);
+        others[i] = randomProbe<3>(generator);
+        directions[i] = randomDirection(generator);
+        values[i] = glm::vec3(randomDirection(generator));
+    }
+
+    sh::Probe<3> projected {}, projectedBatch {};
+    for (uint32_t i = 0; i < count; i++) {
+        sh::project(projected, directions[i], values[i]);
+    }
+    sh::projectBatch(projectedBatch, directions.data(), values.data(), count);
+    CHECK(probesNear(projectedBatch, projected, 1e-5f));
+
+    sh::evaluateBatch(probes.data(), directions.data(), batch.data(), count);
+    for (uint32_t i = 0; i < count; i++) {
+        CHECK_NEAR(batch[i], sh::evaluate(probes[i], directions[i]), 1e-5f);
+    }
+    sh::irradianceBatch(probes.data(), directions.data(), batch.data(), count);
+    for (uint32_t i = 0; i < count; i++) {
+        CHECK_NEAR(batch[i], sh::irradiance(probes[i], directions[i]), 1e-5f);
+    }
+    std::vector<sh::AmbientCube> cubes(count);
+    sh::ambientCubeBatch(probes.data(), cubes.data(), count);
+    for (uint32_t i = 0; i < count; i++) {
+        const sh::AmbientCube cube = sh::ambientCube(probes[i]);
+        for (uint32_t face = 0; face < 6; face++) {
+            CHECK_NEAR(cubes[i][face], cube[face], 1e-5f);
+        }
+    }
+    sh::lerpBatch(probes.data(), others.data(), 0.3f, results.data(), count);
+    for (uint32_t i = 0; i < count; i++) {
+        CHECK(probesNear(results[i], sh::lerp(probes[i], others[i], 0.3f), 1e-5f));
+    }
+    const sh::Rotation<3> rotation(glm::mat3(glm::rotate(glm::mat4(1.0f), 0.7f, glm::vec3(0.0f, 1.0f, 0.0f))));
+    sh::rotateBatch(rotation, probes.data(), results.data(), count);
+    for (uint32_t i = 0; i < count; i++) {
+        CHECK(probesNear(results[i], rotation.apply(probes[i]), 1e-5f));
+    }
+    results = probes;
+    sh::convolveCosineBatch(results.data(), count);
+    for (uint32_t i = 0; i < count; i++) {
+        sh::Probe<3> expected = probes[i];
+        sh::convolveCosine(expected);
+        CHECK(probesNear(results[i], expected, 1e-5f));
+    }
+    results = probes;
+    sh::windowBatch(results.data(), count, 4.0f);
+    for (uint32_t i = 0; i < count; i++) {
+        sh::Probe<3> expected = probes[i];
+        sh::window(expected, 4.0f);
+        CHECK(probesNear(results[i], expected, 1e-5f));
+    }
+}
+
+static void testNormalPacking(std::mt19937& generator)
+{
+    const glm::vec3 axes[] = { { 1, 0, 0 }, { -1, 0, 0 }, { 0, 1, 0 }, { 0, -1, 0 }, { 0, 0, 1 }, { 0, 0, -1 } };
+    for (const glm::vec3& axis : axes) {
+        CHECK_NEAR(sh::unpackNormal(sh::packNormal(axis)), axis, 1e-4f);
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        const glm::vec3 n = randomDirection(generator);
+        CHECK(glm::dot(sh::unpackNormal(sh::packNormal(n)), n) > 0.99999f);
+        const glm::mat3 frame = sh::tangentFrame(n);
+        CHECK_NEAR(frame[2], n, 1e-6f);
+        CHECK_NEAR(glm::dot(frame[0], frame[1]), 0.0f, 1e-5f);
+        CHECK_NEAR(glm::length(frame[0]), 1.0f, 1e-5f);
+    }
+    // H-basis probes project in the frame of their packed normal, so the hemisphere above n is the upper one
+    const glm::vec3 normal = glm::normalize(glm::vec3(0.2f, -0.9f, 0.3f));
+    sh::HProbe<4> probe {};
+    probe.normal = sh::packNormal(normal);
+    sh::project(probe, normal, glm::vec3(1.0f));
+    float h[4];
+    sh::hbasis<4>(glm::vec3(0.0f, 0.0f, 1.0f), h);
+    for (uint32_t i = 0; i < 4; i++) {
+        CHECK_NEAR(probe[i].x, h[i], 1e-3f);
+    }
+}
+
+int main()
+{
+    std::mt19937 generator(1);
+    testShaderBasis(generator);
+    testOrthonormality();
+    testConstantRadiance(generator);
+    testDirectionalIrradiance();
+    testRotation(generator);
+    testBatchKernels(generator);
+    testNormalPacking(generator);
+    return testing::report("shtest");
+}
@@ -0,0 +1,174 @@
+/*
+* Headless compute device for the tests that run a compute shader next to its CPU implementation
+*
+* Creates a Vulkan 1.2 instance without any surface extension and a device with buffer device addresses, scalar block
+* layout and 64 bit integers, which the probe shaders need. create() returns false when there is no such device, the test
+* then returns testing::skipped. The shaders are the SPIR-V built by shaders/CMakeLists.txt
+*
+* This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+*/
+
+#pragma once
+
+#include "VulkanDevice.h"
+#include "VulkanTools.h"
+#include "testing.hpp"
+#include <vector>
+
+struct TestDevice {
+    VkInstance instance = VK_NULL_HANDLE;
+    vks::VulkanDevice* vulkanDevice = nullptr;
+    VkDevice device = VK_NULL_HANDLE;
+    VkQueue queue = VK_NULL_HANDLE;
+    // Timestamps at the start and the end of every run, none if the queue can't write them
+    VkQueryPool queryPool = VK_NULL_HANDLE;
+
+    TestDevice() = default;
+    TestDevice(const TestDevice&) = delete;
+
+    ~TestDevice()
+    {
+        if (queryPool != VK_NULL_HANDLE) {
+            vkDestroyQueryPool(device, queryPool, nullptr);
+        }
+        delete vulkanDevice;
+        if (instance != VK_NULL_HANDLE) {
+            vkDestroyInstance(instance, nullptr);
+        }
+    }
+
+    bool create()
+    {
+        VkApplicationInfo appInfo {};
+        appInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+        appInfo.pApplicationName = "tests";
+        appInfo.pEngineName = "tests";
+        appInfo.apiVersion = VK_API_VERSION_1_2;
+        VkInstanceCreateInfo instanceCI {};
+        instanceCI.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+        instanceCI.pApplicationInfo = &appInfo;
+        if (vkCreateInstance(&instanceCI, nullptr, &instance) != VK_SUCCESS) {
+            instance = VK_NULL_HANDLE;
+            std::cerr << "No Vulkan instance" << std::endl;
+            return false;
+        }
+        uint32_t physicalDeviceCount = 0;
+        vkEnumeratePhysicalDevices(instance, &physicalDeviceCount, nullptr);
+        std::vector<VkPhysicalDevice> physicalDevices(physicalDeviceCount);
+        if (physicalDeviceCount > 0) {
+            vkEnumeratePhysicalDevices(instance, &physicalDeviceCount, physicalDevices.data());
+        }
+        for (VkPhysicalDevice physicalDevice : physicalDevices) {
+            VkPhysicalDeviceProperties properties;
+            vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+            if (properties.apiVersion < VK_API_VERSION_1_2) {
+                continue;
+            }
+            VkPhysicalDeviceVulkan12Features vulkan12Features {};
+            vulkan12Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+            VkPhysicalDeviceFeatures2 features2 {};
+            features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+            features2.pNext = &vulkan12Features;
+            vkGetPhysicalDeviceFeatures2(physicalDevice, &features2);
+            if (!vulkan12Features.bufferDeviceAddress || !vulkan12Features.scalarBlockLayout || !features2.features.shaderInt64) {
+                continue;
+            }
+
+            vulkanDevice = new vks::VulkanDevice(physicalDevice);
+            VkPhysicalDeviceVulkan12Features enabledVulkan12Features {};
+            enabledVulkan12Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+            enabledVulkan12Features.bufferDeviceAddress = VK_TRUE;
+            enabledVulkan12Features.scalarBlockLayout = VK_TRUE;
+            VkPhysicalDeviceFeatures enabledFeatures {};
+            enabledFeatures.shaderInt64 = VK_TRUE;
+            VK_CHECK_RESULT(vulkanDevice->createLogicalDevice(enabledFeatures, {}, &enabledVulkan12Features, false));
+            device = vulkanDevice->logicalDevice;
+            vkGetDeviceQueue(device, vulkanDevice->queueFamilyIndices.graphics, 0, &queue);
+            if (vulkanDevice->queueFamilyProperties[vulkanDevice->queueFamilyIndices.graphics].timestampValidBits > 0) {
+                VkQueryPoolCreateInfo queryPoolCI {};
+                queryPoolCI.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+                queryPoolCI.queryType = VK_QUERY_TYPE_TIMESTAMP;
+                queryPoolCI.queryCount = 2;
+                VK_CHECK_RESULT(vkCreateQueryPool(device, &queryPoolCI, nullptr, &queryPool));
+            }
+            std::cout << "Device: " << properties.deviceName << std::endl;
+            return true;
+        }
+        std::cerr << "No device with buffer device addresses, scalar block layout and shaderInt64" << std::endl;
+        return false;
+    }
+
+    // Compute stage of a shader of shaders/glsl, the caller destroys its module once the pipeline is created
+    VkPipelineShaderStageCreateInfo loadShader(const std::string& fileName)
+    {
+        VkPipelineShaderStageCreateInfo shaderStage {};
+        shaderStage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        shaderStage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+        shaderStage.module = vks::tools::loadShader((getShaderBasePath() + "glsl/" + fileName).c_str(), device);
+        shaderStage.pName = "main";
+        assert(shaderStage.module != VK_NULL_HANDLE);
+        return shaderStage;
+    }
+
+    // Device local storage buffer with a device address, holding size bytes of data if it is given and zeros otherwise
+    void createBuffer(vks::Buffer& buffer, VkDeviceSize size, const void* data = nullptr)
+    {
+        const VkBufferUsageFlags usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+        VK_CHECK_RESULT(vulkanDevice->createBuffer(usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &buffer, size));
+        if (data != nullptr) {
+            vks::Buffer staging;
+            VK_CHECK_RESULT(vulkanDevice->createBuffer(VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &staging, size, const_cast<void*>(data)));
+            vulkanDevice->copyBuffer(&staging, &buffer, queue);
+            staging.destroy();
+        } else {
+            VkCommandBuffer commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+            vkCmdFillBuffer(commandBuffer, buffer.buffer, 0, VK_WHOLE_SIZE, 0);
+            vulkanDevice->flushCommandBuffer(commandBuffer, queue);
+        }
+    }
+
+    VkDeviceAddress address(const vks::Buffer& buffer) const
+    {
+        VkBufferDeviceAddressInfo addressInfo {};
+        addressInfo.sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO;
+        addressInfo.buffer = buffer.buffer;
+        return vkGetBufferDeviceAddress(device, &addressInfo);
+    }
+
+    // Copies the first size bytes of buffer to data
+    void download(vks::Buffer& buffer, VkDeviceSize size, void* data)
+    {
+        vks::Buffer staging;
+        VK_CHECK_RESULT(vulkanDevice->createBuffer(VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &staging, size));
+        VkBufferCopy copyRegion { 0, 0, size };
+        vulkanDevice->copyBuffer(&buffer, &staging, queue, &copyRegion);
+        VK_CHECK_RESULT(staging.map());
+        memcpy(data, staging.mapped, size);
+        staging.destroy();
+    }
+
+    /**
+    * Records the commands of record, submits them, waits for them and returns the milliseconds the device spent on them,
+    * 0 without timestamps. The commands make their results visible to transfers themselves
+    */
+    template<typename F>
+    double run(F&& record)
+    {
+        VkCommandBuffer commandBuffer = vulkanDevice->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+        if (queryPool != VK_NULL_HANDLE) {
+            vkCmdResetQueryPool(commandBuffer, queryPool, 0, 2);
+            vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, queryPool, 0);
+        }
+        record(commandBuffer);
+        if (queryPool != VK_NULL_HANDLE) {
+            vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queryPool, 1);
+        }
+        vulkanDevice->flushCommandBuffer(commandBuffer, queue);
+        if (queryPool == VK_NULL_HANDLE) {
+            return 0.0;
+        }
+        uint64_t timestamps[2];
+        VK_CHECK_RESULT(vkGetQueryPoolResults(device, queryPool, 0, 2, sizeof(timestamps), timestamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+        return static_cast<double>(timestamps[1] - timestamps[0]) * vulkanDevice->properties.limits.timestampPeriod * 1e-6;
+    }
+};
@@ -0,0 +1,81 @@
+/*
+* Minimal checks and timing for the tests and benchmarks
+*
+* A test executable runs its checks, prints every failure with its location and returns report(), which is non zero
+* when a check failed. Tests that need a Vulkan device return skipped when there is none, ctest reports them as skipped
+*
+* This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+*/
+
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <glm/glm.hpp>
+
+namespace testing
+{
+    /** @brief Exit code of a test that could not run, see SKIP_RETURN_CODE in tests/CMakeLists.txt */
+    constexpr int skipped = 77;
+
+    inline uint32_t checkCount = 0;
+    inline uint32_t failureCount = 0;
+
+    inline bool check(bool condition, const char* expression, const char* file, int line)
+    {
+        checkCount++;
+        if (!condition) {
+            failureCount++;
+            std::cerr << file << ":" << line << ": check failed: " << expression << std::endl;
+        }
+        return condition;
+    }
+
+    inline bool checkNear(float value, float expected, float tolerance, const char* expression, const char* file, int line)
+    {
+        checkCount++;
+        if (!(std::abs(value - expected) <= tolerance)) {
+            failureCount++;
+            std::cerr << file << ":" << line << ": check failed: " << expression << " is " << value << ", expected " << expected << " +- " << tolerance << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    inline bool checkNear(const glm::vec3& value, const glm::vec3& expected, float tolerance, const char* expression, const char* file, int line)
+    {
+        bool near = true;
+        for (int i = 0; i < 3; i++) {
+            near = checkNear(value[i], expected[i], tolerance, expression, file, line) && near;
+        }
+        return near;
+    }
+
+    /** @brief Summary line, returns the exit code of the test */
+    inline int report(const char* name)
+    {
+        std::cout << name << ": " << checkCount - failureCount << "/" << checkCount << " checks passed" << std::endl;
+        return failureCount == 0 ? 0 : 1;
+    }
+
+    /** @brief Seconds per call of f, averaged over as many calls as fit into minSeconds after one warm up call */
+    template<typename F>
+    double measure(F&& f, double minSeconds = 0.5)
+    {
+        f();
+        uint32_t calls = 0;
+        const auto start = std::chrono::high_resolution_clock::now();
+        double elapsed = 0.0;
+        do {
+            f();
+            calls++;
+            elapsed = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+        } while (elapsed < minSeconds);
+        return elapsed / calls;
+    }
+}
+
+#define CHECK(condition) testing::check((condition), #condition, __FILE__, __LINE__)
+#define CHECK_NEAR(value, expected, tolerance) testing::checkNear((value), (expected), (tolerance), #value, __FILE__, __LINE__)
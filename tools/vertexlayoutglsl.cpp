@@ -0,0 +1,48 @@
+/*
+* Writes shaders/glsl/common/vertexlayout.glsl from vkglTF::RayTracingVertexLayout::glsl()
+*
+* The build runs it with --output, so the include the ray tracing shaders use always follows the C++ layout. The file
+* is only rewritten when its contents differ, and the committed copy keeps compileshaders.py working without CMake.
+* --check compares without writing and fails on any difference, ctest runs it to catch a stale committed copy
+*
+* This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+*/
+
+#include "VulkanglTFModel.h"
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+static std::string readFile(const std::string& path)
+{
+    std::ifstream file(path, std::ios::binary);
+    std::stringstream contents;
+    contents << file.rdbuf();
+    return contents.str();
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc != 3 || (strcmp(argv[1], "--output") != 0 && strcmp(argv[1], "--check") != 0)) {
+        std::cerr << "usage: vertexlayoutglsl --output|--check <vertexlayout.glsl>" << std::endl;
+        return 2;
+    }
+    const std::string path = argv[2];
+    const std::string source = vkglTF::RayTracingVertexLayout::glsl();
+    if (readFile(path) == source) {
+        return 0;
+    }
+    if (strcmp(argv[1], "--check") == 0) {
+        std::cerr << path << " does not match vkglTF::RayTracingVertexLayout, build the vertexlayout target to regenerate it" << std::endl;
+        return 1;
+    }
+    std::ofstream file(path, std::ios::binary);
+    file << source;
+    if (!file) {
+        std::cerr << "Could not write " << path << std::endl;
+        return 1;
+    }
+    std::cout << "Regenerated " << path << std::endl;
+    return 0;
+}